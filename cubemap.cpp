@@ -0,0 +1,301 @@
+#include "cubemap.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <stdexcept>
+#include <string>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#include "stb_image.h"
+#include "thread_pool.h"
+
+
+namespace {
+
+const double PI = 3.1415926535897932384626433832795;
+
+const uint32_t CACHE_MAGIC = 0x42435145; // "EQCB"
+const uint32_t CACHE_VERSION = 1;
+
+struct CacheHeader {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t face_size;
+    uint32_t reserved;
+    uint64_t source_size;
+    int64_t source_mtime;
+};
+
+// Direction through the point (s, t) in [-1, 1] of a face, with t going down
+// the rows, matching how GL selects faces and texels for a direction
+void face_direction(int face, float s, float t, float &x, float &y, float &z) {
+    switch (face) {
+        case 0: x = 1;  y = -t; z = -s; break; // +X
+        case 1: x = -1; y = -t; z = s;  break; // -X
+        case 2: x = s;  y = 1;  z = t;  break; // +Y
+        case 3: x = s;  y = -1; z = -t; break; // -Y
+        case 4: x = s;  y = -t; z = 1;  break; // +Z
+        default: x = -s; y = -t; z = -1; break; // -Z
+    }
+}
+
+// atan2 with a Cephes style polynomial (about 1e-7 radians off), which is much
+// cheaper than the libm one and, unlike it, vectorizes
+float atan2_approx(float y, float x) {
+    float ax = std::abs(x), ay = std::abs(y);
+    bool swap = ay > ax;
+    float t = swap ? ax / ay : (ax > 0 ? ay / ax : 0.f);
+    float offset = 0.f;
+    if (t > 0.41421356f) { // tan(pi / 8)
+        offset = float(PI / 4);
+        t = (t - 1) / (t + 1);
+    }
+    float z = t * t;
+    float r = offset + (((8.05374449538e-2f * z - 1.38776856032e-1f) * z + 1.99777106478e-1f) * z - 3.33329491539e-1f) * z * t + t;
+    if (swap)
+        r = float(PI / 2) - r;
+    if (x < 0)
+        r = float(PI) - r;
+    return y < 0 ? -r : r;
+}
+
+#ifdef __SSE2__
+__m128 select_ps(__m128 mask, __m128 a, __m128 b) {
+    return _mm_or_ps(_mm_and_ps(mask, a), _mm_andnot_ps(mask, b));
+}
+
+// Four lanes of atan2_approx
+__m128 atan2_approx(__m128 y, __m128 x) {
+    __m128 sign_mask = _mm_set1_ps(-0.f);
+    __m128 ax = _mm_andnot_ps(sign_mask, x), ay = _mm_andnot_ps(sign_mask, y);
+    __m128 swap = _mm_cmpgt_ps(ay, ax);
+    __m128 num = select_ps(swap, ax, ay);
+    __m128 den = _mm_max_ps(select_ps(swap, ay, ax), _mm_set1_ps(1e-30f));
+    __m128 t = _mm_div_ps(num, den);
+
+    __m128 reduce = _mm_cmpgt_ps(t, _mm_set1_ps(0.41421356f));
+    __m128 one = _mm_set1_ps(1.f);
+    t = select_ps(reduce, _mm_div_ps(_mm_sub_ps(t, one), _mm_add_ps(t, one)), t);
+    __m128 offset = _mm_and_ps(reduce, _mm_set1_ps(float(PI / 4)));
+
+    __m128 z = _mm_mul_ps(t, t);
+    __m128 p = _mm_set1_ps(8.05374449538e-2f);
+    p = _mm_sub_ps(_mm_mul_ps(p, z), _mm_set1_ps(1.38776856032e-1f));
+    p = _mm_add_ps(_mm_mul_ps(p, z), _mm_set1_ps(1.99777106478e-1f));
+    p = _mm_sub_ps(_mm_mul_ps(p, z), _mm_set1_ps(3.33329491539e-1f));
+    __m128 r = _mm_add_ps(offset, _mm_add_ps(_mm_mul_ps(_mm_mul_ps(p, z), t), t));
+
+    r = select_ps(swap, _mm_sub_ps(_mm_set1_ps(float(PI / 2)), r), r);
+    r = select_ps(_mm_cmplt_ps(x, _mm_setzero_ps()), _mm_sub_ps(_mm_set1_ps(float(PI)), r), r);
+    return _mm_or_ps(r, _mm_and_ps(y, sign_mask));
+}
+#endif
+
+// Where the texels of a face row fall in the equirectangular image, in texels.
+// Same mapping as point_to_geo_coords and geo_coords_to_tex_coords in earth.vert
+void map_row(int face, int row, int face_size, int width, int height, float *source_x, float *source_y) {
+    float t = 2.f * (row + 0.5f) / face_size - 1.f;
+    float x_scale = width / float(2 * PI), y_scale = height / float(PI);
+
+    int column = 0;
+#ifdef __SSE2__
+    for (; column + 4 <= face_size; column += 4) {
+        __m128 s = _mm_sub_ps(_mm_mul_ps(_mm_add_ps(_mm_set_ps(column + 3.f, column + 2.f, column + 1.f, float(column)), _mm_set1_ps(0.5f)),
+                                         _mm_set1_ps(2.f / face_size)), _mm_set1_ps(1.f));
+        __m128 t4 = _mm_set1_ps(t), one = _mm_set1_ps(1.f);
+        __m128 x, y, z;
+        switch (face) {
+            case 0: x = one; y = _mm_sub_ps(_mm_setzero_ps(), t4); z = _mm_sub_ps(_mm_setzero_ps(), s); break;
+            case 1: x = _mm_sub_ps(_mm_setzero_ps(), one); y = _mm_sub_ps(_mm_setzero_ps(), t4); z = s; break;
+            case 2: x = s; y = one; z = t4; break;
+            case 3: x = s; y = _mm_sub_ps(_mm_setzero_ps(), one); z = _mm_sub_ps(_mm_setzero_ps(), t4); break;
+            case 4: x = s; y = _mm_sub_ps(_mm_setzero_ps(), t4); z = one; break;
+            default: x = _mm_sub_ps(_mm_setzero_ps(), s); y = _mm_sub_ps(_mm_setzero_ps(), t4); z = _mm_sub_ps(_mm_setzero_ps(), one); break;
+        }
+        __m128 lat = atan2_approx(y, _mm_sqrt_ps(_mm_add_ps(_mm_mul_ps(x, x), _mm_mul_ps(z, z))));
+        __m128 lng = atan2_approx(x, z);
+        __m128 half_pi = _mm_set1_ps(float(PI / 2)), half = _mm_set1_ps(0.5f);
+        _mm_storeu_ps(source_x + column, _mm_sub_ps(_mm_mul_ps(_mm_add_ps(lng, _mm_set1_ps(float(PI))), _mm_set1_ps(x_scale)), half));
+        _mm_storeu_ps(source_y + column, _mm_sub_ps(_mm_mul_ps(_mm_sub_ps(half_pi, lat), _mm_set1_ps(y_scale)), half));
+    }
+#endif
+    for (; column < face_size; ++column) {
+        float s = 2.f * (column + 0.5f) / face_size - 1.f;
+        float x, y, z;
+        face_direction(face, s, t, x, y, z);
+        float lat = atan2_approx(y, std::sqrt(x * x + z * z));
+        float lng = atan2_approx(x, z);
+        source_x[column] = (lng + float(PI)) * x_scale - 0.5f;
+        source_y[column] = (float(PI / 2) - lat) * y_scale - 0.5f;
+    }
+}
+
+// Four RGBA8 texels and their weights in 1/256, the weights add up to 256
+uint32_t blend(uint32_t p00, uint32_t p01, uint32_t p10, uint32_t p11,
+               int w00, int w01, int w10, int w11) {
+#ifdef __SSE2__
+    __m128i zero = _mm_setzero_si128();
+    __m128i top = _mm_unpacklo_epi8(_mm_unpacklo_epi32(_mm_cvtsi32_si128(p00), _mm_cvtsi32_si128(p01)), zero);
+    __m128i bottom = _mm_unpacklo_epi8(_mm_unpacklo_epi32(_mm_cvtsi32_si128(p10), _mm_cvtsi32_si128(p11)), zero);
+    __m128i top_weights = _mm_set_epi16(w01, w01, w01, w01, w00, w00, w00, w00);
+    __m128i bottom_weights = _mm_set_epi16(w11, w11, w11, w11, w10, w10, w10, w10);
+
+    // 255 * 256 + 128 still fits into 16 bits, so no widening is needed
+    __m128i sum = _mm_add_epi16(_mm_mullo_epi16(top, top_weights), _mm_mullo_epi16(bottom, bottom_weights));
+    sum = _mm_add_epi16(sum, _mm_srli_si128(sum, 8));
+    sum = _mm_srli_epi16(_mm_add_epi16(sum, _mm_set1_epi16(128)), 8);
+    return _mm_cvtsi128_si32(_mm_packus_epi16(sum, zero));
+#else
+    uint32_t result = 0;
+    for (int shift = 0; shift < 32; shift += 8) {
+        uint32_t sum = ((p00 >> shift) & 0xff) * w00 + ((p01 >> shift) & 0xff) * w01
+                     + ((p10 >> shift) & 0xff) * w10 + ((p11 >> shift) & 0xff) * w11;
+        result |= ((sum + 128) >> 8) << shift;
+    }
+    return result;
+#endif
+}
+
+void convert_row(const unsigned char *pixels, int width, int height,
+                 int face, int row, int face_size, unsigned char *out) {
+    auto texel = [&](int x, int y) {
+        uint32_t value;
+        std::memcpy(&value, pixels + (size_t(y) * width + x) * 4, 4);
+        return value;
+    };
+
+    std::vector<float> source_x(face_size), source_y(face_size);
+    map_row(face, row, face_size, width, height, source_x.data(), source_y.data());
+
+    for (int column = 0; column < face_size; ++column) {
+        float sx = source_x[column];
+        float sy = std::clamp(source_y[column], 0.f, height - 1.f);
+        int x0 = int(sx + 1) - 1; // sx >= -0.5, so this is floor
+        int y0 = int(sy);
+        int fx = int((sx - x0) * 256 + 0.5f);
+        int fy = int((sy - y0) * 256 + 0.5f);
+
+        // Longitude wraps around, latitude is clamped at the poles
+        if (x0 < 0)
+            x0 += width;
+        else if (x0 >= width)
+            x0 -= width;
+        int x1 = x0 + 1 < width ? x0 + 1 : 0;
+        int y1 = std::min(y0 + 1, height - 1);
+
+        int top = 256 - fy, bottom = fy;
+        int w00 = ((256 - fx) * top + 128) >> 8;
+        int w10 = ((256 - fx) * bottom + 128) >> 8;
+
+        uint32_t value = blend(texel(x0, y0), texel(x1, y0), texel(x0, y1), texel(x1, y1),
+                               w00, top - w00, w10, bottom - w10);
+        std::memcpy(out + size_t(column) * 4, &value, 4);
+    }
+}
+
+CacheHeader cache_header_for(const std::filesystem::path &source_path, int face_size) {
+    CacheHeader header{};
+    header.magic = CACHE_MAGIC;
+    header.version = CACHE_VERSION;
+    header.face_size = face_size;
+    header.source_size = std::filesystem::file_size(source_path);
+    header.source_mtime = std::filesystem::last_write_time(source_path).time_since_epoch().count();
+    return header;
+}
+
+}
+
+
+int cubemap_face_size(int equirect_width) {
+    return std::max(1, equirect_width / 4);
+}
+
+TextureImage equirect_to_cubemap(const unsigned char *pixels, int width, int height, int face_size, ThreadPool &pool) {
+    TextureImage cubemap;
+    cubemap.width = cubemap.height = face_size;
+    cubemap.faces.resize(6);
+    for (auto &face : cubemap.faces)
+        face.resize(size_t(face_size) * face_size * 4);
+
+    pool.parallel_for(6 * size_t(face_size), [&](size_t i) {
+        int face = int(i / face_size);
+        int row = int(i % face_size);
+        convert_row(pixels, width, height, face, row, face_size,
+                    cubemap.faces[face].data() + size_t(row) * face_size * 4);
+    });
+
+    return cubemap;
+}
+
+bool read_cubemap_cache(const std::filesystem::path &cache_path, const std::filesystem::path &source_path, TextureImage &cubemap) {
+    std::ifstream file(cache_path, std::ios::binary);
+    if (!file)
+        return false;
+
+    CacheHeader header;
+    if (!file.read(reinterpret_cast<char *>(&header), sizeof(header)))
+        return false;
+
+    CacheHeader expected = cache_header_for(source_path, header.face_size);
+    if (header.magic != expected.magic || header.version != expected.version ||
+        header.source_size != expected.source_size || header.source_mtime != expected.source_mtime)
+        return false;
+
+    cubemap.width = cubemap.height = header.face_size;
+    cubemap.faces.resize(6);
+    for (auto &face : cubemap.faces) {
+        face.resize(size_t(header.face_size) * header.face_size * 4);
+        if (!file.read(reinterpret_cast<char *>(face.data()), face.size()))
+            return false;
+    }
+    return true;
+}
+
+void write_cubemap_cache(const std::filesystem::path &cache_path, const std::filesystem::path &source_path, const TextureImage &cubemap) {
+    std::filesystem::create_directories(cache_path.parent_path());
+
+    // Write next to the final path and rename, so a reader never sees half a file
+    auto temp_path = cache_path;
+    temp_path += ".tmp";
+    {
+        std::ofstream file(temp_path, std::ios::binary);
+        if (!file)
+            throw std::runtime_error((std::string) "Failed to write the cubemap cache: " + (std::string) temp_path);
+
+        CacheHeader header = cache_header_for(source_path, cubemap.width);
+        file.write(reinterpret_cast<const char *>(&header), sizeof(header));
+        for (auto &face : cubemap.faces)
+            file.write(reinterpret_cast<const char *>(face.data()), face.size());
+    }
+    std::filesystem::rename(temp_path, cache_path);
+}
+
+std::filesystem::path cubemap_cache_path(const std::filesystem::path &cache_dir, const std::filesystem::path &source_path) {
+    return cache_dir / (source_path.filename().string() + ".cube");
+}
+
+TextureImage load_cubemap(const std::filesystem::path &source_path, const std::filesystem::path &cache_dir, ThreadPool &pool) {
+    auto cache_path = cubemap_cache_path(cache_dir, source_path);
+
+    TextureImage cubemap;
+    if (read_cubemap_cache(cache_path, source_path, cubemap))
+        return cubemap;
+
+    int width, height, channels;
+    stbi_uc *data = stbi_load(source_path.c_str(), &width, &height, &channels, 4); // RGBA
+    if (!data) {
+        throw std::runtime_error((std::string) "Failed to load texture: " + (std::string) source_path);
+    }
+
+    cubemap = equirect_to_cubemap(data, width, height, cubemap_face_size(width), pool);
+    stbi_image_free(data);
+
+    write_cubemap_cache(cache_path, source_path, cubemap);
+    return cubemap;
+}
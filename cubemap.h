@@ -0,0 +1,29 @@
+#pragma once
+
+#include <filesystem>
+
+#include "texture_image.h"
+
+class ThreadPool;
+
+
+// Cubemaps are TextureImages with six square faces in the GL order:
+// +X, -X, +Y, -Y, +Z, -Z
+
+// Face size with the same texel density at the equator as an equirectangular
+// image of the given width: four faces go around the equator
+int cubemap_face_size(int equirect_width);
+
+// Resamples an RGBA8 equirectangular image (the layout earth.vert maps with
+// geo_coords_to_tex_coords) into a cubemap, rows of faces in parallel
+TextureImage equirect_to_cubemap(const unsigned char *pixels, int width, int height, int face_size, ThreadPool &pool);
+
+// The cache is keyed by the size and modification time of the source file
+bool read_cubemap_cache(const std::filesystem::path &cache_path, const std::filesystem::path &source_path, TextureImage &cubemap);
+void write_cubemap_cache(const std::filesystem::path &cache_path, const std::filesystem::path &source_path, const TextureImage &cubemap);
+
+std::filesystem::path cubemap_cache_path(const std::filesystem::path &cache_dir, const std::filesystem::path &source_path);
+
+// Converted image of the file at source_path, taken from cache_dir if it is
+// up to date there and stored into it otherwise
+TextureImage load_cubemap(const std::filesystem::path &source_path, const std::filesystem::path &cache_dir, ThreadPool &pool);
@@ -0,0 +1,79 @@
+#include "file_watcher.h"
+
+#include <cerrno>
+#include <cstring>
+#include <set>
+#include <stdexcept>
+#include <string>
+
+#ifdef __linux__
+#include <sys/inotify.h>
+#include <unistd.h>
+#endif
+
+
+#ifdef __linux__
+
+FileWatcher::FileWatcher() {
+    fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (fd < 0)
+        throw std::runtime_error((std::string) "inotify_init1: " + std::strerror(errno));
+}
+
+FileWatcher::~FileWatcher() {
+    close(fd);
+}
+
+void FileWatcher::watch(const std::filesystem::path &path) {
+    auto file = std::filesystem::absolute(path).lexically_normal();
+    files[file] = path;
+
+    auto directory = file.parent_path();
+    for (auto &[descriptor, watched] : directories)
+        if (watched == directory)
+            return;
+
+    int descriptor = inotify_add_watch(fd, directory.c_str(), IN_CLOSE_WRITE | IN_MOVED_TO);
+    if (descriptor < 0)
+        throw std::runtime_error("inotify_add_watch " + directory.string() + ": " + std::strerror(errno));
+    directories[descriptor] = directory;
+}
+
+std::vector<std::filesystem::path> FileWatcher::changed_files() {
+    std::set<std::filesystem::path> changed;
+
+    alignas(inotify_event) char buffer[4096];
+    ssize_t length;
+    while ((length = read(fd, buffer, sizeof(buffer))) > 0) {
+        for (char *event_start = buffer; event_start < buffer + length;) {
+            auto *event = reinterpret_cast<inotify_event *>(event_start);
+            event_start += sizeof(inotify_event) + event->len;
+
+            auto directory = directories.find(event->wd);
+            if (directory == directories.end() || event->len == 0)
+                continue;
+
+            auto file = files.find(directory->second / event->name);
+            if (file != files.end())
+                changed.insert(file->second);
+        }
+    }
+
+    return {changed.begin(), changed.end()};
+}
+
+#else
+
+FileWatcher::FileWatcher() {}
+
+FileWatcher::~FileWatcher() {}
+
+void FileWatcher::watch(const std::filesystem::path &path) {
+    files[path] = path;
+}
+
+std::vector<std::filesystem::path> FileWatcher::changed_files() {
+    return {};
+}
+
+#endif
@@ -0,0 +1,30 @@
+#pragma once
+
+#include <filesystem>
+#include <map>
+#include <vector>
+
+
+// Reports files that were written or replaced, through inotify. The parent
+// directories are watched rather than the files themselves, since editors and
+// exporters usually save by writing a temporary file and renaming it over the
+// old one. Without inotify nothing is ever reported.
+class FileWatcher {
+public:
+    FileWatcher();
+    ~FileWatcher();
+
+    FileWatcher(const FileWatcher &) = delete;
+    FileWatcher &operator=(const FileWatcher &) = delete;
+
+    void watch(const std::filesystem::path &path);
+
+    // Watched files changed since the previous call, each listed once and as
+    // it was passed to watch(); never blocks
+    std::vector<std::filesystem::path> changed_files();
+
+private:
+    int fd = -1;
+    std::map<int, std::filesystem::path> directories; // by watch descriptor
+    std::map<std::filesystem::path, std::filesystem::path> files; // as watched, by normalized path
+};
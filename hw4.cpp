@@ -6,6 +6,7 @@
 #include <chrono>
 #include <vector>
 #include <map>
+#include <future>
 #include <cmath>
 #include <cassert>
 #include <cstring>
@@ -28,17 +29,44 @@
 #include "glm/common.hpp"
 
 #include "stb_image.h"
+#include "cubemap.h"
+#include "file_watcher.h"
+#include "texture_residency.h"
+#include "texture_image.h"
+#include "texture_streaming.h"
+#include "thread_pool.h"
 
 
 
 GLuint load_texture(const std::filesystem::path &path, bool srgb = false);
+GLuint load_cubemap_texture(const TextureImage &cubemap, bool srgb = false);
+std::vector<GLuint> load_plane_textures(const std::filesystem::path &path);
 std::string read_file(const std::filesystem::path &path);
 
 GLuint create_shader(GLenum type, const char *source);
 GLuint create_program(GLuint vertex_shader, GLuint fragment_shader);
+// For live reloading: the program is returned right after glLinkProgram, and
+// with ARB_parallel_shader_compile the driver compiles in the background while
+// program_link_finished polls it. check_program_link deletes the program and
+// returns the info logs if compilation or linking failed.
+GLuint start_program_link(const char *vertex_source, const char *fragment_source);
+bool program_link_finished(GLuint program);
+bool check_program_link(GLuint program, std::string &info_log);
+std::string add_shader_defines(const std::string &source, const std::string &defines);
 
 void generate_sphere(std::vector<glm::vec3> &vertices, size_t subdivisions_num);
 
+struct Options {
+    size_t texture_budget_mb = 0; // 0 - no budget, only accounting
+    bool cubemap = false;
+    size_t bench_frames = 0; // 0 - run until closed
+    bool progressive = false;
+    size_t decode_budget_us = 0; // 0 - the full images are decoded on the thread pool
+    bool watch = false;
+    bool planar_jpeg = false;
+};
+Options parse_options(int argc, char **argv);
+
 
 std::string to_string(std::string_view str) {
     return std::string(str.begin(), str.end());
@@ -52,8 +80,10 @@ void glew_fail(std::string_view message, GLenum error) {
     throw std::runtime_error(to_string(message) + reinterpret_cast<const char *>(glewGetErrorString(error)));
 }
 
-int main() try {
+int main(int argc, char **argv) try {
+    auto startup_start = std::chrono::steady_clock::now();
     std::filesystem::path project_root = PROJECT_ROOT;
+    Options options = parse_options(argc, argv);
     
     if (SDL_Init(SDL_INIT_VIDEO) != 0)
         sdl2_fail("SDL_Init: ");
@@ -92,12 +122,29 @@ int main() try {
     if (!GLEW_VERSION_3_3)
         throw std::runtime_error("OpenGL 3.3 is not supported");
 
+    if (options.watch && GLEW_ARB_parallel_shader_compile)
+        glMaxShaderCompilerThreadsARB(0xFFFFFFFF); // as many as the driver likes
+
 
     // Load and compile shaders
 
+    std::string shader_defines;
+    if (options.cubemap)
+        shader_defines += "#define CUBEMAP_TEXTURES\n";
+    if (options.planar_jpeg)
+        shader_defines += "#define PLANAR_DIFFUSE_TEXTURES\n";
+
+    auto shader_path = [&](const std::string &name, const char *extension) {
+        return project_root / ("shaders/" + name + extension);
+    };
+
+    auto read_shader_sources = [&](const std::string &name) {
+        return std::pair{add_shader_defines(read_file(shader_path(name, ".vert")), shader_defines),
+                         add_shader_defines(read_file(shader_path(name, ".frag")), shader_defines)};
+    };
+
     auto load_shaders = [&](const char *name) -> GLuint {
-        auto vertex_shader_source = read_file((project_root / ((std::string) "shaders/" + name + ".vert")).c_str());
-        auto fragment_shader_source = read_file((project_root / ((std::string) "shaders/" + name + ".frag")).c_str());
+        auto [vertex_shader_source, fragment_shader_source] = read_shader_sources(name);
 
         auto vertex_shader = create_shader(GL_VERTEX_SHADER, vertex_shader_source.c_str());
         auto fragment_shader = create_shader(GL_FRAGMENT_SHADER, fragment_shader_source.c_str());
@@ -110,10 +157,119 @@ int main() try {
 
     // Load textures
 
-    GLuint earth_diffuse_day_texture = load_texture(project_root / "earth_diffuse_day.jpg", true);
-    GLuint earth_diffuse_night_texture = load_texture(project_root / "earth_diffuse_night.jpg", true);
-    GLuint earth_specular_texture = load_texture(project_root / "earth_specular.jpg", false);
-    GLuint earth_heightmap_texture = load_texture(project_root / "earth_heightmap.png", false);
+    ThreadPool thread_pool;
+    set_decode_thread_pool(&thread_pool);
+    TextureResidency texture_residency(thread_pool, options.texture_budget_mb * 1024 * 1024);
+
+    // Cubemaps are converted from the equirectangular images once and then
+    // loaded from the cache
+    std::filesystem::path cache_dir = project_root / ".cache";
+    GLenum earth_texture_target = options.cubemap ? GL_TEXTURE_CUBE_MAP : GL_TEXTURE_2D;
+    if (options.cubemap)
+        glEnable(GL_TEXTURE_CUBE_MAP_SEAMLESS);
+
+    // With --progressive, the textures start from a small preview and the full
+    // images are decoded in the background (or with --decode-budget-us, a
+    // little every frame) and uploaded a few rows per frame
+    const size_t STREAMING_UPLOAD_BYTES_PER_FRAME = 16 * 1024 * 1024;
+    TextureStreamer texture_streamer(thread_pool, texture_residency, cache_dir, STREAMING_UPLOAD_BYTES_PER_FRAME,
+                                     std::chrono::microseconds(options.decode_budget_us));
+
+    auto texture_decoder = [&](const std::filesystem::path &path) -> TextureStreamer::Decode {
+        if (!options.cubemap)
+            return [path](int level) { return load_texture_image(path, level); };
+        return [path, cache_dir, &thread_pool](int) { return load_cubemap(path, cache_dir, thread_pool); };
+    };
+
+    auto load_tracked_texture = [&](const std::filesystem::path &path, bool srgb) -> GLuint {
+        if (options.progressive) {
+            int image_width, image_height, channels;
+            if (!stbi_info(path.c_str(), &image_width, &image_height, &channels))
+                throw std::runtime_error((std::string) "Failed to load texture: " + (std::string) path);
+
+            if (options.cubemap)
+                image_width = image_height = cubemap_face_size(image_width);
+            return texture_streamer.load(earth_texture_target, path, srgb, image_width, image_height, texture_decoder(path));
+        }
+
+        if (!options.cubemap) {
+            GLuint texture = load_texture(path, srgb);
+            texture_residency.track(texture, path, srgb);
+            return texture;
+        }
+
+        auto reload_cubemap = [path, cache_dir, &thread_pool](int) { return load_cubemap(path, cache_dir, thread_pool); };
+        GLuint texture = load_cubemap_texture(load_cubemap(path, cache_dir, thread_pool), srgb);
+        texture_residency.track(texture, GL_TEXTURE_CUBE_MAP, path.filename().string(), srgb, reload_cubemap);
+        return texture;
+    };
+
+    // Texture files are mapped instead of read through FILE, but not with
+    // --watch, where an editor truncating one while it is decoded would crash hw4
+    stbi_set_mmap(!options.watch);
+
+    // With --watch, changed textures are decoded again on the thread pool and
+    // streamed in, and changed shaders are recompiled in the background while
+    // the old program stays in use until the new one links
+    FileWatcher file_watcher;
+    std::map<std::filesystem::path, std::pair<GLuint, bool>> watched_textures; // texture and srgb
+    std::map<std::filesystem::path, std::string> watched_shaders; // program name
+
+    auto load_watched_texture = [&](const std::filesystem::path &path, bool srgb) -> GLuint {
+        GLuint texture = load_tracked_texture(path, srgb);
+        if (options.watch) {
+            file_watcher.watch(path);
+            watched_textures[path] = {texture, srgb};
+        }
+        return texture;
+    };
+
+    // With --planar-jpeg, the diffuse textures are the Y, Cb and Cr planes of
+    // the JPEGs as they are decoded, and earth.frag converts them to color
+    auto load_diffuse_texture = [&](const std::filesystem::path &path, GLuint *chroma_textures) -> GLuint {
+        if (!options.planar_jpeg)
+            return load_watched_texture(path, true);
+
+        std::vector<GLuint> planes = load_plane_textures(path);
+        if (planes.size() != 3)
+            throw std::runtime_error((std::string) "--planar-jpeg needs a YCbCr JPEG: " + (std::string) path);
+        // Restoring a level of any plane decodes the whole JPEG, so the planes
+        // are restored together
+        std::vector<std::string> plane_names;
+        for (const char *plane_name : {" (Y)", " (Cb)", " (Cr)"})
+            plane_names.push_back(path.filename().string() + plane_name);
+        texture_residency.track_planes(planes, plane_names, [path](int level) { return load_texture_planes(path, level); });
+        chroma_textures[0] = planes[1];
+        chroma_textures[1] = planes[2];
+        return planes[0];
+    };
+
+    GLuint earth_diffuse_day_chroma_textures[2] = {}; // Cb and Cr, with --planar-jpeg
+    GLuint earth_diffuse_night_chroma_textures[2] = {};
+    GLuint earth_diffuse_day_texture = load_diffuse_texture(project_root / "earth_diffuse_day.jpg",
+                                                            earth_diffuse_day_chroma_textures);
+    GLuint earth_diffuse_night_texture = load_diffuse_texture(project_root / "earth_diffuse_night.jpg",
+                                                              earth_diffuse_night_chroma_textures);
+    GLuint earth_specular_texture = load_watched_texture(project_root / "earth_specular.jpg", false);
+    GLuint earth_heightmap_texture = load_watched_texture(project_root / "earth_heightmap.png", false);
+
+    std::map<std::string, GLuint *> programs = {{"earth", &earth_program}, {"post", &post_program}};
+    if (options.watch) {
+        for (auto &[name, program] : programs) {
+            for (auto extension : {".vert", ".frag"}) {
+                file_watcher.watch(shader_path(name, extension));
+                watched_shaders[shader_path(name, extension)] = name;
+            }
+        }
+    }
+
+    struct ShaderReload {
+        std::future<std::pair<std::string, std::string>> sources;
+        GLuint program = 0; // once the sources are read
+    };
+    std::map<std::string, ShaderReload> shader_reloads;
+
+    size_t reported_texture_bytes = 0;
 
 
     // Get uniform's locations
@@ -129,6 +285,10 @@ int main() try {
                 GLint diffuse_day_texture; // sampler2D
                 GLint diffuse_night_texture; // sampler2D
                 GLint specular_texture; // sampler2D
+                GLint diffuse_day_cb_texture; // sampler2D, with --planar-jpeg
+                GLint diffuse_day_cr_texture; // sampler2D
+                GLint diffuse_night_cb_texture; // sampler2D
+                GLint diffuse_night_cr_texture; // sampler2D
             } material;
 
             struct {
@@ -155,25 +315,33 @@ int main() try {
 
     } locations;
 
-    locations.earth.view = glGetUniformLocation(earth_program, "view");
-    locations.earth.projection = glGetUniformLocation(earth_program, "projection");
-    locations.earth.camera_position = glGetUniformLocation(earth_program, "camera_position");
+    // Programs can be replaced by reloading
+    auto update_uniform_locations = [&]() {
+        locations.earth.view = glGetUniformLocation(earth_program, "view");
+        locations.earth.projection = glGetUniformLocation(earth_program, "projection");
+        locations.earth.camera_position = glGetUniformLocation(earth_program, "camera_position");
 
-    locations.earth.material.diffuse_day_texture = glGetUniformLocation(earth_program, "material.diffuse_day_texture");
-    locations.earth.material.diffuse_night_texture = glGetUniformLocation(earth_program, "material.diffuse_night_texture");
-    locations.earth.material.specular_texture = glGetUniformLocation(earth_program, "material.specular_texture");
+        locations.earth.material.diffuse_day_texture = glGetUniformLocation(earth_program, "material.diffuse_day_texture");
+        locations.earth.material.diffuse_night_texture = glGetUniformLocation(earth_program, "material.diffuse_night_texture");
+        locations.earth.material.specular_texture = glGetUniformLocation(earth_program, "material.specular_texture");
+        locations.earth.material.diffuse_day_cb_texture = glGetUniformLocation(earth_program, "material.diffuse_day_cb_texture");
+        locations.earth.material.diffuse_day_cr_texture = glGetUniformLocation(earth_program, "material.diffuse_day_cr_texture");
+        locations.earth.material.diffuse_night_cb_texture = glGetUniformLocation(earth_program, "material.diffuse_night_cb_texture");
+        locations.earth.material.diffuse_night_cr_texture = glGetUniformLocation(earth_program, "material.diffuse_night_cr_texture");
 
-    locations.earth.heightmap = glGetUniformLocation(earth_program, "heightmap");
-    locations.earth.geodata.earth_radius_at_peak = glGetUniformLocation(earth_program, "geodata.earth_radius_at_peak");
-    locations.earth.geodata.earth_radius_at_sea = glGetUniformLocation(earth_program, "geodata.earth_radius_at_sea");
-    locations.earth.geodata.height_multiplier = glGetUniformLocation(earth_program, "geodata.height_multiplier");
+        locations.earth.heightmap = glGetUniformLocation(earth_program, "heightmap");
+        locations.earth.geodata.earth_radius_at_peak = glGetUniformLocation(earth_program, "geodata.earth_radius_at_peak");
+        locations.earth.geodata.earth_radius_at_sea = glGetUniformLocation(earth_program, "geodata.earth_radius_at_sea");
+        locations.earth.geodata.height_multiplier = glGetUniformLocation(earth_program, "geodata.height_multiplier");
 
-    locations.earth.sun.pos = glGetUniformLocation(earth_program, "sun.pos");
-    locations.earth.sun.color = glGetUniformLocation(earth_program, "sun.color");
+        locations.earth.sun.pos = glGetUniformLocation(earth_program, "sun.pos");
+        locations.earth.sun.color = glGetUniformLocation(earth_program, "sun.color");
 
-    locations.earth.ambient_light.color = glGetUniformLocation(earth_program, "ambient_light.color");
+        locations.earth.ambient_light.color = glGetUniformLocation(earth_program, "ambient_light.color");
 
-    locations.post.hdr_buffer = glGetUniformLocation(post_program, "hdr_buffer");
+        locations.post.hdr_buffer = glGetUniformLocation(post_program, "hdr_buffer");
+    };
+    update_uniform_locations();
 
 
     // Create buffers for the scene and generate data
@@ -250,6 +418,19 @@ int main() try {
 
     std::map<SDL_Keycode, bool> button_down;
 
+    // With --bench-frames, the GPU time of the earth pass is measured for the
+    // given number of frames and printed together with the texture memory
+    GLuint earth_pass_query;
+    glGenQueries(1, &earth_pass_query);
+    size_t frames_rendered = 0;
+    double earth_pass_total_ms = 0;
+
+    bool first_frame_reported = false;
+    bool streaming_reported = false;
+    auto ms_since_startup = [&]() {
+        return std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - startup_start).count();
+    };
+
     bool running = true;
     while (running) {
         for (SDL_Event event; SDL_PollEvent(&event);)
@@ -282,6 +463,54 @@ int main() try {
         if (!running)
             break;
 
+
+        // Hot reload
+
+        for (auto &path : file_watcher.changed_files()) {
+            std::cout << "Reloading " << path.filename().string() << std::endl;
+            if (auto texture = watched_textures.find(path); texture != watched_textures.end()) {
+                auto [texture_id, srgb] = texture->second;
+                texture_streamer.reload(texture_id, earth_texture_target, path, srgb, texture_decoder(path));
+            } else if (auto shader = watched_shaders.find(path); shader != watched_shaders.end()) {
+                // A change during a recompilation starts it over
+                std::string name = shader->second;
+                if (shader_reloads[name].program)
+                    glDeleteProgram(shader_reloads[name].program);
+                shader_reloads[name] = {thread_pool.submit([&read_shader_sources, name]() { return read_shader_sources(name); })};
+            }
+        }
+
+        for (auto it = shader_reloads.begin(); it != shader_reloads.end();) {
+            auto &[name, reload] = *it;
+            try {
+                if (!reload.program) {
+                    if (reload.sources.wait_for(std::chrono::seconds(0)) != std::future_status::ready) {
+                        ++it;
+                        continue;
+                    }
+                    auto [vertex_source, fragment_source] = reload.sources.get();
+                    reload.program = start_program_link(vertex_source.c_str(), fragment_source.c_str());
+                }
+                if (!program_link_finished(reload.program)) {
+                    ++it;
+                    continue;
+                }
+
+                std::string info_log;
+                if (check_program_link(reload.program, info_log)) {
+                    glDeleteProgram(*programs[name]);
+                    *programs[name] = reload.program;
+                    update_uniform_locations();
+                    std::cout << "Reloaded " << name << " shaders" << std::endl;
+                } else {
+                    std::cerr << "Keeping the old " << name << " shaders:\n" << info_log << std::endl;
+                }
+            } catch (std::exception const &e) {
+                std::cerr << "Keeping the old " << name << " shaders: " << e.what() << std::endl;
+            }
+            it = shader_reloads.erase(it);
+        }
+
         auto now = std::chrono::high_resolution_clock::now();
         float dt = std::chrono::duration_cast<std::chrono::duration<float>>(now - last_frame_start).count();
         last_frame_start = now;
@@ -309,9 +538,10 @@ int main() try {
 
 
         // Calc matrices for the scene
+        const float fov = glm::pi<float>() / 2.f;
         const float near = 0.001f;
         const float far = 20.f;
-        glm::mat4 camera_projection_mat = glm::perspective(glm::pi<float>() / 2.f, (1.f * width) / height, near, far);
+        glm::mat4 camera_projection_mat = glm::perspective(fov, (1.f * width) / height, near, far);
 
         glm::mat4 camera_view_mat(1.f);
         camera_view_mat = glm::translate(camera_view_mat, {0.f, 0.f, -camera_distance});
@@ -328,8 +558,28 @@ int main() try {
         glm::vec3 sun_pos(std::cos(sun_angle), 0.f, std::sin(sun_angle));
 
 
+        // Keep only the mip levels needed at this distance: the surface point
+        // right below the camera is the closest, so it needs the most texels
+        float pixels_per_radian = (height / 2.f) / std::tan(fov / 2.f) / std::max(camera_distance - 1.f, near);
+        texture_residency.update(pixels_per_radian);
+
+        texture_streamer.update();
+        if (options.progressive && texture_streamer.finished() && !streaming_reported) {
+            std::cout << "Textures streamed after " << ms_since_startup() << " ms" << std::endl;
+            streaming_reported = true;
+        }
+
+        if (texture_residency.allocated_bytes() != reported_texture_bytes) {
+            reported_texture_bytes = texture_residency.allocated_bytes();
+            texture_residency.print_report(std::cout);
+        }
+
+
         // Render the earth into the HDR buffer
 
+        if (options.bench_frames)
+            glBeginQuery(GL_TIME_ELAPSED, earth_pass_query);
+
         glBindFramebuffer(GL_DRAW_FRAMEBUFFER, hdr_fbo);
         glViewport(0, 0, width, height);
 
@@ -350,21 +600,33 @@ int main() try {
         glUniform3fv(locations.earth.camera_position, 1, glm::value_ptr(camera_pos));
 
         glActiveTexture(GL_TEXTURE0);
-        glBindTexture(GL_TEXTURE_2D, earth_diffuse_day_texture);
+        glBindTexture(earth_texture_target, earth_diffuse_day_texture);
         glUniform1i(locations.earth.material.diffuse_day_texture, 0);
 
         glActiveTexture(GL_TEXTURE1);
-        glBindTexture(GL_TEXTURE_2D, earth_diffuse_night_texture);
+        glBindTexture(earth_texture_target, earth_diffuse_night_texture);
         glUniform1i(locations.earth.material.diffuse_night_texture, 1);
 
         glActiveTexture(GL_TEXTURE2);
-        glBindTexture(GL_TEXTURE_2D, earth_specular_texture);
+        glBindTexture(earth_texture_target, earth_specular_texture);
         glUniform1i(locations.earth.material.specular_texture, 2);
 
         glActiveTexture(GL_TEXTURE3);
-        glBindTexture(GL_TEXTURE_2D, earth_heightmap_texture);
+        glBindTexture(earth_texture_target, earth_heightmap_texture);
         glUniform1i(locations.earth.heightmap, 3);
 
+        if (options.planar_jpeg) {
+            GLuint chroma_textures[] = {earth_diffuse_day_chroma_textures[0], earth_diffuse_day_chroma_textures[1],
+                                        earth_diffuse_night_chroma_textures[0], earth_diffuse_night_chroma_textures[1]};
+            GLint chroma_locations[] = {locations.earth.material.diffuse_day_cb_texture, locations.earth.material.diffuse_day_cr_texture,
+                                        locations.earth.material.diffuse_night_cb_texture, locations.earth.material.diffuse_night_cr_texture};
+            for (int i = 0; i < 4; ++i) {
+                glActiveTexture(GL_TEXTURE4 + i);
+                glBindTexture(GL_TEXTURE_2D, chroma_textures[i]);
+                glUniform1i(chroma_locations[i], 4 + i);
+            }
+        }
+
         glUniform1f(locations.earth.geodata.earth_radius_at_peak, earth_radius_at_peak_km);
         glUniform1f(locations.earth.geodata.earth_radius_at_sea, earth_radius_at_sea_km);
         glUniform1f(locations.earth.geodata.height_multiplier, height_multiplier);
@@ -376,6 +638,13 @@ int main() try {
 
         glDrawArrays(GL_TRIANGLES, 0, earth_vertices_count);
 
+        if (options.bench_frames) {
+            glEndQuery(GL_TIME_ELAPSED);
+            GLuint64 earth_pass_ns;
+            glGetQueryObjectui64v(earth_pass_query, GL_QUERY_RESULT, &earth_pass_ns);
+            earth_pass_total_ms += earth_pass_ns / 1e6;
+        }
+
 
         // Render the HDR buffer with post processing
         glBindFramebuffer(GL_DRAW_FRAMEBUFFER, 0);
@@ -396,6 +665,18 @@ int main() try {
 
 
         SDL_GL_SwapWindow(window);
+
+        if (!first_frame_reported) {
+            std::cout << "First frame after " << ms_since_startup() << " ms" << std::endl;
+            first_frame_reported = true;
+        }
+
+        if (options.bench_frames && ++frames_rendered == options.bench_frames) {
+            std::cout << (options.cubemap ? "cubemap" : "equirectangular") << " textures, "
+                      << frames_rendered << " frames: earth pass " << earth_pass_total_ms / frames_rendered << " ms average, "
+                      << texture_residency.allocated_bytes() / (1024.0 * 1024.0) << " MiB of textures" << std::endl;
+            running = false;
+        }
     }
 
     SDL_GL_DeleteContext(gl_context);
@@ -406,6 +687,34 @@ catch (std::exception const &e) {
     return EXIT_FAILURE;
 }
 
+Options parse_options(int argc, char **argv) {
+    Options options;
+    for (int i = 1; i < argc; ++i) {
+        std::string_view arg = argv[i];
+        if (arg == "--texture-budget-mb" && i + 1 < argc) {
+            options.texture_budget_mb = std::stoul(argv[++i]);
+        } else if (arg == "--cubemap") {
+            options.cubemap = true;
+        } else if (arg == "--bench-frames" && i + 1 < argc) {
+            options.bench_frames = std::stoul(argv[++i]);
+        } else if (arg == "--progressive") {
+            options.progressive = true;
+        } else if (arg == "--decode-budget-us" && i + 1 < argc) {
+            options.decode_budget_us = std::stoul(argv[++i]);
+        } else if (arg == "--watch") {
+            options.watch = true;
+        } else if (arg == "--planar-jpeg") {
+            options.planar_jpeg = true;
+        } else {
+            throw std::runtime_error("Unknown argument: " + to_string(arg) + "\n"
+                                     "Usage: hw4 [--texture-budget-mb N] [--cubemap] [--bench-frames N] [--progressive] [--decode-budget-us N] [--watch] [--planar-jpeg]");
+        }
+    }
+    if (options.planar_jpeg && (options.cubemap || options.progressive || options.watch))
+        throw std::runtime_error("--planar-jpeg does not work with --cubemap, --progressive or --watch");
+    return options;
+}
+
 std::string read_file(const std::filesystem::path &path) {
     std::ifstream file(path);
     if (!file) {
@@ -422,9 +731,23 @@ const char *gl_error_str(GLenum error);
 
 GLuint load_texture(const std::filesystem::path &path, bool srgb) {
     int width, height, channels;
-    void* data; 
-    data = stbi_load(path.c_str(), &width, &height, &channels, 4); // RGBA
-    if (!data) {
+    if (!stbi_info(path.c_str(), &width, &height, &channels)) {
+        throw std::runtime_error((std::string) "Failed to load texture: " + (std::string) path);
+    }
+
+    // The image is decoded straight into a mapped pixel buffer, already as RGBA
+    // rows, so there is no copy of it in between and glTexImage2D reads from the buffer
+    GLsizeiptr size = GLsizeiptr(width) * height * 4;
+    GLuint pixel_buffer;
+    glGenBuffers(1, &pixel_buffer);
+    glBindBuffer(GL_PIXEL_UNPACK_BUFFER, pixel_buffer);
+    glBufferData(GL_PIXEL_UNPACK_BUFFER, size, nullptr, GL_STREAM_DRAW);
+    auto pixels = (stbi_uc *) glMapBufferRange(GL_PIXEL_UNPACK_BUFFER, 0, size, GL_MAP_WRITE_BIT | GL_MAP_INVALIDATE_BUFFER_BIT);
+    bool decoded = pixels && stbi_load_into(path.c_str(), pixels, width * 4, width, height, 4, 0); // RGBA
+    bool unmapped = pixels && glUnmapBuffer(GL_PIXEL_UNPACK_BUFFER);
+    if (!decoded || !unmapped) {
+        glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+        glDeleteBuffers(1, &pixel_buffer);
         throw std::runtime_error((std::string) "Failed to load texture: " + (std::string) path);
     }
 
@@ -433,10 +756,11 @@ GLuint load_texture(const std::filesystem::path &path, bool srgb) {
     glBindTexture(GL_TEXTURE_2D, textureID);
 
     GLenum internal_format = srgb ? GL_SRGB8_ALPHA8 : GL_RGBA;
-    glTexImage2D(GL_TEXTURE_2D, 0, internal_format, width, height, 0, GL_RGBA, GL_UNSIGNED_BYTE, data);
+    glTexImage2D(GL_TEXTURE_2D, 0, internal_format, width, height, 0, GL_RGBA, GL_UNSIGNED_BYTE, nullptr);
     GLenum error = glGetError();
+    glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+    glDeleteBuffers(1, &pixel_buffer);
     if (error != GL_NO_ERROR) {
-        stbi_image_free(data);
         throw std::runtime_error((std::string) "OpenGL error during texture upload: " + gl_error_str(error));
     }
     
@@ -447,12 +771,74 @@ GLuint load_texture(const std::filesystem::path &path, bool srgb) {
     glTexParameterf(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
     glTexParameterf(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
 
-    stbi_image_free(data);
+    return textureID;
+}
+
+
+GLuint load_cubemap_texture(const TextureImage &cubemap, bool srgb) {
+    GLuint textureID;
+    glGenTextures(1, &textureID);
+    glBindTexture(GL_TEXTURE_CUBE_MAP, textureID);
+
+    GLenum internal_format = srgb ? GL_SRGB8_ALPHA8 : GL_RGBA;
+    for (int face = 0; face < 6; ++face) {
+        glTexImage2D(GL_TEXTURE_CUBE_MAP_POSITIVE_X + face, 0, internal_format, cubemap.width, cubemap.height, 0,
+                     GL_RGBA, GL_UNSIGNED_BYTE, cubemap.faces[face].data());
+    }
+    GLenum error = glGetError();
+    if (error != GL_NO_ERROR) {
+        throw std::runtime_error((std::string) "OpenGL error during cubemap upload: " + gl_error_str(error));
+    }
+
+    glGenerateMipmap(GL_TEXTURE_CUBE_MAP);
+
+    glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_MIN_FILTER, GL_LINEAR_MIPMAP_LINEAR);
+    glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+    glTexParameterf(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+    glTexParameterf(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+    glTexParameterf(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_WRAP_R, GL_CLAMP_TO_EDGE);
 
     return textureID;
 }
 
 
+// Single channel textures with the planes of a JPEG at their own resolution:
+// Y, Cb and Cr, or just Y if it is grayscale. None if it is not a YCbCr JPEG.
+std::vector<GLuint> load_plane_textures(const std::filesystem::path &path) {
+    std::vector<GLuint> result;
+    for (auto &plane : load_texture_planes(path)) {
+        GLuint textureID;
+        glGenTextures(1, &textureID);
+        glBindTexture(GL_TEXTURE_2D, textureID);
+
+        glPixelStorei(GL_UNPACK_ALIGNMENT, 1); // rows are not padded to 4 bytes
+        glTexImage2D(GL_TEXTURE_2D, 0, GL_R8, plane.width, plane.height, 0, GL_RED, GL_UNSIGNED_BYTE, plane.faces[0].data());
+        glPixelStorei(GL_UNPACK_ALIGNMENT, 4);
+        GLenum error = glGetError();
+        if (error != GL_NO_ERROR) {
+            throw std::runtime_error((std::string) "OpenGL error during texture upload: " + gl_error_str(error));
+        }
+
+        glGenerateMipmap(GL_TEXTURE_2D);
+
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR_MIPMAP_LINEAR);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+        glTexParameterf(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+        glTexParameterf(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+
+        result.push_back(textureID);
+    }
+    return result;
+}
+
+
+// The defines go right after the #version line, which has to stay first
+std::string add_shader_defines(const std::string &source, const std::string &defines) {
+    size_t version_end = source.find('\n') + 1;
+    return source.substr(0, version_end) + defines + source.substr(version_end);
+}
+
+
 GLuint create_shader(GLenum type, const char *source) {
     GLuint result = glCreateShader(type);
     glShaderSource(result, 1, &source, nullptr);
@@ -489,6 +875,59 @@ GLuint create_program(GLuint vertex_shader, GLuint fragment_shader) {
     return result;
 }
 
+GLuint start_program_link(const char *vertex_source, const char *fragment_source) {
+    GLuint result = glCreateProgram();
+    for (auto [type, source] : {std::pair{GL_VERTEX_SHADER, vertex_source}, std::pair{GL_FRAGMENT_SHADER, fragment_source}}) {
+        GLuint shader = glCreateShader(type);
+        glShaderSource(shader, 1, &source, nullptr);
+        glCompileShader(shader);
+        glAttachShader(result, shader);
+        glDeleteShader(shader); // goes away with the program
+    }
+    glLinkProgram(result);
+    return result;
+}
+
+
+bool program_link_finished(GLuint program) {
+    if (!GLEW_ARB_parallel_shader_compile)
+        return true; // the status queries will just wait
+    GLint status;
+    glGetProgramiv(program, GL_COMPLETION_STATUS_ARB, &status);
+    return status == GL_TRUE;
+}
+
+
+bool check_program_link(GLuint program, std::string &info_log) {
+    GLint status;
+    glGetProgramiv(program, GL_LINK_STATUS, &status);
+    if (status == GL_TRUE)
+        return true;
+
+    GLuint shaders[2];
+    GLsizei shaders_num;
+    glGetAttachedShaders(program, 2, &shaders_num, shaders);
+    for (GLsizei i = 0; i < shaders_num; ++i) {
+        glGetShaderiv(shaders[i], GL_COMPILE_STATUS, &status);
+        if (status == GL_TRUE)
+            continue;
+        GLint info_log_length;
+        glGetShaderiv(shaders[i], GL_INFO_LOG_LENGTH, &info_log_length);
+        std::string shader_log(info_log_length, '\0');
+        glGetShaderInfoLog(shaders[i], shader_log.size(), nullptr, shader_log.data());
+        info_log += "Shader compilation failed: " + shader_log;
+    }
+
+    GLint info_log_length;
+    glGetProgramiv(program, GL_INFO_LOG_LENGTH, &info_log_length);
+    std::string program_log(info_log_length, '\0');
+    glGetProgramInfoLog(program, program_log.size(), nullptr, program_log.data());
+    info_log += "Program linkage failed: " + program_log;
+
+    glDeleteProgram(program);
+    return false;
+}
+
 void generate_sphere(std::vector<glm::vec3> &vertices,
                      size_t subdivisions_num) {
     // Start with a regular icosahedron
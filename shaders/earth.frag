@@ -1,9 +1,26 @@
 #version 330 core
 
+// The textures are either equirectangular images sampled with the texture
+// coords or cubemaps sampled with the direction from the center
+#ifdef CUBEMAP_TEXTURES
+#define earth_sampler samplerCube
+#define sample_earth(s, tex_coords, point) texture(s, point)
+#else
+#define earth_sampler sampler2D
+#define sample_earth(s, tex_coords, point) texture(s, tex_coords)
+#endif
+
 struct Material {
-    sampler2D diffuse_day_texture;
-    sampler2D diffuse_night_texture;
-    sampler2D specular_texture;
+    earth_sampler diffuse_day_texture;
+    earth_sampler diffuse_night_texture;
+    earth_sampler specular_texture;
+#ifdef PLANAR_DIFFUSE_TEXTURES
+    // The diffuse textures above hold Y, these the chroma of the JPEGs
+    sampler2D diffuse_day_cb_texture;
+    sampler2D diffuse_day_cr_texture;
+    sampler2D diffuse_night_cb_texture;
+    sampler2D diffuse_night_cr_texture;
+#endif
 };
 
 struct Geodata {
@@ -27,7 +44,7 @@ in vec2 texcoord;
 uniform vec3 camera_position;
 
 uniform Material material;
-uniform sampler2D heightmap;
+uniform earth_sampler heightmap;
 uniform Geodata geodata;
 uniform AmbientLight ambient_light;
 uniform Sun sun;
@@ -55,16 +72,32 @@ vec3 texcoord_to_world_point(vec2 tex_coords) {
     vec2 geo_coords = tex_coords_to_geo_coords(tex_coords);
     vec3 point = geo_coords_to_world_point(geo_coords);
     
-    float height = texture(heightmap, tex_coords).x;
+    float height = sample_earth(heightmap, tex_coords, point).x;
     float radius = sea_radius + geodata.height_multiplier * height * (1 - sea_radius);
     return radius * point;
 }
 
+#ifdef PLANAR_DIFFUSE_TEXTURES
+// Full range YCbCr of JPEG (JFIF) to linear RGB, as the sRGB textures give it
+vec3 ycbcr_to_linear(float y, float cb, float cr) {
+    vec3 c = clamp(vec3(y + 1.402 * (cr - 0.5),
+                        y - 0.344136 * (cb - 0.5) - 0.714136 * (cr - 0.5),
+                        y + 1.772 * (cb - 0.5)), 0.0, 1.0);
+    return mix(c / 12.92, pow((c + 0.055) / 1.055, vec3(2.4)), step(0.04045, c));
+}
+#endif
+
 void main()
 {
     // Calc the normal vector
 
+#ifdef CUBEMAP_TEXTURES
+    // Four faces go around the equator
+    vec2 texel_size = 1.0 / (vec2(4, 2) * vec2(textureSize(heightmap, 0)));
+#else
     vec2 texel_size = 1.0 / vec2(textureSize(heightmap, 0));
+#endif
+    vec3 direction = normalize(position);
 
     vec3 p_west = texcoord_to_world_point(texcoord - vec2(texel_size.x, 0));
     vec3 p_east = texcoord_to_world_point(texcoord + vec2(texel_size.x, 0));
@@ -84,14 +117,23 @@ void main()
     float diffuse = max(0.0, dot(norm, sunlight_dir));;
 
     vec3 reflected_dir = reflect(sunlight_dir, norm);
-    float glossiness = texture(material.specular_texture, texcoord).x;
+    float glossiness = sample_earth(material.specular_texture, texcoord, direction).x;
     float specular_power = 5.f;
     float specular = glossiness * pow(max(0.0, dot(reflected_dir, view_dir)), specular_power);
 
     vec3 light = sun.color * (diffuse + specular); 
 
-    vec3 albedo_day = texture(material.diffuse_day_texture, texcoord).xyz;
-    vec3 albedo_night = texture(material.diffuse_night_texture, texcoord).xyz;
+#ifdef PLANAR_DIFFUSE_TEXTURES
+    vec3 albedo_day = ycbcr_to_linear(texture(material.diffuse_day_texture, texcoord).x,
+                                      texture(material.diffuse_day_cb_texture, texcoord).x,
+                                      texture(material.diffuse_day_cr_texture, texcoord).x);
+    vec3 albedo_night = ycbcr_to_linear(texture(material.diffuse_night_texture, texcoord).x,
+                                        texture(material.diffuse_night_cb_texture, texcoord).x,
+                                        texture(material.diffuse_night_cr_texture, texcoord).x);
+#else
+    vec3 albedo_day = sample_earth(material.diffuse_day_texture, texcoord, direction).xyz;
+    vec3 albedo_night = sample_earth(material.diffuse_night_texture, texcoord, direction).xyz;
+#endif
 
     vec3 color = max(vec3(0), 1 - light) * albedo_night + light * albedo_day;
     out_color = vec4(color, 1);
@@ -28,7 +28,11 @@ struct Geodata {
     float earth_radius_at_peak;
     float earth_radius_at_sea;
 };
+#ifdef CUBEMAP_TEXTURES
+uniform samplerCube heightmap;
+#else
 uniform sampler2D heightmap;
+#endif
 uniform Geodata geodata;
 
 void main()
@@ -38,7 +42,11 @@ void main()
 
     float sea_radius = geodata.earth_radius_at_sea / geodata.earth_radius_at_peak;
     
+#ifdef CUBEMAP_TEXTURES
+    float height = texture(heightmap, in_position).x;
+#else
     float height = texture(heightmap, texcoord).x;
+#endif
     float radius = sea_radius + geodata.height_multiplier * height * (1 - sea_radius);
 
     gl_Position = projection * view * vec4(radius * in_position, 1);
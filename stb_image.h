@@ -37,7 +37,7 @@
 
       - decode from memory or through FILE (define STBI_NO_STDIO to remove code)
       - decode from arbitrary I/O callbacks
-      - SIMD acceleration on x86/x64 (SSE2) and ARM (NEON)
+      - SIMD acceleration on x86/x64 (SSE2, AVX2) and ARM (NEON)
 
    Full documentation under "DOCUMENTATION" below.
 
@@ -252,6 +252,73 @@ RECENT REVISION HISTORY:
 //
 // ===========================================================================
 //
+// Memory allocation
+//
+// Decoding an image allocates and frees a few temporary buffers, and the
+// zlib output of a PNG grows through realloc. By default all of that goes
+// through STBI_MALLOC/STBI_REALLOC/STBI_FREE (malloc, realloc, free). An
+// allocator can be installed at run time instead, for all threads or just
+// the calling one:
+//
+//     stbi_pool *pool = stbi_pool_create(64 << 20);
+//     stbi_set_allocator_thread(stbi_pool_allocator(pool));
+//     ... load images, stbi_image_free them ...
+//     stbi_pool_stats(pool, &in_use, &peak, &cached);
+//
+// The pool keeps what is freed and hands it out again, so after the first
+// few images the next ones mostly reuse memory that is already paged in.
+//
+// Every block starts with a small header saying which allocator it came
+// from, so memory returned by stb_image has to be freed by stbi_image_free
+// (not free()), and can be freed on any thread. Blocks allocated by tasks
+// on other threads (stbi_set_parallel_for) come from those threads'
+// allocator.
+//
+// ===========================================================================
+//
+// Decoder contexts
+//
+// The settings above (flip, unpremultiply, iPhone PNG conversion, the
+// allocator) and the failure reason are global, or per thread where the
+// compiler has thread-local variables. For decoding on many threads at
+// once, each thread can have a decoder context instead, which carries its
+// own settings, failure reason and memory pool:
+//
+//     stbi_decoder *d = stbi_decoder_create(64 << 20);
+//     stbi_decoder_set_flip_vertically_on_load(d, 1);
+//     data = stbi_load_ctx(d, filename, &x, &y, &n, 4);
+//     if (!data) ... stbi_decoder_failure_reason(d) ...
+//     stbi_image_free(data);
+//     stbi_decoder_destroy(d);
+//
+// The _ctx functions use nothing but the decoder's settings (the HDR gamma
+// and scale, the SIMD level and parallel_for are still global), and the
+// pool's memory is reused from one image to the next. A decoder is used by
+// one thread at a time, any number of them can decode in parallel. Without
+// thread-local variables (STBI_NO_THREAD_LOCALS) only one thread at a time
+// may decode, as with the plain functions.
+//
+// ===========================================================================
+//
+// Memory-mapped files
+//
+// On Linux, macOS and other Unix-likes, after stbi_set_mmap(1), stbi_load,
+// stbi_load_16, stbi_loadf and stbi_load_into map the file and decode it like
+// stbi_load_from_memory does, with a hint to the kernel that it is read
+// sequentially, instead of going through FILE a small buffer at a time. Other
+// files (pipes, and files of 2 GB and more) are still read through FILE.
+// Define STBI_NO_MMAP to leave the mapping out entirely.
+//
+// Mapping is off by default because a file truncated by someone else while
+// it is being decoded crashes the process (SIGBUS) instead of failing, so
+// only turn it on for files nothing else writes to while they are loaded.
+//
+// For files that are likely not cached yet, stbi_set_mmap_prefetch(1) reads
+// the mapping ahead of the decoder on a separate thread, so waiting for the
+// disk overlaps with decoding.
+//
+// ===========================================================================
+//
 // SIMD support
 //
 // The JPEG decoder will try to automatically use SIMD kernels on x86 when
@@ -271,6 +338,203 @@ RECENT REVISION HISTORY:
 // you have issues compiling it, you can disable it entirely by
 // defining STBI_NO_SIMD.
 //
+// On x64 with GCC, Clang or MSVC there are also AVX2 kernels, compiled
+// for AVX2 individually (no -mavx2 needed) and used only if CPUID says the
+// CPU and OS support it. Define STBI_NO_AVX2 to leave them out. The JPEG
+// IDCT kernels transform two blocks per pass there, and for RGBA output of
+// YCbCr JPEGs chroma upsampling and color conversion run in a single pass.
+//
+// Changing the number of channels (gray to RGB or RGBA, RGB to RGBA and
+// back) is done with AVX2 byte shuffles, a register of pixels at a time.
+//
+// PNG scanlines are unfiltered with SSE2 (and AVX2 for the Up filter) on
+// x86 too; the Avg and Paeth filters only with 3 or more bytes per pixel,
+// since below that every byte depends on the one just before it.
+//
+// The kernels can be limited at run time, e.g. to compare their output
+// with the plain C code, which they all match exactly:
+//
+//     stbi_set_simd_level(STBI_SIMD_NONE);  // or STBI_SIMD_SSE2, STBI_SIMD_AVX2 (default)
+//
+// ===========================================================================
+//
+// Streaming PNG rows
+//
+// stbi_load has the whole compressed file and the whole image in memory at
+// the end. For PNGs too large for that, the rows can be read top to bottom
+// instead, a few at a time, with memory bounded by the width of the image
+// (the 32K deflate window and a couple of scanlines) no matter its height:
+//
+//     stbi_png_rows *r = stbi_png_rows_open(filename, &x, &y, &n, 4);
+//     while ((count = stbi_png_rows_read(r, strip, x*4, strip_rows)) > 0)
+//        ... the next count rows are in strip ...
+//     stbi_png_rows_close(r);
+//
+// The pixels are exactly what stbi_load returns (stbi_png_rows_read_16 what
+// stbi_load_16 does), except that stbi_set_flip_vertically_on_load does not
+// apply. Interlaced PNGs cannot be streamed; opening them fails, so fall
+// back to stbi_load. The file is closed by stbi_png_rows_close, the memory
+// or callbacks have to stay valid until then.
+//
+// ===========================================================================
+//
+// Streaming GIF frames
+//
+// stbi_load_gif_from_memory returns every frame of an animation at once, in
+// one buffer, which for a long loop can be far more than the frames shown at
+// any one time. They can be decoded one at a time instead:
+//
+//     stbi_gif_frames *f = stbi_gif_frames_open(filename, &x, &y);
+//     while (stbi_gif_frames_next(f, &pixels, &delay_ms) > 0)
+//        ... show the x*y RGBA pixels for delay_ms milliseconds ...
+//     stbi_gif_frames_close(f);
+//
+// The frames are exactly those of stbi_load_gif_from_memory, composed onto
+// the ones before as it does. pixels points into f and is overwritten by the
+// next call; the memory used is a few frames, however long the animation.
+// stbi_gif_frames_next returns 0 after the last frame and -1 on an error;
+// to loop, open it again. The file is closed by stbi_gif_frames_close, the
+// memory or callbacks have to stay valid until then.
+//
+// ===========================================================================
+//
+// Incremental decoding
+//
+// A decode on the thread that renders stalls a frame for as long as it
+// takes. It can be spread over frames instead, a little each:
+//
+//     stbi_incremental *d = stbi_incremental_begin(filename, 4);
+//     ... every frame:
+//        if (stbi_incremental_step(d, 2000, 0) != 0)
+//           pixels = stbi_incremental_finish(d, &x, &y, &n);
+//
+// stbi_incremental_step returns once 2000 microseconds have gone by, or
+// once budget_rows units of work have (a row of MCUs of a JPEG scan, a row
+// of blocks transformed, a row of pixels converted; a row of pixels of a
+// PNG, inflated, unfiltered and converted). It checks the time between
+// units, so it overshoots by up to one. The other formats, and interlaced
+// PNGs, are decoded whole by the first step. stbi_incremental_finish
+// decodes whatever is left, frees d and returns the image that stbi_load
+// would, or NULL with the reason of the error; stbi_incremental_abort just
+// frees d. The flip and JPEG scale settings are read by begin, the file is
+// closed once the decode is done, the memory or callbacks have to stay
+// valid until then.
+//
+// stbi_incremental_begin_ctx and the like begin with a decoder context
+// (see "Decoder contexts" above); the steps, finish, preview and abort of
+// d all use it then, so it has to outlive d. Before the image is allocated
+// (by the step that finds its size, to be safe before the first step),
+//
+//     ok = stbi_incremental_into(d, pixels, x*4, x, y, 0);
+//
+// has the rest of the decode write into the caller's memory as
+// stbi_load_into would, x and y being the size from stbi_info and the
+// channels those given to begin. finish returns pixels then, and neither
+// it nor abort frees them.
+//
+// A progressive JPEG has something to show long before it is done: its
+// first scans hold the DC coefficients, the average of every 8x8 block,
+// and the next ones the lowest frequencies. Between steps,
+//
+//     preview = stbi_incremental_preview(d, &px, &py, &scale);
+//
+// returns the image as far as its scans are decoded, 1/8 of its size in
+// each direction after the DC scans, 1/4 or 1/2 once the AC scans up to
+// those frequencies are in (as stbi_set_jpeg_scale_on_load would decode it,
+// from coefficients with their refinement bits still missing). It is a
+// copy in the channels and orientation of the final image, NULL before the
+// DC scans, after the last scan and for anything but a progressive JPEG.
+//
+// ===========================================================================
+//
+// Decoding into your own memory
+//
+// stbi_load allocates the image and often converts it once more at the end
+// (e.g. to RGBA). If the pixels are only going to be copied somewhere else,
+// like a mapped GL pixel buffer, they can be decoded straight into it:
+//
+//     stbi_info(filename, &x, &y, &n);
+//     ... get x*y*4 bytes at pixels ...
+//     ok = stbi_load_into(filename, pixels, x*4, x, y, 4, 0);
+//
+// The rows are pitch bytes apart, bottom to top if flip is set (instead of
+// stbi_set_flip_vertically_on_load), and the image has to be exactly x by y.
+// JPEG and non-interlaced PNG write each row in its final format in their
+// last pass, with the channel conversion done right there; the other
+// formats are decoded as usual and copied in. It returns 0 on an error, and
+// the rows may be partly written then.
+//
+// ===========================================================================
+//
+// Region-of-interest decoding
+//
+// A tile, a crop or the part of a huge image that is on screen can be
+// decoded without the rest:
+//
+//     ok = stbi_load_region_into(filename, pixels, w*4, x, y, w, h, 4, 0);
+//
+// writes the w by h pixels from column x, row y on the way
+// stbi_load_into writes a whole image; the image has to contain them. The
+// pixels are the same as those of the whole image. JPEG only transforms
+// and converts the blocks around the region and stops reading each scan
+// after the last rows it needs; with restart markers it skips the entropy
+// decoding of the intervals that lie outside the region as well. PNG stops
+// inflating after the region's last row (the rows above it still have to
+// be inflated and unfiltered) and converts only its columns. The other
+// formats, and interlaced PNGs, are decoded whole and cropped. With
+// stbi_set_jpeg_scale_on_load the region is in the scaled-down image.
+//
+// ===========================================================================
+//
+// Scaled JPEG decoding
+//
+// Previews, coarse mip levels and the like do not need every pixel of a
+// big JPEG. With
+//
+//     stbi_set_jpeg_scale_on_load(8);
+//
+// JPEGs come out 1/8 of their size (rounded up) in each direction, and
+// stbi_info reports that size as well. The 8x8 blocks are transformed
+// straight to 4x4, 2x2 or single pixels (for 1/2, 1/4, 1/8) from their low
+// frequencies, so the inverse DCT, chroma upsampling and color conversion
+// shrink along with the image; subsampled chroma is transformed to the
+// scaled luma's resolution where it can, which leaves it nothing to
+// upsample. The entropy decoding still reads all of a baseline image, but
+// a 1/8 decode of a progressive JPEG skips the AC scans of the components
+// that come out at one pixel per block unread, and keeps just their DC
+// coefficients in memory. The 1/2 and 1/4 blocks are transformed from all
+// 64 coefficients, folded as in libjpeg's reduced IDCT, so each pixel is the
+// average of the full-size pixels it covers, up to rounding. Subsampled
+// chroma skips the smoothing of the full-size upsampling, though, so colors
+// can differ slightly along sharp chroma edges.
+//
+// ===========================================================================
+//
+// Planar JPEG decoding
+//
+// A JPEG is stored as a luma plane and (usually subsampled) chroma planes.
+// Converted to RGBA it takes 4 bytes per pixel, where 4:2:0 planes take 1.5,
+// and the upsampling and color conversion are most of the decode time after
+// the IDCT. When something else can do the conversion, e.g. a shader
+// sampling the planes as separate textures, they can be had as they are:
+//
+//     stbi_jpeg_planes p;
+//     if (stbi_load_jpeg_planes(filename, &x, &y, &p) > 0) {
+//        ... p.planes planes, p.width[i] by p.height[i] bytes at p.data[i],
+//            rows p.stride[i] bytes apart ...
+//        stbi_jpeg_planes_free(&p);
+//     }
+//
+// That is Y, Cb and Cr for color JPEGs, just Y for grayscale ones, with the
+// values of the file (JFIF: full range, chroma centered between the luma
+// samples). RGB and CMYK JPEGs, and anything that is not a JPEG, have no
+// such planes: for them it returns -1, which is not an error (the failure
+// reason is left alone), to tell them from files that fail to decode. A
+// plane is at its own resolution: 4:2:0 chroma has ceil(x/2) by ceil(y/2)
+// samples. With stbi_set_jpeg_scale_on_load the planes are scaled down too,
+// though not necessarily by the same factor (chroma may come out at the
+// luma's scaled resolution); their sizes say which. Flipping does not apply.
+//
 // ===========================================================================
 //
 // HDR image support   (disable by defining STBI_NO_HDR)
@@ -306,6 +570,18 @@ RECENT REVISION HISTORY:
 //
 //     stbi_is_hdr(char *filename);
 //
+// The floats can also be had as IEEE half floats, the format GPUs filter at
+// half the memory (GL_RGB16F):
+//
+//    stbi_us *data = stbi_loadf_half(filename, &x, &y, &n, 3);
+//    glTexImage2D(GL_TEXTURE_2D, 0, GL_RGB16F, x, y, 0, GL_RGB, GL_HALF_FLOAT, data);
+//
+// They are the floats of stbi_loadf rounded to the nearest half. .HDR files
+// are converted a scanline at a time, without a float image in between.
+// Their RGBE pixels are converted to floats with SSE2, and floats to halves
+// with F16C where the CPU has it (at the STBI_SIMD_AVX2 level), both
+// exactly as the plain C code does.
+//
 // ===========================================================================
 //
 // iPhone PNG support:
@@ -447,6 +723,117 @@ STBIDEF stbi_us *stbi_load_16          (char const *filename, int *x, int *y, in
 STBIDEF stbi_us *stbi_load_from_file_16(FILE *f, int *x, int *y, int *channels_in_file, int desired_channels);
 #endif
 
+////////////////////////////////////
+//
+// PNG row streaming interface, see "Streaming PNG rows" above
+//
+#ifndef STBI_NO_PNG
+typedef struct stbi_png_rows stbi_png_rows;
+
+STBIDEF stbi_png_rows *stbi_png_rows_from_memory   (stbi_uc const *buffer, int len, int *x, int *y, int *channels_in_file, int desired_channels);
+STBIDEF stbi_png_rows *stbi_png_rows_from_callbacks(stbi_io_callbacks const *clbk, void *user, int *x, int *y, int *channels_in_file, int desired_channels);
+#ifndef STBI_NO_STDIO
+STBIDEF stbi_png_rows *stbi_png_rows_open          (char const *filename, int *x, int *y, int *channels_in_file, int desired_channels);
+#endif
+// read the next rows, top to bottom; stride is in bytes. They return how
+// many were read: less than count at the bottom, -1 on an error
+STBIDEF int  stbi_png_rows_read   (stbi_png_rows *r, stbi_uc *rows, int stride, int count);
+STBIDEF int  stbi_png_rows_read_16(stbi_png_rows *r, stbi_us *rows, int stride, int count);
+STBIDEF void stbi_png_rows_close  (stbi_png_rows *r);
+#endif
+
+////////////////////////////////////
+//
+// planar JPEG decoding, see "Planar JPEG decoding" above; they return 1 on
+// success, 0 on an error, -1 for images that are not YCbCr or gray JPEGs
+//
+#ifndef STBI_NO_JPEG
+typedef struct
+{
+   int      planes;       // 3 (Y, Cb, Cr) or 1 (Y)
+   int      width[3], height[3];
+   int      stride[3];    // bytes from one row to the next
+   stbi_uc *data[3];
+   void    *memory[3];    // for stbi_jpeg_planes_free
+} stbi_jpeg_planes;
+
+STBIDEF int  stbi_load_jpeg_planes_from_memory   (stbi_uc const *buffer, int len, int *x, int *y, stbi_jpeg_planes *planes);
+STBIDEF int  stbi_load_jpeg_planes_from_callbacks(stbi_io_callbacks const *clbk, void *user, int *x, int *y, stbi_jpeg_planes *planes);
+#ifndef STBI_NO_STDIO
+STBIDEF int  stbi_load_jpeg_planes               (char const *filename, int *x, int *y, stbi_jpeg_planes *planes);
+#endif
+STBIDEF void stbi_jpeg_planes_free               (stbi_jpeg_planes *planes);
+#endif
+
+////////////////////////////////////
+//
+// GIF frame streaming interface, see "Streaming GIF frames" above
+//
+#ifndef STBI_NO_GIF
+typedef struct stbi_gif_frames stbi_gif_frames;
+
+STBIDEF stbi_gif_frames *stbi_gif_frames_from_memory   (stbi_uc const *buffer, int len, int *x, int *y);
+STBIDEF stbi_gif_frames *stbi_gif_frames_from_callbacks(stbi_io_callbacks const *clbk, void *user, int *x, int *y);
+#ifndef STBI_NO_STDIO
+STBIDEF stbi_gif_frames *stbi_gif_frames_open          (char const *filename, int *x, int *y);
+#endif
+// decodes the next frame: x*y RGBA pixels, valid until the next call, and
+// the delay before the frame after it. Returns 1, 0 after the last frame,
+// -1 on an error
+STBIDEF int  stbi_gif_frames_next (stbi_gif_frames *f, stbi_uc const **pixels, int *delay_ms);
+STBIDEF void stbi_gif_frames_close(stbi_gif_frames *f);
+#endif
+
+////////////////////////////////////
+//
+// incremental decoding, see "Incremental decoding" above
+//
+
+typedef struct stbi_incremental stbi_incremental;
+
+STBIDEF stbi_incremental *stbi_incremental_begin_from_memory   (stbi_uc const *buffer, int len, int desired_channels);
+STBIDEF stbi_incremental *stbi_incremental_begin_from_callbacks(stbi_io_callbacks const *clbk, void *user, int desired_channels);
+#ifndef STBI_NO_STDIO
+STBIDEF stbi_incremental *stbi_incremental_begin               (char const *filename, int desired_channels);
+#endif
+// decodes until budget_us microseconds or budget_rows rows have gone by (0
+// for no limit); returns 1 when the image is done, 0 if there is more, -1
+// on an error
+STBIDEF int      stbi_incremental_step  (stbi_incremental *d, int budget_us, int budget_rows);
+// decodes the rest, frees d and returns the image, NULL on an error
+STBIDEF stbi_uc *stbi_incremental_finish(stbi_incremental *d, int *x, int *y, int *channels_in_file);
+STBIDEF void     stbi_incremental_abort (stbi_incremental *d);
+// a progressive JPEG as far as it is decoded, 1/scale of its size; NULL if
+// there is nothing to show yet, or no more (free it with stbi_image_free)
+STBIDEF stbi_uc *stbi_incremental_preview(stbi_incremental *d, int *x, int *y, int *scale);
+// decodes into the caller's width*height pixels instead, rows pitch bytes
+// apart; desired_channels has to have been given. Returns 1, or 0 on an
+// error and d goes on as before
+STBIDEF int      stbi_incremental_into  (stbi_incremental *d, stbi_uc *pixels, int pitch, int width, int height, int flip);
+
+////////////////////////////////////
+//
+// decoding into caller memory, see "Decoding into your own memory" above;
+// they return 1 on success, 0 on an error
+//
+
+STBIDEF int stbi_load_into_from_memory   (stbi_uc           const *buffer, int len   , stbi_uc *pixels, int pitch, int width, int height, int channels, int flip);
+STBIDEF int stbi_load_into_from_callbacks(stbi_io_callbacks const *clbk  , void *user, stbi_uc *pixels, int pitch, int width, int height, int channels, int flip);
+
+#ifndef STBI_NO_STDIO
+STBIDEF int stbi_load_into           (char const *filename, stbi_uc *pixels, int pitch, int width, int height, int channels, int flip);
+STBIDEF int stbi_load_into_from_file (FILE *f, stbi_uc *pixels, int pitch, int width, int height, int channels, int flip);
+#endif
+
+// the width by height pixels from x, y on, see "Region-of-interest decoding" above
+STBIDEF int stbi_load_region_into_from_memory   (stbi_uc           const *buffer, int len   , stbi_uc *pixels, int pitch, int x, int y, int width, int height, int channels, int flip);
+STBIDEF int stbi_load_region_into_from_callbacks(stbi_io_callbacks const *clbk  , void *user, stbi_uc *pixels, int pitch, int x, int y, int width, int height, int channels, int flip);
+
+#ifndef STBI_NO_STDIO
+STBIDEF int stbi_load_region_into           (char const *filename, stbi_uc *pixels, int pitch, int x, int y, int width, int height, int channels, int flip);
+STBIDEF int stbi_load_region_into_from_file (FILE *f, stbi_uc *pixels, int pitch, int x, int y, int width, int height, int channels, int flip);
+#endif
+
 ////////////////////////////////////
 //
 // float-per-channel interface
@@ -459,6 +846,14 @@ STBIDEF stbi_us *stbi_load_from_file_16(FILE *f, int *x, int *y, int *channels_i
    STBIDEF float *stbi_loadf            (char const *filename, int *x, int *y, int *channels_in_file, int desired_channels);
    STBIDEF float *stbi_loadf_from_file  (FILE *f, int *x, int *y, int *channels_in_file, int desired_channels);
    #endif
+
+   // as IEEE half floats
+   STBIDEF stbi_us *stbi_loadf_half_from_memory   (stbi_uc const *buffer, int len, int *x, int *y, int *channels_in_file, int desired_channels);
+   STBIDEF stbi_us *stbi_loadf_half_from_callbacks(stbi_io_callbacks const *clbk, void *user, int *x, int *y, int *channels_in_file, int desired_channels);
+
+   #ifndef STBI_NO_STDIO
+   STBIDEF stbi_us *stbi_loadf_half               (char const *filename, int *x, int *y, int *channels_in_file, int desired_channels);
+   #endif
 #endif
 
 #ifndef STBI_NO_HDR
@@ -484,7 +879,8 @@ STBIDEF int      stbi_is_hdr_from_file(FILE *f);
 // on most compilers (and ALL modern mainstream compilers) this is threadsafe
 STBIDEF const char *stbi_failure_reason  (void);
 
-// free the loaded image -- this is just free()
+// free the loaded image, or any other memory stb_image returns (zlib output,
+// GIF delays) -- this is NOT just free(), see "Memory allocation" above
 STBIDEF void     stbi_image_free      (void *retval_from_stbi_load);
 
 // get image dimensions & components without fully decoding
@@ -514,12 +910,118 @@ STBIDEF void stbi_convert_iphone_png_to_rgb(int flag_true_if_should_convert);
 // flip the image vertically, so the first pixel in the output array is the bottom left
 STBIDEF void stbi_set_flip_vertically_on_load(int flag_true_if_should_flip);
 
+// decode JPEGs scaled down by 1/denominator (1, 2, 4 or 8), see "Scaled JPEG
+// decoding" above; the other formats load at their full size
+STBIDEF void stbi_set_jpeg_scale_on_load(int denominator);
+
+// highest instruction set the SIMD kernels may use, for all threads; the
+// kernels are still only used if the CPU supports them
+enum
+{
+   STBI_SIMD_NONE = 0,
+   STBI_SIMD_SSE2 = 1,
+   STBI_SIMD_AVX2 = 2
+};
+STBIDEF void stbi_set_simd_level(int level);
+
+// lets the decoders spread work over the threads of the application: the
+// function has to call task(task_data, i) for every i in [0, count), in any
+// order and on any threads, and return once all of them have returned.
+// NULL (the default) decodes everything on the calling thread. Currently
+// used by the JPEG decoder for baseline scans with restart markers and for
+// the color conversion.
+typedef void stbi_parallel_for_func(void *user, int count, void (*task)(void *task_data, int i), void *task_data);
+STBIDEF void stbi_set_parallel_for(stbi_parallel_for_func *parallel_for, void *user);
+
+// memory for the images and for the decoders' temporary buffers, instead of
+// STBI_MALLOC/STBI_FREE; see "Memory allocation" above. alloc gets the size
+// (with a small header) and returns memory aligned like malloc's, free gets
+// the same size back. NULL restores STBI_MALLOC/STBI_FREE. The allocator has
+// to stay valid until all the memory from it is freed, which stb_image does
+// through the allocator the memory came from, whatever is installed then.
+typedef struct stbi_allocator
+{
+   void *(*alloc)(void *user, size_t size);
+   void  (*free) (void *user, void *p, size_t size);
+   void  *user;
+} stbi_allocator;
+STBIDEF void stbi_set_allocator(stbi_allocator const *allocator);
+
+// a pool that keeps freed blocks (up to max_cached bytes of them) to hand
+// out again, and counts the bytes in use and their peak. It can be shared
+// by threads, but one pool per thread (stbi_set_allocator_thread) avoids
+// them waiting on each other
+typedef struct stbi_pool stbi_pool;
+STBIDEF stbi_pool *stbi_pool_create(size_t max_cached);
+STBIDEF stbi_allocator const *stbi_pool_allocator(stbi_pool *pool);
+STBIDEF void stbi_pool_stats(stbi_pool *pool, size_t *in_use, size_t *peak, size_t *cached);
+STBIDEF void stbi_pool_reset_peak(stbi_pool *pool);
+// all the memory from the pool has to be freed by now
+STBIDEF void stbi_pool_destroy(stbi_pool *pool);
+
+////////////////////////////////////
+//
+// decoder contexts, see "Decoder contexts" above
+//
+
+typedef struct stbi_decoder stbi_decoder;
+
+// with a pool that keeps up to max_cached bytes, or none if 0
+STBIDEF stbi_decoder *stbi_decoder_create(size_t max_cached);
+// everything loaded through it has to be freed by now
+STBIDEF void          stbi_decoder_destroy(stbi_decoder *d);
+
+STBIDEF void          stbi_decoder_set_flip_vertically_on_load(stbi_decoder *d, int flag_true_if_should_flip);
+STBIDEF void          stbi_decoder_set_unpremultiply_on_load(stbi_decoder *d, int flag_true_if_should_unpremultiply);
+STBIDEF void          stbi_decoder_convert_iphone_png_to_rgb(stbi_decoder *d, int flag_true_if_should_convert);
+STBIDEF void          stbi_decoder_set_jpeg_scale_on_load(stbi_decoder *d, int denominator);
+// replaces the decoder's pool, NULL for STBI_MALLOC/STBI_FREE
+STBIDEF void          stbi_decoder_set_allocator(stbi_decoder *d, stbi_allocator const *allocator);
+// the pool of the decoder, for stbi_pool_stats; NULL if it has none
+STBIDEF stbi_pool    *stbi_decoder_pool(stbi_decoder *d);
+// why the last call through the decoder that failed did ("" before any)
+STBIDEF const char   *stbi_decoder_failure_reason(stbi_decoder *d);
+
+STBIDEF stbi_uc *stbi_load_from_memory_ctx     (stbi_decoder *d, stbi_uc const *buffer, int len, int *x, int *y, int *channels_in_file, int desired_channels);
+STBIDEF stbi_uc *stbi_load_from_callbacks_ctx  (stbi_decoder *d, stbi_io_callbacks const *clbk, void *user, int *x, int *y, int *channels_in_file, int desired_channels);
+STBIDEF stbi_us *stbi_load_16_from_memory_ctx  (stbi_decoder *d, stbi_uc const *buffer, int len, int *x, int *y, int *channels_in_file, int desired_channels);
+STBIDEF int      stbi_load_into_from_memory_ctx(stbi_decoder *d, stbi_uc const *buffer, int len, stbi_uc *pixels, int pitch, int width, int height, int channels, int flip);
+STBIDEF int      stbi_load_region_into_from_memory_ctx(stbi_decoder *d, stbi_uc const *buffer, int len, stbi_uc *pixels, int pitch, int x, int y, int width, int height, int channels, int flip);
+STBIDEF int      stbi_info_from_memory_ctx     (stbi_decoder *d, stbi_uc const *buffer, int len, int *x, int *y, int *comp);
+STBIDEF int      stbi_info_from_callbacks_ctx  (stbi_decoder *d, stbi_io_callbacks const *clbk, void *user, int *x, int *y, int *comp);
+STBIDEF stbi_incremental *stbi_incremental_begin_from_memory_ctx   (stbi_decoder *d, stbi_uc const *buffer, int len, int desired_channels);
+STBIDEF stbi_incremental *stbi_incremental_begin_from_callbacks_ctx(stbi_decoder *d, stbi_io_callbacks const *clbk, void *user, int desired_channels);
+
+#ifndef STBI_NO_STDIO
+STBIDEF stbi_uc *stbi_load_ctx     (stbi_decoder *d, char const *filename, int *x, int *y, int *channels_in_file, int desired_channels);
+STBIDEF stbi_us *stbi_load_16_ctx  (stbi_decoder *d, char const *filename, int *x, int *y, int *channels_in_file, int desired_channels);
+STBIDEF int      stbi_load_into_ctx(stbi_decoder *d, char const *filename, stbi_uc *pixels, int pitch, int width, int height, int channels, int flip);
+STBIDEF int      stbi_load_region_into_ctx(stbi_decoder *d, char const *filename, stbi_uc *pixels, int pitch, int x, int y, int width, int height, int channels, int flip);
+STBIDEF int      stbi_info_ctx     (stbi_decoder *d, char const *filename, int *x, int *y, int *comp);
+STBIDEF stbi_incremental *stbi_incremental_begin_ctx(stbi_decoder *d, char const *filename, int desired_channels);
+#endif
+#if !defined(STBI_NO_JPEG) && !defined(STBI_NO_STDIO)
+STBIDEF int      stbi_load_jpeg_planes_ctx(stbi_decoder *d, char const *filename, int *x, int *y, stbi_jpeg_planes *planes);
+#endif
+
+#ifndef STBI_NO_STDIO
+// read files through a memory mapping instead of FILE where possible (see
+// "Memory-mapped files" above). Off by default
+STBIDEF void stbi_set_mmap(int flag_true_if_should_map);
+
+// files read through a memory mapping are read ahead of the decoder by a
+// thread, which helps when they are not in the page cache yet. Off by default
+STBIDEF void stbi_set_mmap_prefetch(int flag_true_if_should_prefetch);
+#endif
+
 // as above, but only applies to images loaded on the thread that calls the function
 // this function is only available if your compiler supports thread-local variables;
 // calling it will fail to link if your compiler doesn't
 STBIDEF void stbi_set_unpremultiply_on_load_thread(int flag_true_if_should_unpremultiply);
 STBIDEF void stbi_convert_iphone_png_to_rgb_thread(int flag_true_if_should_convert);
 STBIDEF void stbi_set_flip_vertically_on_load_thread(int flag_true_if_should_flip);
+STBIDEF void stbi_set_jpeg_scale_on_load_thread(int denominator);
+STBIDEF void stbi_set_allocator_thread(stbi_allocator const *allocator);
 
 // ZLIB client - used by PNG, available for other purposes
 
@@ -593,6 +1095,24 @@ STBIDEF int   stbi_zlib_decode_noheader_buffer(char *obuffer, int olen, const ch
 
 #ifndef STBI_NO_STDIO
 #include <stdio.h>
+// (not with a strict C standard, as in -std=c99, unless POSIX is asked for)
+#if !defined(STBI_NO_MMAP) && (defined(__unix__) || defined(__APPLE__)) \
+    && (!defined(__STRICT_ANSI__) || (defined(_POSIX_C_SOURCE) && _POSIX_C_SOURCE >= 200112L))
+#define STBI__MMAP
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+#endif
+
+// the time budget of stbi_incremental_step is measured with a monotonic
+// clock where there is one, with clock() otherwise
+#include <time.h>
+#if (defined(__unix__) || defined(__APPLE__)) \
+    && (!defined(__STRICT_ANSI__) || (defined(_POSIX_C_SOURCE) && _POSIX_C_SOURCE >= 199309L))
+#define STBI__CLOCK_MONOTONIC
 #endif
 
 #ifndef STBI_ASSERT
@@ -640,12 +1160,14 @@ typedef unsigned short stbi__uint16;
 typedef   signed short stbi__int16;
 typedef unsigned int   stbi__uint32;
 typedef   signed int   stbi__int32;
+typedef unsigned __int64 stbi__uint64;
 #else
 #include <stdint.h>
 typedef uint16_t stbi__uint16;
 typedef int16_t  stbi__int16;
 typedef uint32_t stbi__uint32;
 typedef int32_t  stbi__int32;
+typedef uint64_t stbi__uint64;
 #endif
 
 // should produce compiler error if size is wrong
@@ -747,7 +1269,7 @@ static int stbi__cpuid3(void)
 
 #define STBI_SIMD_ALIGN(type, name) __declspec(align(16)) type name
 
-#if !defined(STBI_NO_JPEG) && defined(STBI_SSE2)
+#if defined(STBI_SSE2) && (!defined(STBI_NO_JPEG) || !defined(STBI_NO_PNG) || !defined(STBI_NO_HDR))
 static int stbi__sse2_available(void)
 {
    int info3 = stbi__cpuid3();
@@ -758,7 +1280,7 @@ static int stbi__sse2_available(void)
 #else // assume GCC-style if not VC++
 #define STBI_SIMD_ALIGN(type, name) type name __attribute__((aligned(16)))
 
-#if !defined(STBI_NO_JPEG) && defined(STBI_SSE2)
+#if defined(STBI_SSE2) && (!defined(STBI_NO_JPEG) || !defined(STBI_NO_PNG) || !defined(STBI_NO_HDR))
 static int stbi__sse2_available(void)
 {
    // If we're even attempting to compile this on GCC/Clang, that means
@@ -771,6 +1293,66 @@ static int stbi__sse2_available(void)
 #endif
 #endif
 
+// AVX2 kernels are compiled for AVX2 individually and picked at run time
+#if defined(STBI_SSE2) && defined(STBI__X64_TARGET) && !defined(STBI_NO_AVX2)
+#if defined(__GNUC__) || defined(__clang__)
+#define STBI_AVX2
+#include <immintrin.h>
+#define STBI__AVX2_TARGET __attribute__((target("avx2")))
+// for helpers of the kernels, which pass vectors around
+#define STBI__AVX2_INLINE __attribute__((target("avx2"), always_inline)) static __inline__
+#elif defined(_MSC_VER) && _MSC_VER >= 1700
+#define STBI_AVX2
+#include <immintrin.h>
+#define STBI__AVX2_TARGET
+#define STBI__AVX2_INLINE static __forceinline
+#endif
+#endif
+
+// only the 8-bit decoders and the format conversion have AVX2 kernels
+#if defined(STBI_AVX2) && !(defined(STBI_NO_JPEG) && defined(STBI_NO_PNG) && defined(STBI_NO_BMP) && defined(STBI_NO_PSD) && defined(STBI_NO_TGA) && defined(STBI_NO_GIF) && defined(STBI_NO_PIC) && defined(STBI_NO_PNM))
+static int stbi__avx2_available(void)
+{
+#if defined(__GNUC__) || defined(__clang__)
+   return __builtin_cpu_supports("avx2");
+#else
+   int info[4];
+   __cpuid(info, 1);
+   // the OS has to save the YMM registers (OSXSAVE, then XCR0 bits 1 and 2)
+   if (((info[2] >> 27) & 1) == 0 || (_xgetbv(0) & 6) != 6)
+      return 0;
+   __cpuidex(info, 7, 0);
+   return (info[1] >> 5) & 1;
+#endif
+}
+#endif
+
+// F16C (floats to halves) came along with AVX2 on every CPU so far, it is
+// used at the same SIMD level
+#if defined(STBI_AVX2) && !defined(STBI_NO_LINEAR)
+#define STBI_F16C
+#if defined(__GNUC__) || defined(__clang__)
+#include <cpuid.h>
+#define STBI__F16C_TARGET __attribute__((target("f16c")))
+static int stbi__f16c_available(void)
+{
+   unsigned int a, b, c, d;
+   // its instructions need the OS to save the AVX registers too
+   return __get_cpuid(1, &a, &b, &c, &d) && ((c >> 29) & 1) && __builtin_cpu_supports("avx");
+}
+#else
+#define STBI__F16C_TARGET
+static int stbi__f16c_available(void)
+{
+   int info[4];
+   __cpuid(info, 1);
+   if (((info[2] >> 27) & 1) == 0 || (_xgetbv(0) & 6) != 6)
+      return 0;
+   return (info[2] >> 29) & 1;
+}
+#endif
+#endif
+
 // ARM NEON
 #if defined(STBI_NO_SIMD) && defined(STBI_NEON)
 #undef STBI_NEON
@@ -814,8 +1396,30 @@ typedef struct
 
    stbi_uc *img_buffer, *img_buffer_end;
    stbi_uc *img_buffer_original, *img_buffer_original_end;
+
+   struct stbi__into *into; // caller memory to decode into, see stbi__load_into
 } stbi__context;
 
+// memory of the caller to decode into: row y of the image (or of the
+// region) starts at pixels + y*stride, and stride is negative for flipped
+// images
+typedef struct stbi__into
+{
+   stbi_uc *pixels;
+   int stride;
+   int width, height, channels;
+   int region, x0, y0; // only the width by height pixels from x0, y0 on
+   int written; // by a decoder that converted straight into it
+} stbi__into;
+
+// whether an image x by y pixels is the size given, or contains the region
+static int stbi__into_fits(stbi__into *into, int x, int y)
+{
+   if (into->region)
+      return into->width <= x - into->x0 && into->height <= y - into->y0;
+   return into->width == x && into->height == y;
+}
+
 
 static void stbi__refill_buffer(stbi__context *s);
 
@@ -825,6 +1429,7 @@ static void stbi__start_mem(stbi__context *s, stbi_uc const *buffer, int len)
    s->io.read = NULL;
    s->read_from_callbacks = 0;
    s->callback_already_read = 0;
+   s->into = NULL;
    s->img_buffer = s->img_buffer_original = (stbi_uc *) buffer;
    s->img_buffer_end = s->img_buffer_original_end = (stbi_uc *) buffer+len;
 }
@@ -837,6 +1442,7 @@ static void stbi__start_callbacks(stbi__context *s, stbi_io_callbacks *c, void *
    s->buflen = sizeof(s->buffer_start);
    s->read_from_callbacks = 1;
    s->callback_already_read = 0;
+   s->into = NULL;
    s->img_buffer = s->img_buffer_original = s->buffer_start;
    stbi__refill_buffer(s);
    s->img_buffer_original_end = s->img_buffer_end;
@@ -937,6 +1543,9 @@ static int      stbi__psd_is16(stbi__context *s);
 #ifndef STBI_NO_HDR
 static int      stbi__hdr_test(stbi__context *s);
 static float   *stbi__hdr_load(stbi__context *s, int *x, int *y, int *comp, int req_comp, stbi__result_info *ri);
+#ifndef STBI_NO_LINEAR
+static stbi_us *stbi__hdr_load_half(stbi__context *s, int *x, int *y, int *comp, int req_comp);
+#endif
 static int      stbi__hdr_info(stbi__context *s, int *x, int *y, int *comp);
 #endif
 
@@ -966,93 +1575,502 @@ STBI_THREAD_LOCAL
 #endif
 const char *stbi__g_failure_reason;
 
+// the settings and failure reason of a decoder context, see "Decoder contexts"
+struct stbi_decoder
+{
+   int flip, unpremultiply, de_iphone, jpeg_scale_shift;
+   stbi_allocator const *allocator;
+   stbi_pool *pool;
+   const char *failure_reason;
+};
+
+// the context of the stbi_*_ctx call running on this thread, if any; the
+// settings and failure reason below come from it then
+static
+#ifdef STBI_THREAD_LOCAL
+STBI_THREAD_LOCAL
+#endif
+stbi_decoder *stbi__decoder;
+
 STBIDEF const char *stbi_failure_reason(void)
 {
-   return stbi__g_failure_reason;
+   return stbi__decoder ? stbi__decoder->failure_reason : stbi__g_failure_reason;
+}
+
+#if !defined(STBI_NO_FAILURE_STRINGS) || !defined(STBI_NO_GIF)
+static void stbi__set_failure_reason(const char *str)
+{
+   if (stbi__decoder)
+      stbi__decoder->failure_reason = str;
+   else
+      stbi__g_failure_reason = str;
 }
+#endif
 
 #ifndef STBI_NO_FAILURE_STRINGS
 static int stbi__err(const char *str)
 {
-   stbi__g_failure_reason = str;
+   stbi__set_failure_reason(str);
    return 0;
 }
 #endif
 
-static void *stbi__malloc(size_t size)
+// Every block starts with the allocator it came from (NULL for STBI_MALLOC)
+// and its size, so it goes back to the right place from any thread
+typedef union
 {
-    return STBI_MALLOC(size);
-}
+   struct
+   {
+      stbi_allocator const *allocator;
+      size_t size;
+   } b;
+   char align[16];
+} stbi__block;
 
-// stb_image uses ints pervasively, including for offset calculations.
-// therefore the largest decoded image size we can support with the
-// current code, even on 64-bit targets, is INT_MAX. this is not a
-// significant limitation for the intended use case.
-//
-// we do, however, need to make sure our size calculations don't
-// overflow. hence a few helper functions for size calculations that
-// multiply integers together, making sure that they're non-negative
-// and no overflow occurs.
+static stbi_allocator const *stbi__allocator_global;
 
-// return 1 if the sum is valid, 0 on overflow.
-// negative terms are considered invalid.
-static int stbi__addsizes_valid(int a, int b)
+#ifndef STBI_THREAD_LOCAL
+#define stbi__allocator  (stbi__decoder ? stbi__decoder->allocator : stbi__allocator_global)
+#else
+static STBI_THREAD_LOCAL stbi_allocator const *stbi__allocator_local;
+static STBI_THREAD_LOCAL int stbi__allocator_set;
+
+STBIDEF void stbi_set_allocator_thread(stbi_allocator const *allocator)
 {
-   if (b < 0) return 0;
-   // now 0 <= b <= INT_MAX, hence also
-   // 0 <= INT_MAX - b <= INTMAX.
-   // And "a + b <= INT_MAX" (which might overflow) is the
-   // same as a <= INT_MAX - b (no overflow)
-   return a <= INT_MAX - b;
+   stbi__allocator_local = allocator;
+   stbi__allocator_set = 1;
 }
 
-// returns 1 if the product is valid, 0 on overflow.
-// negative factors are considered invalid.
-static int stbi__mul2sizes_valid(int a, int b)
+#define stbi__allocator  (stbi__decoder ? stbi__decoder->allocator                \
+                          : stbi__allocator_set ? stbi__allocator_local        \
+                          : stbi__allocator_global)
+#endif
+
+STBIDEF void stbi_set_allocator(stbi_allocator const *allocator)
 {
-   if (a < 0 || b < 0) return 0;
-   if (b == 0) return 1; // mul-by-0 is always safe
-   // portable way to check for no overflows in a*b
-   return a <= INT_MAX/b;
+   stbi__allocator_global = allocator;
 }
 
-#if !defined(STBI_NO_JPEG) || !defined(STBI_NO_PNG) || !defined(STBI_NO_TGA) || !defined(STBI_NO_HDR)
-// returns 1 if "a*b + add" has no negative terms/factors and doesn't overflow
-static int stbi__mad2sizes_valid(int a, int b, int add)
+static void *stbi__alloc_from(stbi_allocator const *a, size_t size)
 {
-   return stbi__mul2sizes_valid(a, b) && stbi__addsizes_valid(a*b, add);
+   stbi__block *block;
+   if (size > (size_t) -1 - sizeof(stbi__block)) return NULL;
+   block = (stbi__block *) (a ? a->alloc(a->user, sizeof(stbi__block) + size) : STBI_MALLOC(sizeof(stbi__block) + size));
+   if (block == NULL) return NULL;
+   block->b.allocator = a;
+   block->b.size = size;
+   return block + 1;
 }
-#endif
 
-// returns 1 if "a*b*c + add" has no negative terms/factors and doesn't overflow
-static int stbi__mad3sizes_valid(int a, int b, int c, int add)
+static void *stbi__malloc(size_t size)
 {
-   return stbi__mul2sizes_valid(a, b) && stbi__mul2sizes_valid(a*b, c) &&
-      stbi__addsizes_valid(a*b*c, add);
+   return stbi__alloc_from(stbi__allocator, size);
 }
 
-// returns 1 if "a*b*c*d + add" has no negative terms/factors and doesn't overflow
-#if !defined(STBI_NO_LINEAR) || !defined(STBI_NO_HDR) || !defined(STBI_NO_PNM)
-static int stbi__mad4sizes_valid(int a, int b, int c, int d, int add)
+static void stbi__free(void *p)
 {
-   return stbi__mul2sizes_valid(a, b) && stbi__mul2sizes_valid(a*b, c) &&
-      stbi__mul2sizes_valid(a*b*c, d) && stbi__addsizes_valid(a*b*c*d, add);
+   stbi__block *block;
+   if (p == NULL) return;
+   block = (stbi__block *) p - 1;
+   if (block->b.allocator)
+      block->b.allocator->free(block->b.allocator->user, block, sizeof(stbi__block) + block->b.size);
+   else
+      STBI_FREE(block);
+}
+
+#if !defined(STBI_NO_JPEG) || !defined(STBI_NO_ZLIB) || !defined(STBI_NO_GIF)
+// grows (or shrinks) a block within the allocator it came from
+static void *stbi__realloc(void *p, size_t size)
+{
+   stbi__block *block, *grown;
+   void *q;
+   if (p == NULL) return stbi__malloc(size);
+   block = (stbi__block *) p - 1;
+   if (block->b.allocator == NULL) {
+      if (size > (size_t) -1 - sizeof(stbi__block)) return NULL;
+      grown = (stbi__block *) STBI_REALLOC_SIZED(block, sizeof(stbi__block) + block->b.size, sizeof(stbi__block) + size);
+      if (grown == NULL) return NULL;
+      grown->b.size = size;
+      return grown + 1;
+   }
+   q = stbi__alloc_from(block->b.allocator, size);
+   if (q == NULL) return NULL;
+   memcpy(q, p, size < block->b.size ? size : block->b.size);
+   stbi__free(p);
+   return q;
 }
 #endif
 
-#if !defined(STBI_NO_JPEG) || !defined(STBI_NO_PNG) || !defined(STBI_NO_TGA) || !defined(STBI_NO_HDR)
-// mallocs with size overflow checking
-static void *stbi__malloc_mad2(int a, int b, int add)
-{
-   if (!stbi__mad2sizes_valid(a, b, add)) return NULL;
-   return stbi__malloc(a*b + add);
-}
+// a short lock for the pool, whose operations are a few pointer updates
+#if defined(__GNUC__) || defined(__clang__)
+#define stbi__lock(l)    while (__atomic_exchange_n(l, 1, __ATOMIC_ACQUIRE)) {}
+#define stbi__unlock(l)  __atomic_store_n(l, 0, __ATOMIC_RELEASE)
+#elif defined(_MSC_VER)
+#define stbi__lock(l)    while (_InterlockedExchange(l, 1)) {}
+#define stbi__unlock(l)  _InterlockedExchange(l, 0)
+#else
+// without atomics, a pool must not be used by two threads at a time
+#define stbi__lock(l)    ((void) 0)
+#define stbi__unlock(l)  ((void) 0)
 #endif
 
-static void *stbi__malloc_mad3(int a, int b, int c, int add)
+// size classes of the pool: 4 per power of two from 64 bytes on, so a block
+// is at most 25% bigger than asked for
+#define STBI__POOL_CLASSES  (4 * (sizeof(size_t) * 8 - 6))
+
+struct stbi_pool
 {
-   if (!stbi__mad3sizes_valid(a, b, c, add)) return NULL;
-   return stbi__malloc(a*b*c + add);
+   stbi_allocator allocator;
+   void *free_blocks[STBI__POOL_CLASSES];
+   size_t in_use, peak, cached, max_cached;
+   volatile long lock;
+};
+
+static int stbi__pool_class(size_t size, size_t *class_size)
+{
+   int e = 6, m;
+   size_t s = size < 64 ? 63 : size - 1;
+   while ((s >> e) >= 2) ++e;
+   // s is in [2^e, 2^(e+1)) (or below 64), split that range in 4
+   m = (int) ((s >> (e - 2)) & 3);
+   if (size <= 64) { *class_size = 64; return 0; }
+   if ((size_t) (4 + m + 1) > ((size_t) -1 >> (e - 2))) return -1;
+   *class_size = (size_t) (4 + m + 1) << (e - 2);
+   return (e - 6) * 4 + m + 1;
+}
+
+static void *stbi__pool_alloc(void *user, size_t size)
+{
+   stbi_pool *pool = (stbi_pool *) user;
+   size_t class_size;
+   int c = stbi__pool_class(size, &class_size);
+   void *p = NULL;
+   if (c < 0 || c >= (int) STBI__POOL_CLASSES) return NULL;
+
+   stbi__lock(&pool->lock);
+   if (pool->free_blocks[c]) {
+      p = pool->free_blocks[c];
+      pool->free_blocks[c] = *(void **) p;
+      pool->cached -= class_size;
+   }
+   pool->in_use += class_size;
+   if (pool->in_use > pool->peak) pool->peak = pool->in_use;
+   stbi__unlock(&pool->lock);
+
+   if (p == NULL) {
+      p = STBI_MALLOC(class_size);
+      if (p == NULL) {
+         stbi__lock(&pool->lock);
+         pool->in_use -= class_size;
+         stbi__unlock(&pool->lock);
+      }
+   }
+   return p;
+}
+
+static void stbi__pool_free(void *user, void *p, size_t size)
+{
+   stbi_pool *pool = (stbi_pool *) user;
+   size_t class_size;
+   int c = stbi__pool_class(size, &class_size), keep;
+
+   stbi__lock(&pool->lock);
+   pool->in_use -= class_size;
+   keep = pool->cached + class_size <= pool->max_cached;
+   if (keep) {
+      *(void **) p = pool->free_blocks[c];
+      pool->free_blocks[c] = p;
+      pool->cached += class_size;
+   }
+   stbi__unlock(&pool->lock);
+
+   if (!keep) STBI_FREE(p);
+}
+
+STBIDEF stbi_pool *stbi_pool_create(size_t max_cached)
+{
+   stbi_pool *pool = (stbi_pool *) STBI_MALLOC(sizeof(stbi_pool));
+   if (pool == NULL) return NULL;
+   memset(pool, 0, sizeof(*pool));
+   pool->allocator.alloc = stbi__pool_alloc;
+   pool->allocator.free = stbi__pool_free;
+   pool->allocator.user = pool;
+   pool->max_cached = max_cached;
+   return pool;
+}
+
+STBIDEF stbi_allocator const *stbi_pool_allocator(stbi_pool *pool)
+{
+   return &pool->allocator;
+}
+
+STBIDEF void stbi_pool_stats(stbi_pool *pool, size_t *in_use, size_t *peak, size_t *cached)
+{
+   stbi__lock(&pool->lock);
+   if (in_use) *in_use = pool->in_use;
+   if (peak)   *peak = pool->peak;
+   if (cached) *cached = pool->cached;
+   stbi__unlock(&pool->lock);
+}
+
+STBIDEF void stbi_pool_reset_peak(stbi_pool *pool)
+{
+   stbi__lock(&pool->lock);
+   pool->peak = pool->in_use;
+   stbi__unlock(&pool->lock);
+}
+
+STBIDEF void stbi_pool_destroy(stbi_pool *pool)
+{
+   int c;
+   if (pool == NULL) return;
+   for (c=0; c < (int) STBI__POOL_CLASSES; ++c) {
+      while (pool->free_blocks[c]) {
+         void *p = pool->free_blocks[c];
+         pool->free_blocks[c] = *(void **) p;
+         STBI_FREE(p);
+      }
+   }
+   STBI_FREE(pool);
+}
+
+STBIDEF stbi_decoder *stbi_decoder_create(size_t max_cached)
+{
+   stbi_decoder *d = (stbi_decoder *) STBI_MALLOC(sizeof(stbi_decoder));
+   if (d == NULL) return NULL;
+   memset(d, 0, sizeof(*d));
+   d->failure_reason = "";
+   if (max_cached) {
+      d->pool = stbi_pool_create(max_cached);
+      if (d->pool == NULL) { STBI_FREE(d); return NULL; }
+      d->allocator = stbi_pool_allocator(d->pool);
+   }
+   return d;
+}
+
+STBIDEF void stbi_decoder_destroy(stbi_decoder *d)
+{
+   if (d == NULL) return;
+   stbi_pool_destroy(d->pool);
+   STBI_FREE(d);
+}
+
+STBIDEF void stbi_decoder_set_flip_vertically_on_load(stbi_decoder *d, int flag_true_if_should_flip)
+{
+   d->flip = flag_true_if_should_flip;
+}
+
+STBIDEF void stbi_decoder_set_unpremultiply_on_load(stbi_decoder *d, int flag_true_if_should_unpremultiply)
+{
+   d->unpremultiply = flag_true_if_should_unpremultiply;
+}
+
+STBIDEF void stbi_decoder_convert_iphone_png_to_rgb(stbi_decoder *d, int flag_true_if_should_convert)
+{
+   d->de_iphone = flag_true_if_should_convert;
+}
+
+STBIDEF void stbi_decoder_set_allocator(stbi_decoder *d, stbi_allocator const *allocator)
+{
+   d->allocator = allocator;
+}
+
+STBIDEF stbi_pool *stbi_decoder_pool(stbi_decoder *d)
+{
+   return d->pool;
+}
+
+STBIDEF const char *stbi_decoder_failure_reason(stbi_decoder *d)
+{
+   return d->failure_reason;
+}
+
+// the _ctx functions are the plain ones with stbi__decoder pointing at the
+// context meanwhile
+static stbi_decoder *stbi__enter_decoder(stbi_decoder *d)
+{
+   stbi_decoder *prev = stbi__decoder;
+   stbi__decoder = d;
+   return prev;
+}
+
+STBIDEF stbi_uc *stbi_load_from_memory_ctx(stbi_decoder *d, stbi_uc const *buffer, int len, int *x, int *y, int *comp, int req_comp)
+{
+   stbi_decoder *prev = stbi__enter_decoder(d);
+   stbi_uc *result = stbi_load_from_memory(buffer, len, x, y, comp, req_comp);
+   stbi__decoder = prev;
+   return result;
+}
+
+STBIDEF stbi_uc *stbi_load_from_callbacks_ctx(stbi_decoder *d, stbi_io_callbacks const *clbk, void *user, int *x, int *y, int *comp, int req_comp)
+{
+   stbi_decoder *prev = stbi__enter_decoder(d);
+   stbi_uc *result = stbi_load_from_callbacks(clbk, user, x, y, comp, req_comp);
+   stbi__decoder = prev;
+   return result;
+}
+
+STBIDEF stbi_us *stbi_load_16_from_memory_ctx(stbi_decoder *d, stbi_uc const *buffer, int len, int *x, int *y, int *comp, int req_comp)
+{
+   stbi_decoder *prev = stbi__enter_decoder(d);
+   stbi_us *result = stbi_load_16_from_memory(buffer, len, x, y, comp, req_comp);
+   stbi__decoder = prev;
+   return result;
+}
+
+STBIDEF int stbi_load_into_from_memory_ctx(stbi_decoder *d, stbi_uc const *buffer, int len, stbi_uc *pixels, int pitch, int width, int height, int channels, int flip)
+{
+   stbi_decoder *prev = stbi__enter_decoder(d);
+   int result = stbi_load_into_from_memory(buffer, len, pixels, pitch, width, height, channels, flip);
+   stbi__decoder = prev;
+   return result;
+}
+
+STBIDEF int stbi_load_region_into_from_memory_ctx(stbi_decoder *d, stbi_uc const *buffer, int len, stbi_uc *pixels, int pitch, int x, int y, int width, int height, int channels, int flip)
+{
+   stbi_decoder *prev = stbi__enter_decoder(d);
+   int result = stbi_load_region_into_from_memory(buffer, len, pixels, pitch, x, y, width, height, channels, flip);
+   stbi__decoder = prev;
+   return result;
+}
+
+STBIDEF int stbi_info_from_memory_ctx(stbi_decoder *d, stbi_uc const *buffer, int len, int *x, int *y, int *comp)
+{
+   stbi_decoder *prev = stbi__enter_decoder(d);
+   int result = stbi_info_from_memory(buffer, len, x, y, comp);
+   stbi__decoder = prev;
+   return result;
+}
+
+STBIDEF int stbi_info_from_callbacks_ctx(stbi_decoder *d, stbi_io_callbacks const *clbk, void *user, int *x, int *y, int *comp)
+{
+   stbi_decoder *prev = stbi__enter_decoder(d);
+   int result = stbi_info_from_callbacks(clbk, user, x, y, comp);
+   stbi__decoder = prev;
+   return result;
+}
+
+#ifndef STBI_NO_STDIO
+STBIDEF stbi_uc *stbi_load_ctx(stbi_decoder *d, char const *filename, int *x, int *y, int *comp, int req_comp)
+{
+   stbi_decoder *prev = stbi__enter_decoder(d);
+   stbi_uc *result = stbi_load(filename, x, y, comp, req_comp);
+   stbi__decoder = prev;
+   return result;
+}
+
+STBIDEF stbi_us *stbi_load_16_ctx(stbi_decoder *d, char const *filename, int *x, int *y, int *comp, int req_comp)
+{
+   stbi_decoder *prev = stbi__enter_decoder(d);
+   stbi_us *result = stbi_load_16(filename, x, y, comp, req_comp);
+   stbi__decoder = prev;
+   return result;
+}
+
+STBIDEF int stbi_load_into_ctx(stbi_decoder *d, char const *filename, stbi_uc *pixels, int pitch, int width, int height, int channels, int flip)
+{
+   stbi_decoder *prev = stbi__enter_decoder(d);
+   int result = stbi_load_into(filename, pixels, pitch, width, height, channels, flip);
+   stbi__decoder = prev;
+   return result;
+}
+
+STBIDEF int stbi_load_region_into_ctx(stbi_decoder *d, char const *filename, stbi_uc *pixels, int pitch, int x, int y, int width, int height, int channels, int flip)
+{
+   stbi_decoder *prev = stbi__enter_decoder(d);
+   int result = stbi_load_region_into(filename, pixels, pitch, x, y, width, height, channels, flip);
+   stbi__decoder = prev;
+   return result;
+}
+
+STBIDEF int stbi_info_ctx(stbi_decoder *d, char const *filename, int *x, int *y, int *comp)
+{
+   stbi_decoder *prev = stbi__enter_decoder(d);
+   int result = stbi_info(filename, x, y, comp);
+   stbi__decoder = prev;
+   return result;
+}
+
+#ifndef STBI_NO_JPEG
+STBIDEF int stbi_load_jpeg_planes_ctx(stbi_decoder *d, char const *filename, int *x, int *y, stbi_jpeg_planes *planes)
+{
+   stbi_decoder *prev = stbi__enter_decoder(d);
+   int result = stbi_load_jpeg_planes(filename, x, y, planes);
+   stbi__decoder = prev;
+   return result;
+}
+#endif
+#endif
+
+// stb_image uses ints pervasively, including for offset calculations.
+// therefore the largest decoded image size we can support with the
+// current code, even on 64-bit targets, is INT_MAX. this is not a
+// significant limitation for the intended use case.
+//
+// we do, however, need to make sure our size calculations don't
+// overflow. hence a few helper functions for size calculations that
+// multiply integers together, making sure that they're non-negative
+// and no overflow occurs.
+
+// return 1 if the sum is valid, 0 on overflow.
+// negative terms are considered invalid.
+static int stbi__addsizes_valid(int a, int b)
+{
+   if (b < 0) return 0;
+   // now 0 <= b <= INT_MAX, hence also
+   // 0 <= INT_MAX - b <= INTMAX.
+   // And "a + b <= INT_MAX" (which might overflow) is the
+   // same as a <= INT_MAX - b (no overflow)
+   return a <= INT_MAX - b;
+}
+
+// returns 1 if the product is valid, 0 on overflow.
+// negative factors are considered invalid.
+static int stbi__mul2sizes_valid(int a, int b)
+{
+   if (a < 0 || b < 0) return 0;
+   if (b == 0) return 1; // mul-by-0 is always safe
+   // portable way to check for no overflows in a*b
+   return a <= INT_MAX/b;
+}
+
+#if !defined(STBI_NO_JPEG) || !defined(STBI_NO_PNG) || !defined(STBI_NO_TGA) || !defined(STBI_NO_HDR)
+// returns 1 if "a*b + add" has no negative terms/factors and doesn't overflow
+static int stbi__mad2sizes_valid(int a, int b, int add)
+{
+   return stbi__mul2sizes_valid(a, b) && stbi__addsizes_valid(a*b, add);
+}
+#endif
+
+// returns 1 if "a*b*c + add" has no negative terms/factors and doesn't overflow
+static int stbi__mad3sizes_valid(int a, int b, int c, int add)
+{
+   return stbi__mul2sizes_valid(a, b) && stbi__mul2sizes_valid(a*b, c) &&
+      stbi__addsizes_valid(a*b*c, add);
+}
+
+// returns 1 if "a*b*c*d + add" has no negative terms/factors and doesn't overflow
+#if !defined(STBI_NO_LINEAR) || !defined(STBI_NO_HDR) || !defined(STBI_NO_PNM)
+static int stbi__mad4sizes_valid(int a, int b, int c, int d, int add)
+{
+   return stbi__mul2sizes_valid(a, b) && stbi__mul2sizes_valid(a*b, c) &&
+      stbi__mul2sizes_valid(a*b*c, d) && stbi__addsizes_valid(a*b*c*d, add);
+}
+#endif
+
+#if !defined(STBI_NO_JPEG) || !defined(STBI_NO_PNG) || !defined(STBI_NO_TGA) || !defined(STBI_NO_HDR)
+// mallocs with size overflow checking
+static void *stbi__malloc_mad2(int a, int b, int add)
+{
+   if (!stbi__mad2sizes_valid(a, b, add)) return NULL;
+   return stbi__malloc(a*b + add);
+}
+#endif
+
+static void *stbi__malloc_mad3(int a, int b, int c, int add)
+{
+   if (!stbi__mad3sizes_valid(a, b, c, add)) return NULL;
+   return stbi__malloc(a*b*c + add);
 }
 
 #if !defined(STBI_NO_LINEAR) || !defined(STBI_NO_HDR) || !defined(STBI_NO_PNM)
@@ -1080,7 +2098,7 @@ static void *stbi__malloc_mad4(int a, int b, int c, int d, int add)
 
 STBIDEF void stbi_image_free(void *retval_from_stbi_load)
 {
-   STBI_FREE(retval_from_stbi_load);
+   stbi__free(retval_from_stbi_load);
 }
 
 #ifndef STBI_NO_LINEAR
@@ -1093,13 +2111,44 @@ static stbi_uc *stbi__hdr_to_ldr(float   *data, int x, int y, int comp);
 
 static int stbi__vertically_flip_on_load_global = 0;
 
+static int stbi__simd_level = STBI_SIMD_AVX2;
+
+STBIDEF void stbi_set_simd_level(int level)
+{
+   stbi__simd_level = level;
+}
+
+static stbi_parallel_for_func *stbi__parallel_for;
+static void *stbi__parallel_for_user;
+
+STBIDEF void stbi_set_parallel_for(stbi_parallel_for_func *parallel_for, void *user)
+{
+   stbi__parallel_for = parallel_for;
+   stbi__parallel_for_user = user;
+}
+
+#ifndef STBI_NO_STDIO
+static int stbi__mmap = 0;
+static int stbi__mmap_prefetch = 0;
+
+STBIDEF void stbi_set_mmap(int flag_true_if_should_map)
+{
+   stbi__mmap = flag_true_if_should_map;
+}
+
+STBIDEF void stbi_set_mmap_prefetch(int flag_true_if_should_prefetch)
+{
+   stbi__mmap_prefetch = flag_true_if_should_prefetch;
+}
+#endif
+
 STBIDEF void stbi_set_flip_vertically_on_load(int flag_true_if_should_flip)
 {
    stbi__vertically_flip_on_load_global = flag_true_if_should_flip;
 }
 
 #ifndef STBI_THREAD_LOCAL
-#define stbi__vertically_flip_on_load  stbi__vertically_flip_on_load_global
+#define stbi__vertically_flip_on_load  (stbi__decoder ? stbi__decoder->flip : stbi__vertically_flip_on_load_global)
 #else
 static STBI_THREAD_LOCAL int stbi__vertically_flip_on_load_local, stbi__vertically_flip_on_load_set;
 
@@ -1109,11 +2158,47 @@ STBIDEF void stbi_set_flip_vertically_on_load_thread(int flag_true_if_should_fli
    stbi__vertically_flip_on_load_set = 1;
 }
 
-#define stbi__vertically_flip_on_load  (stbi__vertically_flip_on_load_set       \
+#define stbi__vertically_flip_on_load  (stbi__decoder ? stbi__decoder->flip     \
+                                         : stbi__vertically_flip_on_load_set    \
                                          ? stbi__vertically_flip_on_load_local  \
                                          : stbi__vertically_flip_on_load_global)
 #endif // STBI_THREAD_LOCAL
 
+// log2 of the stbi_set_jpeg_scale_on_load denominator
+static int stbi__jpeg_scale_shift_global = 0;
+
+static int stbi__scale_shift(int denominator)
+{
+   return denominator >= 8 ? 3 : denominator >= 4 ? 2 : denominator >= 2 ? 1 : 0;
+}
+
+STBIDEF void stbi_set_jpeg_scale_on_load(int denominator)
+{
+   stbi__jpeg_scale_shift_global = stbi__scale_shift(denominator);
+}
+
+STBIDEF void stbi_decoder_set_jpeg_scale_on_load(stbi_decoder *d, int denominator)
+{
+   d->jpeg_scale_shift = stbi__scale_shift(denominator);
+}
+
+#ifndef STBI_THREAD_LOCAL
+#define stbi__jpeg_scale_shift  (stbi__decoder ? stbi__decoder->jpeg_scale_shift : stbi__jpeg_scale_shift_global)
+#else
+static STBI_THREAD_LOCAL int stbi__jpeg_scale_shift_local, stbi__jpeg_scale_shift_set;
+
+STBIDEF void stbi_set_jpeg_scale_on_load_thread(int denominator)
+{
+   stbi__jpeg_scale_shift_local = stbi__scale_shift(denominator);
+   stbi__jpeg_scale_shift_set = 1;
+}
+
+#define stbi__jpeg_scale_shift  (stbi__decoder ? stbi__decoder->jpeg_scale_shift \
+                                  : stbi__jpeg_scale_shift_set                \
+                                  ? stbi__jpeg_scale_shift_local              \
+                                  : stbi__jpeg_scale_shift_global)
+#endif // STBI_THREAD_LOCAL
+
 static void *stbi__load_main(stbi__context *s, int *x, int *y, int *comp, int req_comp, stbi__result_info *ri, int bpc)
 {
    memset(ri, 0, sizeof(*ri)); // make sure it's initialized if we add new fields
@@ -1179,7 +2264,7 @@ static stbi_uc *stbi__convert_16_to_8(stbi__uint16 *orig, int w, int h, int chan
    for (i = 0; i < img_len; ++i)
       reduced[i] = (stbi_uc)((orig[i] >> 8) & 0xFF); // top half of each byte is sufficient approx of 16->8 bit scaling
 
-   STBI_FREE(orig);
+   stbi__free(orig);
    return reduced;
 }
 
@@ -1195,7 +2280,7 @@ static stbi__uint16 *stbi__convert_8_to_16(stbi_uc *orig, int w, int h, int chan
    for (i = 0; i < img_len; ++i)
       enlarged[i] = (stbi__uint16)((orig[i] << 8) + orig[i]); // replicate to high and low byte, maps 0->0, 255->0xffff
 
-   STBI_FREE(orig);
+   stbi__free(orig);
    return enlarged;
 }
 
@@ -1237,7 +2322,7 @@ static void stbi__vertical_flip_slices(void *image, int w, int h, int z, int byt
 }
 #endif
 
-static unsigned char *stbi__load_and_postprocess_8bit(stbi__context *s, int *x, int *y, int *comp, int req_comp)
+static unsigned char *stbi__load_8bit(stbi__context *s, int *x, int *y, int *comp, int req_comp)
 {
    stbi__result_info ri;
    void *result = stbi__load_main(s, x, y, comp, req_comp, &ri, 8);
@@ -1255,6 +2340,16 @@ static unsigned char *stbi__load_and_postprocess_8bit(stbi__context *s, int *x,
 
    // @TODO: move stbi__convert_format to here
 
+   return (unsigned char *) result;
+}
+
+static unsigned char *stbi__load_and_postprocess_8bit(stbi__context *s, int *x, int *y, int *comp, int req_comp)
+{
+   unsigned char *result = stbi__load_8bit(s, x, y, comp, req_comp);
+
+   if (result == NULL)
+      return NULL;
+
    if (stbi__vertically_flip_on_load) {
       int channels = req_comp ? req_comp : *comp;
       stbi__vertical_flip(result, *x, *y, channels * sizeof(stbi_uc));
@@ -1290,6 +2385,54 @@ static stbi__uint16 *stbi__load_and_postprocess_16bit(stbi__context *s, int *x,
    return (stbi__uint16 *) result;
 }
 
+// JPEG and PNG write straight into the caller's rows when they can, for the
+// rest the image is decoded as usual and copied in (the region of it, if
+// there is one)
+static int stbi__load_into(stbi__context *s, stbi_uc *pixels, int pitch, int x0, int y0, int width, int height, int channels, int flip, int region)
+{
+   stbi__result_info ri;
+   stbi__into into;
+   void *result;
+   int x, y, comp, j, i;
+
+   if (channels < 1 || channels > 4) return stbi__err("bad req_comp", "Internal error");
+   if (width <= 0 || height <= 0 || pitch < width*channels) return stbi__err("bad pitch", "Rows given overlap");
+   if (x0 < 0 || y0 < 0) return stbi__err("bad region", "Region starts outside the image");
+
+   into.pixels = flip ? pixels + (ptrdiff_t) pitch * (height - 1) : pixels;
+   into.stride = flip ? -pitch : pitch;
+   into.width = width;
+   into.height = height;
+   into.channels = channels;
+   into.region = region;
+   into.x0 = x0;
+   into.y0 = y0;
+   into.written = 0;
+   s->into = &into;
+   result = stbi__load_main(s, &x, &y, &comp, channels, &ri, 8);
+   s->into = NULL;
+
+   if (result == NULL) return 0;
+   if (into.written) return 1;
+   if (!stbi__into_fits(&into, x, y)) {
+      stbi__free(result);
+      return stbi__err("size mismatch", region ? "Region is not inside the image" : "Image is not the size given");
+   }
+   for (j=0; j < height; ++j) {
+      stbi_uc *dest = into.pixels + (ptrdiff_t) into.stride * j;
+      size_t first = ((size_t) x * (y0 + j) + x0) * channels;
+      if (ri.bits_per_channel == 16) {
+         stbi__uint16 *src = (stbi__uint16 *) result + first;
+         for (i=0; i < width*channels; ++i)
+            dest[i] = (stbi_uc) (src[i] >> 8);
+      } else {
+         memcpy(dest, (stbi_uc *) result + first, (size_t) width * channels);
+      }
+   }
+   stbi__free(result);
+   return 1;
+}
+
 #if !defined(STBI_NO_HDR) && !defined(STBI_NO_LINEAR)
 static void stbi__float_postprocess(float *result, int *x, int *y, int *comp, int req_comp)
 {
@@ -1342,21 +2485,90 @@ static FILE *stbi__fopen(char const *filename, char const *mode)
    return f;
 }
 
-
-STBIDEF stbi_uc *stbi_load(char const *filename, int *x, int *y, int *comp, int req_comp)
+#ifdef STBI__MMAP
+// a file mapped for stbi__start_mem, instead of read through FILE
+typedef struct
 {
-   FILE *f = stbi__fopen(filename, "rb");
-   unsigned char *result;
-   if (!f) return stbi__errpuc("can't fopen", "Unable to open file");
-   result = stbi_load_from_file(f,x,y,comp,req_comp);
-   fclose(f);
-   return result;
+   stbi_uc *data;
+   size_t size;
+   pthread_t prefetch;
+   int prefetching;
+   volatile int stop;
+} stbi__mapped_file;
+
+// touches a byte of every page, so they are read from disk while the
+// decoder is still busy with the ones before
+static void *stbi__prefetch_pages(void *arg)
+{
+   stbi__mapped_file *m = (stbi__mapped_file *) arg;
+   size_t page = (size_t) sysconf(_SC_PAGESIZE), i;
+   volatile stbi_uc sink = 0;
+   for (i=0; i < m->size && !m->stop; i += page)
+      sink += m->data[i];
+   return NULL;
+}
+
+// 0 if mapping is off or the file cannot be mapped (or is too big for an
+// int length), the caller falls back to FILE then, which also reports the error
+static int stbi__map_file(stbi__mapped_file *m, char const *filename)
+{
+   struct stat st;
+   void *data;
+   int fd;
+   if (!stbi__mmap) return 0;
+   fd = open(filename, O_RDONLY);
+   if (fd < 0) return 0;
+   if (fstat(fd, &st) != 0 || !S_ISREG(st.st_mode) || st.st_size <= 0 || st.st_size > INT_MAX) {
+      close(fd);
+      return 0;
+   }
+   data = mmap(NULL, (size_t) st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+   close(fd);
+   if (data == MAP_FAILED) return 0;
+
+   m->data = (stbi_uc *) data;
+   m->size = (size_t) st.st_size;
+   m->stop = 0;
+   // all the decoders read their input front to back
+   posix_madvise(data, m->size, POSIX_MADV_SEQUENTIAL);
+   m->prefetching = stbi__mmap_prefetch && pthread_create(&m->prefetch, NULL, stbi__prefetch_pages, m) == 0;
+   return 1;
 }
 
-STBIDEF stbi_uc *stbi_load_from_file(FILE *f, int *x, int *y, int *comp, int req_comp)
+static void stbi__unmap_file(stbi__mapped_file *m)
 {
-   unsigned char *result;
-   stbi__context s;
+   if (m->prefetching) {
+      m->stop = 1;
+      pthread_join(m->prefetch, NULL);
+   }
+   munmap(m->data, m->size);
+}
+#endif
+
+
+STBIDEF stbi_uc *stbi_load(char const *filename, int *x, int *y, int *comp, int req_comp)
+{
+   FILE *f;
+   unsigned char *result;
+#ifdef STBI__MMAP
+   stbi__mapped_file m;
+   if (stbi__map_file(&m, filename)) {
+      result = stbi_load_from_memory(m.data, (int) m.size, x, y, comp, req_comp);
+      stbi__unmap_file(&m);
+      return result;
+   }
+#endif
+   f = stbi__fopen(filename, "rb");
+   if (!f) return stbi__errpuc("can't fopen", "Unable to open file");
+   result = stbi_load_from_file(f,x,y,comp,req_comp);
+   fclose(f);
+   return result;
+}
+
+STBIDEF stbi_uc *stbi_load_from_file(FILE *f, int *x, int *y, int *comp, int req_comp)
+{
+   unsigned char *result;
+   stbi__context s;
    stbi__start_file(&s,f);
    result = stbi__load_and_postprocess_8bit(&s,x,y,comp,req_comp);
    if (result) {
@@ -1366,6 +2578,70 @@ STBIDEF stbi_uc *stbi_load_from_file(FILE *f, int *x, int *y, int *comp, int req
    return result;
 }
 
+STBIDEF int stbi_load_into(char const *filename, stbi_uc *pixels, int pitch, int width, int height, int channels, int flip)
+{
+   FILE *f;
+   int result;
+#ifdef STBI__MMAP
+   stbi__mapped_file m;
+   if (stbi__map_file(&m, filename)) {
+      result = stbi_load_into_from_memory(m.data, (int) m.size, pixels, pitch, width, height, channels, flip);
+      stbi__unmap_file(&m);
+      return result;
+   }
+#endif
+   f = stbi__fopen(filename, "rb");
+   if (!f) return stbi__err("can't fopen", "Unable to open file");
+   result = stbi_load_into_from_file(f,pixels,pitch,width,height,channels,flip);
+   fclose(f);
+   return result;
+}
+
+STBIDEF int stbi_load_into_from_file(FILE *f, stbi_uc *pixels, int pitch, int width, int height, int channels, int flip)
+{
+   int result;
+   stbi__context s;
+   stbi__start_file(&s,f);
+   result = stbi__load_into(&s,pixels,pitch,0,0,width,height,channels,flip,0);
+   if (result) {
+      // need to 'unget' all the characters in the IO buffer
+      fseek(f, - (int) (s.img_buffer_end - s.img_buffer), SEEK_CUR);
+   }
+   return result;
+}
+
+STBIDEF int stbi_load_region_into(char const *filename, stbi_uc *pixels, int pitch, int x, int y, int width, int height, int channels, int flip)
+{
+   FILE *f;
+   int result;
+#ifdef STBI__MMAP
+   stbi__mapped_file m;
+   if (stbi__map_file(&m, filename)) {
+      result = stbi_load_region_into_from_memory(m.data, (int) m.size, pixels, pitch, x, y, width, height, channels, flip);
+      stbi__unmap_file(&m);
+      return result;
+   }
+#endif
+   f = stbi__fopen(filename, "rb");
+   if (!f) return stbi__err("can't fopen", "Unable to open file");
+   result = stbi_load_region_into_from_file(f,pixels,pitch,x,y,width,height,channels,flip);
+   fclose(f);
+   return result;
+}
+
+STBIDEF int stbi_load_region_into_from_file(FILE *f, stbi_uc *pixels, int pitch, int x, int y, int width, int height, int channels, int flip)
+{
+   int result;
+   stbi__context s;
+   stbi__start_file(&s,f);
+   result = stbi__load_into(&s,pixels,pitch,x,y,width,height,channels,flip,1);
+   if (result) {
+      // need to 'unget' all the characters in the IO buffer
+      fseek(f, - (int) (s.img_buffer_end - s.img_buffer), SEEK_CUR);
+   }
+   return result;
+}
+
 STBIDEF stbi__uint16 *stbi_load_from_file_16(FILE *f, int *x, int *y, int *comp, int req_comp)
 {
    stbi__uint16 *result;
@@ -1381,8 +2657,17 @@ STBIDEF stbi__uint16 *stbi_load_from_file_16(FILE *f, int *x, int *y, int *comp,
 
 STBIDEF stbi_us *stbi_load_16(char const *filename, int *x, int *y, int *comp, int req_comp)
 {
-   FILE *f = stbi__fopen(filename, "rb");
+   FILE *f;
    stbi__uint16 *result;
+#ifdef STBI__MMAP
+   stbi__mapped_file m;
+   if (stbi__map_file(&m, filename)) {
+      result = stbi_load_16_from_memory(m.data, (int) m.size, x, y, comp, req_comp);
+      stbi__unmap_file(&m);
+      return result;
+   }
+#endif
+   f = stbi__fopen(filename, "rb");
    if (!f) return (stbi_us *) stbi__errpuc("can't fopen", "Unable to open file");
    result = stbi_load_from_file_16(f,x,y,comp,req_comp);
    fclose(f);
@@ -1420,6 +2705,34 @@ STBIDEF stbi_uc *stbi_load_from_callbacks(stbi_io_callbacks const *clbk, void *u
    return stbi__load_and_postprocess_8bit(&s,x,y,comp,req_comp);
 }
 
+STBIDEF int stbi_load_into_from_memory(stbi_uc const *buffer, int len, stbi_uc *pixels, int pitch, int width, int height, int channels, int flip)
+{
+   stbi__context s;
+   stbi__start_mem(&s,buffer,len);
+   return stbi__load_into(&s,pixels,pitch,0,0,width,height,channels,flip,0);
+}
+
+STBIDEF int stbi_load_into_from_callbacks(stbi_io_callbacks const *clbk, void *user, stbi_uc *pixels, int pitch, int width, int height, int channels, int flip)
+{
+   stbi__context s;
+   stbi__start_callbacks(&s, (stbi_io_callbacks *) clbk, user);
+   return stbi__load_into(&s,pixels,pitch,0,0,width,height,channels,flip,0);
+}
+
+STBIDEF int stbi_load_region_into_from_memory(stbi_uc const *buffer, int len, stbi_uc *pixels, int pitch, int x, int y, int width, int height, int channels, int flip)
+{
+   stbi__context s;
+   stbi__start_mem(&s,buffer,len);
+   return stbi__load_into(&s,pixels,pitch,x,y,width,height,channels,flip,1);
+}
+
+STBIDEF int stbi_load_region_into_from_callbacks(stbi_io_callbacks const *clbk, void *user, stbi_uc *pixels, int pitch, int x, int y, int width, int height, int channels, int flip)
+{
+   stbi__context s;
+   stbi__start_callbacks(&s, (stbi_io_callbacks *) clbk, user);
+   return stbi__load_into(&s,pixels,pitch,x,y,width,height,channels,flip,1);
+}
+
 #ifndef STBI_NO_GIF
 STBIDEF stbi_uc *stbi_load_gif_from_memory(stbi_uc const *buffer, int len, int **delays, int *x, int *y, int *z, int *comp, int req_comp)
 {
@@ -1436,7 +2749,64 @@ STBIDEF stbi_uc *stbi_load_gif_from_memory(stbi_uc const *buffer, int len, int *
 }
 #endif
 
+// converts n floats to halves, see stbi__half_kernel
+typedef void stbi__half_func(stbi_us *output, float const *input, size_t n);
+
 #ifndef STBI_NO_LINEAR
+// IEEE half floats, rounded to nearest even as F16C does
+static stbi_us stbi__float_to_half(float f)
+{
+   stbi__uint32 u, sign, mant, rem, halfway;
+   int shift;
+   memcpy(&u, &f, sizeof(u));
+   sign = (u >> 16) & 0x8000;
+   u &= 0x7fffffff;
+   if (u > 0x7f800000) return (stbi_us) (sign | 0x7e00 | ((u >> 13) & 0x3ff)); // quiet NaN
+   if (u >= 0x38800000) { // normal half, or too large for one
+      u -= (127 - 15) << 23;
+      u = (u + 0xfff + ((u >> 13) & 1)) >> 13;
+      return (stbi_us) (sign | (u < 0x7c00 ? u : 0x7c00));
+   }
+   if (u <= 0x33000000) return (stbi_us) sign; // at most half of the smallest denormal
+   mant = (u & 0x7fffff) | 0x800000;
+   shift = 126 - (int) (u >> 23);
+   rem = mant & ((1u << shift) - 1);
+   halfway = 1u << (shift - 1);
+   mant >>= shift;
+   if (rem > halfway || (rem == halfway && (mant & 1))) ++mant;
+   return (stbi_us) (sign | mant);
+}
+
+static void stbi__float_to_half_row(stbi_us *output, float const *input, size_t n)
+{
+   size_t i;
+   for (i=0; i < n; ++i)
+      output[i] = stbi__float_to_half(input[i]);
+}
+
+#ifdef STBI_F16C
+STBI__F16C_TARGET
+static void stbi__float_to_half_row_f16c(stbi_us *output, float const *input, size_t n)
+{
+   size_t i;
+   for (i=0; i+8 <= n; i += 8) {
+      _mm_storel_epi64((__m128i *) (output+i),   _mm_cvtps_ph(_mm_loadu_ps(input+i),   0)); // to nearest even
+      _mm_storel_epi64((__m128i *) (output+i+4), _mm_cvtps_ph(_mm_loadu_ps(input+i+4), 0));
+   }
+   for (; i < n; ++i)
+      output[i] = stbi__float_to_half(input[i]);
+}
+#endif
+
+static stbi__half_func *stbi__half_kernel(void)
+{
+#ifdef STBI_F16C
+   if (stbi__simd_level >= STBI_SIMD_AVX2 && stbi__f16c_available())
+      return stbi__float_to_half_row_f16c;
+#endif
+   return stbi__float_to_half_row;
+}
+
 static float *stbi__loadf_main(stbi__context *s, int *x, int *y, int *comp, int req_comp)
 {
    unsigned char *data;
@@ -1473,7 +2843,16 @@ STBIDEF float *stbi_loadf_from_callbacks(stbi_io_callbacks const *clbk, void *us
 STBIDEF float *stbi_loadf(char const *filename, int *x, int *y, int *comp, int req_comp)
 {
    float *result;
-   FILE *f = stbi__fopen(filename, "rb");
+   FILE *f;
+#ifdef STBI__MMAP
+   stbi__mapped_file m;
+   if (stbi__map_file(&m, filename)) {
+      result = stbi_loadf_from_memory(m.data, (int) m.size, x, y, comp, req_comp);
+      stbi__unmap_file(&m);
+      return result;
+   }
+#endif
+   f = stbi__fopen(filename, "rb");
    if (!f) return stbi__errpf("can't fopen", "Unable to open file");
    result = stbi_loadf_from_file(f,x,y,comp,req_comp);
    fclose(f);
@@ -1488,6 +2867,68 @@ STBIDEF float *stbi_loadf_from_file(FILE *f, int *x, int *y, int *comp, int req_
 }
 #endif // !STBI_NO_STDIO
 
+static stbi_us *stbi__loadf_half_main(stbi__context *s, int *x, int *y, int *comp, int req_comp)
+{
+   float *data;
+   stbi_us *result;
+   size_t n;
+   #ifndef STBI_NO_HDR
+   if (stbi__hdr_test(s)) {
+      result = stbi__hdr_load_half(s,x,y,comp,req_comp);
+      if (result && stbi__vertically_flip_on_load)
+         stbi__vertical_flip(result, *x, *y, (req_comp ? req_comp : *comp) * sizeof(stbi_us));
+      return result;
+   }
+   #endif
+   data = stbi__loadf_main(s,x,y,comp,req_comp);
+   if (!data) return NULL;
+   n = (size_t) *x * *y * (req_comp ? req_comp : *comp);
+   result = (stbi_us *) stbi__malloc(n * sizeof(stbi_us));
+   if (result)
+      stbi__half_kernel()(result, data, n);
+   else
+      (void) stbi__err("outofmem", "Out of memory");
+   stbi__free(data);
+   return result;
+}
+
+STBIDEF stbi_us *stbi_loadf_half_from_memory(stbi_uc const *buffer, int len, int *x, int *y, int *comp, int req_comp)
+{
+   stbi__context s;
+   stbi__start_mem(&s,buffer,len);
+   return stbi__loadf_half_main(&s,x,y,comp,req_comp);
+}
+
+STBIDEF stbi_us *stbi_loadf_half_from_callbacks(stbi_io_callbacks const *clbk, void *user, int *x, int *y, int *comp, int req_comp)
+{
+   stbi__context s;
+   stbi__start_callbacks(&s, (stbi_io_callbacks *) clbk, user);
+   return stbi__loadf_half_main(&s,x,y,comp,req_comp);
+}
+
+#ifndef STBI_NO_STDIO
+STBIDEF stbi_us *stbi_loadf_half(char const *filename, int *x, int *y, int *comp, int req_comp)
+{
+   stbi_us *result;
+   FILE *f;
+   stbi__context s;
+#ifdef STBI__MMAP
+   stbi__mapped_file m;
+   if (stbi__map_file(&m, filename)) {
+      result = stbi_loadf_half_from_memory(m.data, (int) m.size, x, y, comp, req_comp);
+      stbi__unmap_file(&m);
+      return result;
+   }
+#endif
+   f = stbi__fopen(filename, "rb");
+   if (!f) return (stbi_us *) stbi__errpuc("can't fopen", "Unable to open file");
+   stbi__start_file(&s,f);
+   result = stbi__loadf_half_main(&s,x,y,comp,req_comp);
+   fclose(f);
+   return result;
+}
+#endif // !STBI_NO_STDIO
+
 #endif // !STBI_NO_LINEAR
 
 // these is-hdr-or-not is defined independent of whether STBI_NO_LINEAR is
@@ -1571,7 +3012,8 @@ enum
 {
    STBI__SCAN_load=0,
    STBI__SCAN_type,
-   STBI__SCAN_header
+   STBI__SCAN_header,
+   STBI__SCAN_idat    // png: stop at the first IDAT, for reading the image data as a stream
 };
 
 static void stbi__refill_buffer(stbi__context *s)
@@ -1640,7 +3082,7 @@ static void stbi__skip(stbi__context *s, int n)
 }
 #endif
 
-#if defined(STBI_NO_PNG) && defined(STBI_NO_TGA) && defined(STBI_NO_HDR) && defined(STBI_NO_PNM)
+#if defined(STBI_NO_PNG) && defined(STBI_NO_TGA) && defined(STBI_NO_PNM)
 // nothing
 #else
 static int stbi__getn(stbi__context *s, stbi_uc *buffer, int n)
@@ -1729,12 +3171,119 @@ static stbi_uc stbi__compute_y(int r, int g, int b)
 }
 #endif
 
+#if defined(STBI_AVX2) && !(defined(STBI_NO_JPEG) && defined(STBI_NO_PNG) && defined(STBI_NO_BMP) && defined(STBI_NO_PSD) && defined(STBI_NO_TGA) && defined(STBI_NO_GIF) && defined(STBI_NO_PIC) && defined(STBI_NO_PNM))
+// byte shuffles for the conversions that only move bytes around, two
+// registers of output per step; they return how many pixels they did and
+// leave the rest to the scalar loops
+STBI__AVX2_TARGET
+static int stbi__convert_row_avx2(stbi_uc const *src, stbi_uc *dest, int img_n, int req_comp, int x)
+{
+   int i = 0;
+   __m256i alpha = _mm256_set1_epi32((int) 0xff000000u);
+   switch (img_n*8 + req_comp) {
+      case 1*8+3: { // gray -> RGB, 16 pixels to 48 bytes
+         __m128i m0 = _mm_setr_epi8(0,0,0,1,1,1,2,2,2,3,3,3,4,4,4,5);
+         __m128i m1 = _mm_setr_epi8(5,5,6,6,6,7,7,7,8,8,8,9,9,9,10,10);
+         __m128i m2 = _mm_setr_epi8(10,11,11,11,12,12,12,13,13,13,14,14,14,15,15,15);
+         for (; i+16 <= x; i += 16) {
+            __m128i g = _mm_loadu_si128((__m128i const *) (src + i));
+            _mm_storeu_si128((__m128i *) (dest + i*3 +  0), _mm_shuffle_epi8(g, m0));
+            _mm_storeu_si128((__m128i *) (dest + i*3 + 16), _mm_shuffle_epi8(g, m1));
+            _mm_storeu_si128((__m128i *) (dest + i*3 + 32), _mm_shuffle_epi8(g, m2));
+         }
+         break;
+      }
+      case 1*8+4: { // gray -> RGBA, the same 16 bytes in both lanes
+         __m256i lo = _mm256_setr_epi8(0,0,0,-1,1,1,1,-1,2,2,2,-1,3,3,3,-1, 4,4,4,-1,5,5,5,-1,6,6,6,-1,7,7,7,-1);
+         __m256i hi = _mm256_setr_epi8(8,8,8,-1,9,9,9,-1,10,10,10,-1,11,11,11,-1, 12,12,12,-1,13,13,13,-1,14,14,14,-1,15,15,15,-1);
+         for (; i+16 <= x; i += 16) {
+            __m256i g = _mm256_broadcastsi128_si256(_mm_loadu_si128((__m128i const *) (src + i)));
+            _mm256_storeu_si256((__m256i *) (dest + i*4 +  0), _mm256_or_si256(_mm256_shuffle_epi8(g, lo), alpha));
+            _mm256_storeu_si256((__m256i *) (dest + i*4 + 32), _mm256_or_si256(_mm256_shuffle_epi8(g, hi), alpha));
+         }
+         break;
+      }
+      case 2*8+4: { // gray+alpha -> RGBA
+         __m256i m = _mm256_setr_epi8(0,0,0,1,2,2,2,3,4,4,4,5,6,6,6,7, 8,8,8,9,10,10,10,11,12,12,12,13,14,14,14,15);
+         for (; i+16 <= x; i += 16) {
+            __m256i lo = _mm256_broadcastsi128_si256(_mm_loadu_si128((__m128i const *) (src + i*2)));
+            __m256i hi = _mm256_broadcastsi128_si256(_mm_loadu_si128((__m128i const *) (src + i*2 + 16)));
+            _mm256_storeu_si256((__m256i *) (dest + i*4 +  0), _mm256_shuffle_epi8(lo, m));
+            _mm256_storeu_si256((__m256i *) (dest + i*4 + 32), _mm256_shuffle_epi8(hi, m));
+         }
+         break;
+      }
+      case 3*8+4: { // RGB -> RGBA; four pixels per lane, loaded 16 bytes at a time
+         __m256i m = _mm256_setr_epi8(0,1,2,-1,3,4,5,-1,6,7,8,-1,9,10,11,-1, 0,1,2,-1,3,4,5,-1,6,7,8,-1,9,10,11,-1);
+         // the last load reads 4 bytes past the 48 it uses
+         for (; i+18 <= x; i += 16) {
+            stbi_uc const *in = src + i*3;
+            __m256i lo = _mm256_inserti128_si256(_mm256_castsi128_si256(_mm_loadu_si128((__m128i const *) (in +  0))), _mm_loadu_si128((__m128i const *) (in + 12)), 1);
+            __m256i hi = _mm256_inserti128_si256(_mm256_castsi128_si256(_mm_loadu_si128((__m128i const *) (in + 24))), _mm_loadu_si128((__m128i const *) (in + 36)), 1);
+            _mm256_storeu_si256((__m256i *) (dest + i*4 +  0), _mm256_or_si256(_mm256_shuffle_epi8(lo, m), alpha));
+            _mm256_storeu_si256((__m256i *) (dest + i*4 + 32), _mm256_or_si256(_mm256_shuffle_epi8(hi, m), alpha));
+         }
+         break;
+      }
+      case 4*8+3: { // RGBA -> RGB; each 16 byte store has 4 bytes of garbage that the next one overwrites
+         __m256i m = _mm256_setr_epi8(0,1,2,4,5,6,8,9,10,12,13,14,-1,-1,-1,-1, 0,1,2,4,5,6,8,9,10,12,13,14,-1,-1,-1,-1);
+         for (; i+10 <= x; i += 8) {
+            __m256i p = _mm256_shuffle_epi8(_mm256_loadu_si256((__m256i const *) (src + i*4)), m);
+            _mm_storeu_si128((__m128i *) (dest + i*3 +  0), _mm256_castsi256_si128(p));
+            _mm_storeu_si128((__m128i *) (dest + i*3 + 12), _mm256_extracti128_si256(p, 1));
+         }
+         break;
+      }
+   }
+   return i;
+}
+#endif // STBI_AVX2
+
+#if defined(STBI_NO_JPEG) && defined(STBI_NO_PNG) && defined(STBI_NO_BMP) && defined(STBI_NO_PSD) && defined(STBI_NO_TGA) && defined(STBI_NO_GIF) && defined(STBI_NO_PIC) && defined(STBI_NO_PNM)
+// nothing
+#else
+// converts one scanline of x pixels
+static int stbi__convert_row(unsigned char const *src, unsigned char *dest, int img_n, int req_comp, unsigned int x)
+{
+   int i;
+#ifdef STBI_AVX2
+   if (stbi__simd_level >= STBI_SIMD_AVX2 && stbi__avx2_available()) {
+      int done = stbi__convert_row_avx2(src, dest, img_n, req_comp, (int) x);
+      src += done*img_n;
+      dest += done*req_comp;
+      x -= done;
+   }
+#endif
+   #define STBI__COMBO(a,b)  ((a)*8+(b))
+   #define STBI__CASE(a,b)   case STBI__COMBO(a,b): for(i=x-1; i >= 0; --i, src += a, dest += b)
+   // convert source image with img_n components to one with req_comp components;
+   // avoid switch per pixel, so use switch per scanline and massive macros
+   switch (STBI__COMBO(img_n, req_comp)) {
+      STBI__CASE(1,2) { dest[0]=src[0]; dest[1]=255;                                     } break;
+      STBI__CASE(1,3) { dest[0]=dest[1]=dest[2]=src[0];                                  } break;
+      STBI__CASE(1,4) { dest[0]=dest[1]=dest[2]=src[0]; dest[3]=255;                     } break;
+      STBI__CASE(2,1) { dest[0]=src[0];                                                  } break;
+      STBI__CASE(2,3) { dest[0]=dest[1]=dest[2]=src[0];                                  } break;
+      STBI__CASE(2,4) { dest[0]=dest[1]=dest[2]=src[0]; dest[3]=src[1];                  } break;
+      STBI__CASE(3,4) { dest[0]=src[0];dest[1]=src[1];dest[2]=src[2];dest[3]=255;        } break;
+      STBI__CASE(3,1) { dest[0]=stbi__compute_y(src[0],src[1],src[2]);                   } break;
+      STBI__CASE(3,2) { dest[0]=stbi__compute_y(src[0],src[1],src[2]); dest[1] = 255;    } break;
+      STBI__CASE(4,1) { dest[0]=stbi__compute_y(src[0],src[1],src[2]);                   } break;
+      STBI__CASE(4,2) { dest[0]=stbi__compute_y(src[0],src[1],src[2]); dest[1] = src[3]; } break;
+      STBI__CASE(4,3) { dest[0]=src[0];dest[1]=src[1];dest[2]=src[2];                    } break;
+      default: STBI_ASSERT(0); return stbi__err("unsupported", "Unsupported format conversion");
+   }
+   #undef STBI__CASE
+   return 1;
+}
+#endif
+
 #if defined(STBI_NO_PNG) && defined(STBI_NO_BMP) && defined(STBI_NO_PSD) && defined(STBI_NO_TGA) && defined(STBI_NO_GIF) && defined(STBI_NO_PIC) && defined(STBI_NO_PNM)
 // nothing
 #else
 static unsigned char *stbi__convert_format(unsigned char *data, int img_n, int req_comp, unsigned int x, unsigned int y)
 {
-   int i,j;
+   int j;
    unsigned char *good;
 
    if (req_comp == img_n) return data;
@@ -1742,7 +3291,7 @@ static unsigned char *stbi__convert_format(unsigned char *data, int img_n, int r
 
    good = (unsigned char *) stbi__malloc_mad3(req_comp, x, y, 0);
    if (good == NULL) {
-      STBI_FREE(data);
+      stbi__free(data);
       return stbi__errpuc("outofmem", "Out of memory");
    }
 
@@ -1750,29 +3299,14 @@ static unsigned char *stbi__convert_format(unsigned char *data, int img_n, int r
       unsigned char *src  = data + j * x * img_n   ;
       unsigned char *dest = good + j * x * req_comp;
 
-      #define STBI__COMBO(a,b)  ((a)*8+(b))
-      #define STBI__CASE(a,b)   case STBI__COMBO(a,b): for(i=x-1; i >= 0; --i, src += a, dest += b)
-      // convert source image with img_n components to one with req_comp components;
-      // avoid switch per pixel, so use switch per scanline and massive macros
-      switch (STBI__COMBO(img_n, req_comp)) {
-         STBI__CASE(1,2) { dest[0]=src[0]; dest[1]=255;                                     } break;
-         STBI__CASE(1,3) { dest[0]=dest[1]=dest[2]=src[0];                                  } break;
-         STBI__CASE(1,4) { dest[0]=dest[1]=dest[2]=src[0]; dest[3]=255;                     } break;
-         STBI__CASE(2,1) { dest[0]=src[0];                                                  } break;
-         STBI__CASE(2,3) { dest[0]=dest[1]=dest[2]=src[0];                                  } break;
-         STBI__CASE(2,4) { dest[0]=dest[1]=dest[2]=src[0]; dest[3]=src[1];                  } break;
-         STBI__CASE(3,4) { dest[0]=src[0];dest[1]=src[1];dest[2]=src[2];dest[3]=255;        } break;
-         STBI__CASE(3,1) { dest[0]=stbi__compute_y(src[0],src[1],src[2]);                   } break;
-         STBI__CASE(3,2) { dest[0]=stbi__compute_y(src[0],src[1],src[2]); dest[1] = 255;    } break;
-         STBI__CASE(4,1) { dest[0]=stbi__compute_y(src[0],src[1],src[2]);                   } break;
-         STBI__CASE(4,2) { dest[0]=stbi__compute_y(src[0],src[1],src[2]); dest[1] = src[3]; } break;
-         STBI__CASE(4,3) { dest[0]=src[0];dest[1]=src[1];dest[2]=src[2];                    } break;
-         default: STBI_ASSERT(0); STBI_FREE(data); STBI_FREE(good); return stbi__errpuc("unsupported", "Unsupported format conversion");
-      }
-      #undef STBI__CASE
-   }
-
-   STBI_FREE(data);
+      if (!stbi__convert_row(src, dest, img_n, req_comp, x)) {
+         stbi__free(data);
+         stbi__free(good);
+         return NULL;
+      }
+   }
+
+   stbi__free(data);
    return good;
 }
 #endif
@@ -1789,9 +3323,36 @@ static stbi__uint16 stbi__compute_y_16(int r, int g, int b)
 #if defined(STBI_NO_PNG) && defined(STBI_NO_PSD)
 // nothing
 #else
+// converts one scanline of x pixels
+static int stbi__convert_row16(stbi__uint16 const *src, stbi__uint16 *dest, int img_n, int req_comp, unsigned int x)
+{
+   int i;
+   #define STBI__COMBO(a,b)  ((a)*8+(b))
+   #define STBI__CASE(a,b)   case STBI__COMBO(a,b): for(i=x-1; i >= 0; --i, src += a, dest += b)
+   // convert source image with img_n components to one with req_comp components;
+   // avoid switch per pixel, so use switch per scanline and massive macros
+   switch (STBI__COMBO(img_n, req_comp)) {
+      STBI__CASE(1,2) { dest[0]=src[0]; dest[1]=0xffff;                                     } break;
+      STBI__CASE(1,3) { dest[0]=dest[1]=dest[2]=src[0];                                     } break;
+      STBI__CASE(1,4) { dest[0]=dest[1]=dest[2]=src[0]; dest[3]=0xffff;                     } break;
+      STBI__CASE(2,1) { dest[0]=src[0];                                                     } break;
+      STBI__CASE(2,3) { dest[0]=dest[1]=dest[2]=src[0];                                     } break;
+      STBI__CASE(2,4) { dest[0]=dest[1]=dest[2]=src[0]; dest[3]=src[1];                     } break;
+      STBI__CASE(3,4) { dest[0]=src[0];dest[1]=src[1];dest[2]=src[2];dest[3]=0xffff;        } break;
+      STBI__CASE(3,1) { dest[0]=stbi__compute_y_16(src[0],src[1],src[2]);                   } break;
+      STBI__CASE(3,2) { dest[0]=stbi__compute_y_16(src[0],src[1],src[2]); dest[1] = 0xffff; } break;
+      STBI__CASE(4,1) { dest[0]=stbi__compute_y_16(src[0],src[1],src[2]);                   } break;
+      STBI__CASE(4,2) { dest[0]=stbi__compute_y_16(src[0],src[1],src[2]); dest[1] = src[3]; } break;
+      STBI__CASE(4,3) { dest[0]=src[0];dest[1]=src[1];dest[2]=src[2];                       } break;
+      default: STBI_ASSERT(0); return stbi__err("unsupported", "Unsupported format conversion");
+   }
+   #undef STBI__CASE
+   return 1;
+}
+
 static stbi__uint16 *stbi__convert_format16(stbi__uint16 *data, int img_n, int req_comp, unsigned int x, unsigned int y)
 {
-   int i,j;
+   int j;
    stbi__uint16 *good;
 
    if (req_comp == img_n) return data;
@@ -1799,7 +3360,7 @@ static stbi__uint16 *stbi__convert_format16(stbi__uint16 *data, int img_n, int r
 
    good = (stbi__uint16 *) stbi__malloc(req_comp * x * y * 2);
    if (good == NULL) {
-      STBI_FREE(data);
+      stbi__free(data);
       return (stbi__uint16 *) stbi__errpuc("outofmem", "Out of memory");
    }
 
@@ -1807,29 +3368,14 @@ static stbi__uint16 *stbi__convert_format16(stbi__uint16 *data, int img_n, int r
       stbi__uint16 *src  = data + j * x * img_n   ;
       stbi__uint16 *dest = good + j * x * req_comp;
 
-      #define STBI__COMBO(a,b)  ((a)*8+(b))
-      #define STBI__CASE(a,b)   case STBI__COMBO(a,b): for(i=x-1; i >= 0; --i, src += a, dest += b)
-      // convert source image with img_n components to one with req_comp components;
-      // avoid switch per pixel, so use switch per scanline and massive macros
-      switch (STBI__COMBO(img_n, req_comp)) {
-         STBI__CASE(1,2) { dest[0]=src[0]; dest[1]=0xffff;                                     } break;
-         STBI__CASE(1,3) { dest[0]=dest[1]=dest[2]=src[0];                                     } break;
-         STBI__CASE(1,4) { dest[0]=dest[1]=dest[2]=src[0]; dest[3]=0xffff;                     } break;
-         STBI__CASE(2,1) { dest[0]=src[0];                                                     } break;
-         STBI__CASE(2,3) { dest[0]=dest[1]=dest[2]=src[0];                                     } break;
-         STBI__CASE(2,4) { dest[0]=dest[1]=dest[2]=src[0]; dest[3]=src[1];                     } break;
-         STBI__CASE(3,4) { dest[0]=src[0];dest[1]=src[1];dest[2]=src[2];dest[3]=0xffff;        } break;
-         STBI__CASE(3,1) { dest[0]=stbi__compute_y_16(src[0],src[1],src[2]);                   } break;
-         STBI__CASE(3,2) { dest[0]=stbi__compute_y_16(src[0],src[1],src[2]); dest[1] = 0xffff; } break;
-         STBI__CASE(4,1) { dest[0]=stbi__compute_y_16(src[0],src[1],src[2]);                   } break;
-         STBI__CASE(4,2) { dest[0]=stbi__compute_y_16(src[0],src[1],src[2]); dest[1] = src[3]; } break;
-         STBI__CASE(4,3) { dest[0]=src[0];dest[1]=src[1];dest[2]=src[2];                       } break;
-         default: STBI_ASSERT(0); STBI_FREE(data); STBI_FREE(good); return (stbi__uint16*) stbi__errpuc("unsupported", "Unsupported format conversion");
-      }
-      #undef STBI__CASE
-   }
-
-   STBI_FREE(data);
+      if (!stbi__convert_row16(src, dest, img_n, req_comp, x)) {
+         stbi__free(data);
+         stbi__free(good);
+         return NULL;
+      }
+   }
+
+   stbi__free(data);
    return good;
 }
 #endif
@@ -1841,7 +3387,7 @@ static float   *stbi__ldr_to_hdr(stbi_uc *data, int x, int y, int comp)
    float *output;
    if (!data) return NULL;
    output = (float *) stbi__malloc_mad4(x, y, comp, sizeof(float), 0);
-   if (output == NULL) { STBI_FREE(data); return stbi__errpf("outofmem", "Out of memory"); }
+   if (output == NULL) { stbi__free(data); return stbi__errpf("outofmem", "Out of memory"); }
    // compute number of non-alpha components
    if (comp & 1) n = comp; else n = comp-1;
    for (i=0; i < x*y; ++i) {
@@ -1854,7 +3400,7 @@ static float   *stbi__ldr_to_hdr(stbi_uc *data, int x, int y, int comp)
          output[i*comp + n] = data[i*comp + n]/255.0f;
       }
    }
-   STBI_FREE(data);
+   stbi__free(data);
    return output;
 }
 #endif
@@ -1867,7 +3413,7 @@ static stbi_uc *stbi__hdr_to_ldr(float   *data, int x, int y, int comp)
    stbi_uc *output;
    if (!data) return NULL;
    output = (stbi_uc *) stbi__malloc_mad3(x, y, comp, 0);
-   if (output == NULL) { STBI_FREE(data); return stbi__errpuc("outofmem", "Out of memory"); }
+   if (output == NULL) { stbi__free(data); return stbi__errpuc("outofmem", "Out of memory"); }
    // compute number of non-alpha components
    if (comp & 1) n = comp; else n = comp-1;
    for (i=0; i < x*y; ++i) {
@@ -1884,7 +3430,7 @@ static stbi_uc *stbi__hdr_to_ldr(float   *data, int x, int y, int comp)
          output[i*comp + k] = (stbi_uc) stbi__float2int(z);
       }
    }
-   STBI_FREE(data);
+   stbi__free(data);
    return output;
 }
 #endif
@@ -1913,7 +3459,7 @@ static stbi_uc *stbi__hdr_to_ldr(float   *data, int x, int y, int comp)
 #ifndef STBI_NO_JPEG
 
 // huffman decoding acceleration
-#define FAST_BITS   9  // larger handles more cases; smaller stomps less cache
+#define FAST_BITS   11 // larger handles more cases; smaller stomps less cache
 
 typedef struct
 {
@@ -1949,14 +3495,17 @@ typedef struct
       int dc_pred;
 
       int x,y,w2,h2;
+      int idct_size; // side of the blocks in data: 8, or less when scaled down
       stbi_uc *data;
       void *raw_data, *raw_coeff;
       stbi_uc *linebuf;
       short   *coeff;   // progressive only
       int      coeff_w, coeff_h; // number of 8x8 coefficient blocks
+      int      coeff_n; // coefficients kept per block: 64, or just DC for blocks transformed to one pixel
+      stbi__uint64 bands; // zigzag positions whose first scan is decoded, for previews
    } img_comp[4];
 
-   stbi__uint32   code_buffer; // jpeg entropy-coded buffer
+   stbi__uint64   code_buffer; // jpeg entropy-coded buffer, MSB first
    int            code_bits;   // number of valid bits
    unsigned char  marker;      // marker seen while filling entropy buffer
    int            nomore;      // flag if we saw a marker so must stop
@@ -1973,11 +3522,23 @@ typedef struct
 
    int scan_n, order[4];
    int restart_interval, todo;
+   int scale_shift; // the image is decoded at 1/(1 << scale_shift) of its size
+
+// decoding a region: the MCUs transformed for it and the output columns
+// converted for it (the whole image otherwise), see stbi__jpeg_setup_roi
+   int roi;
+   int roi_mcu_x0, roi_mcu_y0, roi_mcu_x1, roi_mcu_y1;
+   int roi_x0, roi_x1;
 
 // kernels
    void (*idct_block_kernel)(stbi_uc *out, int out_stride, short data[64]);
+   // two blocks in one pass, NULL if there is no such kernel
+   void (*idct_block2_kernel)(stbi_uc *out0, int out0_stride, short data0[64], stbi_uc *out1, int out1_stride, short data1[64]);
    void (*YCbCr_to_RGB_kernel)(stbi_uc *out, const stbi_uc *y, const stbi_uc *pcb, const stbi_uc *pcr, int count, int step);
    stbi_uc *(*resample_row_hv_2_kernel)(stbi_uc *out, stbi_uc *in_near, stbi_uc *in_far, int w, int hs);
+   // chroma upsampling and YCbCr to RGBA in one pass, NULL if there is no such kernel
+   void (*YCbCr_upsample_kernel)(stbi_uc *out, stbi_uc const *y, stbi_uc const *cb_near, stbi_uc const *cb_far,
+                                 stbi_uc const *cr_near, stbi_uc const *cr_far, int w, int count, int hs, int vs);
 } stbi__jpeg;
 
 static int stbi__build_huffman(stbi__huffman *h, int *count)
@@ -2051,25 +3612,39 @@ static void stbi__build_fast_ac(stbi__int16 *fast_ac, stbi__huffman *h)
 
 static void stbi__grow_buffer_unsafe(stbi__jpeg *j)
 {
+   stbi__context *s = j->s;
    do {
-      unsigned int b = j->nomore ? 0 : stbi__get8(j->s);
+      unsigned int b;
+      if (!j->nomore && s->img_buffer_end - s->img_buffer >= 8) {
+         // bulk refill with as many whole bytes as fit, as long as none of
+         // the next eight is 0xff, i.e. there is no marker or stuffing
+         stbi_uc *p = s->img_buffer;
+         stbi__uint64 v = ((stbi__uint64) p[0] << 56) | ((stbi__uint64) p[1] << 48) | ((stbi__uint64) p[2] << 40) | ((stbi__uint64) p[3] << 32) |
+                          ((stbi__uint64) p[4] << 24) | ((stbi__uint64) p[5] << 16) | ((stbi__uint64) p[6] <<  8) |  (stbi__uint64) p[7];
+         stbi__uint64 t = ~v; // has a zero byte where v has 0xff
+         if (((t - 0x0101010101010101ull) & ~t & 0x8080808080808080ull) == 0) {
+            int n = (64 - j->code_bits) >> 3;
+            j->code_buffer |= (v >> (64 - 8*n)) << (64 - j->code_bits - 8*n);
+            j->code_bits += 8*n;
+            s->img_buffer += n;
+            continue;
+         }
+      }
+      b = j->nomore ? 0 : stbi__get8(s);
       if (b == 0xff) {
-         int c = stbi__get8(j->s);
-         while (c == 0xff) c = stbi__get8(j->s); // consume fill bytes
+         int c = stbi__get8(s);
+         while (c == 0xff) c = stbi__get8(s); // consume fill bytes
          if (c != 0) {
             j->marker = (unsigned char) c;
             j->nomore = 1;
             return;
          }
       }
-      j->code_buffer |= b << (24 - j->code_bits);
+      j->code_buffer |= (stbi__uint64) b << (56 - j->code_bits);
       j->code_bits += 8;
-   } while (j->code_bits <= 24);
+   } while (j->code_bits <= 56);
 }
 
-// (1 << n) - 1
-static const stbi__uint32 stbi__bmask[17]={0,1,3,7,15,31,63,127,255,511,1023,2047,4095,8191,16383,32767,65535};
-
 // decode a jpeg huffman value from the bitstream
 stbi_inline static int stbi__jpeg_huff_decode(stbi__jpeg *j, stbi__huffman *h)
 {
@@ -2080,7 +3655,7 @@ stbi_inline static int stbi__jpeg_huff_decode(stbi__jpeg *j, stbi__huffman *h)
 
    // look at the top FAST_BITS and determine what symbol ID it is,
    // if the code is <= FAST_BITS
-   c = (j->code_buffer >> (32 - FAST_BITS)) & ((1 << FAST_BITS)-1);
+   c = (int) (j->code_buffer >> (64 - FAST_BITS));
    k = h->fast[c];
    if (k < 255) {
       int s = h->size[k];
@@ -2097,7 +3672,7 @@ stbi_inline static int stbi__jpeg_huff_decode(stbi__jpeg *j, stbi__huffman *h)
    // end; in other words, regardless of the number of bits, it
    // wants to be compared against something shifted to have 16;
    // that way we don't need to shift inside the loop.
-   temp = j->code_buffer >> 16;
+   temp = (unsigned int) (j->code_buffer >> 48);
    for (k=FAST_BITS+1 ; ; ++k)
       if (temp < h->maxcode[k])
          break;
@@ -2111,8 +3686,8 @@ stbi_inline static int stbi__jpeg_huff_decode(stbi__jpeg *j, stbi__huffman *h)
       return -1;
 
    // convert the huffman code to the symbol id
-   c = ((j->code_buffer >> (32 - k)) & stbi__bmask[k]) + h->delta[k];
-   STBI_ASSERT((((j->code_buffer) >> (32 - h->size[c])) & stbi__bmask[h->size[c]]) == h->code[c]);
+   c = (int) (j->code_buffer >> (64 - k)) + h->delta[k];
+   STBI_ASSERT((j->code_buffer >> (64 - h->size[c])) == h->code[c]);
 
    // convert the id to a symbol
    j->code_bits -= k;
@@ -2125,40 +3700,39 @@ static const int stbi__jbias[16] = {0,-1,-3,-7,-15,-31,-63,-127,-255,-511,-1023,
 
 // combined JPEG 'receive' and JPEG 'extend', since baseline
 // always extends everything it receives.
+// n is 1..15
 stbi_inline static int stbi__extend_receive(stbi__jpeg *j, int n)
 {
    unsigned int k;
    int sgn;
    if (j->code_bits < n) stbi__grow_buffer_unsafe(j);
 
-   sgn = j->code_buffer >> 31; // sign bit always in MSB; 0 if MSB clear (positive), 1 if MSB set (negative)
-   k = stbi_lrot(j->code_buffer, n);
-   j->code_buffer = k & ~stbi__bmask[n];
-   k &= stbi__bmask[n];
+   sgn = (int) (j->code_buffer >> 63); // sign bit always in MSB; 0 if MSB clear (positive), 1 if MSB set (negative)
+   k = (unsigned int) (j->code_buffer >> (64 - n));
+   j->code_buffer <<= n;
    j->code_bits -= n;
    return k + (stbi__jbias[n] & (sgn - 1));
 }
 
-// get some unsigned bits
+// get some unsigned bits, n is 1..15
 stbi_inline static int stbi__jpeg_get_bits(stbi__jpeg *j, int n)
 {
    unsigned int k;
    if (j->code_bits < n) stbi__grow_buffer_unsafe(j);
-   k = stbi_lrot(j->code_buffer, n);
-   j->code_buffer = k & ~stbi__bmask[n];
-   k &= stbi__bmask[n];
+   k = (unsigned int) (j->code_buffer >> (64 - n));
+   j->code_buffer <<= n;
    j->code_bits -= n;
    return k;
 }
 
 stbi_inline static int stbi__jpeg_get_bit(stbi__jpeg *j)
 {
-   unsigned int k;
+   int k;
    if (j->code_bits < 1) stbi__grow_buffer_unsafe(j);
-   k = j->code_buffer;
+   k = (int) (j->code_buffer >> 63);
    j->code_buffer <<= 1;
    --j->code_bits;
-   return k & 0x80000000;
+   return k;
 }
 
 // given a value that's at position X in the zigzag stream,
@@ -2202,7 +3776,7 @@ static int stbi__jpeg_decode_block(stbi__jpeg *j, short data[64], stbi__huffman
       unsigned int zig;
       int c,r,s;
       if (j->code_bits < 16) stbi__grow_buffer_unsafe(j);
-      c = (j->code_buffer >> (32 - FAST_BITS)) & ((1 << FAST_BITS)-1);
+      c = (int) (j->code_buffer >> (64 - FAST_BITS));
       r = fac[c];
       if (r) { // fast-AC path
          k += (r >> 4) & 15; // run
@@ -2241,7 +3815,7 @@ static int stbi__jpeg_decode_block_prog_dc(stbi__jpeg *j, short data[64], stbi__
 
    if (j->succ_high == 0) {
       // first scan for DC coefficient, must be first
-      memset(data,0,64*sizeof(data[0])); // 0 all the ac values now
+      memset(data,0,j->img_comp[b].coeff_n*sizeof(data[0])); // 0 all the ac values now
       t = stbi__jpeg_huff_decode(j, hdc);
       if (t < 0 || t > 15) return stbi__err("can't merge dc and ac", "Corrupt JPEG");
       diff = t ? stbi__extend_receive(j, t) : 0;
@@ -2277,7 +3851,7 @@ static int stbi__jpeg_decode_block_prog_ac(stbi__jpeg *j, short data[64], stbi__
          unsigned int zig;
          int c,r,s;
          if (j->code_bits < 16) stbi__grow_buffer_unsafe(j);
-         c = (j->code_buffer >> (32 - FAST_BITS)) & ((1 << FAST_BITS)-1);
+         c = (int) (j->code_buffer >> (64 - FAST_BITS));
          r = fac[c];
          if (r) { // fast-AC path
             k += (r >> 4) & 15; // run
@@ -2489,6 +4063,118 @@ static void stbi__idct_block(stbi_uc *out, int out_stride, short data[64])
    }
 }
 
+// IDCT of a block scaled down to size x size pixels (4, 2 or 1), each the
+// average of the full-size pixels it covers. Averaging 8/size outputs of
+// the 8-point IDCT turns frequency k into cos(k*pi/16) (for 4, 2 points:
+// sin(k*pi/4) / (4*sin(k*pi/16))) times its size-point basis function, and
+// k above size/2 aliases onto 8-k (for 2 points: onto 1), with the sign of
+// the alias. So the 8 coefficients of every row and column are folded
+// into size of them, as in libjpeg's jidctred.c, and the size-point IDCT
+// of those is the box filtered block.
+// folds 8 coefficients x, xs apart, into size of them at y, ys apart,
+// scaled by 4096 >> shift
+#define STBI__IDCT_FOLD(y,ys,x,xs,size,shift)                                   \
+   if (size == 4) {                                                            \
+      y[0]    = (x[0]*4096 + ((1<<shift)>>1)) >> shift;                         \
+      y[ys]   = (x[xs]*stbi__f2f(0.98078528f) - x[7*xs]*stbi__f2f(0.19509032f) + ((1<<shift)>>1)) >> shift; \
+      y[2*ys] = (x[2*xs]*stbi__f2f(0.92387953f) - x[6*xs]*stbi__f2f(0.38268343f) + ((1<<shift)>>1)) >> shift; \
+      y[3*ys] = (x[3*xs]*stbi__f2f(0.83146961f) - x[5*xs]*stbi__f2f(0.55557023f) + ((1<<shift)>>1)) >> shift; \
+   } else {                                                                    \
+      y[0]    = (x[0]*4096 + ((1<<shift)>>1)) >> shift;                         \
+      y[ys]   = (x[xs]*stbi__f2f(0.90612745f) - x[3*xs]*stbi__f2f(0.31818510f)  \
+               + x[5*xs]*stbi__f2f(0.21260752f) - x[7*xs]*stbi__f2f(0.18023996f) + ((1<<shift)>>1)) >> shift; \
+   }
+
+// folds the columns, then the rows of a block into size x size
+// coefficients with 2 extra bits of precision; the weights of a row add
+// up to at most 1.62, so no sum gets past 32768 * 1.62 * 4 * 4096 * 1.62
+static void stbi__idct_fold(int *f, short data[64], int size)
+{
+   // frequency 4 (and 2, 6 for 2 points) averages out entirely, so its
+   // rows and columns are skipped
+   static const int columns4[] = { 0,1,2,3,5,6,7 }, columns2[] = { 0,1,3,5,7 };
+   const int *columns = size == 4 ? columns4 : columns2;
+   int columns_n = size == 4 ? 7 : 5;
+   int t[4*8];
+   int i,j;
+   for (j=0; j < columns_n; ++j) {
+      short *d = data + columns[j];
+      int *u = t + columns[j];
+      if ((d[8]|d[24]|d[40]|d[56]) == 0 && (size == 2 || (d[16]|d[48]) == 0)) {
+         u[0] = d[0] * 4;
+         for (i=1; i < size; ++i) u[i*8] = 0;
+      } else {
+         STBI__IDCT_FOLD(u, 8, d, 8, size, 10)
+      }
+   }
+   for (j=0; j < size; ++j) {
+      int *u = t + j*8, *g = f + j*size;
+      STBI__IDCT_FOLD(g, 1, u, 1, size, 12)
+   }
+}
+
+#define STBI__IDCT_C0  stbi__f2f(0.3535534f) // cos(0)/sqrt(2)/2
+#define STBI__IDCT_C1  stbi__f2f(0.4619398f) // cos(pi/8)/2
+#define STBI__IDCT_C3  stbi__f2f(0.1913417f) // cos(3*pi/8)/2
+
+#define STBI__IDCT4_1D(s0,s1,s2,s3)                 \
+   int e0,e1,o0,o1;                                 \
+   e0 = (s0+s2) * STBI__IDCT_C0;                    \
+   e1 = (s0-s2) * STBI__IDCT_C0;                    \
+   o0 = s1*STBI__IDCT_C1 + s3*STBI__IDCT_C3;        \
+   o1 = s1*STBI__IDCT_C3 - s3*STBI__IDCT_C1;
+
+static void stbi__idct_scaled(stbi_uc *out, int out_stride, short data[64], int size)
+{
+   int i,val[16],*v=val;
+   int f[16],*d=f;
+
+   if (size == 1) {
+      out[0] = stbi__clamp(((data[0] + 4) >> 3) + 128);
+      return;
+   }
+
+   stbi__idct_fold(f, data, size);
+   if (size == 2) {
+      int a = (d[0]+d[2]) * STBI__IDCT_C0, b = (d[1]+d[3]) * STBI__IDCT_C0;
+      int c = (d[0]-d[2]) * STBI__IDCT_C0, e = (d[1]-d[3]) * STBI__IDCT_C0;
+      // all four coefficients of a 2-point IDCT are C0; scaled as below
+      a = (a + 2048) >> 12; b = (b + 2048) >> 12;
+      c = (c + 2048) >> 12; e = (e + 2048) >> 12;
+      out[0]            = stbi__clamp(((a+b) * STBI__IDCT_C0 + 8192 + (128<<14)) >> 14);
+      out[1]            = stbi__clamp(((a-b) * STBI__IDCT_C0 + 8192 + (128<<14)) >> 14);
+      out[out_stride]   = stbi__clamp(((c+e) * STBI__IDCT_C0 + 8192 + (128<<14)) >> 14);
+      out[out_stride+1] = stbi__clamp(((c-e) * STBI__IDCT_C0 + 8192 + (128<<14)) >> 14);
+      return;
+   }
+
+   // columns of the folded coefficients, which already have the 2 extra
+   // bits: no sum gets past 4 * 32767 * 1.39 * (2*C0 + C1 + C3), nor does
+   // any row sum after the >> 12
+   for (i=0; i < 4; ++i,++d,++v) {
+      if (d[4]==0 && d[8]==0 && d[12]==0) {
+         v[0] = v[4] = v[8] = v[12] = (d[0] * STBI__IDCT_C0 + 2048) >> 12;
+      } else {
+         STBI__IDCT4_1D(d[0],d[4],d[8],d[12])
+         e0 += 2048; e1 += 2048;
+         v[ 0] = (e0+o0) >> 12;
+         v[12] = (e0-o0) >> 12;
+         v[ 4] = (e1+o1) >> 12;
+         v[ 8] = (e1-o1) >> 12;
+      }
+   }
+
+   for (i=0, v=val; i < 4; ++i,v+=4,out+=out_stride) {
+      STBI__IDCT4_1D(v[0],v[1],v[2],v[3])
+      e0 += 8192 + (128<<14);
+      e1 += 8192 + (128<<14);
+      out[0] = stbi__clamp((e0+o0) >> 14);
+      out[3] = stbi__clamp((e0-o0) >> 14);
+      out[1] = stbi__clamp((e1+o1) >> 14);
+      out[2] = stbi__clamp((e1-o1) >> 14);
+   }
+}
+
 #ifdef STBI_SSE2
 // sse2 integer IDCT. not the fastest possible implementation but it
 // produces bit-identical results to the generic C version so it's
@@ -2670,51 +4356,232 @@ static void stbi__idct_simd(stbi_uc *out, int out_stride, short data[64])
 
 #endif // STBI_SSE2
 
-#ifdef STBI_NEON
-
-// NEON integer IDCT. should produce bit-identical
-// results to the generic C version.
-static void stbi__idct_simd(stbi_uc *out, int out_stride, short data[64])
+#ifdef STBI_AVX2
+// AVX2 version of stbi__idct_simd for two blocks at once, one in each 128-bit
+// lane. Every instruction works within lanes, so this is the SSE2 code
+// step for step and bit-identical to stbi__idct_block as well.
+STBI__AVX2_TARGET
+static void stbi__idct_avx2(stbi_uc *out0, int out0_stride, short data0[64], stbi_uc *out1, int out1_stride, short data1[64])
 {
-   int16x8_t row0, row1, row2, row3, row4, row5, row6, row7;
-
-   int16x4_t rot0_0 = vdup_n_s16(stbi__f2f(0.5411961f));
-   int16x4_t rot0_1 = vdup_n_s16(stbi__f2f(-1.847759065f));
-   int16x4_t rot0_2 = vdup_n_s16(stbi__f2f( 0.765366865f));
-   int16x4_t rot1_0 = vdup_n_s16(stbi__f2f( 1.175875602f));
-   int16x4_t rot1_1 = vdup_n_s16(stbi__f2f(-0.899976223f));
-   int16x4_t rot1_2 = vdup_n_s16(stbi__f2f(-2.562915447f));
-   int16x4_t rot2_0 = vdup_n_s16(stbi__f2f(-1.961570560f));
-   int16x4_t rot2_1 = vdup_n_s16(stbi__f2f(-0.390180644f));
-   int16x4_t rot3_0 = vdup_n_s16(stbi__f2f( 0.298631336f));
-   int16x4_t rot3_1 = vdup_n_s16(stbi__f2f( 2.053119869f));
-   int16x4_t rot3_2 = vdup_n_s16(stbi__f2f( 3.072711026f));
-   int16x4_t rot3_3 = vdup_n_s16(stbi__f2f( 1.501321110f));
+   __m256i row0, row1, row2, row3, row4, row5, row6, row7;
+   __m256i tmp;
 
-#define dct_long_mul(out, inq, coeff) \
-   int32x4_t out##_l = vmull_s16(vget_low_s16(inq), coeff); \
-   int32x4_t out##_h = vmull_s16(vget_high_s16(inq), coeff)
+   #define dct_const(x,y)  _mm256_setr_epi16((x),(y),(x),(y),(x),(y),(x),(y),(x),(y),(x),(y),(x),(y),(x),(y))
 
-#define dct_long_mac(out, acc, inq, coeff) \
-   int32x4_t out##_l = vmlal_s16(acc##_l, vget_low_s16(inq), coeff); \
-   int32x4_t out##_h = vmlal_s16(acc##_h, vget_high_s16(inq), coeff)
+   #define dct_rot(out0,out1, x,y,c0,c1) \
+      __m256i c0##lo = _mm256_unpacklo_epi16((x),(y)); \
+      __m256i c0##hi = _mm256_unpackhi_epi16((x),(y)); \
+      __m256i out0##_l = _mm256_madd_epi16(c0##lo, c0); \
+      __m256i out0##_h = _mm256_madd_epi16(c0##hi, c0); \
+      __m256i out1##_l = _mm256_madd_epi16(c0##lo, c1); \
+      __m256i out1##_h = _mm256_madd_epi16(c0##hi, c1)
 
-#define dct_widen(out, inq) \
-   int32x4_t out##_l = vshll_n_s16(vget_low_s16(inq), 12); \
-   int32x4_t out##_h = vshll_n_s16(vget_high_s16(inq), 12)
+   #define dct_widen(out, in) \
+      __m256i out##_l = _mm256_srai_epi32(_mm256_unpacklo_epi16(_mm256_setzero_si256(), (in)), 4); \
+      __m256i out##_h = _mm256_srai_epi32(_mm256_unpackhi_epi16(_mm256_setzero_si256(), (in)), 4)
 
-// wide add
-#define dct_wadd(out, a, b) \
-   int32x4_t out##_l = vaddq_s32(a##_l, b##_l); \
-   int32x4_t out##_h = vaddq_s32(a##_h, b##_h)
+   #define dct_wadd(out, a, b) \
+      __m256i out##_l = _mm256_add_epi32(a##_l, b##_l); \
+      __m256i out##_h = _mm256_add_epi32(a##_h, b##_h)
 
-// wide sub
-#define dct_wsub(out, a, b) \
-   int32x4_t out##_l = vsubq_s32(a##_l, b##_l); \
-   int32x4_t out##_h = vsubq_s32(a##_h, b##_h)
+   #define dct_wsub(out, a, b) \
+      __m256i out##_l = _mm256_sub_epi32(a##_l, b##_l); \
+      __m256i out##_h = _mm256_sub_epi32(a##_h, b##_h)
 
-// butterfly a/b, then shift using "shiftop" by "s" and pack
-#define dct_bfly32o(out0,out1, a,b,shiftop,s) \
+   #define dct_bfly32o(out0, out1, a,b,bias,s) \
+      { \
+         __m256i abiased_l = _mm256_add_epi32(a##_l, bias); \
+         __m256i abiased_h = _mm256_add_epi32(a##_h, bias); \
+         dct_wadd(sum, abiased, b); \
+         dct_wsub(dif, abiased, b); \
+         out0 = _mm256_packs_epi32(_mm256_srai_epi32(sum_l, s), _mm256_srai_epi32(sum_h, s)); \
+         out1 = _mm256_packs_epi32(_mm256_srai_epi32(dif_l, s), _mm256_srai_epi32(dif_h, s)); \
+      }
+
+   #define dct_interleave8(a, b) \
+      tmp = a; \
+      a = _mm256_unpacklo_epi8(a, b); \
+      b = _mm256_unpackhi_epi8(tmp, b)
+
+   #define dct_interleave16(a, b) \
+      tmp = a; \
+      a = _mm256_unpacklo_epi16(a, b); \
+      b = _mm256_unpackhi_epi16(tmp, b)
+
+   #define dct_pass(bias,shift) \
+      { \
+         /* even part */ \
+         dct_rot(t2e,t3e, row2,row6, rot0_0,rot0_1); \
+         __m256i sum04 = _mm256_add_epi16(row0, row4); \
+         __m256i dif04 = _mm256_sub_epi16(row0, row4); \
+         dct_widen(t0e, sum04); \
+         dct_widen(t1e, dif04); \
+         dct_wadd(x0, t0e, t3e); \
+         dct_wsub(x3, t0e, t3e); \
+         dct_wadd(x1, t1e, t2e); \
+         dct_wsub(x2, t1e, t2e); \
+         /* odd part */ \
+         dct_rot(y0o,y2o, row7,row3, rot2_0,rot2_1); \
+         dct_rot(y1o,y3o, row5,row1, rot3_0,rot3_1); \
+         __m256i sum17 = _mm256_add_epi16(row1, row7); \
+         __m256i sum35 = _mm256_add_epi16(row3, row5); \
+         dct_rot(y4o,y5o, sum17,sum35, rot1_0,rot1_1); \
+         dct_wadd(x4, y0o, y4o); \
+         dct_wadd(x5, y1o, y5o); \
+         dct_wadd(x6, y2o, y5o); \
+         dct_wadd(x7, y3o, y4o); \
+         dct_bfly32o(row0,row7, x0,x7,bias,shift); \
+         dct_bfly32o(row1,row6, x1,x6,bias,shift); \
+         dct_bfly32o(row2,row5, x2,x5,bias,shift); \
+         dct_bfly32o(row3,row4, x3,x4,bias,shift); \
+      }
+
+   // row r of the first block in the low lane, of the second in the high one
+   #define dct_load(r) \
+      _mm256_inserti128_si256(_mm256_castsi128_si256(_mm_loadu_si128((const __m128i *) (data0 + (r)*8))), \
+                              _mm_loadu_si128((const __m128i *) (data1 + (r)*8)), 1)
+
+   // stores the low 8 bytes of a lane, then the high ones, one row each
+   #define dct_store2(lane) \
+      _mm_storel_epi64((__m128i *) out0, (lane)); out0 += out0_stride; \
+      _mm_storel_epi64((__m128i *) out0, _mm_shuffle_epi32((lane), 0x4e)); out0 += out0_stride
+
+   #define dct_store2_1(lane) \
+      _mm_storel_epi64((__m128i *) out1, (lane)); out1 += out1_stride; \
+      _mm_storel_epi64((__m128i *) out1, _mm_shuffle_epi32((lane), 0x4e)); out1 += out1_stride
+
+   __m256i rot0_0 = dct_const(stbi__f2f(0.5411961f), stbi__f2f(0.5411961f) + stbi__f2f(-1.847759065f));
+   __m256i rot0_1 = dct_const(stbi__f2f(0.5411961f) + stbi__f2f( 0.765366865f), stbi__f2f(0.5411961f));
+   __m256i rot1_0 = dct_const(stbi__f2f(1.175875602f) + stbi__f2f(-0.899976223f), stbi__f2f(1.175875602f));
+   __m256i rot1_1 = dct_const(stbi__f2f(1.175875602f), stbi__f2f(1.175875602f) + stbi__f2f(-2.562915447f));
+   __m256i rot2_0 = dct_const(stbi__f2f(-1.961570560f) + stbi__f2f( 0.298631336f), stbi__f2f(-1.961570560f));
+   __m256i rot2_1 = dct_const(stbi__f2f(-1.961570560f), stbi__f2f(-1.961570560f) + stbi__f2f( 3.072711026f));
+   __m256i rot3_0 = dct_const(stbi__f2f(-0.390180644f) + stbi__f2f( 2.053119869f), stbi__f2f(-0.390180644f));
+   __m256i rot3_1 = dct_const(stbi__f2f(-0.390180644f), stbi__f2f(-0.390180644f) + stbi__f2f( 1.501321110f));
+
+   __m256i bias_0 = _mm256_set1_epi32(512);
+   __m256i bias_1 = _mm256_set1_epi32(65536 + (128<<17));
+
+   row0 = dct_load(0);
+   row1 = dct_load(1);
+   row2 = dct_load(2);
+   row3 = dct_load(3);
+   row4 = dct_load(4);
+   row5 = dct_load(5);
+   row6 = dct_load(6);
+   row7 = dct_load(7);
+
+   // column pass
+   dct_pass(bias_0, 10);
+
+   {
+      // 16bit 8x8 transposes, one per lane
+      dct_interleave16(row0, row4);
+      dct_interleave16(row1, row5);
+      dct_interleave16(row2, row6);
+      dct_interleave16(row3, row7);
+
+      dct_interleave16(row0, row2);
+      dct_interleave16(row1, row3);
+      dct_interleave16(row4, row6);
+      dct_interleave16(row5, row7);
+
+      dct_interleave16(row0, row1);
+      dct_interleave16(row2, row3);
+      dct_interleave16(row4, row5);
+      dct_interleave16(row6, row7);
+   }
+
+   // row pass
+   dct_pass(bias_1, 17);
+
+   {
+      __m256i p0 = _mm256_packus_epi16(row0, row1);
+      __m256i p1 = _mm256_packus_epi16(row2, row3);
+      __m256i p2 = _mm256_packus_epi16(row4, row5);
+      __m256i p3 = _mm256_packus_epi16(row6, row7);
+
+      // 8bit 8x8 transposes, one per lane
+      dct_interleave8(p0, p2);
+      dct_interleave8(p1, p3);
+
+      dct_interleave8(p0, p1);
+      dct_interleave8(p2, p3);
+
+      dct_interleave8(p0, p2);
+      dct_interleave8(p1, p3);
+
+      dct_store2(_mm256_castsi256_si128(p0));
+      dct_store2(_mm256_castsi256_si128(p2));
+      dct_store2(_mm256_castsi256_si128(p1));
+      dct_store2(_mm256_castsi256_si128(p3));
+
+      dct_store2_1(_mm256_extracti128_si256(p0, 1));
+      dct_store2_1(_mm256_extracti128_si256(p2, 1));
+      dct_store2_1(_mm256_extracti128_si256(p1, 1));
+      dct_store2_1(_mm256_extracti128_si256(p3, 1));
+   }
+
+#undef dct_const
+#undef dct_rot
+#undef dct_widen
+#undef dct_wadd
+#undef dct_wsub
+#undef dct_bfly32o
+#undef dct_interleave8
+#undef dct_interleave16
+#undef dct_pass
+#undef dct_load
+#undef dct_store2
+#undef dct_store2_1
+}
+#endif // STBI_AVX2
+
+#ifdef STBI_NEON
+
+// NEON integer IDCT. should produce bit-identical
+// results to the generic C version.
+static void stbi__idct_simd(stbi_uc *out, int out_stride, short data[64])
+{
+   int16x8_t row0, row1, row2, row3, row4, row5, row6, row7;
+
+   int16x4_t rot0_0 = vdup_n_s16(stbi__f2f(0.5411961f));
+   int16x4_t rot0_1 = vdup_n_s16(stbi__f2f(-1.847759065f));
+   int16x4_t rot0_2 = vdup_n_s16(stbi__f2f( 0.765366865f));
+   int16x4_t rot1_0 = vdup_n_s16(stbi__f2f( 1.175875602f));
+   int16x4_t rot1_1 = vdup_n_s16(stbi__f2f(-0.899976223f));
+   int16x4_t rot1_2 = vdup_n_s16(stbi__f2f(-2.562915447f));
+   int16x4_t rot2_0 = vdup_n_s16(stbi__f2f(-1.961570560f));
+   int16x4_t rot2_1 = vdup_n_s16(stbi__f2f(-0.390180644f));
+   int16x4_t rot3_0 = vdup_n_s16(stbi__f2f( 0.298631336f));
+   int16x4_t rot3_1 = vdup_n_s16(stbi__f2f( 2.053119869f));
+   int16x4_t rot3_2 = vdup_n_s16(stbi__f2f( 3.072711026f));
+   int16x4_t rot3_3 = vdup_n_s16(stbi__f2f( 1.501321110f));
+
+#define dct_long_mul(out, inq, coeff) \
+   int32x4_t out##_l = vmull_s16(vget_low_s16(inq), coeff); \
+   int32x4_t out##_h = vmull_s16(vget_high_s16(inq), coeff)
+
+#define dct_long_mac(out, acc, inq, coeff) \
+   int32x4_t out##_l = vmlal_s16(acc##_l, vget_low_s16(inq), coeff); \
+   int32x4_t out##_h = vmlal_s16(acc##_h, vget_high_s16(inq), coeff)
+
+#define dct_widen(out, inq) \
+   int32x4_t out##_l = vshll_n_s16(vget_low_s16(inq), 12); \
+   int32x4_t out##_h = vshll_n_s16(vget_high_s16(inq), 12)
+
+// wide add
+#define dct_wadd(out, a, b) \
+   int32x4_t out##_l = vaddq_s32(a##_l, b##_l); \
+   int32x4_t out##_h = vaddq_s32(a##_h, b##_h)
+
+// wide sub
+#define dct_wsub(out, a, b) \
+   int32x4_t out##_l = vsubq_s32(a##_l, b##_l); \
+   int32x4_t out##_h = vsubq_s32(a##_h, b##_h)
+
+// butterfly a/b, then shift using "shiftop" by "s" and pack
+#define dct_bfly32o(out0,out1, a,b,shiftop,s) \
    { \
       dct_wadd(sum, a, b); \
       dct_wsub(dif, a, b); \
@@ -2912,154 +4779,504 @@ static void stbi__jpeg_reset(stbi__jpeg *j)
    // since we don't even allow 1<<30 pixels
 }
 
-static int stbi__parse_entropy_coded_data(stbi__jpeg *z)
+// blocks go through idct_block2_kernel in pairs when there is one: the first
+// block of a pair waits here until the second one is decoded. Blocks scaled
+// down to less than 8x8 skip the queue
+typedef struct
 {
-   stbi__jpeg_reset(z);
-   if (!z->progressive) {
-      if (z->scan_n == 1) {
-         int i,j;
-         STBI_SIMD_ALIGN(short, data[64]);
-         int n = z->order[0];
-         // non-interleaved data, we just need to process one block at a time,
-         // in trivial scanline order
-         // number of blocks to do just depends on how many actual "pixels" this
-         // component has, independent of interleaved MCU blocking and such
-         int w = (z->img_comp[n].x+7) >> 3;
-         int h = (z->img_comp[n].y+7) >> 3;
-         for (j=0; j < h; ++j) {
-            for (i=0; i < w; ++i) {
-               int ha = z->img_comp[n].ha;
-               if (!stbi__jpeg_decode_block(z, data, z->huff_dc+z->img_comp[n].hd, z->huff_ac+ha, z->fast_ac[ha], n, z->dequant[z->img_comp[n].tq])) return 0;
-               z->idct_block_kernel(z->img_comp[n].data+z->img_comp[n].w2*j*8+i*8, z->img_comp[n].w2, data);
-               // every data block is an MCU, so countdown the restart interval
-               if (--z->todo <= 0) {
-                  if (z->code_bits < 24) stbi__grow_buffer_unsafe(z);
-                  // if it's NOT a restart, then just bail, so we get corrupt data
-                  // rather than no data
-                  if (!STBI__RESTART(z->marker)) return 1;
-                  stbi__jpeg_reset(z);
-               }
-            }
+   stbi_uc *out;
+   int out_stride;
+   short *data;
+} stbi__idct_queue;
+
+static void stbi__idct_push(stbi__jpeg *z, stbi__idct_queue *q, stbi_uc *out, int out_stride, short *data, int size)
+{
+   if (size != 8) {
+      stbi__idct_scaled(out, out_stride, data, size);
+   } else if (!z->idct_block2_kernel) {
+      z->idct_block_kernel(out, out_stride, data);
+   } else if (q->data) {
+      z->idct_block2_kernel(q->out, q->out_stride, q->data, out, out_stride, data);
+      q->data = NULL;
+   } else {
+      q->out = out;
+      q->out_stride = out_stride;
+      q->data = data;
+   }
+}
+
+static void stbi__idct_flush(stbi__jpeg *z, stbi__idct_queue *q)
+{
+   if (q->data) {
+      z->idct_block_kernel(q->out, q->out_stride, q->data);
+      q->data = NULL;
+   }
+}
+
+// whether the MCU at column mcu_x, row mcu_y gets transformed
+static int stbi__jpeg_in_roi(stbi__jpeg *z, int mcu_x, int mcu_y)
+{
+   return mcu_x >= z->roi_mcu_x0 && mcu_x < z->roi_mcu_x1 && mcu_y >= z->roi_mcu_y0 && mcu_y < z->roi_mcu_y1;
+}
+
+// decodes `count` MCUs of a baseline scan, starting from MCU `first` which
+// has to begin a restart interval, with the decoder freshly reset
+static int stbi__jpeg_decode_mcus(stbi__jpeg *z, int first, int count)
+{
+   if (z->scan_n == 1) {
+      int i,j,m;
+      STBI_SIMD_ALIGN(short, data[2][64]);
+      stbi__idct_queue queue = { NULL, 0, NULL };
+      int n = z->order[0];
+      // non-interleaved data, we just need to process one block at a time,
+      // in trivial scanline order
+      // number of blocks to do just depends on how many actual "pixels" this
+      // component has, independent of interleaved MCU blocking and such
+      int w = (z->img_comp[n].x+7) >> 3;
+      int size = z->img_comp[n].idct_size;
+      i = first % w;
+      j = first / w;
+      for (m=0; m < count; ++m) {
+         int ha = z->img_comp[n].ha;
+         short *block = queue.data ? data[1] : data[0];
+         if (!stbi__jpeg_decode_block(z, block, z->huff_dc+z->img_comp[n].hd, z->huff_ac+ha, z->fast_ac[ha], n, z->dequant[z->img_comp[n].tq])) return 0;
+         if (stbi__jpeg_in_roi(z, i / z->img_comp[n].h, j / z->img_comp[n].v))
+            stbi__idct_push(z, &queue, z->img_comp[n].data+z->img_comp[n].w2*j*size+i*size, z->img_comp[n].w2, block, size);
+         if (++i == w) { i = 0; ++j; }
+         // every data block is an MCU, so countdown the restart interval
+         if (--z->todo <= 0) {
+            if (z->code_bits < 24) stbi__grow_buffer_unsafe(z);
+            // if it's NOT a restart, then just bail, so we get corrupt data
+            // rather than no data
+            if (!STBI__RESTART(z->marker)) { stbi__idct_flush(z, &queue); return 1; }
+            stbi__jpeg_reset(z);
          }
-         return 1;
-      } else { // interleaved
-         int i,j,k,x,y;
-         STBI_SIMD_ALIGN(short, data[64]);
-         for (j=0; j < z->img_mcu_y; ++j) {
-            for (i=0; i < z->img_mcu_x; ++i) {
-               // scan an interleaved mcu... process scan_n components in order
-               for (k=0; k < z->scan_n; ++k) {
-                  int n = z->order[k];
-                  // scan out an mcu's worth of this component; that's just determined
-                  // by the basic H and V specified for the component
-                  for (y=0; y < z->img_comp[n].v; ++y) {
-                     for (x=0; x < z->img_comp[n].h; ++x) {
-                        int x2 = (i*z->img_comp[n].h + x)*8;
-                        int y2 = (j*z->img_comp[n].v + y)*8;
-                        int ha = z->img_comp[n].ha;
-                        if (!stbi__jpeg_decode_block(z, data, z->huff_dc+z->img_comp[n].hd, z->huff_ac+ha, z->fast_ac[ha], n, z->dequant[z->img_comp[n].tq])) return 0;
-                        z->idct_block_kernel(z->img_comp[n].data+z->img_comp[n].w2*y2+x2, z->img_comp[n].w2, data);
-                     }
-                  }
-               }
-               // after all interleaved components, that's an interleaved MCU,
-               // so now count down the restart interval
-               if (--z->todo <= 0) {
-                  if (z->code_bits < 24) stbi__grow_buffer_unsafe(z);
-                  if (!STBI__RESTART(z->marker)) return 1;
-                  stbi__jpeg_reset(z);
+      }
+      stbi__idct_flush(z, &queue);
+      return 1;
+   } else { // interleaved
+      int i,j,k,x,y,m;
+      STBI_SIMD_ALIGN(short, data[2][64]);
+      stbi__idct_queue queue = { NULL, 0, NULL };
+      i = first % z->img_mcu_x;
+      j = first / z->img_mcu_x;
+      for (m=0; m < count; ++m) {
+         int in_roi = stbi__jpeg_in_roi(z, i, j);
+         // scan an interleaved mcu... process scan_n components in order
+         for (k=0; k < z->scan_n; ++k) {
+            int n = z->order[k];
+            // scan out an mcu's worth of this component; that's just determined
+            // by the basic H and V specified for the component
+            for (y=0; y < z->img_comp[n].v; ++y) {
+               for (x=0; x < z->img_comp[n].h; ++x) {
+                  int size = z->img_comp[n].idct_size;
+                  int x2 = (i*z->img_comp[n].h + x)*size;
+                  int y2 = (j*z->img_comp[n].v + y)*size;
+                  int ha = z->img_comp[n].ha;
+                  short *block = queue.data ? data[1] : data[0];
+                  if (!stbi__jpeg_decode_block(z, block, z->huff_dc+z->img_comp[n].hd, z->huff_ac+ha, z->fast_ac[ha], n, z->dequant[z->img_comp[n].tq])) return 0;
+                  if (in_roi)
+                     stbi__idct_push(z, &queue, z->img_comp[n].data+z->img_comp[n].w2*y2+x2, z->img_comp[n].w2, block, size);
                }
             }
          }
+         if (++i == z->img_mcu_x) { i = 0; ++j; }
+         // after all interleaved components, that's an interleaved MCU,
+         // so now count down the restart interval
+         if (--z->todo <= 0) {
+            if (z->code_bits < 24) stbi__grow_buffer_unsafe(z);
+            if (!STBI__RESTART(z->marker)) { stbi__idct_flush(z, &queue); return 1; }
+            stbi__jpeg_reset(z);
+         }
+      }
+      stbi__idct_flush(z, &queue);
+      return 1;
+   }
+}
+
+static int stbi__jpeg_scan_mcus(stbi__jpeg *z)
+{
+   if (z->scan_n == 1) {
+      int n = z->order[0];
+      return ((z->img_comp[n].x+7) >> 3) * ((z->img_comp[n].y+7) >> 3);
+   }
+   return z->img_mcu_x * z->img_mcu_y;
+}
+
+// how many of them there are up to the end of the last MCU row transformed
+static int stbi__jpeg_scan_roi_mcus(stbi__jpeg *z)
+{
+   if (z->scan_n == 1) {
+      int n = z->order[0];
+      int h = (z->img_comp[n].y+7) >> 3, rows = z->roi_mcu_y1 * z->img_comp[n].v;
+      return ((z->img_comp[n].x+7) >> 3) * (rows < h ? rows : h);
+   }
+   return z->img_mcu_x * z->roi_mcu_y1;
+}
+
+// whether any of the `count` MCUs of the scan from `first` on gets
+// transformed; those spanning more than a row are taken to
+static int stbi__jpeg_scan_in_roi(stbi__jpeg *z, int first, int count)
+{
+   int w = z->img_mcu_x, h = 1, v = 1, last = first + count - 1;
+   if (z->scan_n == 1) {
+      int n = z->order[0];
+      w = (z->img_comp[n].x+7) >> 3;
+      h = z->img_comp[n].h;
+      v = z->img_comp[n].v;
+   }
+   if (last / w / v < z->roi_mcu_y0 || first / w / v >= z->roi_mcu_y1) return 0;
+   if (first / w != last / w) return 1;
+   return last % w / h >= z->roi_mcu_x0 && first % w / h < z->roi_mcu_x1;
+}
+
+// Restart intervals of a baseline scan are independent, so with a parallel_for
+// they are decoded by separate tasks, each from its own copy of the decoder
+// reading a memory context over the scan data. Decoding a region, the
+// intervals outside it are skipped, and the tasks run one after the other
+// without a parallel_for.
+#define STBI__JPEG_MCUS_PER_TASK  1024
+
+typedef struct
+{
+   stbi__jpeg *z;
+   stbi_uc *data;
+   int data_len;
+   int *starts; // of every restart interval in data
+   int intervals_num, intervals_per_task;
+   int failed;
+   const char *failure_reason;
+} stbi__jpeg_parallel_scan;
+
+static void stbi__jpeg_decode_task(void *task_data, int task)
+{
+   stbi__jpeg_parallel_scan *scan = (stbi__jpeg_parallel_scan *) task_data;
+   int ri = scan->z->restart_interval;
+   int first_interval = task * scan->intervals_per_task;
+   int last_interval = first_interval + scan->intervals_per_task;
+   int total = stbi__jpeg_scan_mcus(scan->z);
+   int k = first_interval, end;
+   stbi__context s;
+   stbi__jpeg *z = (stbi__jpeg *) stbi__malloc(sizeof(stbi__jpeg));
+   if (!z) {
+      scan->failed = 1;
+      scan->failure_reason = "outofmem";
+      return;
+   }
+   memcpy(z, scan->z, sizeof(stbi__jpeg));
+   z->s = &s;
+   if (last_interval > scan->intervals_num) last_interval = scan->intervals_num;
+   while (k < last_interval) {
+      // each run of intervals in the region in one go
+      if (!stbi__jpeg_scan_in_roi(z, k * ri, ri < total - k*ri ? ri : total - k*ri)) { ++k; continue; }
+      for (end = k+1; end < last_interval && stbi__jpeg_scan_in_roi(z, end * ri, ri < total - end*ri ? ri : total - end*ri); ++end)
+         ;
+      stbi__start_mem(&s, scan->data + scan->starts[k], scan->data_len - scan->starts[k]);
+      stbi__jpeg_reset(z);
+      if (!stbi__jpeg_decode_mcus(z, k * ri, (end * ri < total ? end * ri : total) - k * ri)) {
+         scan->failed = 1;
+         scan->failure_reason = stbi_failure_reason(); // of this thread
+         break;
+      }
+      k = end;
+   }
+   stbi__free(z);
+}
+
+static int stbi__jpeg_decode_scan_parallel(stbi__jpeg *z)
+{
+   stbi__jpeg_parallel_scan scan;
+   stbi__context *s = z->s;
+   int total = stbi__jpeg_scan_mcus(z);
+   int len = 0, found = 0, result = 1;
+   stbi_uc *data, marker = STBI__MARKER_none;
+
+   scan.z = z;
+   scan.intervals_num = (total + z->restart_interval - 1) / z->restart_interval;
+   scan.intervals_per_task = z->restart_interval < STBI__JPEG_MCUS_PER_TASK ? STBI__JPEG_MCUS_PER_TASK / z->restart_interval : 1;
+   scan.failed = 0;
+   scan.failure_reason = NULL;
+   scan.starts = (int *) stbi__malloc_mad2(scan.intervals_num, sizeof(int), 0);
+   if (!scan.starts) return stbi__err("outofmem", "Out of memory");
+
+   // Find the restart markers up to the marker that ends the scan. Memory is
+   // searched in place, callback streams are read into a buffer first.
+   if (!s->read_from_callbacks) {
+      stbi_uc *p = s->img_buffer, *end = s->img_buffer_end;
+      data = p;
+      while ((p = (stbi_uc *) memchr(p, 0xff, end - p)) != NULL && p + 1 < end) {
+         if (p[1] == 0x00 || p[1] == 0xff) { p += 1 + (p[1] == 0x00); continue; }
+         if (!STBI__RESTART(p[1])) { marker = p[1]; break; }
+         if (++found < scan.intervals_num) scan.starts[found] = (int) (p + 2 - data);
+         p += 2;
+      }
+      if (marker != STBI__MARKER_none) {
+         len = (int) (p - data);
+         s->img_buffer = p + 2;
+      } else {
+         len = (int) (end - data);
+         s->img_buffer = end;
+      }
+   } else {
+      int capacity = 1 << 16;
+      data = (stbi_uc *) stbi__malloc(capacity);
+      while (data && !stbi__at_eof(s)) {
+         stbi_uc c = stbi__get8(s);
+         if (len + 2 > capacity) {
+            stbi_uc *grown = (stbi_uc *) stbi__realloc(data, capacity * 2);
+            if (!grown) { stbi__free(data); data = NULL; break; }
+            data = grown;
+            capacity *= 2;
+         }
+         if (c == 0xff) {
+            stbi_uc next = stbi__get8(s);
+            while (next == 0xff) next = stbi__get8(s);
+            if (next != 0x00 && !STBI__RESTART(next)) { marker = next; break; }
+            data[len++] = c;
+            data[len++] = next;
+            if (next != 0x00 && ++found < scan.intervals_num) scan.starts[found] = len;
+         } else {
+            data[len++] = c;
+         }
+      }
+      if (!data) { stbi__free(scan.starts); return stbi__err("outofmem", "Out of memory"); }
+   }
+   scan.data = data;
+   scan.data_len = len;
+   scan.starts[0] = 0;
+
+   if (found + 1 == scan.intervals_num) {
+      int tasks_num = (scan.intervals_num + scan.intervals_per_task - 1) / scan.intervals_per_task;
+      if (stbi__parallel_for) {
+         stbi__parallel_for(stbi__parallel_for_user, tasks_num, stbi__jpeg_decode_task, &scan);
+      } else {
+         int task;
+         for (task=0; task < tasks_num && !scan.failed; ++task)
+            stbi__jpeg_decode_task(&scan, task);
+      }
+      if (scan.failed) {
+         #ifndef STBI_NO_FAILURE_STRINGS
+         stbi__set_failure_reason(scan.failure_reason);
+         #endif
+         result = 0;
+      }
+   } else {
+      // not the restart markers the image size asks for: decode it the
+      // serial way, which copes with corrupt data as well as it can
+      stbi__context mem;
+      stbi__start_mem(&mem, data, len);
+      z->s = &mem;
+      result = stbi__jpeg_decode_mcus(z, 0, total);
+      z->s = s;
+   }
+
+   z->marker = marker;
+   if (s->read_from_callbacks) stbi__free(data);
+   stbi__free(scan.starts);
+   return result;
+}
+
+// moves past the entropy-coded data of a scan to the marker after it
+static int stbi__jpeg_skip_scan(stbi__jpeg *z)
+{
+   stbi__context *s = z->s;
+   if (!s->read_from_callbacks) {
+      stbi_uc *p = s->img_buffer, *end = s->img_buffer_end;
+      while ((p = (stbi_uc *) memchr(p, 0xff, end - p)) != NULL && p + 1 < end) {
+         if (p[1] == 0x00 || p[1] == 0xff || STBI__RESTART(p[1])) { p += 1 + (p[1] != 0xff); continue; }
+         z->marker = p[1];
+         s->img_buffer = p + 2;
          return 1;
       }
+      s->img_buffer = end;
    } else {
-      if (z->scan_n == 1) {
-         int i,j;
-         int n = z->order[0];
-         // non-interleaved data, we just need to process one block at a time,
-         // in trivial scanline order
-         // number of blocks to do just depends on how many actual "pixels" this
-         // component has, independent of interleaved MCU blocking and such
-         int w = (z->img_comp[n].x+7) >> 3;
-         int h = (z->img_comp[n].y+7) >> 3;
-         for (j=0; j < h; ++j) {
-            for (i=0; i < w; ++i) {
-               short *data = z->img_comp[n].coeff + 64 * (i + j * z->img_comp[n].coeff_w);
-               if (z->spec_start == 0) {
+      while (!stbi__at_eof(s)) {
+         if (stbi__get8(s) == 0xff) {
+            stbi_uc c = stbi__get8(s);
+            while (c == 0xff) c = stbi__get8(s);
+            if (c != 0x00 && !STBI__RESTART(c)) { z->marker = c; return 1; }
+         }
+      }
+   }
+   return 1;
+}
+
+// decodes `count` MCUs of a progressive scan from MCU `first` on, like
+// stbi__jpeg_decode_mcus does those of a baseline scan, into the coefficients
+static int stbi__jpeg_decode_mcus_prog(stbi__jpeg *z, int first, int count)
+{
+   if (z->scan_n == 1) {
+      int i,j,m;
+      int n = z->order[0];
+      // non-interleaved data, we just need to process one block at a time,
+      // in trivial scanline order
+      // number of blocks to do just depends on how many actual "pixels" this
+      // component has, independent of interleaved MCU blocking and such
+      int w = (z->img_comp[n].x+7) >> 3;
+      i = first % w;
+      j = first / w;
+      for (m=0; m < count; ++m) {
+         short *data = z->img_comp[n].coeff + z->img_comp[n].coeff_n * (i + j * z->img_comp[n].coeff_w);
+         if (z->spec_start == 0) {
+            if (!stbi__jpeg_decode_block_prog_dc(z, data, &z->huff_dc[z->img_comp[n].hd], n))
+               return 0;
+         } else {
+            int ha = z->img_comp[n].ha;
+            if (!stbi__jpeg_decode_block_prog_ac(z, data, &z->huff_ac[ha], z->fast_ac[ha]))
+               return 0;
+         }
+         if (++i == w) { i = 0; ++j; }
+         // every data block is an MCU, so countdown the restart interval
+         if (--z->todo <= 0) {
+            if (z->code_bits < 24) stbi__grow_buffer_unsafe(z);
+            if (!STBI__RESTART(z->marker)) return 1;
+            stbi__jpeg_reset(z);
+         }
+      }
+      return 1;
+   } else { // interleaved
+      int i,j,k,x,y,m;
+      i = first % z->img_mcu_x;
+      j = first / z->img_mcu_x;
+      for (m=0; m < count; ++m) {
+         // scan an interleaved mcu... process scan_n components in order
+         for (k=0; k < z->scan_n; ++k) {
+            int n = z->order[k];
+            // scan out an mcu's worth of this component; that's just determined
+            // by the basic H and V specified for the component
+            for (y=0; y < z->img_comp[n].v; ++y) {
+               for (x=0; x < z->img_comp[n].h; ++x) {
+                  int x2 = (i*z->img_comp[n].h + x);
+                  int y2 = (j*z->img_comp[n].v + y);
+                  short *data = z->img_comp[n].coeff + z->img_comp[n].coeff_n * (x2 + y2 * z->img_comp[n].coeff_w);
                   if (!stbi__jpeg_decode_block_prog_dc(z, data, &z->huff_dc[z->img_comp[n].hd], n))
                      return 0;
-               } else {
-                  int ha = z->img_comp[n].ha;
-                  if (!stbi__jpeg_decode_block_prog_ac(z, data, &z->huff_ac[ha], z->fast_ac[ha]))
-                     return 0;
-               }
-               // every data block is an MCU, so countdown the restart interval
-               if (--z->todo <= 0) {
-                  if (z->code_bits < 24) stbi__grow_buffer_unsafe(z);
-                  if (!STBI__RESTART(z->marker)) return 1;
-                  stbi__jpeg_reset(z);
                }
             }
          }
-         return 1;
-      } else { // interleaved
-         int i,j,k,x,y;
-         for (j=0; j < z->img_mcu_y; ++j) {
-            for (i=0; i < z->img_mcu_x; ++i) {
-               // scan an interleaved mcu... process scan_n components in order
-               for (k=0; k < z->scan_n; ++k) {
-                  int n = z->order[k];
-                  // scan out an mcu's worth of this component; that's just determined
-                  // by the basic H and V specified for the component
-                  for (y=0; y < z->img_comp[n].v; ++y) {
-                     for (x=0; x < z->img_comp[n].h; ++x) {
-                        int x2 = (i*z->img_comp[n].h + x);
-                        int y2 = (j*z->img_comp[n].v + y);
-                        short *data = z->img_comp[n].coeff + 64 * (x2 + y2 * z->img_comp[n].coeff_w);
-                        if (!stbi__jpeg_decode_block_prog_dc(z, data, &z->huff_dc[z->img_comp[n].hd], n))
-                           return 0;
-                     }
-                  }
-               }
-               // after all interleaved components, that's an interleaved MCU,
-               // so now count down the restart interval
-               if (--z->todo <= 0) {
-                  if (z->code_bits < 24) stbi__grow_buffer_unsafe(z);
-                  if (!STBI__RESTART(z->marker)) return 1;
-                  stbi__jpeg_reset(z);
-               }
-            }
+         if (++i == z->img_mcu_x) { i = 0; ++j; }
+         // after all interleaved components, that's an interleaved MCU,
+         // so now count down the restart interval
+         if (--z->todo <= 0) {
+            if (z->code_bits < 24) stbi__grow_buffer_unsafe(z);
+            if (!STBI__RESTART(z->marker)) return 1;
+            stbi__jpeg_reset(z);
          }
-         return 1;
       }
+      return 1;
+   }
+}
+
+// how many MCUs of the scan need decoding: those up to the end of the last
+// MCU row a region needs, and none of the AC scans of a component scaled
+// down to one pixel per block. (Skipping only the AC scans of high
+// frequencies for a 2x2 or 4x4 IDCT would not work: a refinement scan
+// reads bits for every coefficient its band made nonzero so far.)
+static int stbi__jpeg_scan_needed(stbi__jpeg *z)
+{
+   if (z->progressive && z->scan_n == 1 && z->spec_start != 0 && z->img_comp[z->order[0]].idct_size == 1)
+      return 0;
+   return stbi__jpeg_scan_roi_mcus(z);
+}
+
+// after the needed MCUs of a scan: the rest of it is only skipped, unless
+// it is a baseline scan of every component, which ends the decode of a
+// region (see stbi__decode_jpeg_image)
+static int stbi__jpeg_skip_unneeded(stbi__jpeg *z, int needed)
+{
+   if (needed < stbi__jpeg_scan_mcus(z) && z->marker == STBI__MARKER_none && (z->progressive || z->scan_n != z->s->img_n))
+      return stbi__jpeg_skip_scan(z);
+   return 1;
+}
+
+static int stbi__parse_entropy_coded_data(stbi__jpeg *z)
+{
+   int needed = stbi__jpeg_scan_needed(z);
+   stbi__jpeg_reset(z);
+   if (!z->progressive) {
+      int total = stbi__jpeg_scan_mcus(z);
+      if ((stbi__parallel_for || z->roi) && z->restart_interval && total > z->restart_interval)
+         return stbi__jpeg_decode_scan_parallel(z);
+      if (!stbi__jpeg_decode_mcus(z, 0, needed)) return 0;
+   } else {
+      if (!stbi__jpeg_decode_mcus_prog(z, 0, needed)) return 0;
    }
+   return stbi__jpeg_skip_unneeded(z, needed);
 }
 
-static void stbi__jpeg_dequantize(short *data, stbi__uint16 *dequant)
+// only the size x size lowest frequencies that a scaled IDCT reads
+// blocks scaled down to one pixel only need their DC coefficient, the
+// others are folded from all 64 (see stbi__idct_scaled)
+static void stbi__jpeg_dequantize(short *data, stbi__uint16 *dequant, int size)
 {
    int i;
-   for (i=0; i < 64; ++i)
-      data[i] *= dequant[i];
+   if (size == 1)
+      data[0] *= dequant[0];
+   else
+      for (i=0; i < 64; ++i)
+         data[i] *= dequant[i];
+}
+
+// dequantizes and transforms `count` rows of blocks of component n of a
+// progressive image from row `first` on, in order. The pixels take the
+// place of the coefficients: a row of blocks comes out at most half as large
+// as its coefficients, so from the second row on it only overwrites rows
+// already transformed; the first row is transformed from a copy. After the
+// last row the memory shrinks to the size of the pixels.
+static int stbi__jpeg_finish_rows(stbi__jpeg *z, int n, int first, int count)
+{
+   int i,j;
+   int w = (z->img_comp[n].x+7) >> 3, rows = (z->img_comp[n].y+7) >> 3;
+   int size = z->img_comp[n].idct_size, coeff_n = z->img_comp[n].coeff_n;
+   size_t row_coeffs = (size_t) z->img_comp[n].coeff_w * coeff_n;
+   stbi__idct_queue queue = { NULL, 0, NULL };
+   if (z->img_comp[n].raw_data == NULL) {
+      z->img_comp[n].raw_data = z->img_comp[n].raw_coeff;
+      z->img_comp[n].data = (stbi_uc *) z->img_comp[n].coeff;
+      z->img_comp[n].raw_coeff = NULL; // coeff stays valid until the last row
+   }
+   for (j=first; j < first + count; ++j) {
+      short *coeff = z->img_comp[n].coeff + row_coeffs * j, *copy = NULL;
+      if (j == 0) {
+         copy = (short *) stbi__malloc_mad2((int) row_coeffs, sizeof(short), 0);
+         if (!copy) return stbi__err("outofmem", "Out of memory");
+         memcpy(copy, coeff, row_coeffs * sizeof(short));
+         coeff = copy;
+      }
+      for (i=0; i < w; ++i) {
+         short *data = coeff + coeff_n * i;
+         if (!stbi__jpeg_in_roi(z, i / z->img_comp[n].h, j / z->img_comp[n].v)) continue;
+         stbi__jpeg_dequantize(data, z->dequant[z->img_comp[n].tq], size);
+         stbi__idct_push(z, &queue, z->img_comp[n].data+z->img_comp[n].w2*j*size+i*size, z->img_comp[n].w2, data, size);
+      }
+      // the next row overwrites this one's coefficients
+      stbi__idct_flush(z, &queue);
+      stbi__free(copy);
+   }
+   if (first + count == rows) {
+      size_t offset = z->img_comp[n].data - (stbi_uc *) z->img_comp[n].raw_data;
+      size_t plane = (size_t) z->img_comp[n].w2 * z->img_comp[n].h2;
+      stbi_uc *shrunk = (stbi_uc *) stbi__realloc(z->img_comp[n].raw_data, plane + 15);
+      z->img_comp[n].coeff = NULL;
+      if (shrunk) {
+         stbi_uc *data = (stbi_uc*) (((size_t) shrunk + 15) & ~15);
+         if (data != shrunk + offset) memmove(data, shrunk + offset, plane);
+         z->img_comp[n].raw_data = shrunk;
+         z->img_comp[n].data = data;
+      }
+   }
+   return 1;
 }
 
-static void stbi__jpeg_finish(stbi__jpeg *z)
+static int stbi__jpeg_finish(stbi__jpeg *z)
 {
    if (z->progressive) {
       // dequantize and idct the data
-      int i,j,n;
-      for (n=0; n < z->s->img_n; ++n) {
-         int w = (z->img_comp[n].x+7) >> 3;
-         int h = (z->img_comp[n].y+7) >> 3;
-         for (j=0; j < h; ++j) {
-            for (i=0; i < w; ++i) {
-               short *data = z->img_comp[n].coeff + 64 * (i + j * z->img_comp[n].coeff_w);
-               stbi__jpeg_dequantize(data, z->dequant[z->img_comp[n].tq]);
-               z->idct_block_kernel(z->img_comp[n].data+z->img_comp[n].w2*j*8+i*8, z->img_comp[n].w2, data);
-            }
-         }
-      }
+      int n;
+      for (n=0; n < z->s->img_n; ++n)
+         if (!stbi__jpeg_finish_rows(z, n, 0, (z->img_comp[n].y+7) >> 3)) return 0;
    }
+   return 1;
 }
 
 static int stbi__process_marker(stbi__jpeg *z, int m)
@@ -3209,23 +5426,71 @@ static int stbi__free_jpeg_components(stbi__jpeg *z, int ncomp, int why)
    int i;
    for (i=0; i < ncomp; ++i) {
       if (z->img_comp[i].raw_data) {
-         STBI_FREE(z->img_comp[i].raw_data);
+         stbi__free(z->img_comp[i].raw_data);
          z->img_comp[i].raw_data = NULL;
          z->img_comp[i].data = NULL;
       }
       if (z->img_comp[i].raw_coeff) {
-         STBI_FREE(z->img_comp[i].raw_coeff);
+         stbi__free(z->img_comp[i].raw_coeff);
          z->img_comp[i].raw_coeff = 0;
          z->img_comp[i].coeff = 0;
       }
       if (z->img_comp[i].linebuf) {
-         STBI_FREE(z->img_comp[i].linebuf);
+         stbi__free(z->img_comp[i].linebuf);
          z->img_comp[i].linebuf = NULL;
       }
    }
    return why;
 }
 
+// Works out what a region of the output needs. The resamplers treat the
+// first and last columns they are given as the edges of the image, so the
+// converted columns start and end one multiple of every horizontal factor
+// outside the region; a lores row or column is at most one MCU away from
+// the output pixels it is interpolated into, so one more MCU of margin
+// around those covers every block read.
+static int stbi__jpeg_setup_roi(stbi__jpeg *z)
+{
+   stbi__into *into = z->s->into;
+   int round = (1 << z->scale_shift) - 1;
+   int img_x = (int) ((z->s->img_x + round) >> z->scale_shift);
+   int img_y = (int) ((z->s->img_y + round) >> z->scale_shift);
+   int mcu_w = z->img_mcu_w >> z->scale_shift;
+   int mcu_h = z->img_mcu_h >> z->scale_shift;
+   int i, step = 1;
+
+   z->roi = 0;
+   z->roi_mcu_x0 = z->roi_mcu_y0 = 0;
+   z->roi_mcu_x1 = z->img_mcu_x;
+   z->roi_mcu_y1 = z->img_mcu_y;
+   z->roi_x0 = 0;
+   z->roi_x1 = img_x;
+   if (!into) return 1;
+   if (!stbi__into_fits(into, img_x, img_y))
+      return stbi__err("size mismatch", into->region ? "Region is not inside the image" : "Image is not the size given");
+   if (!into->region) return 1;
+
+   for (i=0; i < z->s->img_n; ++i) {
+      // as load_jpeg_image sets up the resamplers; step becomes the lcm
+      int hs = z->img_h_max / z->img_comp[i].h * (8 >> z->scale_shift) / z->img_comp[i].idct_size;
+      int lcm = step;
+      while (lcm % hs) lcm += step;
+      step = lcm;
+   }
+   z->roi = 1;
+   z->roi_x0 = (into->x0 / step - 1) * step;
+   z->roi_x1 = ((into->x0 + into->width + step-1) / step + 1) * step;
+   if (z->roi_x0 < 0) z->roi_x0 = 0;
+   if (z->roi_x1 > img_x) z->roi_x1 = img_x;
+   z->roi_mcu_x0 = z->roi_x0 / mcu_w;
+   z->roi_mcu_x1 = (z->roi_x1 + mcu_w-1) / mcu_w;
+   z->roi_mcu_y0 = into->y0 / mcu_h - 1;
+   z->roi_mcu_y1 = (into->y0 + into->height - 1) / mcu_h + 2;
+   if (z->roi_mcu_y0 < 0) z->roi_mcu_y0 = 0;
+   if (z->roi_mcu_y1 > z->img_mcu_y) z->roi_mcu_y1 = z->img_mcu_y;
+   return 1;
+}
+
 static int stbi__process_frame_header(stbi__jpeg *z, int scan)
 {
    stbi__context *s = z->s;
@@ -3284,6 +5549,13 @@ static int stbi__process_frame_header(stbi__jpeg *z, int scan)
    z->img_mcu_y = (s->img_y + z->img_mcu_h-1) / z->img_mcu_h;
 
    for (i=0; i < s->img_n; ++i) {
+      // scaled down, blocks shrink to 8 >> scale_shift pixels, but those of
+      // a component subsampled alike in both directions by 2 or 4 only as
+      // much as it takes to come out at the luma's resolution
+      int hs = h_max / z->img_comp[i].h, vs = v_max / z->img_comp[i].v;
+      z->img_comp[i].idct_size = 8 >> z->scale_shift;
+      if (hs == vs && (hs == 2 || hs == 4) && hs <= (1 << z->scale_shift))
+         z->img_comp[i].idct_size *= hs;
       // number of effective pixels (e.g. for non-interleaved MCU)
       z->img_comp[i].x = (s->img_x * z->img_comp[i].h + h_max-1) / h_max;
       z->img_comp[i].y = (s->img_y * z->img_comp[i].v + v_max-1) / v_max;
@@ -3294,28 +5566,35 @@ static int stbi__process_frame_header(stbi__jpeg *z, int scan)
       //
       // img_mcu_x, img_mcu_y: <=17 bits; comp[i].h and .v are <=4 (checked earlier)
       // so these muls can't overflow with 32-bit ints (which we require)
-      z->img_comp[i].w2 = z->img_mcu_x * z->img_comp[i].h * 8;
-      z->img_comp[i].h2 = z->img_mcu_y * z->img_comp[i].v * 8;
+      z->img_comp[i].w2 = z->img_mcu_x * z->img_comp[i].h * z->img_comp[i].idct_size;
+      z->img_comp[i].h2 = z->img_mcu_y * z->img_comp[i].v * z->img_comp[i].idct_size;
       z->img_comp[i].coeff = 0;
       z->img_comp[i].raw_coeff = 0;
       z->img_comp[i].linebuf = NULL;
-      z->img_comp[i].raw_data = stbi__malloc_mad2(z->img_comp[i].w2, z->img_comp[i].h2, 15);
-      if (z->img_comp[i].raw_data == NULL)
-         return stbi__free_jpeg_components(z, i+1, stbi__err("outofmem", "Out of memory"));
-      // align blocks for idct using mmx/sse
-      z->img_comp[i].data = (stbi_uc*) (((size_t) z->img_comp[i].raw_data + 15) & ~15);
+      z->img_comp[i].raw_data = NULL;
+      z->img_comp[i].data = NULL;
       if (z->progressive) {
-         // w2, h2 are multiples of 8 (see above)
-         z->img_comp[i].coeff_w = z->img_comp[i].w2 / 8;
-         z->img_comp[i].coeff_h = z->img_comp[i].h2 / 8;
-         z->img_comp[i].raw_coeff = stbi__malloc_mad3(z->img_comp[i].w2, z->img_comp[i].h2, sizeof(short), 15);
+         // the pixels are transformed into the memory of the coefficients
+         // (see stbi__jpeg_finish_rows); blocks that come out as a single
+         // pixel only keep their DC coefficient, their AC scans are skipped
+         z->img_comp[i].coeff_w = z->img_mcu_x * z->img_comp[i].h;
+         z->img_comp[i].coeff_h = z->img_mcu_y * z->img_comp[i].v;
+         z->img_comp[i].coeff_n = z->img_comp[i].idct_size == 1 ? 1 : 64;
+         z->img_comp[i].bands = 0;
+         z->img_comp[i].raw_coeff = stbi__malloc_mad3(z->img_comp[i].coeff_w * z->img_comp[i].coeff_n, z->img_comp[i].coeff_h, sizeof(short), 15);
          if (z->img_comp[i].raw_coeff == NULL)
             return stbi__free_jpeg_components(z, i+1, stbi__err("outofmem", "Out of memory"));
          z->img_comp[i].coeff = (short*) (((size_t) z->img_comp[i].raw_coeff + 15) & ~15);
+      } else {
+         z->img_comp[i].raw_data = stbi__malloc_mad2(z->img_comp[i].w2, z->img_comp[i].h2, 15);
+         if (z->img_comp[i].raw_data == NULL)
+            return stbi__free_jpeg_components(z, i+1, stbi__err("outofmem", "Out of memory"));
+         // align blocks for idct using mmx/sse
+         z->img_comp[i].data = (stbi_uc*) (((size_t) z->img_comp[i].raw_data + 15) & ~15);
       }
    }
 
-   return 1;
+   return stbi__jpeg_setup_roi(z);
 }
 
 // use comparisons since in some cases we handle more than one case (e.g. SOF)
@@ -3352,31 +5631,14 @@ static int stbi__decode_jpeg_header(stbi__jpeg *z, int scan)
 }
 
 // decode image to YCbCr format
-static int stbi__decode_jpeg_image(stbi__jpeg *j)
+// reads the markers up to the next scan and its header; returns 1 at a
+// scan, 2 at the end of the image, 0 on an error
+static int stbi__jpeg_next_scan(stbi__jpeg *j)
 {
-   int m;
-   for (m = 0; m < 4; m++) {
-      j->img_comp[m].raw_data = NULL;
-      j->img_comp[m].raw_coeff = NULL;
-   }
-   j->restart_interval = 0;
-   if (!stbi__decode_jpeg_header(j, STBI__SCAN_load)) return 0;
-   m = stbi__get_marker(j);
+   int m = stbi__get_marker(j);
    while (!stbi__EOI(m)) {
       if (stbi__SOS(m)) {
-         if (!stbi__process_scan_header(j)) return 0;
-         if (!stbi__parse_entropy_coded_data(j)) return 0;
-         if (j->marker == STBI__MARKER_none ) {
-            // handle 0s at the end of image data from IP Kamera 9060
-            while (!stbi__at_eof(j->s)) {
-               int x = stbi__get8(j->s);
-               if (x == 255) {
-                  j->marker = stbi__get8(j->s);
-                  break;
-               }
-            }
-            // if we reach eof without hitting a marker, stbi__get_marker() below will fail and we'll eventually return 0
-         }
+         return stbi__process_scan_header(j);
       } else if (stbi__DNL(m)) {
          int Ld = stbi__get16be(j->s);
          stbi__uint32 NL = stbi__get16be(j->s);
@@ -3387,11 +5649,58 @@ static int stbi__decode_jpeg_image(stbi__jpeg *j)
       }
       m = stbi__get_marker(j);
    }
-   if (j->progressive)
-      stbi__jpeg_finish(j);
+   return 2;
+}
+
+// after the entropy-coded data of a scan
+static void stbi__jpeg_end_scan(stbi__jpeg *j)
+{
+   if (j->marker == STBI__MARKER_none ) {
+      // handle 0s at the end of image data from IP Kamera 9060
+      while (!stbi__at_eof(j->s)) {
+         int x = stbi__get8(j->s);
+         if (x == 255) {
+            j->marker = stbi__get8(j->s);
+            break;
+         }
+      }
+      // if we reach eof without hitting a marker, stbi__get_marker() below will fail and we'll eventually return 0
+   }
+}
+
+// reads the markers up to the first scan, with the frame header
+static int stbi__jpeg_begin(stbi__jpeg *j)
+{
+   int m;
+   for (m = 0; m < 4; m++) {
+      j->img_comp[m].raw_data = NULL;
+      j->img_comp[m].raw_coeff = NULL;
+   }
+   j->restart_interval = 0;
+   return stbi__decode_jpeg_header(j, STBI__SCAN_load);
+}
+
+// the scans after stbi__jpeg_begin
+static int stbi__decode_jpeg_scans(stbi__jpeg *j)
+{
+   int m;
+   while ((m = stbi__jpeg_next_scan(j)) == 1) {
+      if (!stbi__parse_entropy_coded_data(j)) return 0;
+      // a region has all it needs from a baseline scan of every component
+      if (j->roi && !j->progressive && j->scan_n == j->s->img_n) break;
+      stbi__jpeg_end_scan(j);
+   }
+   if (m == 0) return 0;
+   if (j->progressive && !stbi__jpeg_finish(j)) return 0;
    return 1;
 }
 
+static int stbi__decode_jpeg_image(stbi__jpeg *j)
+{
+   if (!stbi__jpeg_begin(j)) return 0;
+   return stbi__decode_jpeg_scans(j);
+}
+
 // static jfif-centered resampling (across block boundaries)
 
 typedef stbi_uc *(*resample_row_func)(stbi_uc *out, stbi_uc *in0, stbi_uc *in1,
@@ -3623,7 +5932,7 @@ static void stbi__YCbCr_to_RGB_row(stbi_uc *out, const stbi_uc *y, const stbi_uc
       out[0] = (stbi_uc)r;
       out[1] = (stbi_uc)g;
       out[2] = (stbi_uc)b;
-      out[3] = 255;
+      if (step == 4) out[3] = 255;
       out += step;
    }
 }
@@ -3757,19 +6066,165 @@ static void stbi__YCbCr_to_RGB_simd(stbi_uc *out, stbi_uc const *y, stbi_uc cons
       out[0] = (stbi_uc)r;
       out[1] = (stbi_uc)g;
       out[2] = (stbi_uc)b;
-      out[3] = 255;
+      if (step == 4) out[3] = 255;
       out += step;
    }
 }
 #endif
 
+#ifdef STBI_AVX2
+// chroma of output pixel x as the resamplers would produce it, from rows
+// blended vertically (t = 3*near + far, which is 4*near without vertical
+// subsampling as in_far == in_near then). Clamping the neighbours gives the
+// edges of stbi__resample_row_hv_2; stbi__resample_row_h_2 weights its
+// second to last sample 3:1 for the last even pixel, and so does this.
+static int stbi__upsample_chroma(stbi_uc const *in_near, stbi_uc const *in_far, int w, int hs, int vs, int x)
+{
+   int i = hs == 2 ? x >> 1 : x;
+   int t = 3*in_near[i] + in_far[i];
+   if (hs == 2) {
+      int j = (x & 1) ? (i+1 < w ? i+1 : i) : (i > 0 ? i-1 : i);
+      int u = 3*in_near[j] + in_far[j];
+      if (vs == 1 && !(x & 1) && i == w-1 && w > 1)
+         return (3*u + t + 8) >> 4;
+      return (3*t + u + 8) >> 4;
+   }
+   return (4*t + 8) >> 4;
+}
+
+static void stbi__YCbCr_upsample_pixels(stbi_uc *out, stbi_uc const *y, stbi_uc const *cb_near, stbi_uc const *cb_far,
+                                        stbi_uc const *cr_near, stbi_uc const *cr_far, int w, int hs, int vs, int first, int last)
+{
+   int x;
+   for (x=first; x < last; ++x) {
+      stbi_uc cb = (stbi_uc) stbi__upsample_chroma(cb_near, cb_far, w, hs, vs, x);
+      stbi_uc cr = (stbi_uc) stbi__upsample_chroma(cr_near, cr_far, w, hs, vs, x);
+      stbi__YCbCr_to_RGB_row(out + x*4, y + x, &cb, &cr, 1, 4);
+   }
+}
+
+// upsamples 16 chroma samples starting at i into the 32 outputs starting at
+// 2*i, with the arithmetic of stbi__resample_row_hv_2_simd. Needs the samples
+// at i-1 and i+16 as well.
+STBI__AVX2_INLINE void stbi__upsample_chroma_h2_avx2(__m256i *lo, __m256i *hi, stbi_uc const *in_near, stbi_uc const *in_far, int i)
+{
+   // vertical pass, 3*x + y = 4*x + (y - x)
+   __m256i nearw = _mm256_cvtepu8_epi16(_mm_loadu_si128((__m128i const *) (in_near + i)));
+   __m256i farw  = _mm256_cvtepu8_epi16(_mm_loadu_si128((__m128i const *) (in_far + i)));
+   __m256i curr  = _mm256_add_epi16(_mm256_slli_epi16(nearw, 2), _mm256_sub_epi16(farw, nearw));
+
+   // curr shifted by a pixel either way; alignr works within lanes, so the
+   // pixel crossing the middle comes from a lane swapped copy
+   __m256i prv0  = _mm256_alignr_epi8(curr, _mm256_permute2x128_si256(curr, curr, 0x08), 14);
+   __m256i nxt0  = _mm256_alignr_epi8(_mm256_permute2x128_si256(curr, curr, 0x81), curr, 2);
+   __m256i prev  = _mm256_insert_epi16(prv0, 3*in_near[i-1] + in_far[i-1], 0);
+   __m256i next  = _mm256_insert_epi16(nxt0, 3*in_near[i+16] + in_far[i+16], 15);
+
+   // horizontal pass, even = 4*cur + (prev - cur), odd = 4*cur + (next - cur)
+   __m256i curb  = _mm256_add_epi16(_mm256_slli_epi16(curr, 2), _mm256_set1_epi16(8));
+   __m256i even  = _mm256_srli_epi16(_mm256_add_epi16(curb, _mm256_sub_epi16(prev, curr)), 4);
+   __m256i odd   = _mm256_srli_epi16(_mm256_add_epi16(curb, _mm256_sub_epi16(next, curr)), 4);
+
+   // interleave within lanes, then put the halves back in order
+   __m256i int0  = _mm256_unpacklo_epi16(even, odd);
+   __m256i int1  = _mm256_unpackhi_epi16(even, odd);
+   *lo = _mm256_permute2x128_si256(int0, int1, 0x20);
+   *hi = _mm256_permute2x128_si256(int0, int1, 0x31);
+}
+
+// converts 16 pixels from luma bytes and chroma words to RGBA, with the
+// arithmetic of the SSE2 stbi__YCbCr_to_RGB_simd
+STBI__AVX2_INLINE void stbi__YCbCr_to_RGBA_avx2(stbi_uc *out, stbi_uc const *y, __m256i cb, __m256i cr)
+{
+   __m256i signflip  = _mm256_set1_epi16(-0x8000);
+   __m256i cr_const0 = _mm256_set1_epi16(   (short) ( 1.40200f*4096.0f+0.5f));
+   __m256i cr_const1 = _mm256_set1_epi16( - (short) ( 0.71414f*4096.0f+0.5f));
+   __m256i cb_const0 = _mm256_set1_epi16( - (short) ( 0.34414f*4096.0f+0.5f));
+   __m256i cb_const1 = _mm256_set1_epi16(   (short) ( 1.77200f*4096.0f+0.5f));
+   __m256i xw = _mm256_set1_epi16(255); // alpha channel
+
+   // (y << 8 | 128) >> 4, and (c - 128) << 8
+   __m256i yws = _mm256_or_si256(_mm256_slli_epi16(_mm256_cvtepu8_epi16(_mm_loadu_si128((__m128i const *) y)), 4), _mm256_set1_epi16(8));
+   __m256i crw = _mm256_xor_si256(_mm256_slli_epi16(cr, 8), signflip);
+   __m256i cbw = _mm256_xor_si256(_mm256_slli_epi16(cb, 8), signflip);
+
+   // color transform
+   __m256i cr0 = _mm256_mulhi_epi16(cr_const0, crw);
+   __m256i cb0 = _mm256_mulhi_epi16(cb_const0, cbw);
+   __m256i cb1 = _mm256_mulhi_epi16(cbw, cb_const1);
+   __m256i cr1 = _mm256_mulhi_epi16(crw, cr_const1);
+   __m256i rws = _mm256_add_epi16(cr0, yws);
+   __m256i gwt = _mm256_add_epi16(cb0, yws);
+   __m256i bws = _mm256_add_epi16(yws, cb1);
+   __m256i gws = _mm256_add_epi16(gwt, cr1);
+
+   // descale
+   __m256i rw = _mm256_srai_epi16(rws, 4);
+   __m256i bw = _mm256_srai_epi16(bws, 4);
+   __m256i gw = _mm256_srai_epi16(gws, 4);
+
+   // back to byte and interleave channels, all within lanes: lane 0 ends up
+   // with pixels 0-3 and 4-7, lane 1 with 8-11 and 12-15
+   __m256i brb = _mm256_packus_epi16(rw, bw);
+   __m256i gxb = _mm256_packus_epi16(gw, xw);
+   __m256i t0 = _mm256_unpacklo_epi8(brb, gxb);
+   __m256i t1 = _mm256_unpackhi_epi8(brb, gxb);
+   __m256i o0 = _mm256_unpacklo_epi16(t0, t1);
+   __m256i o1 = _mm256_unpackhi_epi16(t0, t1);
+
+   _mm256_storeu_si256((__m256i *) (out + 0), _mm256_permute2x128_si256(o0, o1, 0x20));
+   _mm256_storeu_si256((__m256i *) (out + 32), _mm256_permute2x128_si256(o0, o1, 0x31));
+}
+
+// upsamples both chroma rows, converts and writes RGBA in a single pass,
+// instead of resampling into line buffers and converting those. Luma is at
+// full resolution; chroma is subsampled by hs horizontally and vs vertically,
+// where it is blended from in_near and in_far (pass in_far == in_near for
+// vs == 1). Matches the separate kernels exactly.
+STBI__AVX2_TARGET
+static void stbi__YCbCr_upsample_to_RGBA_avx2(stbi_uc *out, stbi_uc const *y, stbi_uc const *cb_near, stbi_uc const *cb_far,
+                                              stbi_uc const *cr_near, stbi_uc const *cr_far, int w, int count, int hs, int vs)
+{
+   int x = 0;
+   if (hs == 2) {
+      // the first two pixels need the left edge, and the vector steps read
+      // one chroma sample to either side
+      x = count < 2 ? count : 2;
+      stbi__YCbCr_upsample_pixels(out, y, cb_near, cb_far, cr_near, cr_far, w, hs, vs, 0, x);
+      for (; x+32 <= count && (x >> 1) + 16 < w; x += 32) {
+         __m256i cb_lo, cb_hi, cr_lo, cr_hi;
+         stbi__upsample_chroma_h2_avx2(&cb_lo, &cb_hi, cb_near, cb_far, x >> 1);
+         stbi__upsample_chroma_h2_avx2(&cr_lo, &cr_hi, cr_near, cr_far, x >> 1);
+         stbi__YCbCr_to_RGBA_avx2(out + x*4, y + x, cb_lo, cr_lo);
+         stbi__YCbCr_to_RGBA_avx2(out + x*4 + 64, y + x + 16, cb_hi, cr_hi);
+      }
+   } else {
+      __m256i three = _mm256_set1_epi16(3);
+      __m256i bias  = _mm256_set1_epi16(2);
+      for (; x+16 <= count; x += 16) {
+         #define stbi__blend(in_near, in_far) \
+            _mm256_srli_epi16(_mm256_add_epi16(_mm256_add_epi16(_mm256_mullo_epi16(_mm256_cvtepu8_epi16(_mm_loadu_si128((__m128i const *) (in_near + x))), three), \
+                                                                _mm256_cvtepu8_epi16(_mm_loadu_si128((__m128i const *) (in_far + x)))), bias), 2)
+         stbi__YCbCr_to_RGBA_avx2(out + x*4, y + x, stbi__blend(cb_near, cb_far), stbi__blend(cr_near, cr_far));
+         #undef stbi__blend
+      }
+   }
+   stbi__YCbCr_upsample_pixels(out, y, cb_near, cb_far, cr_near, cr_far, w, hs, vs, x, count);
+}
+#endif // STBI_AVX2
+
 // set up the kernels
 static void stbi__setup_jpeg(stbi__jpeg *j)
 {
    j->idct_block_kernel = stbi__idct_block;
+   j->idct_block2_kernel = NULL;
+   j->YCbCr_upsample_kernel = NULL;
    j->YCbCr_to_RGB_kernel = stbi__YCbCr_to_RGB_row;
    j->resample_row_hv_2_kernel = stbi__resample_row_hv_2;
 
+   if (stbi__simd_level < STBI_SIMD_SSE2)
+      return;
+
 #ifdef STBI_SSE2
    if (stbi__sse2_available()) {
       j->idct_block_kernel = stbi__idct_simd;
@@ -3778,6 +6233,13 @@ static void stbi__setup_jpeg(stbi__jpeg *j)
    }
 #endif
 
+#ifdef STBI_AVX2
+   if (stbi__simd_level >= STBI_SIMD_AVX2 && stbi__avx2_available()) {
+      j->idct_block2_kernel = stbi__idct_avx2;
+      j->YCbCr_upsample_kernel = stbi__YCbCr_upsample_to_RGBA_avx2;
+   }
+#endif
+
 #ifdef STBI_NEON
    j->idct_block_kernel = stbi__idct_simd;
    j->YCbCr_to_RGB_kernel = stbi__YCbCr_to_RGB_simd;
@@ -3808,21 +6270,199 @@ static stbi_uc stbi__blinn_8x8(stbi_uc x, stbi_uc y)
    return (stbi_uc) ((t + (t >>8)) >> 8);
 }
 
-static stbi_uc *load_jpeg_image(stbi__jpeg *z, int *out_x, int *out_y, int *comp, int req_comp)
+// resample and color-convert rows_num rows of width pixels into output,
+// stride bytes apart, with resamplers positioned at the first of them. No
+// converter writes past the width*n bytes of a row, so rows may sit right
+// next to caller memory or to rows another thread is converting
+static void stbi__jpeg_convert_rows(stbi__jpeg *z, stbi__resample *res_comp, stbi_uc **linebuf, stbi_uc *output, int stride,
+                                    int n, int decode_n, int is_rgb, int rows_num, unsigned int width)
+{
+   int k;
+   unsigned int i,j;
+   stbi_uc *coutput[4] = { NULL, NULL, NULL, NULL };
+   stbi_uc *in_near[4], *in_far[4];
+   // plain YCbCr with full resolution luma and both chroma components
+   // subsampled alike goes to RGBA through the fused kernel, if there is one
+   int fused = z->YCbCr_upsample_kernel && n == 4 && decode_n == 3 && z->s->img_n == 3 && !is_rgb &&
+               res_comp[0].hs == 1 && res_comp[0].vs == 1 &&
+               res_comp[1].hs == res_comp[2].hs && res_comp[1].vs == res_comp[2].vs &&
+               res_comp[1].hs <= 2 && res_comp[1].vs <= 2;
+   for (j=0; j < (unsigned int) rows_num; ++j) {
+      stbi_uc *out = output + (ptrdiff_t) stride * j;
+      for (k=0; k < decode_n; ++k) {
+         stbi__resample *r = &res_comp[k];
+         int y_bot = r->ystep >= (r->vs >> 1);
+         in_near[k] = y_bot ? r->line1 : r->line0;
+         in_far[k]  = y_bot ? r->line0 : r->line1;
+         if (!fused)
+            coutput[k] = r->resample(linebuf[k], in_near[k], in_far[k], r->w_lores, r->hs);
+         if (++r->ystep >= r->vs) {
+            r->ystep = 0;
+            r->line0 = r->line1;
+            if (++r->ypos < z->img_comp[k].y)
+               r->line1 += z->img_comp[k].w2;
+         }
+      }
+      if (fused) {
+         if (res_comp[1].vs == 1) {
+            in_far[1] = in_near[1];
+            in_far[2] = in_near[2];
+         }
+         z->YCbCr_upsample_kernel(out, in_near[0], in_near[1], in_far[1], in_near[2], in_far[2],
+                                  res_comp[1].w_lores, width, res_comp[1].hs, res_comp[1].vs);
+         continue;
+      }
+      if (n >= 3) {
+         stbi_uc *y = coutput[0];
+         if (z->s->img_n == 3) {
+            if (is_rgb) {
+               for (i=0; i < width; ++i) {
+                  out[0] = y[i];
+                  out[1] = coutput[1][i];
+                  out[2] = coutput[2][i];
+                  if (n == 4) out[3] = 255;
+                  out += n;
+               }
+            } else {
+               z->YCbCr_to_RGB_kernel(out, y, coutput[1], coutput[2], width, n);
+            }
+         } else if (z->s->img_n == 4) {
+            if (z->app14_color_transform == 0) { // CMYK
+               for (i=0; i < width; ++i) {
+                  stbi_uc m = coutput[3][i];
+                  out[0] = stbi__blinn_8x8(coutput[0][i], m);
+                  out[1] = stbi__blinn_8x8(coutput[1][i], m);
+                  out[2] = stbi__blinn_8x8(coutput[2][i], m);
+                  if (n == 4) out[3] = 255;
+                  out += n;
+               }
+            } else if (z->app14_color_transform == 2) { // YCCK
+               z->YCbCr_to_RGB_kernel(out, y, coutput[1], coutput[2], width, n);
+               for (i=0; i < width; ++i) {
+                  stbi_uc m = coutput[3][i];
+                  out[0] = stbi__blinn_8x8(255 - out[0], m);
+                  out[1] = stbi__blinn_8x8(255 - out[1], m);
+                  out[2] = stbi__blinn_8x8(255 - out[2], m);
+                  out += n;
+               }
+            } else { // YCbCr + alpha?  Ignore the fourth channel for now
+               z->YCbCr_to_RGB_kernel(out, y, coutput[1], coutput[2], width, n);
+            }
+         } else {
+            stbi__convert_row(y, out, 1, n, width);
+         }
+      } else {
+         if (is_rgb) {
+            if (n == 1)
+               for (i=0; i < width; ++i)
+                  *out++ = stbi__compute_y(coutput[0][i], coutput[1][i], coutput[2][i]);
+            else {
+               for (i=0; i < width; ++i, out += 2) {
+                  out[0] = stbi__compute_y(coutput[0][i], coutput[1][i], coutput[2][i]);
+                  out[1] = 255;
+               }
+            }
+         } else if (z->s->img_n == 4 && z->app14_color_transform == 0) {
+            for (i=0; i < width; ++i) {
+               stbi_uc m = coutput[3][i];
+               stbi_uc r = stbi__blinn_8x8(coutput[0][i], m);
+               stbi_uc g = stbi__blinn_8x8(coutput[1][i], m);
+               stbi_uc b = stbi__blinn_8x8(coutput[2][i], m);
+               out[0] = stbi__compute_y(r, g, b);
+               if (n == 2) out[1] = 255;
+               out += n;
+            }
+         } else if (z->s->img_n == 4 && z->app14_color_transform == 2) {
+            for (i=0; i < width; ++i) {
+               out[0] = stbi__blinn_8x8(255 - coutput[0][i], coutput[3][i]);
+               if (n == 2) out[1] = 255;
+               out += n;
+            }
+         } else {
+            stbi_uc *y = coutput[0];
+            if (n == 1)
+               for (i=0; i < width; ++i) out[i] = y[i];
+            else
+               stbi__convert_row(y, out, 1, n, width);
+         }
+      }
+   }
+}
+
+// moves a resampler from row 0 of the output to `row`, as if it had been
+// stepped through the rows before
+static void stbi__resample_seek(stbi__resample *r, stbi__jpeg *z, int k, int row)
+{
+   int steps = (r->vs >> 1) + row;
+   int advances = steps / r->vs;
+   int last = z->img_comp[k].y - 1;
+   r->ystep = steps % r->vs;
+   r->ypos = advances;
+   r->line1 = z->img_comp[k].data + z->img_comp[k].w2 * (advances < last ? advances : last);
+   r->line0 = advances == 0 ? r->line1 : z->img_comp[k].data + z->img_comp[k].w2 * (advances - 1 < last ? advances - 1 : last);
+}
+
+// with a parallel_for the rows are converted in tasks of STBI__JPEG_ROWS_PER_TASK
+#define STBI__JPEG_ROWS_PER_TASK  64
+
+typedef struct
 {
+   stbi__jpeg *z;
+   stbi__resample *res_comp; // at row 0
+   stbi_uc *output;
+   int stride;
    int n, decode_n, is_rgb;
-   z->s->img_n = 0; // make stbi__cleanup_jpeg safe
+   int failed;
+} stbi__jpeg_convert;
+
+static void stbi__jpeg_convert_task(void *task_data, int task)
+{
+   stbi__jpeg_convert *c = (stbi__jpeg_convert *) task_data;
+   stbi__jpeg *z = c->z;
+   int first_row = task * STBI__JPEG_ROWS_PER_TASK;
+   int rows_num = (int) z->s->img_y - first_row;
+   stbi_uc *output = c->output + (ptrdiff_t) c->stride * first_row;
+   stbi__resample res_comp[4];
+   stbi_uc *linebuf[4];
+   int k;
+   stbi_uc *buffer = (stbi_uc *) stbi__malloc_mad2(c->decode_n, z->s->img_x * 4 + 3, 0);
+   if (!buffer) {
+      c->failed = 1;
+      return;
+   }
+   for (k=0; k < c->decode_n; ++k) {
+      res_comp[k] = c->res_comp[k];
+      stbi__resample_seek(&res_comp[k], z, k, first_row);
+      linebuf[k] = buffer + k * (z->s->img_x * 4 + 3);
+   }
+   if (rows_num > STBI__JPEG_ROWS_PER_TASK) rows_num = STBI__JPEG_ROWS_PER_TASK;
+   stbi__jpeg_convert_rows(z, res_comp, linebuf, output, c->stride, c->n, c->decode_n, c->is_rgb, rows_num, z->s->img_x);
+   stbi__free(buffer);
+}
 
-   // validate req_comp
-   if (req_comp < 0 || req_comp > 4) return stbi__errpuc("bad req_comp", "Internal error");
+// three components that are R, G and B rather than Y, Cb and Cr
+static int stbi__jpeg_is_rgb(stbi__jpeg *z)
+{
+   return z->s->img_n == 3 && (z->rgb == 3 || (z->app14_color_transform == 0 && !z->jfif));
+}
 
-   // load a jpeg image from whichever source, but leave in YCbCr format
-   if (!stbi__decode_jpeg_image(z)) { stbi__cleanup_jpeg(z); return NULL; }
+// once the planes are decoded: works out the output components and sets up
+// a resampler at row 0 for each one decoded; 0 on an error
+static int stbi__jpeg_setup_output(stbi__jpeg *z, int req_comp, stbi__resample *res_comp, int *out_n, int *out_decode_n, int *out_is_rgb)
+{
+   int n, decode_n, is_rgb, k;
+
+   // from here on the image is as large as the scaled-down planes make it
+   if (z->scale_shift) {
+      int round = (1 << z->scale_shift) - 1;
+      z->s->img_x = (z->s->img_x + round) >> z->scale_shift;
+      z->s->img_y = (z->s->img_y + round) >> z->scale_shift;
+   }
 
    // determine actual number of components to generate
    n = req_comp ? req_comp : z->s->img_n >= 3 ? 3 : 1;
 
-   is_rgb = z->s->img_n == 3 && (z->rgb == 3 || (z->app14_color_transform == 0 && !z->jfif));
+   is_rgb = stbi__jpeg_is_rgb(z);
 
    if (z->s->img_n == 3 && n < 3 && !is_rgb)
       decode_n = 1;
@@ -3831,142 +6471,117 @@ static stbi_uc *load_jpeg_image(stbi__jpeg *z, int *out_x, int *out_y, int *comp
 
    // nothing to do if no components requested; check this now to avoid
    // accessing uninitialized coutput[0] later
-   if (decode_n <= 0) { stbi__cleanup_jpeg(z); return NULL; }
+   if (decode_n <= 0) return 0;
+
+   for (k=0; k < decode_n; ++k) {
+      stbi__resample *r = &res_comp[k];
+
+      // allocate line buffer big enough for upsampling off the edges
+      // with upsample factor of 4
+      z->img_comp[k].linebuf = (stbi_uc *) stbi__malloc(z->s->img_x + 3);
+      if (!z->img_comp[k].linebuf) return stbi__err("outofmem", "Out of memory");
+
+      // planes transformed to more than 8 >> scale_shift pixels per
+      // block are subsampled that much less
+      r->hs      = z->img_h_max / z->img_comp[k].h * (8 >> z->scale_shift) / z->img_comp[k].idct_size;
+      r->vs      = z->img_v_max / z->img_comp[k].v * (8 >> z->scale_shift) / z->img_comp[k].idct_size;
+      r->ystep   = r->vs >> 1;
+      r->w_lores = (z->s->img_x + r->hs-1) / r->hs;
+      r->ypos    = 0;
+      r->line0   = r->line1 = z->img_comp[k].data;
+      if (z->scale_shift)
+         z->img_comp[k].y = (z->s->img_y + r->vs-1) / r->vs;
+
+      if      (r->hs == 1 && r->vs == 1) r->resample = resample_row_1;
+      else if (r->hs == 1 && r->vs == 2) r->resample = stbi__resample_row_v_2;
+      else if (r->hs == 2 && r->vs == 1) r->resample = stbi__resample_row_h_2;
+      else if (r->hs == 2 && r->vs == 2) r->resample = z->resample_row_hv_2_kernel;
+      else                               r->resample = stbi__resample_row_generic;
+   }
+
+   *out_n = n;
+   *out_decode_n = decode_n;
+   *out_is_rgb = is_rgb;
+   return 1;
+}
+
+static stbi_uc *load_jpeg_image(stbi__jpeg *z, int *out_x, int *out_y, int *comp, int req_comp)
+{
+   int n, decode_n, is_rgb, stride;
+   stbi__into *into = z->s->into;
+   z->s->img_n = 0; // make stbi__cleanup_jpeg safe
+
+   // validate req_comp
+   if (req_comp < 0 || req_comp > 4) return stbi__errpuc("bad req_comp", "Internal error");
+
+   // load a jpeg image from whichever source, but leave in YCbCr format
+   if (!stbi__decode_jpeg_image(z)) { stbi__cleanup_jpeg(z); return NULL; }
 
    // resample and color-convert
    {
       int k;
-      unsigned int i,j;
       stbi_uc *output;
-      stbi_uc *coutput[4] = { NULL, NULL, NULL, NULL };
 
       stbi__resample res_comp[4];
 
-      for (k=0; k < decode_n; ++k) {
-         stbi__resample *r = &res_comp[k];
-
-         // allocate line buffer big enough for upsampling off the edges
-         // with upsample factor of 4
-         z->img_comp[k].linebuf = (stbi_uc *) stbi__malloc(z->s->img_x + 3);
-         if (!z->img_comp[k].linebuf) { stbi__cleanup_jpeg(z); return stbi__errpuc("outofmem", "Out of memory"); }
+      if (!stbi__jpeg_setup_output(z, req_comp, res_comp, &n, &decode_n, &is_rgb)) { stbi__cleanup_jpeg(z); return NULL; }
 
-         r->hs      = z->img_h_max / z->img_comp[k].h;
-         r->vs      = z->img_v_max / z->img_comp[k].v;
-         r->ystep   = r->vs >> 1;
-         r->w_lores = (z->s->img_x + r->hs-1) / r->hs;
-         r->ypos    = 0;
-         r->line0   = r->line1 = z->img_comp[k].data;
-
-         if      (r->hs == 1 && r->vs == 1) r->resample = resample_row_1;
-         else if (r->hs == 1 && r->vs == 2) r->resample = stbi__resample_row_v_2;
-         else if (r->hs == 2 && r->vs == 1) r->resample = stbi__resample_row_h_2;
-         else if (r->hs == 2 && r->vs == 2) r->resample = z->resample_row_hv_2_kernel;
-         else                               r->resample = stbi__resample_row_generic;
+      // can't error after this so, this is safe; the size given was
+      // checked in stbi__jpeg_setup_roi
+      if (into) {
+         output = into->pixels;
+         stride = into->stride;
+      } else {
+         output = (stbi_uc *) stbi__malloc_mad3(n, z->s->img_x, z->s->img_y, 1);
+         if (!output) { stbi__cleanup_jpeg(z); return stbi__errpuc("outofmem", "Out of memory"); }
+         stride = n * z->s->img_x;
       }
 
-      // can't error after this so, this is safe
-      output = (stbi_uc *) stbi__malloc_mad3(n, z->s->img_x, z->s->img_y, 1);
-      if (!output) { stbi__cleanup_jpeg(z); return stbi__errpuc("outofmem", "Out of memory"); }
-
       // now go ahead and resample
-      for (j=0; j < z->s->img_y; ++j) {
-         stbi_uc *out = output + n * z->s->img_x * j;
+      if (z->roi) {
+         // the region's rows, converted from column roi_x0 on into a
+         // scratch row, with the resamplers moved to that column
+         int j, width = z->roi_x1 - z->roi_x0;
+         stbi_uc *linebuf[4];
+         stbi_uc *row = (stbi_uc *) stbi__malloc_mad2(width, 4, 3);
+         if (!row) { stbi__cleanup_jpeg(z); return stbi__errpuc("outofmem", "Out of memory"); }
          for (k=0; k < decode_n; ++k) {
             stbi__resample *r = &res_comp[k];
-            int y_bot = r->ystep >= (r->vs >> 1);
-            coutput[k] = r->resample(z->img_comp[k].linebuf,
-                                     y_bot ? r->line1 : r->line0,
-                                     y_bot ? r->line0 : r->line1,
-                                     r->w_lores, r->hs);
-            if (++r->ystep >= r->vs) {
-               r->ystep = 0;
-               r->line0 = r->line1;
-               if (++r->ypos < z->img_comp[k].y)
-                  r->line1 += z->img_comp[k].w2;
-            }
+            stbi__resample_seek(r, z, k, into->y0);
+            r->line0 += z->roi_x0 / r->hs;
+            r->line1 += z->roi_x0 / r->hs;
+            r->w_lores = (width + r->hs-1) / r->hs;
+            linebuf[k] = z->img_comp[k].linebuf;
          }
-         if (n >= 3) {
-            stbi_uc *y = coutput[0];
-            if (z->s->img_n == 3) {
-               if (is_rgb) {
-                  for (i=0; i < z->s->img_x; ++i) {
-                     out[0] = y[i];
-                     out[1] = coutput[1][i];
-                     out[2] = coutput[2][i];
-                     out[3] = 255;
-                     out += n;
-                  }
-               } else {
-                  z->YCbCr_to_RGB_kernel(out, y, coutput[1], coutput[2], z->s->img_x, n);
-               }
-            } else if (z->s->img_n == 4) {
-               if (z->app14_color_transform == 0) { // CMYK
-                  for (i=0; i < z->s->img_x; ++i) {
-                     stbi_uc m = coutput[3][i];
-                     out[0] = stbi__blinn_8x8(coutput[0][i], m);
-                     out[1] = stbi__blinn_8x8(coutput[1][i], m);
-                     out[2] = stbi__blinn_8x8(coutput[2][i], m);
-                     out[3] = 255;
-                     out += n;
-                  }
-               } else if (z->app14_color_transform == 2) { // YCCK
-                  z->YCbCr_to_RGB_kernel(out, y, coutput[1], coutput[2], z->s->img_x, n);
-                  for (i=0; i < z->s->img_x; ++i) {
-                     stbi_uc m = coutput[3][i];
-                     out[0] = stbi__blinn_8x8(255 - out[0], m);
-                     out[1] = stbi__blinn_8x8(255 - out[1], m);
-                     out[2] = stbi__blinn_8x8(255 - out[2], m);
-                     out += n;
-                  }
-               } else { // YCbCr + alpha?  Ignore the fourth channel for now
-                  z->YCbCr_to_RGB_kernel(out, y, coutput[1], coutput[2], z->s->img_x, n);
-               }
-            } else
-               for (i=0; i < z->s->img_x; ++i) {
-                  out[0] = out[1] = out[2] = y[i];
-                  out[3] = 255; // not used if n==3
-                  out += n;
-               }
-         } else {
-            if (is_rgb) {
-               if (n == 1)
-                  for (i=0; i < z->s->img_x; ++i)
-                     *out++ = stbi__compute_y(coutput[0][i], coutput[1][i], coutput[2][i]);
-               else {
-                  for (i=0; i < z->s->img_x; ++i, out += 2) {
-                     out[0] = stbi__compute_y(coutput[0][i], coutput[1][i], coutput[2][i]);
-                     out[1] = 255;
-                  }
-               }
-            } else if (z->s->img_n == 4 && z->app14_color_transform == 0) {
-               for (i=0; i < z->s->img_x; ++i) {
-                  stbi_uc m = coutput[3][i];
-                  stbi_uc r = stbi__blinn_8x8(coutput[0][i], m);
-                  stbi_uc g = stbi__blinn_8x8(coutput[1][i], m);
-                  stbi_uc b = stbi__blinn_8x8(coutput[2][i], m);
-                  out[0] = stbi__compute_y(r, g, b);
-                  out[1] = 255;
-                  out += n;
-               }
-            } else if (z->s->img_n == 4 && z->app14_color_transform == 2) {
-               for (i=0; i < z->s->img_x; ++i) {
-                  out[0] = stbi__blinn_8x8(255 - coutput[0][i], coutput[3][i]);
-                  out[1] = 255;
-                  out += n;
-               }
-            } else {
-               stbi_uc *y = coutput[0];
-               if (n == 1)
-                  for (i=0; i < z->s->img_x; ++i) out[i] = y[i];
-               else
-                  for (i=0; i < z->s->img_x; ++i) { *out++ = y[i]; *out++ = 255; }
-            }
+         for (j=0; j < into->height; ++j) {
+            stbi__jpeg_convert_rows(z, res_comp, linebuf, row, 0, n, decode_n, is_rgb, 1, width);
+            memcpy(output + (ptrdiff_t) stride * j, row + (into->x0 - z->roi_x0) * n, (size_t) into->width * n);
          }
+         stbi__free(row);
+      } else if (stbi__parallel_for && z->s->img_y > STBI__JPEG_ROWS_PER_TASK) {
+         stbi__jpeg_convert convert;
+         convert.z = z;
+         convert.res_comp = res_comp;
+         convert.output = output;
+         convert.stride = stride;
+         convert.n = n;
+         convert.decode_n = decode_n;
+         convert.is_rgb = is_rgb;
+         convert.failed = 0;
+         stbi__parallel_for(stbi__parallel_for_user, (z->s->img_y + STBI__JPEG_ROWS_PER_TASK - 1) / STBI__JPEG_ROWS_PER_TASK,
+                            stbi__jpeg_convert_task, &convert);
+         if (convert.failed) { if (!into) stbi__free(output); stbi__cleanup_jpeg(z); return stbi__errpuc("outofmem", "Out of memory"); }
+      } else {
+         stbi_uc *linebuf[4];
+         for (k=0; k < decode_n; ++k)
+            linebuf[k] = z->img_comp[k].linebuf;
+         stbi__jpeg_convert_rows(z, res_comp, linebuf, output, stride, n, decode_n, is_rgb, z->s->img_y, z->s->img_x);
       }
       stbi__cleanup_jpeg(z);
       *out_x = z->s->img_x;
       *out_y = z->s->img_y;
       if (comp) *comp = z->s->img_n >= 3 ? 3 : 1; // report original components, not output
+      if (into) into->written = 1;
       return output;
    }
 }
@@ -3978,11 +6593,106 @@ static void *stbi__jpeg_load(stbi__context *s, int *x, int *y, int *comp, int re
    if (!j) return stbi__errpuc("outofmem", "Out of memory");
    STBI_NOTUSED(ri);
    j->s = s;
+   j->scale_shift = stbi__jpeg_scale_shift;
    stbi__setup_jpeg(j);
    result = load_jpeg_image(j, x,y,comp,req_comp);
-   STBI_FREE(j);
+   stbi__free(j);
+   return result;
+}
+
+// hands the decoded planes over as they are, see "Planar JPEG decoding"
+static int stbi__jpeg_load_planes(stbi__context *s, int *x, int *y, stbi_jpeg_planes *planes)
+{
+   int k, ok = 1, round;
+   stbi__jpeg *z;
+   memset(planes, 0, sizeof(*planes));
+   if (!stbi__jpeg_test(s)) return -1;
+   z = (stbi__jpeg *) stbi__malloc(sizeof(stbi__jpeg));
+   if (!z) return stbi__err("outofmem", "Out of memory");
+   z->s = s;
+   z->scale_shift = stbi__jpeg_scale_shift;
+   stbi__setup_jpeg(z);
+   s->img_n = 0; // make stbi__cleanup_jpeg safe
+   if (!stbi__jpeg_begin(z))
+      ok = 0;
+   // CMYK or RGB, as the markers up to the frame header tell
+   else if ((s->img_n != 1 && s->img_n != 3) || stbi__jpeg_is_rgb(z))
+      ok = -1;
+   else if (!stbi__decode_jpeg_scans(z))
+      ok = 0;
+
+   if (ok > 0) {
+      round = (1 << z->scale_shift) - 1;
+      *x = (int) ((s->img_x + round) >> z->scale_shift);
+      *y = (int) ((s->img_y + round) >> z->scale_shift);
+      planes->planes = s->img_n;
+      for (k=0; k < s->img_n; ++k) {
+         // as stbi__jpeg_setup_output sets up the resamplers
+         int hs = z->img_h_max / z->img_comp[k].h * (8 >> z->scale_shift) / z->img_comp[k].idct_size;
+         int vs = z->img_v_max / z->img_comp[k].v * (8 >> z->scale_shift) / z->img_comp[k].idct_size;
+         planes->width[k] = (*x + hs-1) / hs;
+         planes->height[k] = (*y + vs-1) / vs;
+         planes->stride[k] = z->img_comp[k].w2;
+         planes->data[k] = z->img_comp[k].data;
+         planes->memory[k] = z->img_comp[k].raw_data;
+         z->img_comp[k].raw_data = NULL; // taken over
+      }
+   }
+   stbi__cleanup_jpeg(z);
+   stbi__free(z);
+   return ok;
+}
+
+STBIDEF int stbi_load_jpeg_planes_from_memory(stbi_uc const *buffer, int len, int *x, int *y, stbi_jpeg_planes *planes)
+{
+   stbi__context s;
+   stbi__start_mem(&s,buffer,len);
+   return stbi__jpeg_load_planes(&s,x,y,planes);
+}
+
+STBIDEF int stbi_load_jpeg_planes_from_callbacks(stbi_io_callbacks const *clbk, void *user, int *x, int *y, stbi_jpeg_planes *planes)
+{
+   stbi__context s;
+   stbi__start_callbacks(&s, (stbi_io_callbacks *) clbk, user);
+   return stbi__jpeg_load_planes(&s,x,y,planes);
+}
+
+#ifndef STBI_NO_STDIO
+STBIDEF int stbi_load_jpeg_planes(char const *filename, int *x, int *y, stbi_jpeg_planes *planes)
+{
+   FILE *f;
+   int result;
+   stbi__context s;
+#ifdef STBI__MMAP
+   stbi__mapped_file m;
+   if (stbi__map_file(&m, filename)) {
+      result = stbi_load_jpeg_planes_from_memory(m.data, (int) m.size, x, y, planes);
+      stbi__unmap_file(&m);
+      return result;
+   }
+#endif
+   f = stbi__fopen(filename, "rb");
+   if (!f) {
+      memset(planes, 0, sizeof(*planes));
+      return stbi__err("can't fopen", "Unable to open file");
+   }
+   stbi__start_file(&s,f);
+   result = stbi__jpeg_load_planes(&s,x,y,planes);
+   fclose(f);
    return result;
 }
+#endif
+
+STBIDEF void stbi_jpeg_planes_free(stbi_jpeg_planes *planes)
+{
+   int k;
+   for (k=0; k < 3; ++k) {
+      stbi__free(planes->memory[k]);
+      planes->memory[k] = NULL;
+      planes->data[k] = NULL;
+   }
+   planes->planes = 0;
+}
 
 static int stbi__jpeg_test(stbi__context *s)
 {
@@ -3993,7 +6703,7 @@ static int stbi__jpeg_test(stbi__context *s)
    stbi__setup_jpeg(j);
    r = stbi__decode_jpeg_header(j, STBI__SCAN_type);
    stbi__rewind(s);
-   STBI_FREE(j);
+   stbi__free(j);
    return r;
 }
 
@@ -4003,8 +6713,8 @@ static int stbi__jpeg_info_raw(stbi__jpeg *j, int *x, int *y, int *comp)
       stbi__rewind( j->s );
       return 0;
    }
-   if (x) *x = j->s->img_x;
-   if (y) *y = j->s->img_y;
+   if (x) *x = (j->s->img_x + (1 << j->scale_shift) - 1) >> j->scale_shift;
+   if (y) *y = (j->s->img_y + (1 << j->scale_shift) - 1) >> j->scale_shift;
    if (comp) *comp = j->s->img_n >= 3 ? 3 : 1;
    return 1;
 }
@@ -4015,8 +6725,9 @@ static int stbi__jpeg_info(stbi__context *s, int *x, int *y, int *comp)
    stbi__jpeg* j = (stbi__jpeg*) (stbi__malloc(sizeof(stbi__jpeg)));
    if (!j) return stbi__err("outofmem", "Out of memory");
    j->s = s;
+   j->scale_shift = stbi__jpeg_scale_shift;
    result = stbi__jpeg_info_raw(j, x, y, comp);
-   STBI_FREE(j);
+   stbi__free(j);
    return result;
 }
 #endif
@@ -4026,27 +6737,76 @@ static int stbi__jpeg_info(stbi__context *s, int *x, int *y, int *comp)
 //      - all input must be provided in an upfront buffer
 //      - all output is written to a single output buffer (can malloc/realloc)
 //    performance
-//      - fast huffman
+//      - fast huffman, with table entries that carry the length/distance base
+//      - 64-bit bit buffer refilled 8 bytes at a time, and match copies 8
+//        bytes at a time, away from the ends of the input and output
 
 #ifndef STBI_NO_ZLIB
 
 // fast-way is faster to check than jpeg huffman, but slow way is slower
-#define STBI__ZFAST_BITS  9 // accelerate all cases in default tables
+#define STBI__ZFAST_BITS  10 // accelerate all cases in default tables
 #define STBI__ZFAST_MASK  ((1 << STBI__ZFAST_BITS) - 1)
 #define STBI__ZNSYMS 288 // number of symbols in literal/length alphabet
 
+// decoded symbols are entries that say what to do with them, so the
+// literal/length and distance decoders need no second lookup:
+//    bits  0-7   code length (fast table only; 0 there means "slow path")
+//    bits  8-12  extra bits to read for a length or distance
+//    bit  13     invalid symbol
+//    bit  14     end of block
+//    bit  15     literal
+//    bits 16-30  literal byte, base length or distance, or the symbol itself
+#define STBI__ZINVALID  0x2000
+#define STBI__ZEOB      0x4000
+#define STBI__ZLITERAL  0x8000
+
+typedef enum
+{
+   STBI__ZSYMBOLS, STBI__ZLITLEN, STBI__ZDIST
+} stbi__zalphabet;
+
 // zlib-style huffman encoding
 // (jpegs packs from left, zlib from right, so can't share code)
 typedef struct
 {
-   stbi__uint16 fast[1 << STBI__ZFAST_BITS];
+   stbi__uint32 fast[1 << STBI__ZFAST_BITS];
    stbi__uint16 firstcode[16];
    int maxcode[17];
    stbi__uint16 firstsymbol[16];
    stbi_uc  size[STBI__ZNSYMS];
-   stbi__uint16 value[STBI__ZNSYMS];
+   stbi__uint32 value[STBI__ZNSYMS];
 } stbi__zhuffman;
 
+static const int stbi__zlength_base[31] = {
+   3,4,5,6,7,8,9,10,11,13,
+   15,17,19,23,27,31,35,43,51,59,
+   67,83,99,115,131,163,195,227,258,0,0 };
+
+static const int stbi__zlength_extra[31]=
+{ 0,0,0,0,0,0,0,0,1,1,1,1,2,2,2,2,3,3,3,3,4,4,4,4,5,5,5,5,0,0,0 };
+
+static const int stbi__zdist_base[32] = { 1,2,3,4,5,7,9,13,17,25,33,49,65,97,129,193,
+257,385,513,769,1025,1537,2049,3073,4097,6145,8193,12289,16385,24577,0,0};
+
+static const int stbi__zdist_extra[32] =
+{ 0,0,0,0,1,1,2,2,3,3,4,4,5,5,6,6,7,7,8,8,9,9,10,10,11,11,12,12,13,13};
+
+static stbi__uint32 stbi__zsymbol_entry(stbi__zalphabet alphabet, int i)
+{
+   switch (alphabet) {
+      case STBI__ZLITLEN:
+         if (i < 256) return STBI__ZLITERAL | ((stbi__uint32) i << 16);
+         if (i == 256) return STBI__ZEOB;
+         if (i >= 286) return STBI__ZINVALID;
+         return ((stbi__uint32) stbi__zlength_base[i-257] << 16) | (stbi__zlength_extra[i-257] << 8);
+      case STBI__ZDIST:
+         if (i >= 30) return STBI__ZINVALID;
+         return ((stbi__uint32) stbi__zdist_base[i] << 16) | (stbi__zdist_extra[i] << 8);
+      default:
+         return (stbi__uint32) i << 16;
+   }
+}
+
 stbi_inline static int stbi__bitreverse16(int n)
 {
   n = ((n & 0xAAAA) >>  1) | ((n & 0x5555) << 1);
@@ -4064,7 +6824,7 @@ stbi_inline static int stbi__bit_reverse(int v, int bits)
    return stbi__bitreverse16(v) >> (16-bits);
 }
 
-static int stbi__zbuild_huffman(stbi__zhuffman *z, const stbi_uc *sizelist, int num)
+static int stbi__zbuild_huffman(stbi__zhuffman *z, const stbi_uc *sizelist, int num, stbi__zalphabet alphabet)
 {
    int i,k=0;
    int code, next_code[16], sizes[17];
@@ -4095,13 +6855,13 @@ static int stbi__zbuild_huffman(stbi__zhuffman *z, const stbi_uc *sizelist, int
       int s = sizelist[i];
       if (s) {
          int c = next_code[s] - z->firstcode[s] + z->firstsymbol[s];
-         stbi__uint16 fastv = (stbi__uint16) ((s << 9) | i);
+         stbi__uint32 entry = stbi__zsymbol_entry(alphabet, i);
          z->size [c] = (stbi_uc     ) s;
-         z->value[c] = (stbi__uint16) i;
+         z->value[c] = entry;
          if (s <= STBI__ZFAST_BITS) {
             int j = stbi__bit_reverse(next_code[s],s);
             while (j < (1 << STBI__ZFAST_BITS)) {
-               z->fast[j] = fastv;
+               z->fast[j] = entry | s;
                j += (1 << s);
             }
          }
@@ -4117,16 +6877,35 @@ static int stbi__zbuild_huffman(stbi__zhuffman *z, const stbi_uc *sizelist, int
 //    we require PNG read all the IDATs and combine them into a single
 //    memory buffer
 
+// where stbi__zinflate is in the stream, so that it can stop and carry on
+enum
+{
+   STBI__ZBLOCK_START,
+   STBI__ZBLOCK_HUFFMAN,
+   STBI__ZBLOCK_STORED,
+   STBI__ZDONE
+};
+
+// stbi__zinflate stopped in a streaming decode, see z_streaming
+#define STBI__ZSUSPENDED  2
+
 typedef struct
 {
    stbi_uc *zbuffer, *zbuffer_end;
+   int zbuffer_reserve;       // input bytes to leave unread until more arrive
    int num_bits;
-   stbi__uint32 code_buffer;
+   int zeof_bytes;            // zero bytes fed in after the end of zbuffer
+   stbi__uint64 code_buffer;  // LSB first; bits above num_bits may hold bytes not consumed yet
 
    char *zout;
    char *zout_start;
    char *zout_end;
    int   z_expandable;
+   int   z_streaming;         // return STBI__ZSUSPENDED when zout is full or the input is down to the reserve
+
+   int zstate, zfinal;
+   int stored_left;           // of the stored block being copied
+   int match_len, match_dist; // rest of a match that did not fit into zout
 
    stbi__zhuffman z_length, z_distance;
 } stbi__zbuf;
@@ -4141,23 +6920,40 @@ stbi_inline static stbi_uc stbi__zget8(stbi__zbuf *z)
    return stbi__zeof(z) ? 0 : *z->zbuffer++;
 }
 
+// tops the bit buffer up to at least 57 bits; past the end of the input
+// it shifts in zero bytes, which are an error only once they get decoded
 static void stbi__fill_bits(stbi__zbuf *z)
 {
+   if (z->zbuffer_end - z->zbuffer >= 8) {
+      // load 8 bytes and keep the whole ones that fit; the rest stay in the
+      // top bits and are loaded again, at the same place, next time
+      stbi_uc *p = z->zbuffer;
+      stbi__uint64 v = (stbi__uint64) p[0]        | ((stbi__uint64) p[1] <<  8) | ((stbi__uint64) p[2] << 16) | ((stbi__uint64) p[3] << 24) |
+                      ((stbi__uint64) p[4] << 32) | ((stbi__uint64) p[5] << 40) | ((stbi__uint64) p[6] << 48) | ((stbi__uint64) p[7] << 56);
+      z->code_buffer |= v << z->num_bits;
+      z->zbuffer += (63 - z->num_bits) >> 3;
+      z->num_bits |= 56;
+      return;
+   }
    do {
-      if (z->code_buffer >= (1U << z->num_bits)) {
-        z->zbuffer = z->zbuffer_end;  /* treat this as EOF so we fail. */
-        return;
-      }
-      z->code_buffer |= (unsigned int) stbi__zget8(z) << z->num_bits;
+      if (stbi__zeof(z))
+         ++z->zeof_bytes;
+      z->code_buffer |= (stbi__uint64) stbi__zget8(z) << z->num_bits;
       z->num_bits += 8;
-   } while (z->num_bits <= 24);
+   } while (z->num_bits <= 56);
+}
+
+// true if more zero bytes were fed in than are still in the bit buffer
+stbi_inline static int stbi__zoverread(stbi__zbuf *z)
+{
+   return z->zeof_bytes * 8 > z->num_bits;
 }
 
 stbi_inline static unsigned int stbi__zreceive(stbi__zbuf *z, int n)
 {
    unsigned int k;
    if (z->num_bits < n) stbi__fill_bits(z);
-   k = z->code_buffer & ((1 << n) - 1);
+   k = (unsigned int) (z->code_buffer & ((1 << n) - 1));
    z->code_buffer >>= n;
    z->num_bits -= n;
    return k;
@@ -4168,7 +6964,7 @@ static int stbi__zhuffman_decode_slowpath(stbi__zbuf *a, stbi__zhuffman *z)
    int b,s,k;
    // not resolved by fast table, so compute it the slow way
    // use jpeg approach, which requires MSbits at top
-   k = stbi__bit_reverse(a->code_buffer, 16);
+   k = stbi__bit_reverse((int) (a->code_buffer & 0xffff), 16);
    for (s=STBI__ZFAST_BITS+1; ; ++s)
       if (k < z->maxcode[s])
          break;
@@ -4179,24 +6975,25 @@ static int stbi__zhuffman_decode_slowpath(stbi__zbuf *a, stbi__zhuffman *z)
    if (z->size[b] != s) return -1;  // was originally an assert, but report failure instead.
    a->code_buffer >>= s;
    a->num_bits -= s;
-   return z->value[b];
+   return (int) z->value[b];
 }
 
+// returns the symbol's entry, or -1 for an invalid code or for running out
+// of input
 stbi_inline static int stbi__zhuffman_decode(stbi__zbuf *a, stbi__zhuffman *z)
 {
-   int b,s;
+   stbi__uint32 b;
+   int s;
    if (a->num_bits < 16) {
-      if (stbi__zeof(a)) {
-         return -1;   /* report error for unexpected end of data. */
-      }
       stbi__fill_bits(a);
+      if (a->zeof_bytes > 8) return -1; // report error for unexpected end of data.
    }
    b = z->fast[a->code_buffer & STBI__ZFAST_MASK];
    if (b) {
-      s = b >> 9;
+      s = b & 255;
       a->code_buffer >>= s;
       a->num_bits -= s;
-      return b & 511;
+      return (int) (b & ~255u);
    }
    return stbi__zhuffman_decode_slowpath(a, z);
 }
@@ -4214,7 +7011,7 @@ static int stbi__zexpand(stbi__zbuf *z, char *zout, int n)  // need to make room
       if(limit > UINT_MAX / 2) return stbi__err("outofmem", "Out of memory");
       limit *= 2;
    }
-   q = (char *) STBI_REALLOC_SIZED(z->zout_start, old_limit, limit);
+   q = (char *) stbi__realloc(z->zout_start, limit);
    STBI_NOTUSED(old_limit);
    if (q == NULL) return stbi__err("outofmem", "Out of memory");
    z->zout_start = q;
@@ -4223,57 +7020,104 @@ static int stbi__zexpand(stbi__zbuf *z, char *zout, int n)  // need to make room
    return 1;
 }
 
-static const int stbi__zlength_base[31] = {
-   3,4,5,6,7,8,9,10,11,13,
-   15,17,19,23,27,31,35,43,51,59,
-   67,83,99,115,131,163,195,227,258,0,0 };
-
-static const int stbi__zlength_extra[31]=
-{ 0,0,0,0,0,0,0,0,1,1,1,1,2,2,2,2,3,3,3,3,4,4,4,4,5,5,5,5,0,0,0 };
-
-static const int stbi__zdist_base[32] = { 1,2,3,4,5,7,9,13,17,25,33,49,65,97,129,193,
-257,385,513,769,1025,1537,2049,3073,4097,6145,8193,12289,16385,24577,0,0};
+// the fast loop needs 8 readable input bytes for its bit buffer refills, and
+// room for the longest match plus the 8 bytes a wide copy may overshoot by
+#define STBI__ZFAST_OUT  (258 + 8)
 
-static const int stbi__zdist_extra[32] =
-{ 0,0,0,0,1,1,2,2,3,3,4,4,5,5,6,6,7,7,8,8,9,9,10,10,11,11,12,12,13,13};
+// streaming: copies as much of a match as fits into zout, and keeps the rest
+// for when there is room again
+static char *stbi__zcopy_match_part(stbi__zbuf *a, char *zout, int len, int dist)
+{
+   char *p = zout - dist;
+   int n = (int) (a->zout_end - zout);
+   if (n > len) n = len;
+   a->match_len = len - n;
+   a->match_dist = dist;
+   while (n--) *zout++ = *p++;
+   return zout;
+}
 
 static int stbi__parse_huffman_block(stbi__zbuf *a)
 {
    char *zout = a->zout;
+   if (a->match_len) {
+      zout = stbi__zcopy_match_part(a, zout, a->match_len, a->match_dist);
+      if (a->match_len) {
+         a->zout = zout;
+         return STBI__ZSUSPENDED;
+      }
+   }
    for(;;) {
-      int z = stbi__zhuffman_decode(a, &a->z_length);
-      if (z < 256) {
-         if (z < 0) return stbi__err("bad huffman code","Corrupt PNG"); // error in huffman codes
+      int z, len, dist;
+      int fast = a->zbuffer_end - a->zbuffer >= 8 + a->zbuffer_reserve && a->zout_end - zout >= STBI__ZFAST_OUT;
+      if (fast) {
+         // one refill covers a run of literals, or a length and distance
+         // with their extra bits (at most 48 bits)
+         stbi__fill_bits(a);
+         z = (int) a->z_length.fast[a->code_buffer & STBI__ZFAST_MASK];
+         if (z & STBI__ZLITERAL) {
+            // in locals, as the stores through zout could alias them
+            stbi__uint32 *fast_table = a->z_length.fast;
+            stbi__uint64 code_buffer = a->code_buffer;
+            int num_bits = a->num_bits;
+            do {
+               code_buffer >>= z & 255;
+               num_bits -= z & 255;
+               *zout++ = (char) (z >> 16);
+               z = (int) fast_table[code_buffer & STBI__ZFAST_MASK];
+            } while ((z & STBI__ZLITERAL) && (z & 255) <= num_bits);
+            a->code_buffer = code_buffer;
+            a->num_bits = num_bits;
+            continue;
+         }
+      } else if (a->z_streaming && (zout >= a->zout_end || a->zbuffer_end - a->zbuffer < a->zbuffer_reserve)) {
+         a->zout = zout;
+         return STBI__ZSUSPENDED;
+      }
+      z = stbi__zhuffman_decode(a, &a->z_length);
+      if (z < 0 || (z & STBI__ZINVALID)) return stbi__err("bad huffman code","Corrupt PNG"); // error in huffman codes
+      if (z & STBI__ZLITERAL) {
          if (zout >= a->zout_end) {
             if (!stbi__zexpand(a, zout, 1)) return 0;
             zout = a->zout;
          }
-         *zout++ = (char) z;
+         *zout++ = (char) (z >> 16);
       } else {
-         stbi_uc *p;
-         int len,dist;
-         if (z == 256) {
+         char *p;
+         if (z & STBI__ZEOB) {
             a->zout = zout;
+            if (stbi__zoverread(a)) return stbi__err("unexpected end","Corrupt PNG");
             return 1;
          }
-         z -= 257;
-         len = stbi__zlength_base[z];
-         if (stbi__zlength_extra[z]) len += stbi__zreceive(a, stbi__zlength_extra[z]);
+         len = (z >> 16) + stbi__zreceive(a, (z >> 8) & 31);
          z = stbi__zhuffman_decode(a, &a->z_distance);
-         if (z < 0) return stbi__err("bad huffman code","Corrupt PNG");
-         dist = stbi__zdist_base[z];
-         if (stbi__zdist_extra[z]) dist += stbi__zreceive(a, stbi__zdist_extra[z]);
+         if (z < 0 || (z & STBI__ZINVALID)) return stbi__err("bad huffman code","Corrupt PNG");
+         dist = (z >> 16) + stbi__zreceive(a, (z >> 8) & 31);
          if (zout - a->zout_start < dist) return stbi__err("bad dist","Corrupt PNG");
-         if (zout + len > a->zout_end) {
-            if (!stbi__zexpand(a, zout, len)) return 0;
-            zout = a->zout;
-         }
-         p = (stbi_uc *) (zout - dist);
-         if (dist == 1) { // run of one byte; common in images.
-            stbi_uc v = *p;
-            if (len) { do *zout++ = v; while (--len); }
+         p = zout - dist;
+         if (fast) {
+            // copy 8 bytes at a time, running over the end of the match;
+            // with a distance under 8 that would read bytes not written yet
+            char *end = zout + len;
+            if (dist >= 8) {
+               do { memcpy(zout, p, 8); zout += 8; p += 8; } while (zout < end);
+            } else if (dist == 1) { // run of one byte; common in images.
+               stbi__uint64 v = (stbi_uc) *p * (stbi__uint64) 0x0101010101010101;
+               do { memcpy(zout, &v, 8); zout += 8; } while (zout < end);
+            } else {
+               do *zout++ = *p++; while (zout < end);
+            }
+            zout = end;
+         } else if (zout + len > a->zout_end && a->z_streaming) {
+            a->zout = stbi__zcopy_match_part(a, zout, len, dist);
+            return STBI__ZSUSPENDED;
          } else {
-            if (len) { do *zout++ = *p++; while (--len); }
+            if (zout + len > a->zout_end) {
+               if (!stbi__zexpand(a, zout, len)) return 0;
+               zout = a->zout;
+               p = zout - dist;
+            }
+            do *zout++ = *p++; while (--len);
          }
       }
    }
@@ -4297,12 +7141,14 @@ static int stbi__compute_huffman_codes(stbi__zbuf *a)
       int s = stbi__zreceive(a,3);
       codelength_sizes[length_dezigzag[i]] = (stbi_uc) s;
    }
-   if (!stbi__zbuild_huffman(&z_codelength, codelength_sizes, 19)) return 0;
+   if (!stbi__zbuild_huffman(&z_codelength, codelength_sizes, 19, STBI__ZSYMBOLS)) return 0;
 
    n = 0;
    while (n < ntot) {
       int c = stbi__zhuffman_decode(a, &z_codelength);
-      if (c < 0 || c >= 19) return stbi__err("bad codelengths", "Corrupt PNG");
+      if (c < 0) return stbi__err("bad codelengths", "Corrupt PNG");
+      c >>= 16;
+      if (c >= 19) return stbi__err("bad codelengths", "Corrupt PNG");
       if (c < 16)
          lencodes[n++] = (stbi_uc) c;
       else {
@@ -4324,8 +7170,8 @@ static int stbi__compute_huffman_codes(stbi__zbuf *a)
       }
    }
    if (n != ntot) return stbi__err("bad codelengths","Corrupt PNG");
-   if (!stbi__zbuild_huffman(&a->z_length, lencodes, hlit)) return 0;
-   if (!stbi__zbuild_huffman(&a->z_distance, lencodes+hlit, hdist)) return 0;
+   if (!stbi__zbuild_huffman(&a->z_length, lencodes, hlit, STBI__ZLITLEN)) return 0;
+   if (!stbi__zbuild_huffman(&a->z_distance, lencodes+hlit, hdist, STBI__ZDIST)) return 0;
    return 1;
 }
 
@@ -4335,26 +7181,43 @@ static int stbi__parse_uncompressed_block(stbi__zbuf *a)
    int len,nlen,k;
    if (a->num_bits & 7)
       stbi__zreceive(a, a->num_bits & 7); // discard
-   // drain the bit-packed data into header
-   k = 0;
-   while (a->num_bits > 0) {
-      header[k++] = (stbi_uc) (a->code_buffer & 255); // suppress MSVC run-time check
-      a->code_buffer >>= 8;
-      a->num_bits -= 8;
-   }
-   if (a->num_bits < 0) return stbi__err("zlib corrupt","Corrupt PNG");
+   // give the whole bytes left in the bit buffer back to the input, except
+   // for the zeros fed in after its end
+   if (stbi__zoverread(a)) return stbi__err("zlib corrupt","Corrupt PNG");
+   a->zbuffer -= (a->num_bits >> 3) - a->zeof_bytes;
+   a->num_bits = 0;
+   a->zeof_bytes = 0;
+   a->code_buffer = 0;
    // now fill header the normal way
-   while (k < 4)
-      header[k++] = stbi__zget8(a);
+   for (k=0; k < 4; ++k)
+      header[k] = stbi__zget8(a);
    len  = header[1] * 256 + header[0];
    nlen = header[3] * 256 + header[2];
    if (nlen != (len ^ 0xffff)) return stbi__err("zlib corrupt","Corrupt PNG");
-   if (a->zbuffer + len > a->zbuffer_end) return stbi__err("read past buffer","Corrupt PNG");
-   if (a->zout + len > a->zout_end)
-      if (!stbi__zexpand(a, a->zout, len)) return 0;
-   memcpy(a->zout, a->zbuffer, len);
-   a->zbuffer += len;
-   a->zout += len;
+   a->stored_left = len;
+   return 1;
+}
+
+static int stbi__copy_uncompressed_block(stbi__zbuf *a)
+{
+   while (a->stored_left) {
+      int len = a->stored_left;
+      if (a->zbuffer_end - a->zbuffer < len) {
+         if (!a->zbuffer_reserve) return stbi__err("read past buffer","Corrupt PNG");
+         len = (int) (a->zbuffer_end - a->zbuffer); // the rest is still to come
+      }
+      if (a->zout_end - a->zout < len) {
+         if (a->z_streaming)
+            len = (int) (a->zout_end - a->zout);
+         else if (!stbi__zexpand(a, a->zout, len))
+            return 0;
+      }
+      if (!len) return STBI__ZSUSPENDED;
+      memcpy(a->zout, a->zbuffer, len);
+      a->zbuffer += len;
+      a->zout += len;
+      a->stored_left -= len;
+   }
    return 1;
 }
 
@@ -4401,40 +7264,83 @@ Init algorithm:
 }
 */
 
-static int stbi__parse_zlib(stbi__zbuf *a, int parse_header)
+static int stbi__zstart(stbi__zbuf *a, int parse_header)
 {
-   int final, type;
    if (parse_header)
       if (!stbi__parse_zlib_header(a)) return 0;
    a->num_bits = 0;
+   a->zeof_bytes = 0;
    a->code_buffer = 0;
-   do {
-      final = stbi__zreceive(a,1);
-      type = stbi__zreceive(a,2);
-      if (type == 0) {
-         if (!stbi__parse_uncompressed_block(a)) return 0;
-      } else if (type == 3) {
-         return 0;
-      } else {
-         if (type == 1) {
-            // use fixed code lengths
-            if (!stbi__zbuild_huffman(&a->z_length  , stbi__zdefault_length  , STBI__ZNSYMS)) return 0;
-            if (!stbi__zbuild_huffman(&a->z_distance, stbi__zdefault_distance,  32)) return 0;
-         } else {
-            if (!stbi__compute_huffman_codes(a)) return 0;
-         }
-         if (!stbi__parse_huffman_block(a)) return 0;
-      }
-   } while (!final);
+   a->zstate = STBI__ZBLOCK_START;
+   a->zfinal = 0;
+   a->stored_left = 0;
+   a->match_len = 0;
    return 1;
 }
 
-static int stbi__do_zlib(stbi__zbuf *a, char *obuf, int olen, int exp, int parse_header)
+// decodes blocks until the end of the stream (returns 1), an error (0), or,
+// for z_streaming, until zout is full or the input runs low
+static int stbi__zinflate(stbi__zbuf *a)
 {
-   a->zout_start = obuf;
+   for (;;) {
+      int result;
+      switch (a->zstate) {
+         case STBI__ZBLOCK_START: {
+            int type;
+            if (a->zfinal) {
+               a->zstate = STBI__ZDONE;
+               return 1;
+            }
+            if (a->zbuffer_end - a->zbuffer < a->zbuffer_reserve) return STBI__ZSUSPENDED;
+            a->zfinal = stbi__zreceive(a,1);
+            type = stbi__zreceive(a,2);
+            if (type == 0) {
+               if (!stbi__parse_uncompressed_block(a)) return 0;
+               a->zstate = STBI__ZBLOCK_STORED;
+            } else if (type == 3) {
+               return 0;
+            } else {
+               if (type == 1) {
+                  // use fixed code lengths
+                  if (!stbi__zbuild_huffman(&a->z_length  , stbi__zdefault_length  , STBI__ZNSYMS, STBI__ZLITLEN)) return 0;
+                  if (!stbi__zbuild_huffman(&a->z_distance, stbi__zdefault_distance,  32, STBI__ZDIST)) return 0;
+               } else {
+                  if (!stbi__compute_huffman_codes(a)) return 0;
+               }
+               a->zstate = STBI__ZBLOCK_HUFFMAN;
+            }
+            break;
+         }
+         case STBI__ZBLOCK_HUFFMAN:
+            result = stbi__parse_huffman_block(a);
+            if (result != 1) return result;
+            a->zstate = STBI__ZBLOCK_START;
+            break;
+         case STBI__ZBLOCK_STORED:
+            result = stbi__copy_uncompressed_block(a);
+            if (result != 1) return result;
+            a->zstate = STBI__ZBLOCK_START;
+            break;
+         default:
+            return 1;
+      }
+   }
+}
+
+static int stbi__parse_zlib(stbi__zbuf *a, int parse_header)
+{
+   if (!stbi__zstart(a, parse_header)) return 0;
+   return stbi__zinflate(a);
+}
+
+static int stbi__do_zlib(stbi__zbuf *a, char *obuf, int olen, int exp, int parse_header)
+{
+   a->zout_start = obuf;
    a->zout       = obuf;
    a->zout_end   = obuf + olen;
    a->z_expandable = exp;
+   a->z_streaming = 0;
+   a->zbuffer_reserve = 0;
 
    return stbi__parse_zlib(a, parse_header);
 }
@@ -4450,7 +7356,7 @@ STBIDEF char *stbi_zlib_decode_malloc_guesssize(const char *buffer, int len, int
       if (outlen) *outlen = (int) (a.zout - a.zout_start);
       return a.zout_start;
    } else {
-      STBI_FREE(a.zout_start);
+      stbi__free(a.zout_start);
       return NULL;
    }
 }
@@ -4471,7 +7377,7 @@ STBIDEF char *stbi_zlib_decode_malloc_guesssize_headerflag(const char *buffer, i
       if (outlen) *outlen = (int) (a.zout - a.zout_start);
       return a.zout_start;
    } else {
-      STBI_FREE(a.zout_start);
+      stbi__free(a.zout_start);
       return NULL;
    }
 }
@@ -4498,7 +7404,7 @@ STBIDEF char *stbi_zlib_decode_noheader_malloc(char const *buffer, int len, int
       if (outlen) *outlen = (int) (a.zout - a.zout_start);
       return a.zout_start;
    } else {
-      STBI_FREE(a.zout_start);
+      stbi__free(a.zout_start);
       return NULL;
    }
 }
@@ -4554,6 +7460,14 @@ typedef struct
    stbi__context *s;
    stbi_uc *idata, *expanded, *out;
    int depth;
+
+   // from the chunks before the image data
+   int color, interlace, is_iphone;
+   int pal_img_n, has_trans;
+   stbi__uint32 pal_len;
+   stbi__uint32 idat_len; // of the first IDAT, when stopped at it by STBI__SCAN_idat
+   stbi_uc palette[1024], tc[3];
+   stbi__uint16 tc16[3];
 } stbi__png;
 
 
@@ -4562,47 +7476,325 @@ enum {
    STBI__F_sub=1,
    STBI__F_up=2,
    STBI__F_avg=3,
-   STBI__F_paeth=4,
-   // synthetic filters used for first scanline to avoid needing a dummy row of 0s
-   STBI__F_avg_first,
-   STBI__F_paeth_first
+   STBI__F_paeth=4
 };
 
-static stbi_uc first_row_filter[5] =
+static int stbi__paeth(int a, int b, int c)
+{
+   // equivalent to the PNG spec's predictor (pa = |b-c|, pb = |a-c|,
+   // pc = |a+b-2c|, ties to a then b) but branch-free, which matters on
+   // noisy rows where the spec's comparisons mispredict
+   int thresh = c*3 - (a + b);
+   int lo = a < b ? a : b;
+   int hi = a < b ? b : a;
+   int t0 = (hi <= thresh) ? lo : c;
+   return (thresh <= lo) ? hi : t0;
+}
+
+// unfilters the n bytes of a scanline into cur, with bpp bytes per pixel
+// (1 for depths below 8). prior is the previous unfiltered scanline, all
+// zeros for the first one, which makes the filters need no special case
+// there.
+static void stbi__png_unfilter_row(int filter, stbi_uc *cur, stbi_uc const *raw, stbi_uc const *prior, int n, int bpp)
 {
-   STBI__F_none,
-   STBI__F_sub,
-   STBI__F_none,
-   STBI__F_avg_first,
-   STBI__F_paeth_first
-};
+   int k;
+   switch (filter) {
+      case STBI__F_none:
+         memcpy(cur, raw, n);
+         break;
+      case STBI__F_sub:
+         memcpy(cur, raw, bpp);
+         for (k=bpp; k < n; ++k) cur[k] = STBI__BYTECAST(raw[k] + cur[k-bpp]);
+         break;
+      case STBI__F_up:
+         for (k=0; k < n; ++k) cur[k] = STBI__BYTECAST(raw[k] + prior[k]);
+         break;
+      case STBI__F_avg:
+         for (k=0; k < bpp; ++k) cur[k] = STBI__BYTECAST(raw[k] + (prior[k]>>1));
+         for (k=bpp; k < n; ++k) cur[k] = STBI__BYTECAST(raw[k] + ((prior[k] + cur[k-bpp])>>1));
+         break;
+      case STBI__F_paeth:
+         for (k=0; k < bpp; ++k) cur[k] = STBI__BYTECAST(raw[k] + prior[k]); // prior[k] == stbi__paeth(0,prior[k],0)
+         for (k=bpp; k < n; ++k) cur[k] = STBI__BYTECAST(raw[k] + stbi__paeth(cur[k-bpp],prior[k],prior[k-bpp]));
+         break;
+   }
+}
 
-static int stbi__paeth(int a, int b, int c)
+typedef void stbi__png_unfilter_func(int filter, stbi_uc *cur, stbi_uc const *raw, stbi_uc const *prior, int n, int bpp);
+
+// the SIMD kernels store whole registers past the end of the scanline
+#define STBI__PNG_ROW_SLACK  16
+
+#ifdef STBI_SSE2
+// Sub and Avg with 3 to 8 bytes per pixel take a pixel per step in the low
+// bytes of a register; the bytes above it are garbage that the following
+// steps overwrite
+
+#define STBI__PNG_PIXEL_LOOP(step) \
+   for (k=0; k < n; k += bpp) { \
+      __m128i x, d; \
+      if (k + 8 <= n) \
+         x = _mm_loadl_epi64((__m128i const *) (raw+k)); \
+      else { \
+         stbi__uint64 v = 0; \
+         memcpy(&v, raw+k, bpp); \
+         x = _mm_loadl_epi64((__m128i const *) &v); \
+      } \
+      { step; } \
+      _mm_storel_epi64((__m128i *) (cur+k), d); \
+      a = d; \
+   }
+
+static stbi_inline __m128i stbi__select_sse2(__m128i mask, __m128i if_set, __m128i if_clear)
 {
-   int p = a + b - c;
-   int pa = abs(p-a);
-   int pb = abs(p-b);
-   int pc = abs(p-c);
-   if (pa <= pb && pa <= pc) return a;
-   if (pb <= pc) return b;
-   return c;
+   return _mm_or_si128(_mm_and_si128(mask, if_set), _mm_andnot_si128(mask, if_clear));
+}
+
+// prefix sum of the Sub filter for 1 and 2 bytes per pixel, 16 bytes at a
+// time; returns how far it got
+static int stbi__png_unfilter_sub_small_sse2(stbi_uc *cur, stbi_uc const *raw, int n, int bpp)
+{
+   int k;
+   __m128i carry = _mm_setzero_si128(); // last pixel so far in every pixel
+   for (k=0; k+16 <= n; k += 16) {
+      __m128i x = _mm_loadu_si128((__m128i const *) (raw+k));
+      if (bpp == 1) {
+         x = _mm_add_epi8(x, _mm_slli_si128(x, 1));
+         x = _mm_add_epi8(x, _mm_slli_si128(x, 2));
+      } else {
+         x = _mm_add_epi8(x, _mm_slli_si128(x, 2));
+      }
+      x = _mm_add_epi8(x, _mm_slli_si128(x, 4));
+      x = _mm_add_epi8(x, _mm_slli_si128(x, 8));
+      x = _mm_add_epi8(x, carry);
+      _mm_storeu_si128((__m128i *) (cur+k), x);
+      if (bpp == 1)
+         carry = _mm_set1_epi8((char) cur[k+15]);
+      else
+         carry = _mm_set1_epi16((short) (cur[k+14] | (cur[k+15] << 8)));
+   }
+   return k;
+}
+
+static void stbi__png_unfilter_row_sse2(int filter, stbi_uc *cur, stbi_uc const *raw, stbi_uc const *prior, int n, int bpp)
+{
+   int k;
+   __m128i zero = _mm_setzero_si128();
+   __m128i a = zero; // left
+
+   if (filter == STBI__F_up) {
+      for (k=0; k+16 <= n; k += 16)
+         _mm_storeu_si128((__m128i *) (cur+k), _mm_add_epi8(_mm_loadu_si128((__m128i const *) (raw+k)), _mm_loadu_si128((__m128i const *) (prior+k))));
+      for (; k < n; ++k) cur[k] = STBI__BYTECAST(raw[k] + prior[k]);
+      return;
+   }
+   if (filter == STBI__F_sub && bpp <= 2) {
+      k = stbi__png_unfilter_sub_small_sse2(cur, raw, n, bpp);
+      for (; k < n; ++k) cur[k] = STBI__BYTECAST(raw[k] + (k >= bpp ? cur[k-bpp] : 0));
+      return;
+   }
+   if (filter == STBI__F_none || bpp < 3) {
+      stbi__png_unfilter_row(filter, cur, raw, prior, n, bpp);
+      return;
+   }
+
+   switch (filter) {
+      case STBI__F_sub:
+         STBI__PNG_PIXEL_LOOP(d = _mm_add_epi8(x, a));
+         break;
+      case STBI__F_avg: {
+         // floor((a + b) / 2) from the rounding up average
+         __m128i one = _mm_set1_epi8(1);
+         STBI__PNG_PIXEL_LOOP(
+            __m128i b = _mm_loadl_epi64((__m128i const *) (prior+k));
+            d = _mm_add_epi8(x, _mm_sub_epi8(_mm_avg_epu8(a, b), _mm_and_si128(_mm_xor_si128(a, b), one))));
+         break;
+      }
+      case STBI__F_paeth: {
+         // the left and upper left pixels stay widened to 16 bits, and the
+         // predictor is picked the way stbi__paeth does, so the chain from one
+         // pixel to the next is only a few instructions long
+         __m128i aw = zero, cw = zero, byte_mask = _mm_set1_epi16(0xff);
+         for (k=0; k < n; k += bpp) {
+            __m128i x, bw, thresh, lo, hi, t0, t1, dw;
+            if (k + 8 <= n)
+               x = _mm_loadl_epi64((__m128i const *) (raw+k));
+            else {
+               stbi__uint64 v = 0;
+               memcpy(&v, raw+k, bpp);
+               x = _mm_loadl_epi64((__m128i const *) &v);
+            }
+            x = _mm_unpacklo_epi8(x, zero);
+            bw = _mm_unpacklo_epi8(_mm_loadl_epi64((__m128i const *) (prior+k)), zero);
+            thresh = _mm_sub_epi16(_mm_sub_epi16(_mm_add_epi16(cw, _mm_add_epi16(cw, cw)), bw), aw);
+            lo = _mm_min_epi16(aw, bw);
+            hi = _mm_max_epi16(aw, bw);
+            t0 = stbi__select_sse2(_mm_cmpgt_epi16(hi, thresh), cw, lo);
+            t1 = stbi__select_sse2(_mm_cmpgt_epi16(thresh, lo), t0, hi);
+            dw = _mm_and_si128(_mm_add_epi16(x, t1), byte_mask);
+            _mm_storel_epi64((__m128i *) (cur+k), _mm_packus_epi16(dw, dw));
+            cw = bw;
+            aw = dw;
+         }
+         break;
+      }
+   }
+}
+#endif // STBI_SSE2
+
+#ifdef STBI_AVX2
+// Up 32 bytes at a time; everything else is the SSE2 kernel
+STBI__AVX2_TARGET
+static void stbi__png_unfilter_row_avx2(int filter, stbi_uc *cur, stbi_uc const *raw, stbi_uc const *prior, int n, int bpp)
+{
+   int k;
+   if (filter == STBI__F_up) {
+      for (k=0; k+32 <= n; k += 32)
+         _mm256_storeu_si256((__m256i *) (cur+k), _mm256_add_epi8(_mm256_loadu_si256((__m256i const *) (raw+k)), _mm256_loadu_si256((__m256i const *) (prior+k))));
+      for (; k < n; ++k) cur[k] = STBI__BYTECAST(raw[k] + prior[k]);
+   } else {
+      stbi__png_unfilter_row_sse2(filter, cur, raw, prior, n, bpp);
+   }
+}
+#endif // STBI_AVX2
+
+static stbi__png_unfilter_func *stbi__png_unfilter_kernel(void)
+{
+#ifdef STBI_AVX2
+   if (stbi__simd_level >= STBI_SIMD_AVX2 && stbi__avx2_available())
+      return stbi__png_unfilter_row_avx2;
+#endif
+#ifdef STBI_SSE2
+   if (stbi__simd_level >= STBI_SIMD_SSE2 && stbi__sse2_available())
+      return stbi__png_unfilter_row_sse2;
+#endif
+   return stbi__png_unfilter_row;
 }
 
 static const stbi_uc stbi__depth_scale_table[9] = { 0, 0xff, 0x55, 0, 0x11, 0,0,0, 0x01 };
 
+// copies an unfiltered scanline to its place in the output; for depths below
+// 8 to the rightmost bytes, so that the bits can be expanded in place
+static void stbi__png_store_row(stbi_uc *dest, stbi_uc const *cur, stbi__uint32 x, int img_n, int out_n, int depth, stbi__uint32 img_width_bytes)
+{
+   int filter_bytes = img_n * (depth == 16 ? 2 : 1);
+   stbi__uint32 i;
+   int k;
+   if (depth < 8) {
+      memcpy(dest + x*out_n - img_width_bytes, cur, img_width_bytes);
+   } else if (img_n == out_n) {
+      memcpy(dest, cur, img_width_bytes);
+   } else if (depth == 8) {
+      // add an opaque alpha channel
+      stbi__convert_row(cur, dest, img_n, out_n, x);
+   } else {
+      STBI_ASSERT(img_n+1 == out_n);
+      for (i=0; i < x; ++i, dest += filter_bytes + (depth == 16 ? 2 : 1), cur += filter_bytes) {
+         for (k=0; k < filter_bytes; ++k)
+            dest[k] = cur[k];
+         dest[filter_bytes] = 255;
+         if (depth == 16) dest[filter_bytes+1] = 255;
+      }
+   }
+}
+
+// unpacks the 1/2/4-bit samples stbi__png_store_row left at the right end of
+// a row into 8-bit ones, adding an opaque alpha channel if out_n asks for it
+static void stbi__png_expand_row(stbi_uc *row, stbi__uint32 x, int img_n, int out_n, int depth, int color, stbi__uint32 img_width_bytes)
+{
+   int k;
+   stbi_uc *cur = row;
+   stbi_uc *in  = row + x*out_n - img_width_bytes;
+   // unpack 1/2/4-bit into a 8-bit buffer. allows us to keep the common 8-bit path optimal at minimal cost for 1/2/4-bit
+   // png guarante byte alignment, if width is not multiple of 8/4/2 we'll decode dummy trailing data that will be skipped in the later loop
+   stbi_uc scale = (color == 0) ? stbi__depth_scale_table[depth] : 1; // scale grayscale values to 0..255 range
+
+   // note that the final byte might overshoot and write more data than desired.
+   // we can allocate enough data that this never writes out of memory, but it
+   // could also overwrite the next scanline. can it overwrite non-empty data
+   // on the next scanline? yes, consider 1-pixel-wide scanlines with 1-bit-per-pixel.
+   // so we need to explicitly clamp the final ones
+
+   if (depth == 4) {
+      for (k=x*img_n; k >= 2; k-=2, ++in) {
+         *cur++ = scale * ((*in >> 4)       );
+         *cur++ = scale * ((*in     ) & 0x0f);
+      }
+      if (k > 0) *cur++ = scale * ((*in >> 4)       );
+   } else if (depth == 2) {
+      for (k=x*img_n; k >= 4; k-=4, ++in) {
+         *cur++ = scale * ((*in >> 6)       );
+         *cur++ = scale * ((*in >> 4) & 0x03);
+         *cur++ = scale * ((*in >> 2) & 0x03);
+         *cur++ = scale * ((*in     ) & 0x03);
+      }
+      if (k > 0) *cur++ = scale * ((*in >> 6)       );
+      if (k > 1) *cur++ = scale * ((*in >> 4) & 0x03);
+      if (k > 2) *cur++ = scale * ((*in >> 2) & 0x03);
+   } else if (depth == 1) {
+      for (k=x*img_n; k >= 8; k-=8, ++in) {
+         *cur++ = scale * ((*in >> 7)       );
+         *cur++ = scale * ((*in >> 6) & 0x01);
+         *cur++ = scale * ((*in >> 5) & 0x01);
+         *cur++ = scale * ((*in >> 4) & 0x01);
+         *cur++ = scale * ((*in >> 3) & 0x01);
+         *cur++ = scale * ((*in >> 2) & 0x01);
+         *cur++ = scale * ((*in >> 1) & 0x01);
+         *cur++ = scale * ((*in     ) & 0x01);
+      }
+      if (k > 0) *cur++ = scale * ((*in >> 7)       );
+      if (k > 1) *cur++ = scale * ((*in >> 6) & 0x01);
+      if (k > 2) *cur++ = scale * ((*in >> 5) & 0x01);
+      if (k > 3) *cur++ = scale * ((*in >> 4) & 0x01);
+      if (k > 4) *cur++ = scale * ((*in >> 3) & 0x01);
+      if (k > 5) *cur++ = scale * ((*in >> 2) & 0x01);
+      if (k > 6) *cur++ = scale * ((*in >> 1) & 0x01);
+   }
+   if (img_n != out_n) {
+      int q;
+      // insert alpha = 255
+      cur = row;
+      if (img_n == 1) {
+         for (q=x-1; q >= 0; --q) {
+            cur[q*2+1] = 255;
+            cur[q*2+0] = cur[q];
+         }
+      } else {
+         STBI_ASSERT(img_n == 3);
+         for (q=x-1; q >= 0; --q) {
+            cur[q*4+3] = 255;
+            cur[q*4+2] = cur[q*3+2];
+            cur[q*4+1] = cur[q*3+1];
+            cur[q*4+0] = cur[q*3+0];
+         }
+      }
+   }
+}
+
+// 16-bit samples from big-endian to platform-native; the unfiltering works on
+// its own copy of the scanlines, so this can run right after storing a row
+static void stbi__png_swap16(stbi_uc *cur, stbi__uint32 n)
+{
+   stbi__uint16 *cur16 = (stbi__uint16*)cur;
+   stbi__uint32 i;
+   for(i=0; i < n; ++i,cur16++,cur+=2) {
+      *cur16 = (cur[0] << 8) | cur[1];
+   }
+}
+
 // create the png data from post-deflated data
 static int stbi__create_png_image_raw(stbi__png *a, stbi_uc *raw, stbi__uint32 raw_len, int out_n, stbi__uint32 x, stbi__uint32 y, int depth, int color)
 {
    int bytes = (depth == 16? 2 : 1);
    stbi__context *s = a->s;
-   stbi__uint32 i,j,stride = x*out_n*bytes;
+   stbi__uint32 j,stride = x*out_n*bytes;
    stbi__uint32 img_len, img_width_bytes;
-   int k;
    int img_n = s->img_n; // copy it into a local for later
 
    int output_bytes = out_n*bytes;
-   int filter_bytes = img_n*bytes;
-   int width = x;
+   int filter_bytes = depth < 8 ? 1 : img_n*bytes;
+   stbi_uc *filter_buf;
+   stbi__png_unfilter_func *unfilter = stbi__png_unfilter_kernel();
 
    STBI_ASSERT(out_n == s->img_n || out_n == s->img_n+1);
    a->out = (stbi_uc *) stbi__malloc_mad3(x, y, output_bytes, 0); // extra bytes to write off the end into
@@ -4617,188 +7809,38 @@ static int stbi__create_png_image_raw(stbi__png *a, stbi_uc *raw, stbi__uint32 r
    // so just check for raw_len < img_len always.
    if (raw_len < img_len) return stbi__err("not enough pixels","Corrupt PNG");
 
+   // unfilter into two alternating scanlines, the first of them cleared to
+   // stand in for the row above the image, and copy into the output from there
+   filter_buf = (stbi_uc *) stbi__malloc_mad2(img_width_bytes, 2, 2*STBI__PNG_ROW_SLACK);
+   if (!filter_buf) return stbi__err("outofmem", "Out of memory");
+   memset(filter_buf, 0, img_width_bytes + STBI__PNG_ROW_SLACK);
+
+   if (depth < 8 && img_width_bytes > x) {
+      stbi__free(filter_buf);
+      return stbi__err("invalid width","Corrupt PNG");
+   }
+
    for (j=0; j < y; ++j) {
-      stbi_uc *cur = a->out + stride*j;
-      stbi_uc *prior;
+      stbi_uc *dest = a->out + stride*j;
+      stbi_uc *prior = filter_buf + (j & 1)*(img_width_bytes + STBI__PNG_ROW_SLACK);
+      stbi_uc *cur = filter_buf + (~j & 1)*(img_width_bytes + STBI__PNG_ROW_SLACK);
       int filter = *raw++;
 
-      if (filter > 4)
+      if (filter > 4) {
+         stbi__free(filter_buf);
          return stbi__err("invalid filter","Corrupt PNG");
-
-      if (depth < 8) {
-         if (img_width_bytes > x) return stbi__err("invalid width","Corrupt PNG");
-         cur += x*out_n - img_width_bytes; // store output to the rightmost img_len bytes, so we can decode in place
-         filter_bytes = 1;
-         width = img_width_bytes;
-      }
-      prior = cur - stride; // bugfix: need to compute this after 'cur +=' computation above
-
-      // if first row, use special filter that doesn't sample previous row
-      if (j == 0) filter = first_row_filter[filter];
-
-      // handle first byte explicitly
-      for (k=0; k < filter_bytes; ++k) {
-         switch (filter) {
-            case STBI__F_none       : cur[k] = raw[k]; break;
-            case STBI__F_sub        : cur[k] = raw[k]; break;
-            case STBI__F_up         : cur[k] = STBI__BYTECAST(raw[k] + prior[k]); break;
-            case STBI__F_avg        : cur[k] = STBI__BYTECAST(raw[k] + (prior[k]>>1)); break;
-            case STBI__F_paeth      : cur[k] = STBI__BYTECAST(raw[k] + stbi__paeth(0,prior[k],0)); break;
-            case STBI__F_avg_first  : cur[k] = raw[k]; break;
-            case STBI__F_paeth_first: cur[k] = raw[k]; break;
-         }
       }
 
-      if (depth == 8) {
-         if (img_n != out_n)
-            cur[img_n] = 255; // first pixel
-         raw += img_n;
-         cur += out_n;
-         prior += out_n;
-      } else if (depth == 16) {
-         if (img_n != out_n) {
-            cur[filter_bytes]   = 255; // first pixel top byte
-            cur[filter_bytes+1] = 255; // first pixel bottom byte
-         }
-         raw += filter_bytes;
-         cur += output_bytes;
-         prior += output_bytes;
-      } else {
-         raw += 1;
-         cur += 1;
-         prior += 1;
-      }
-
-      // this is a little gross, so that we don't switch per-pixel or per-component
-      if (depth < 8 || img_n == out_n) {
-         int nk = (width - 1)*filter_bytes;
-         #define STBI__CASE(f) \
-             case f:     \
-                for (k=0; k < nk; ++k)
-         switch (filter) {
-            // "none" filter turns into a memcpy here; make that explicit.
-            case STBI__F_none:         memcpy(cur, raw, nk); break;
-            STBI__CASE(STBI__F_sub)          { cur[k] = STBI__BYTECAST(raw[k] + cur[k-filter_bytes]); } break;
-            STBI__CASE(STBI__F_up)           { cur[k] = STBI__BYTECAST(raw[k] + prior[k]); } break;
-            STBI__CASE(STBI__F_avg)          { cur[k] = STBI__BYTECAST(raw[k] + ((prior[k] + cur[k-filter_bytes])>>1)); } break;
-            STBI__CASE(STBI__F_paeth)        { cur[k] = STBI__BYTECAST(raw[k] + stbi__paeth(cur[k-filter_bytes],prior[k],prior[k-filter_bytes])); } break;
-            STBI__CASE(STBI__F_avg_first)    { cur[k] = STBI__BYTECAST(raw[k] + (cur[k-filter_bytes] >> 1)); } break;
-            STBI__CASE(STBI__F_paeth_first)  { cur[k] = STBI__BYTECAST(raw[k] + stbi__paeth(cur[k-filter_bytes],0,0)); } break;
-         }
-         #undef STBI__CASE
-         raw += nk;
-      } else {
-         STBI_ASSERT(img_n+1 == out_n);
-         #define STBI__CASE(f) \
-             case f:     \
-                for (i=x-1; i >= 1; --i, cur[filter_bytes]=255,raw+=filter_bytes,cur+=output_bytes,prior+=output_bytes) \
-                   for (k=0; k < filter_bytes; ++k)
-         switch (filter) {
-            STBI__CASE(STBI__F_none)         { cur[k] = raw[k]; } break;
-            STBI__CASE(STBI__F_sub)          { cur[k] = STBI__BYTECAST(raw[k] + cur[k- output_bytes]); } break;
-            STBI__CASE(STBI__F_up)           { cur[k] = STBI__BYTECAST(raw[k] + prior[k]); } break;
-            STBI__CASE(STBI__F_avg)          { cur[k] = STBI__BYTECAST(raw[k] + ((prior[k] + cur[k- output_bytes])>>1)); } break;
-            STBI__CASE(STBI__F_paeth)        { cur[k] = STBI__BYTECAST(raw[k] + stbi__paeth(cur[k- output_bytes],prior[k],prior[k- output_bytes])); } break;
-            STBI__CASE(STBI__F_avg_first)    { cur[k] = STBI__BYTECAST(raw[k] + (cur[k- output_bytes] >> 1)); } break;
-            STBI__CASE(STBI__F_paeth_first)  { cur[k] = STBI__BYTECAST(raw[k] + stbi__paeth(cur[k- output_bytes],0,0)); } break;
-         }
-         #undef STBI__CASE
-
-         // the loop above sets the high byte of the pixels' alpha, but for
-         // 16 bit png files we also need the low byte set. we'll do that here.
-         if (depth == 16) {
-            cur = a->out + stride*j; // start at the beginning of the row again
-            for (i=0; i < x; ++i,cur+=output_bytes) {
-               cur[filter_bytes+1] = 255;
-            }
-         }
-      }
-   }
+      unfilter(filter, cur, raw, prior, img_width_bytes, filter_bytes);
+      raw += img_width_bytes;
 
-   // we make a separate pass to expand bits to pixels; for performance,
-   // this could run two scanlines behind the above code, so it won't
-   // intefere with filtering but will still be in the cache.
-   if (depth < 8) {
-      for (j=0; j < y; ++j) {
-         stbi_uc *cur = a->out + stride*j;
-         stbi_uc *in  = a->out + stride*j + x*out_n - img_width_bytes;
-         // unpack 1/2/4-bit into a 8-bit buffer. allows us to keep the common 8-bit path optimal at minimal cost for 1/2/4-bit
-         // png guarante byte alignment, if width is not multiple of 8/4/2 we'll decode dummy trailing data that will be skipped in the later loop
-         stbi_uc scale = (color == 0) ? stbi__depth_scale_table[depth] : 1; // scale grayscale values to 0..255 range
-
-         // note that the final byte might overshoot and write more data than desired.
-         // we can allocate enough data that this never writes out of memory, but it
-         // could also overwrite the next scanline. can it overwrite non-empty data
-         // on the next scanline? yes, consider 1-pixel-wide scanlines with 1-bit-per-pixel.
-         // so we need to explicitly clamp the final ones
-
-         if (depth == 4) {
-            for (k=x*img_n; k >= 2; k-=2, ++in) {
-               *cur++ = scale * ((*in >> 4)       );
-               *cur++ = scale * ((*in     ) & 0x0f);
-            }
-            if (k > 0) *cur++ = scale * ((*in >> 4)       );
-         } else if (depth == 2) {
-            for (k=x*img_n; k >= 4; k-=4, ++in) {
-               *cur++ = scale * ((*in >> 6)       );
-               *cur++ = scale * ((*in >> 4) & 0x03);
-               *cur++ = scale * ((*in >> 2) & 0x03);
-               *cur++ = scale * ((*in     ) & 0x03);
-            }
-            if (k > 0) *cur++ = scale * ((*in >> 6)       );
-            if (k > 1) *cur++ = scale * ((*in >> 4) & 0x03);
-            if (k > 2) *cur++ = scale * ((*in >> 2) & 0x03);
-         } else if (depth == 1) {
-            for (k=x*img_n; k >= 8; k-=8, ++in) {
-               *cur++ = scale * ((*in >> 7)       );
-               *cur++ = scale * ((*in >> 6) & 0x01);
-               *cur++ = scale * ((*in >> 5) & 0x01);
-               *cur++ = scale * ((*in >> 4) & 0x01);
-               *cur++ = scale * ((*in >> 3) & 0x01);
-               *cur++ = scale * ((*in >> 2) & 0x01);
-               *cur++ = scale * ((*in >> 1) & 0x01);
-               *cur++ = scale * ((*in     ) & 0x01);
-            }
-            if (k > 0) *cur++ = scale * ((*in >> 7)       );
-            if (k > 1) *cur++ = scale * ((*in >> 6) & 0x01);
-            if (k > 2) *cur++ = scale * ((*in >> 5) & 0x01);
-            if (k > 3) *cur++ = scale * ((*in >> 4) & 0x01);
-            if (k > 4) *cur++ = scale * ((*in >> 3) & 0x01);
-            if (k > 5) *cur++ = scale * ((*in >> 2) & 0x01);
-            if (k > 6) *cur++ = scale * ((*in >> 1) & 0x01);
-         }
-         if (img_n != out_n) {
-            int q;
-            // insert alpha = 255
-            cur = a->out + stride*j;
-            if (img_n == 1) {
-               for (q=x-1; q >= 0; --q) {
-                  cur[q*2+1] = 255;
-                  cur[q*2+0] = cur[q];
-               }
-            } else {
-               STBI_ASSERT(img_n == 3);
-               for (q=x-1; q >= 0; --q) {
-                  cur[q*4+3] = 255;
-                  cur[q*4+2] = cur[q*3+2];
-                  cur[q*4+1] = cur[q*3+1];
-                  cur[q*4+0] = cur[q*3+0];
-               }
-            }
-         }
-      }
-   } else if (depth == 16) {
-      // force the image data from big-endian to platform-native.
-      // this is done in a separate pass due to the decoding relying
-      // on the data being untouched, but could probably be done
-      // per-line during decode if care is taken.
-      stbi_uc *cur = a->out;
-      stbi__uint16 *cur16 = (stbi__uint16*)cur;
-
-      for(i=0; i < x*y*out_n; ++i,cur16++,cur+=2) {
-         *cur16 = (cur[0] << 8) | cur[1];
-      }
+      stbi__png_store_row(dest, cur, x, img_n, out_n, depth, img_width_bytes);
+      if (depth < 8)
+         stbi__png_expand_row(dest, x, img_n, out_n, depth, color, img_width_bytes);
+      else if (depth == 16)
+         stbi__png_swap16(dest, x*out_n);
    }
+   stbi__free(filter_buf);
 
    return 1;
 }
@@ -4827,7 +7869,7 @@ static int stbi__create_png_image(stbi__png *a, stbi_uc *image_data, stbi__uint3
       if (x && y) {
          stbi__uint32 img_len = ((((a->s->img_n * x * depth) + 7) >> 3) + 1) * y;
          if (!stbi__create_png_image_raw(a, image_data, image_data_len, out_n, x, y, depth, color)) {
-            STBI_FREE(final);
+            stbi__free(final);
             return 0;
          }
          for (j=0; j < y; ++j) {
@@ -4838,7 +7880,7 @@ static int stbi__create_png_image(stbi__png *a, stbi_uc *image_data, stbi__uint3
                       a->out + (j*x+i)*out_bytes, out_bytes);
             }
          }
-         STBI_FREE(a->out);
+         stbi__free(a->out);
          image_data += img_len;
          image_data_len -= img_len;
       }
@@ -4848,11 +7890,9 @@ static int stbi__create_png_image(stbi__png *a, stbi_uc *image_data, stbi__uint3
    return 1;
 }
 
-static int stbi__compute_transparency(stbi__png *z, stbi_uc tc[3], int out_n)
+static int stbi__compute_transparency(stbi_uc *p, stbi__uint32 pixel_count, stbi_uc tc[3], int out_n)
 {
-   stbi__context *s = z->s;
-   stbi__uint32 i, pixel_count = s->img_x * s->img_y;
-   stbi_uc *p = z->out;
+   stbi__uint32 i;
 
    // compute color-based transparency, assuming we've
    // already got 255 as the alpha value in the output
@@ -4873,11 +7913,9 @@ static int stbi__compute_transparency(stbi__png *z, stbi_uc tc[3], int out_n)
    return 1;
 }
 
-static int stbi__compute_transparency16(stbi__png *z, stbi__uint16 tc[3], int out_n)
+static int stbi__compute_transparency16(stbi__uint16 *p, stbi__uint32 pixel_count, stbi__uint16 tc[3], int out_n)
 {
-   stbi__context *s = z->s;
-   stbi__uint32 i, pixel_count = s->img_x * s->img_y;
-   stbi__uint16 *p = (stbi__uint16*) z->out;
+   stbi__uint32 i;
 
    // compute color-based transparency, assuming we've
    // already got 65535 as the alpha value in the output
@@ -4898,17 +7936,9 @@ static int stbi__compute_transparency16(stbi__png *z, stbi__uint16 tc[3], int ou
    return 1;
 }
 
-static int stbi__expand_png_palette(stbi__png *a, stbi_uc *palette, int len, int pal_img_n)
+static void stbi__png_palette_pixels(stbi_uc *p, stbi_uc const *orig, stbi__uint32 pixel_count, stbi_uc const *palette, int pal_img_n)
 {
-   stbi__uint32 i, pixel_count = a->s->img_x * a->s->img_y;
-   stbi_uc *p, *temp_out, *orig = a->out;
-
-   p = (stbi_uc *) stbi__malloc_mad2(pixel_count, pal_img_n, 0);
-   if (p == NULL) return stbi__err("outofmem", "Out of memory");
-
-   // between here and free(out) below, exitting would leak
-   temp_out = p;
-
+   stbi__uint32 i;
    if (pal_img_n == 3) {
       for (i=0; i < pixel_count; ++i) {
          int n = orig[i]*4;
@@ -4927,8 +7957,19 @@ static int stbi__expand_png_palette(stbi__png *a, stbi_uc *palette, int len, int
          p += 4;
       }
    }
-   STBI_FREE(a->out);
-   a->out = temp_out;
+}
+
+static int stbi__expand_png_palette(stbi__png *a, stbi_uc *palette, int len, int pal_img_n)
+{
+   stbi__uint32 pixel_count = a->s->img_x * a->s->img_y;
+   stbi_uc *p;
+
+   p = (stbi_uc *) stbi__malloc_mad2(pixel_count, pal_img_n, 0);
+   if (p == NULL) return stbi__err("outofmem", "Out of memory");
+
+   stbi__png_palette_pixels(p, a->out, pixel_count, palette, pal_img_n);
+   stbi__free(a->out);
+   a->out = p;
 
    STBI_NOTUSED(len);
 
@@ -4949,8 +7990,8 @@ STBIDEF void stbi_convert_iphone_png_to_rgb(int flag_true_if_should_convert)
 }
 
 #ifndef STBI_THREAD_LOCAL
-#define stbi__unpremultiply_on_load  stbi__unpremultiply_on_load_global
-#define stbi__de_iphone_flag  stbi__de_iphone_flag_global
+#define stbi__unpremultiply_on_load  (stbi__decoder ? stbi__decoder->unpremultiply : stbi__unpremultiply_on_load_global)
+#define stbi__de_iphone_flag  (stbi__decoder ? stbi__decoder->de_iphone : stbi__de_iphone_flag_global)
 #else
 static STBI_THREAD_LOCAL int stbi__unpremultiply_on_load_local, stbi__unpremultiply_on_load_set;
 static STBI_THREAD_LOCAL int stbi__de_iphone_flag_local, stbi__de_iphone_flag_set;
@@ -4967,21 +8008,21 @@ STBIDEF void stbi_convert_iphone_png_to_rgb_thread(int flag_true_if_should_conve
    stbi__de_iphone_flag_set = 1;
 }
 
-#define stbi__unpremultiply_on_load  (stbi__unpremultiply_on_load_set           \
+#define stbi__unpremultiply_on_load  (stbi__decoder ? stbi__decoder->unpremultiply \
+                                       : stbi__unpremultiply_on_load_set        \
                                        ? stbi__unpremultiply_on_load_local      \
                                        : stbi__unpremultiply_on_load_global)
-#define stbi__de_iphone_flag  (stbi__de_iphone_flag_set                         \
+#define stbi__de_iphone_flag  (stbi__decoder ? stbi__decoder->de_iphone         \
+                                : stbi__de_iphone_flag_set                      \
                                 ? stbi__de_iphone_flag_local                    \
                                 : stbi__de_iphone_flag_global)
 #endif // STBI_THREAD_LOCAL
 
-static void stbi__de_iphone(stbi__png *z)
+static void stbi__de_iphone(stbi_uc *p, stbi__uint32 pixel_count, int out_n)
 {
-   stbi__context *s = z->s;
-   stbi__uint32 i, pixel_count = s->img_x * s->img_y;
-   stbi_uc *p = z->out;
+   stbi__uint32 i;
 
-   if (s->img_out_n == 3) {  // convert bgr to rgb
+   if (out_n == 3) {  // convert bgr to rgb
       for (i=0; i < pixel_count; ++i) {
          stbi_uc t = p[0];
          p[0] = p[2];
@@ -4989,7 +8030,7 @@ static void stbi__de_iphone(stbi__png *z)
          p += 3;
       }
    } else {
-      STBI_ASSERT(s->img_out_n == 4);
+      STBI_ASSERT(out_n == 4);
       if (stbi__unpremultiply_on_load) {
          // convert bgr to rgb and unpremultiply
          for (i=0; i < pixel_count; ++i) {
@@ -5020,18 +8061,21 @@ static void stbi__de_iphone(stbi__png *z)
 
 #define STBI__PNG_TYPE(a,b,c,d)  (((unsigned) (a) << 24) + ((unsigned) (b) << 16) + ((unsigned) (c) << 8) + (unsigned) (d))
 
+static int stbi__png_into(stbi__png *z, int req_comp);
+
 static int stbi__parse_png_file(stbi__png *z, int scan, int req_comp)
 {
-   stbi_uc palette[1024], pal_img_n=0;
-   stbi_uc has_trans=0, tc[3]={0};
-   stbi__uint16 tc16[3];
-   stbi__uint32 ioff=0, idata_limit=0, i, pal_len=0;
-   int first=1,k,interlace=0, color=0, is_iphone=0;
+   stbi__uint32 ioff=0, idata_limit=0, i;
+   int first=1,k;
    stbi__context *s = z->s;
 
    z->expanded = NULL;
    z->idata = NULL;
    z->out = NULL;
+   z->color = z->interlace = z->is_iphone = 0;
+   z->pal_img_n = z->has_trans = 0;
+   z->pal_len = 0;
+   memset(z->tc, 0, sizeof(z->tc));
 
    if (!stbi__check_png_header(s)) return 0;
 
@@ -5041,7 +8085,7 @@ static int stbi__parse_png_file(stbi__png *z, int scan, int req_comp)
       stbi__pngchunk c = stbi__get_chunk_header(s);
       switch (c.type) {
          case STBI__PNG_TYPE('C','g','B','I'):
-            is_iphone = 1;
+            z->is_iphone = 1;
             stbi__skip(s, c.length);
             break;
          case STBI__PNG_TYPE('I','H','D','R'): {
@@ -5054,15 +8098,15 @@ static int stbi__parse_png_file(stbi__png *z, int scan, int req_comp)
             if (s->img_y > STBI_MAX_DIMENSIONS) return stbi__err("too large","Very large image (corrupt?)");
             if (s->img_x > STBI_MAX_DIMENSIONS) return stbi__err("too large","Very large image (corrupt?)");
             z->depth = stbi__get8(s);  if (z->depth != 1 && z->depth != 2 && z->depth != 4 && z->depth != 8 && z->depth != 16)  return stbi__err("1/2/4/8/16-bit only","PNG not supported: 1/2/4/8/16-bit only");
-            color = stbi__get8(s);  if (color > 6)         return stbi__err("bad ctype","Corrupt PNG");
-            if (color == 3 && z->depth == 16)                  return stbi__err("bad ctype","Corrupt PNG");
-            if (color == 3) pal_img_n = 3; else if (color & 1) return stbi__err("bad ctype","Corrupt PNG");
+            z->color = stbi__get8(s);  if (z->color > 6)         return stbi__err("bad ctype","Corrupt PNG");
+            if (z->color == 3 && z->depth == 16)                     return stbi__err("bad ctype","Corrupt PNG");
+            if (z->color == 3) z->pal_img_n = 3; else if (z->color & 1) return stbi__err("bad ctype","Corrupt PNG");
             comp  = stbi__get8(s);  if (comp) return stbi__err("bad comp method","Corrupt PNG");
             filter= stbi__get8(s);  if (filter) return stbi__err("bad filter method","Corrupt PNG");
-            interlace = stbi__get8(s); if (interlace>1) return stbi__err("bad interlace method","Corrupt PNG");
+            z->interlace = stbi__get8(s); if (z->interlace>1) return stbi__err("bad interlace method","Corrupt PNG");
             if (!s->img_x || !s->img_y) return stbi__err("0-pixel image","Corrupt PNG");
-            if (!pal_img_n) {
-               s->img_n = (color & 2 ? 3 : 1) + (color & 4 ? 1 : 0);
+            if (!z->pal_img_n) {
+               s->img_n = (z->color & 2 ? 3 : 1) + (z->color & 4 ? 1 : 0);
                if ((1 << 30) / s->img_x / s->img_n < s->img_y) return stbi__err("too large", "Image too large to decode");
                if (scan == STBI__SCAN_header) return 1;
             } else {
@@ -5078,13 +8122,13 @@ static int stbi__parse_png_file(stbi__png *z, int scan, int req_comp)
          case STBI__PNG_TYPE('P','L','T','E'):  {
             if (first) return stbi__err("first not IHDR", "Corrupt PNG");
             if (c.length > 256*3) return stbi__err("invalid PLTE","Corrupt PNG");
-            pal_len = c.length / 3;
-            if (pal_len * 3 != c.length) return stbi__err("invalid PLTE","Corrupt PNG");
-            for (i=0; i < pal_len; ++i) {
-               palette[i*4+0] = stbi__get8(s);
-               palette[i*4+1] = stbi__get8(s);
-               palette[i*4+2] = stbi__get8(s);
-               palette[i*4+3] = 255;
+            z->pal_len = c.length / 3;
+            if (z->pal_len * 3 != c.length) return stbi__err("invalid PLTE","Corrupt PNG");
+            for (i=0; i < z->pal_len; ++i) {
+               z->palette[i*4+0] = stbi__get8(s);
+               z->palette[i*4+1] = stbi__get8(s);
+               z->palette[i*4+2] = stbi__get8(s);
+               z->palette[i*4+3] = 255;
             }
             break;
          }
@@ -5092,21 +8136,21 @@ static int stbi__parse_png_file(stbi__png *z, int scan, int req_comp)
          case STBI__PNG_TYPE('t','R','N','S'): {
             if (first) return stbi__err("first not IHDR", "Corrupt PNG");
             if (z->idata) return stbi__err("tRNS after IDAT","Corrupt PNG");
-            if (pal_img_n) {
+            if (z->pal_img_n) {
                if (scan == STBI__SCAN_header) { s->img_n = 4; return 1; }
-               if (pal_len == 0) return stbi__err("tRNS before PLTE","Corrupt PNG");
-               if (c.length > pal_len) return stbi__err("bad tRNS len","Corrupt PNG");
-               pal_img_n = 4;
+               if (z->pal_len == 0) return stbi__err("tRNS before PLTE","Corrupt PNG");
+               if (c.length > z->pal_len) return stbi__err("bad tRNS len","Corrupt PNG");
+               z->pal_img_n = 4;
                for (i=0; i < c.length; ++i)
-                  palette[i*4+3] = stbi__get8(s);
+                  z->palette[i*4+3] = stbi__get8(s);
             } else {
                if (!(s->img_n & 1)) return stbi__err("tRNS with alpha","Corrupt PNG");
                if (c.length != (stbi__uint32) s->img_n*2) return stbi__err("bad tRNS len","Corrupt PNG");
-               has_trans = 1;
+               z->has_trans = 1;
                if (z->depth == 16) {
-                  for (k = 0; k < s->img_n; ++k) tc16[k] = (stbi__uint16)stbi__get16be(s); // copy the values as-is
+                  for (k = 0; k < s->img_n; ++k) z->tc16[k] = (stbi__uint16)stbi__get16be(s); // copy the values as-is
                } else {
-                  for (k = 0; k < s->img_n; ++k) tc[k] = (stbi_uc)(stbi__get16be(s) & 255) * stbi__depth_scale_table[z->depth]; // non 8-bit images will be larger
+                  for (k = 0; k < s->img_n; ++k) z->tc[k] = (stbi_uc)(stbi__get16be(s) & 255) * stbi__depth_scale_table[z->depth]; // non 8-bit images will be larger
                }
             }
             break;
@@ -5114,8 +8158,13 @@ static int stbi__parse_png_file(stbi__png *z, int scan, int req_comp)
 
          case STBI__PNG_TYPE('I','D','A','T'): {
             if (first) return stbi__err("first not IHDR", "Corrupt PNG");
-            if (pal_img_n && !pal_len) return stbi__err("no PLTE","Corrupt PNG");
-            if (scan == STBI__SCAN_header) { s->img_n = pal_img_n; return 1; }
+            if (z->pal_img_n && !z->pal_len) return stbi__err("no PLTE","Corrupt PNG");
+            if (scan == STBI__SCAN_header) { s->img_n = z->pal_img_n; return 1; }
+            if (scan == STBI__SCAN_idat) { z->idat_len = c.length; return 1; }
+            if (s->into && !z->interlace && z->idata == NULL) {
+               z->idat_len = c.length;
+               return stbi__png_into(z, req_comp);
+            }
             if ((int)(ioff + c.length) < (int)ioff) return 0;
             if (ioff + c.length > idata_limit) {
                stbi__uint32 idata_limit_old = idata_limit;
@@ -5124,7 +8173,7 @@ static int stbi__parse_png_file(stbi__png *z, int scan, int req_comp)
                while (ioff + c.length > idata_limit)
                   idata_limit *= 2;
                STBI_NOTUSED(idata_limit_old);
-               p = (stbi_uc *) STBI_REALLOC_SIZED(z->idata, idata_limit_old, idata_limit); if (p == NULL) return stbi__err("outofmem", "Out of memory");
+               p = (stbi_uc *) stbi__realloc(z->idata, idata_limit); if (p == NULL) return stbi__err("outofmem", "Out of memory");
                z->idata = p;
             }
             if (!stbi__getn(s, z->idata+ioff,c.length)) return stbi__err("outofdata","Corrupt PNG");
@@ -5135,147 +8184,1050 @@ static int stbi__parse_png_file(stbi__png *z, int scan, int req_comp)
          case STBI__PNG_TYPE('I','E','N','D'): {
             stbi__uint32 raw_len, bpl;
             if (first) return stbi__err("first not IHDR", "Corrupt PNG");
+            if (scan == STBI__SCAN_idat) return stbi__err("no IDAT","Corrupt PNG");
             if (scan != STBI__SCAN_load) return 1;
             if (z->idata == NULL) return stbi__err("no IDAT","Corrupt PNG");
             // initial guess for decoded data size to avoid unnecessary reallocs
             bpl = (s->img_x * z->depth + 7) / 8; // bytes per line, per component
             raw_len = bpl * s->img_y * s->img_n /* pixels */ + s->img_y /* filter mode per row */;
-            z->expanded = (stbi_uc *) stbi_zlib_decode_malloc_guesssize_headerflag((char *) z->idata, ioff, raw_len, (int *) &raw_len, !is_iphone);
+            z->expanded = (stbi_uc *) stbi_zlib_decode_malloc_guesssize_headerflag((char *) z->idata, ioff, raw_len, (int *) &raw_len, !z->is_iphone);
             if (z->expanded == NULL) return 0; // zlib should set error
-            STBI_FREE(z->idata); z->idata = NULL;
-            if ((req_comp == s->img_n+1 && req_comp != 3 && !pal_img_n) || has_trans)
+            stbi__free(z->idata); z->idata = NULL;
+            if ((req_comp == s->img_n+1 && req_comp != 3 && !z->pal_img_n) || z->has_trans)
                s->img_out_n = s->img_n+1;
             else
                s->img_out_n = s->img_n;
-            if (!stbi__create_png_image(z, z->expanded, raw_len, s->img_out_n, z->depth, color, interlace)) return 0;
-            if (has_trans) {
+            if (!stbi__create_png_image(z, z->expanded, raw_len, s->img_out_n, z->depth, z->color, z->interlace)) return 0;
+            if (z->has_trans) {
                if (z->depth == 16) {
-                  if (!stbi__compute_transparency16(z, tc16, s->img_out_n)) return 0;
+                  if (!stbi__compute_transparency16((stbi__uint16 *) z->out, s->img_x * s->img_y, z->tc16, s->img_out_n)) return 0;
                } else {
-                  if (!stbi__compute_transparency(z, tc, s->img_out_n)) return 0;
+                  if (!stbi__compute_transparency(z->out, s->img_x * s->img_y, z->tc, s->img_out_n)) return 0;
                }
             }
-            if (is_iphone && stbi__de_iphone_flag && s->img_out_n > 2)
-               stbi__de_iphone(z);
-            if (pal_img_n) {
+            if (z->is_iphone && stbi__de_iphone_flag && s->img_out_n > 2)
+               stbi__de_iphone(z->out, s->img_x * s->img_y, s->img_out_n);
+            if (z->pal_img_n) {
                // pal_img_n == 3 or 4
-               s->img_n = pal_img_n; // record the actual colors we had
-               s->img_out_n = pal_img_n;
+               s->img_n = z->pal_img_n; // record the actual colors we had
+               s->img_out_n = z->pal_img_n;
                if (req_comp >= 3) s->img_out_n = req_comp;
-               if (!stbi__expand_png_palette(z, palette, pal_len, s->img_out_n))
+               if (!stbi__expand_png_palette(z, z->palette, z->pal_len, s->img_out_n))
                   return 0;
-            } else if (has_trans) {
+            } else if (z->has_trans) {
                // non-paletted image with tRNS -> source image has (constant) alpha
                ++s->img_n;
             }
-            STBI_FREE(z->expanded); z->expanded = NULL;
+            stbi__free(z->expanded); z->expanded = NULL;
             // end of PNG chunk, read and skip CRC
             stbi__get32be(s);
             return 1;
          }
 
-         default:
-            // if critical, fail
-            if (first) return stbi__err("first not IHDR", "Corrupt PNG");
-            if ((c.type & (1 << 29)) == 0) {
-               #ifndef STBI_NO_FAILURE_STRINGS
-               // not threadsafe
-               static char invalid_chunk[] = "XXXX PNG chunk not known";
-               invalid_chunk[0] = STBI__BYTECAST(c.type >> 24);
-               invalid_chunk[1] = STBI__BYTECAST(c.type >> 16);
-               invalid_chunk[2] = STBI__BYTECAST(c.type >>  8);
-               invalid_chunk[3] = STBI__BYTECAST(c.type >>  0);
-               #endif
-               return stbi__err(invalid_chunk, "PNG not supported: unknown PNG chunk type");
-            }
-            stbi__skip(s, c.length);
-            break;
+         default:
+            // if critical, fail
+            if (first) return stbi__err("first not IHDR", "Corrupt PNG");
+            if ((c.type & (1 << 29)) == 0) {
+               #ifndef STBI_NO_FAILURE_STRINGS
+               // not threadsafe
+               static char invalid_chunk[] = "XXXX PNG chunk not known";
+               invalid_chunk[0] = STBI__BYTECAST(c.type >> 24);
+               invalid_chunk[1] = STBI__BYTECAST(c.type >> 16);
+               invalid_chunk[2] = STBI__BYTECAST(c.type >>  8);
+               invalid_chunk[3] = STBI__BYTECAST(c.type >>  0);
+               #endif
+               return stbi__err(invalid_chunk, "PNG not supported: unknown PNG chunk type");
+            }
+            stbi__skip(s, c.length);
+            break;
+      }
+      // end of PNG chunk, read and skip CRC
+      stbi__get32be(s);
+   }
+}
+
+static void *stbi__do_png(stbi__png *p, int *x, int *y, int *n, int req_comp, stbi__result_info *ri)
+{
+   void *result=NULL;
+   if (req_comp < 0 || req_comp > 4) return stbi__errpuc("bad req_comp", "Internal error");
+   if (stbi__parse_png_file(p, STBI__SCAN_load, req_comp)) {
+      if (p->s->into && p->s->into->written) {
+         *x = p->s->img_x;
+         *y = p->s->img_y;
+         if (n) *n = p->s->img_n;
+         return p->s->into->pixels;
+      }
+      if (p->depth <= 8)
+         ri->bits_per_channel = 8;
+      else if (p->depth == 16)
+         ri->bits_per_channel = 16;
+      else
+         return stbi__errpuc("bad bits_per_channel", "PNG not supported: unsupported color depth");
+      result = p->out;
+      p->out = NULL;
+      if (req_comp && req_comp != p->s->img_out_n) {
+         if (ri->bits_per_channel == 8)
+            result = stbi__convert_format((unsigned char *) result, p->s->img_out_n, req_comp, p->s->img_x, p->s->img_y);
+         else
+            result = stbi__convert_format16((stbi__uint16 *) result, p->s->img_out_n, req_comp, p->s->img_x, p->s->img_y);
+         p->s->img_out_n = req_comp;
+         if (result == NULL) return result;
+      }
+      *x = p->s->img_x;
+      *y = p->s->img_y;
+      if (n) *n = p->s->img_n;
+   }
+   stbi__free(p->out);      p->out      = NULL;
+   stbi__free(p->expanded); p->expanded = NULL;
+   stbi__free(p->idata);    p->idata    = NULL;
+
+   return result;
+}
+
+static void *stbi__png_load(stbi__context *s, int *x, int *y, int *comp, int req_comp, stbi__result_info *ri)
+{
+   stbi__png p;
+   p.s = s;
+   return stbi__do_png(&p, x,y,comp,req_comp, ri);
+}
+
+static int stbi__png_test(stbi__context *s)
+{
+   int r;
+   r = stbi__check_png_header(s);
+   stbi__rewind(s);
+   return r;
+}
+
+static int stbi__png_info_raw(stbi__png *p, int *x, int *y, int *comp)
+{
+   if (!stbi__parse_png_file(p, STBI__SCAN_header, 0)) {
+      stbi__rewind( p->s );
+      return 0;
+   }
+   if (x) *x = p->s->img_x;
+   if (y) *y = p->s->img_y;
+   if (comp) *comp = p->s->img_n;
+   return 1;
+}
+
+static int stbi__png_info(stbi__context *s, int *x, int *y, int *comp)
+{
+   stbi__png p;
+   p.s = s;
+   return stbi__png_info_raw(&p, x, y, comp);
+}
+
+static int stbi__png_is16(stbi__context *s)
+{
+   stbi__png p;
+   p.s = s;
+   if (!stbi__png_info_raw(&p, NULL, NULL, NULL))
+	   return 0;
+   if (p.depth != 16) {
+      stbi__rewind(p.s);
+      return 0;
+   }
+   return 1;
+}
+
+//////////////////////////////////////////////////////////////////////////////
+//
+//  PNG rows, streamed
+//
+//  the IDAT chunks are read STBI__PNG_STREAM_IN bytes at a time and
+//  inflated into a window that keeps the 32K deflate history, each row
+//  is unfiltered and taken through the same steps as the whole image
+//  is in stbi__parse_png_file and stbi__do_png, one row at a time
+
+#define STBI__PNG_STREAM_IN      65536  // compressed bytes buffered
+#define STBI__PNG_STREAM_MARGIN  1024   // left unread until the IDATs end, more than any block header needs
+#define STBI__PNG_STREAM_OUT     131072 // inflated at a time, at least
+
+struct stbi_png_rows
+{
+   stbi__context *s;
+   stbi__context ctx; // for the public functions; in stbi__png_into, the one stbi_load made
+   stbi__png p;
+   stbi__zbuf z;
+   #ifndef STBI_NO_STDIO
+   FILE *f;
+   #endif
+   stbi__png_unfilter_func *unfilter;
+   int req_comp;
+   int img_n, out_n, pal_n;  // channels unfiltered, stored per pixel, after the palette
+   int de_iphone, failed, inflated, idat_done;
+   stbi__uint32 row, width_bytes, idat_left;
+   stbi_uc *zin, *win, *next_row;
+   stbi_uc *filter_buf, *pixels[2];
+};
+
+// moves the unread compressed bytes to the front and tops them up from the IDAT chunks
+static int stbi__png_rows_refill(stbi_png_rows *r)
+{
+   stbi__zbuf *a = &r->z;
+   int have = (int) (a->zbuffer_end - a->zbuffer);
+   memmove(r->zin, a->zbuffer, have);
+   while (have < STBI__PNG_STREAM_IN && !r->idat_done) {
+      int n = STBI__PNG_STREAM_IN - have;
+      if (r->idat_left == 0) {
+         stbi__pngchunk c;
+         stbi__get32be(r->s); // CRC of the previous chunk
+         c = stbi__get_chunk_header(r->s);
+         if (c.type == STBI__PNG_TYPE('I','D','A','T'))
+            r->idat_left = c.length;
+         else
+            r->idat_done = 1;
+         continue;
+      }
+      if ((stbi__uint32) n > r->idat_left) n = (int) r->idat_left;
+      if (!stbi__getn(r->s, r->zin + have, n)) return stbi__err("outofdata","Corrupt PNG");
+      have += n;
+      r->idat_left -= n;
+   }
+   a->zbuffer = r->zin;
+   a->zbuffer_end = r->zin + have;
+   if (r->idat_done) a->zbuffer_reserve = 0;
+   return 1;
+}
+
+// inflates until the window holds the next filtered row
+static int stbi__png_rows_inflate(stbi_png_rows *r)
+{
+   stbi__zbuf *a = &r->z;
+   stbi__uint32 row_len = r->width_bytes + 1;
+   while ((stbi__uint32) ((stbi_uc *) a->zout - r->next_row) < row_len) {
+      int result;
+      if (r->inflated) return stbi__err("not enough pixels","Corrupt PNG");
+      if (a->zout == a->zout_end) {
+         // slide the window down, keeping the row in progress and 32K of history
+         size_t keep = (stbi_uc *) a->zout - r->next_row;
+         size_t drop;
+         if (keep < 32768) keep = 32768;
+         drop = ((stbi_uc *) a->zout - r->win) - keep;
+         memmove(r->win, r->win + drop, keep);
+         a->zout -= drop;
+         r->next_row -= drop;
+      }
+      if (!r->idat_done && a->zbuffer_end - a->zbuffer < STBI__PNG_STREAM_IN/2)
+         if (!stbi__png_rows_refill(r)) return 0;
+      result = stbi__zinflate(a);
+      if (!result) return 0;
+      if (result == 1) r->inflated = 1;
+   }
+   return 1;
+}
+
+// inflates and unfilters the next row, returns where it is in the filter
+// buffer (until the row after it), NULL on an error
+static stbi_uc *stbi__png_rows_unfilter(stbi_png_rows *r)
+{
+   stbi__uint32 stride = r->width_bytes + STBI__PNG_ROW_SLACK;
+   int depth = r->p.depth, filter;
+   int filter_bytes = depth < 8 ? 1 : r->img_n*(depth == 16 ? 2 : 1);
+   stbi_uc *prior = r->filter_buf + (r->row & 1)*stride;
+   stbi_uc *cur = r->filter_buf + (~r->row & 1)*stride;
+
+   if (!stbi__png_rows_inflate(r)) return NULL;
+   filter = *r->next_row;
+   if (filter > 4) return stbi__errpuc("invalid filter","Corrupt PNG");
+   r->unfilter(filter, cur, r->next_row + 1, prior, r->width_bytes, filter_bytes);
+   r->next_row += r->width_bytes + 1;
+   ++r->row;
+   return cur;
+}
+
+// converts the x pixels of an unfiltered row from cur on into dest with 1
+// or 2 bytes per channel; below 8 bits cur has to be the whole row
+static int stbi__png_rows_convert(stbi_png_rows *r, stbi_uc const *cur, stbi__uint32 x, void *dest, int dest_bytes)
+{
+   stbi__png *z = &r->p;
+   stbi__uint32 i, count;
+   int depth = z->depth, bytes = (depth == 16 ? 2 : 1), n = r->out_n;
+   stbi__uint32 width_bytes = depth < 8 ? r->width_bytes : x*r->img_n*bytes;
+   int convert = r->req_comp && r->req_comp != (z->pal_img_n ? r->pal_n : n);
+   // the last step writes straight into dest, unless the bit depth changes after it
+   stbi_uc *final = dest_bytes == bytes ? (stbi_uc *) dest : NULL;
+   stbi_uc *px = final && !z->pal_img_n && !convert ? final : r->pixels[0];
+   stbi_uc *other = r->pixels[1], *t;
+
+   stbi__png_store_row(px, cur, x, r->img_n, n, depth, width_bytes);
+   if (depth < 8)
+      stbi__png_expand_row(px, x, r->img_n, n, depth, z->color, width_bytes);
+   else if (depth == 16)
+      stbi__png_swap16(px, x*n);
+   if (z->has_trans) {
+      if (depth == 16)
+         stbi__compute_transparency16((stbi__uint16 *) px, x, z->tc16, n);
+      else
+         stbi__compute_transparency(px, x, z->tc, n);
+   }
+   if (r->de_iphone)
+      stbi__de_iphone(px, x, n);
+   if (z->pal_img_n) {
+      t = final && !convert ? final : other;
+      stbi__png_palette_pixels(t, px, x, z->palette, r->pal_n);
+      other = px;
+      px = t;
+      n = r->pal_n;
+   }
+   if (convert) {
+      t = final ? final : other;
+      if (bytes == 1) {
+         if (!stbi__convert_row(px, t, n, r->req_comp, x)) return 0;
+      } else {
+         if (!stbi__convert_row16((stbi__uint16 *) px, (stbi__uint16 *) t, n, r->req_comp, x)) return 0;
+      }
+      px = t;
+      n = r->req_comp;
+   }
+   if (px == final)
+      return 1;
+
+   // to the bit depth asked for, as stbi__convert_16_to_8 and stbi__convert_8_to_16 do
+   count = x*n;
+   if (dest_bytes == 1) {
+      stbi__uint16 *p16 = (stbi__uint16 *) px;
+      for (i=0; i < count; ++i)
+         ((stbi_uc *) dest)[i] = (stbi_uc) (p16[i] >> 8);
+   } else {
+      for (i=0; i < count; ++i)
+         ((stbi__uint16 *) dest)[i] = (stbi__uint16) ((px[i] << 8) + px[i]);
+   }
+   return 1;
+}
+
+// decodes the next row into dest with 1 or 2 bytes per channel
+static int stbi__png_rows_next(stbi_png_rows *r, void *dest, int dest_bytes)
+{
+   stbi_uc *cur = stbi__png_rows_unfilter(r);
+   return cur && stbi__png_rows_convert(r, cur, r->s->img_x, dest, dest_bytes);
+}
+
+// sets up the stream once r->p has been parsed up to the first IDAT
+static int stbi__png_rows_setup(stbi_png_rows *r, int req_comp)
+{
+   stbi__context *s = r->s;
+   stbi__png *z = &r->p;
+   stbi__zbuf *a = &r->z;
+   stbi__uint32 x, row_len, win_len;
+   int bytes;
+
+   r->req_comp = req_comp;
+   if (z->interlace) return stbi__err("interlaced", "PNG not supported: interlaced images cannot be streamed");
+   r->idat_left = z->idat_len;
+
+   x = s->img_x;
+   bytes = (z->depth == 16 ? 2 : 1);
+   r->img_n = s->img_n;
+   if (!stbi__mad3sizes_valid(r->img_n, x, z->depth, 7)) return stbi__err("too large", "Corrupt PNG");
+   r->width_bytes = (((r->img_n * x * z->depth) + 7) >> 3);
+   if (z->depth < 8 && r->width_bytes > x) return stbi__err("invalid width","Corrupt PNG");
+
+   // the channel counts as worked out when loading the whole image
+   if ((req_comp == s->img_n+1 && req_comp != 3 && !z->pal_img_n) || z->has_trans)
+      r->out_n = s->img_n+1;
+   else
+      r->out_n = s->img_n;
+   r->de_iphone = z->is_iphone && stbi__de_iphone_flag && r->out_n > 2;
+   if (z->pal_img_n) {
+      s->img_n = z->pal_img_n;
+      r->pal_n = req_comp >= 3 ? req_comp : z->pal_img_n;
+   } else if (z->has_trans) {
+      ++s->img_n;
+   }
+
+   row_len = r->width_bytes + 1;
+   win_len = 32768 + row_len + (row_len > STBI__PNG_STREAM_OUT ? row_len : STBI__PNG_STREAM_OUT);
+   r->unfilter = stbi__png_unfilter_kernel();
+   r->filter_buf = (stbi_uc *) stbi__malloc_mad2(r->width_bytes, 2, 2*STBI__PNG_ROW_SLACK);
+   r->pixels[0] = (stbi_uc *) stbi__malloc_mad3(x, 4, bytes, 0);
+   r->pixels[1] = (stbi_uc *) stbi__malloc_mad3(x, 4, bytes, 0);
+   r->zin = (stbi_uc *) stbi__malloc(STBI__PNG_STREAM_IN);
+   r->win = (stbi_uc *) stbi__malloc(win_len + STBI__PNG_ROW_SLACK);
+   if (!r->filter_buf || !r->pixels[0] || !r->pixels[1] || !r->zin || !r->win)
+      return stbi__err("outofmem", "Out of memory");
+   memset(r->filter_buf, 0, r->width_bytes + STBI__PNG_ROW_SLACK);
+
+   a->zbuffer = a->zbuffer_end = r->zin;
+   a->zbuffer_reserve = STBI__PNG_STREAM_MARGIN;
+   a->zout_start = a->zout = (char *) r->win;
+   a->zout_end = (char *) r->win + win_len;
+   a->z_expandable = 0;
+   a->z_streaming = 1;
+   r->next_row = r->win;
+   if (!stbi__png_rows_refill(r)) return 0;
+   return stbi__zstart(a, !z->is_iphone);
+}
+
+static int stbi__png_rows_init(stbi_png_rows *r, int req_comp)
+{
+   r->p.s = r->s;
+   if (req_comp < 0 || req_comp > 4) return stbi__err("bad req_comp", "Internal error");
+   if (!stbi__parse_png_file(&r->p, STBI__SCAN_idat, req_comp)) return 0;
+   return stbi__png_rows_setup(r, req_comp);
+}
+
+static stbi_png_rows *stbi__png_rows_alloc(void)
+{
+   stbi_png_rows *r = (stbi_png_rows *) stbi__malloc(sizeof(*r));
+   if (r == NULL) {
+      (void) stbi__err("outofmem", "Out of memory");
+      return NULL;
+   }
+   memset(r, 0, sizeof(*r));
+   r->s = &r->ctx;
+   return r;
+}
+
+// called by stbi__parse_png_file at the first IDAT when loading into caller
+// memory: streams the rows into it, converted on the way like any others.
+// For a region the rows above it are only unfiltered, its columns are
+// converted straight from the filter buffer (below 8 bits, whole rows go
+// through a scratch row), and the rows below it are not inflated at all.
+static int stbi__png_into(stbi__png *z, int req_comp)
+{
+   stbi__into *into = z->s->into;
+   stbi_uc *scratch = NULL;
+   int j, ok;
+   stbi_png_rows *r = stbi__png_rows_alloc();
+   if (r == NULL) return 0;
+   r->s = z->s;
+   r->p = *z;
+   ok = stbi__png_rows_setup(r, req_comp);
+   if (ok && !stbi__into_fits(into, r->s->img_x, r->s->img_y))
+      ok = stbi__err("size mismatch", into->region ? "Region is not inside the image" : "Image is not the size given");
+   if (!into->region) {
+      for (j=0; ok && j < (int) r->s->img_y; ++j)
+         ok = stbi__png_rows_next(r, into->pixels + (ptrdiff_t) into->stride * j, 1);
+   } else {
+      int first = into->x0 * r->img_n * (z->depth == 16 ? 2 : 1);
+      if (ok && z->depth < 8) {
+         scratch = (stbi_uc *) stbi__malloc_mad2(r->s->img_x, into->channels, 0);
+         if (!scratch) ok = stbi__err("outofmem", "Out of memory");
+      }
+      for (j=0; ok && j < into->y0; ++j)
+         ok = stbi__png_rows_unfilter(r) != NULL;
+      for (j=0; ok && j < into->height; ++j) {
+         stbi_uc *dest = into->pixels + (ptrdiff_t) into->stride * j;
+         stbi_uc *cur = stbi__png_rows_unfilter(r);
+         if (!cur) {
+            ok = 0;
+         } else if (scratch) {
+            ok = stbi__png_rows_convert(r, cur, r->s->img_x, scratch, 1);
+            memcpy(dest, scratch + (size_t) into->x0 * into->channels, (size_t) into->width * into->channels);
+         } else {
+            ok = stbi__png_rows_convert(r, cur + first, into->width, dest, 1);
+         }
+      }
+   }
+   stbi__free(scratch);
+   stbi_png_rows_close(r);
+   into->written = ok;
+   return ok;
+}
+
+static stbi_png_rows *stbi__png_rows_begin(stbi_png_rows *r, int *x, int *y, int *comp, int req_comp)
+{
+   if (!stbi__png_rows_init(r, req_comp)) {
+      stbi_png_rows_close(r);
+      return NULL;
+   }
+   *x = r->s->img_x;
+   *y = r->s->img_y;
+   if (comp) *comp = r->s->img_n;
+   return r;
+}
+
+STBIDEF stbi_png_rows *stbi_png_rows_from_memory(stbi_uc const *buffer, int len, int *x, int *y, int *comp, int req_comp)
+{
+   stbi_png_rows *r = stbi__png_rows_alloc();
+   if (r == NULL) return NULL;
+   stbi__start_mem(r->s, buffer, len);
+   return stbi__png_rows_begin(r, x, y, comp, req_comp);
+}
+
+STBIDEF stbi_png_rows *stbi_png_rows_from_callbacks(stbi_io_callbacks const *clbk, void *user, int *x, int *y, int *comp, int req_comp)
+{
+   stbi_png_rows *r = stbi__png_rows_alloc();
+   if (r == NULL) return NULL;
+   stbi__start_callbacks(r->s, (stbi_io_callbacks *) clbk, user);
+   return stbi__png_rows_begin(r, x, y, comp, req_comp);
+}
+
+#ifndef STBI_NO_STDIO
+STBIDEF stbi_png_rows *stbi_png_rows_open(char const *filename, int *x, int *y, int *comp, int req_comp)
+{
+   stbi_png_rows *r;
+   FILE *f = stbi__fopen(filename, "rb");
+   if (!f) {
+      (void) stbi__err("can't fopen", "Unable to open file");
+      return NULL;
+   }
+   r = stbi__png_rows_alloc();
+   if (r == NULL) {
+      fclose(f);
+      return NULL;
+   }
+   r->f = f;
+   stbi__start_file(r->s, f);
+   return stbi__png_rows_begin(r, x, y, comp, req_comp);
+}
+#endif
+
+static int stbi__png_rows_read(stbi_png_rows *r, void *rows, int stride, int count, int bytes)
+{
+   int i;
+   if (r->failed) return -1;
+   for (i=0; i < count && r->row < r->s->img_y; ++i) {
+      if (!stbi__png_rows_next(r, (stbi_uc *) rows + (size_t) i*stride, bytes)) {
+         r->failed = 1;
+         return -1;
+      }
+   }
+   return i;
+}
+
+STBIDEF int stbi_png_rows_read(stbi_png_rows *r, stbi_uc *rows, int stride, int count)
+{
+   return stbi__png_rows_read(r, rows, stride, count, 1);
+}
+
+STBIDEF int stbi_png_rows_read_16(stbi_png_rows *r, stbi_us *rows, int stride, int count)
+{
+   return stbi__png_rows_read(r, rows, stride, count, 2);
+}
+
+STBIDEF void stbi_png_rows_close(stbi_png_rows *r)
+{
+   if (r == NULL) return;
+   #ifndef STBI_NO_STDIO
+   if (r->f) fclose(r->f);
+   #endif
+   stbi__free(r->filter_buf);
+   stbi__free(r->pixels[0]);
+   stbi__free(r->pixels[1]);
+   stbi__free(r->zin);
+   stbi__free(r->win);
+   stbi__free(r);
+}
+#endif
+
+// incremental decoding: the decode split into units of about a row each,
+// run until a budget is used up by stbi_incremental_step
+
+static double stbi__clock_us(void)
+{
+#ifdef STBI__CLOCK_MONOTONIC
+   struct timespec t;
+   clock_gettime(CLOCK_MONOTONIC, &t);
+   return t.tv_sec * 1e6 + t.tv_nsec / 1e3;
+#else
+   return clock() * (1e6 / CLOCKS_PER_SEC);
+#endif
+}
+
+enum
+{
+   STBI__INC_whole,         // any other format: decoded in one unit
+   STBI__INC_jpeg_markers,  // the markers up to the next scan
+   STBI__INC_jpeg_scan,     // a row of MCUs of a scan
+   STBI__INC_jpeg_idct,     // a row of blocks of a progressive image
+   STBI__INC_jpeg_output,   // setting up the color conversion
+   STBI__INC_jpeg_convert,  // an output row
+   STBI__INC_png_rows,      // an output row
+   STBI__INC_done,
+   STBI__INC_failed
+};
+
+struct stbi_incremental
+{
+   stbi__context s;
+   #ifndef STBI_NO_STDIO
+   FILE *f;
+   #endif
+   stbi_decoder *decoder; // of the _ctx begin, used by every call on d
+   int state;
+   int req_comp, flip;
+   int x, y, comp, n;
+   stbi_uc *out;     // the image, or the caller's pixels
+   int pitch;        // bytes from one row of out to the next
+   int into, into_width, into_height; // see stbi_incremental_into
+   int row;          // output rows written, or blocks rows transformed
+   #ifndef STBI_NO_JPEG
+   stbi__jpeg *jpeg;
+   stbi__resample res_comp[4];
+   stbi_uc *linebuf[4];
+   int decode_n, is_rgb;
+   int mcu, mcus;    // of the current scan
+   int comp_n;       // component being transformed
+   #endif
+   #ifndef STBI_NO_PNG
+   stbi_png_rows *png;
+   #endif
+};
+
+// frees what the decode needs, not the image
+static void stbi__incremental_cleanup(stbi_incremental *d)
+{
+   #ifndef STBI_NO_JPEG
+   if (d->jpeg) {
+      stbi__cleanup_jpeg(d->jpeg);
+      stbi__free(d->jpeg);
+      d->jpeg = NULL;
+   }
+   #endif
+   #ifndef STBI_NO_PNG
+   stbi_png_rows_close(d->png);
+   d->png = NULL;
+   #endif
+   #ifndef STBI_NO_STDIO
+   if (d->f) fclose(d->f);
+   d->f = NULL;
+   #endif
+}
+
+// where output row `row` goes, bottom to top when flipping
+static stbi_uc *stbi__incremental_row(stbi_incremental *d, int row)
+{
+   return d->out + (ptrdiff_t) (d->flip ? d->y - 1 - row : row) * d->pitch;
+}
+
+// once the size is known; the caller's pixels just have to fit it
+static int stbi__incremental_alloc(stbi_incremental *d)
+{
+   if (d->into) {
+      if (d->x != d->into_width || d->y != d->into_height) return stbi__err("size mismatch", "Image is not the size given");
+      return 1;
+   }
+   d->out = (stbi_uc *) stbi__malloc_mad3(d->n, d->x, d->y, 1);
+   if (!d->out) return stbi__err("outofmem", "Out of memory");
+   d->pitch = d->x * d->n;
+   return 1;
+}
+
+#ifndef STBI_NO_JPEG
+static int stbi__incremental_jpeg(stbi_incremental *d)
+{
+   stbi__jpeg *z = d->jpeg;
+   int k;
+   switch (d->state) {
+      case STBI__INC_jpeg_markers:
+         k = stbi__jpeg_next_scan(z);
+         if (k == 0) return 0;
+         if (k == 2) {
+            d->state = z->progressive ? STBI__INC_jpeg_idct : STBI__INC_jpeg_output;
+            return 1;
+         }
+         d->mcu = 0;
+         d->mcus = stbi__jpeg_scan_needed(z);
+         stbi__jpeg_reset(z);
+         d->state = STBI__INC_jpeg_scan;
+         // an empty scan still ends below
+         // fall through
+      case STBI__INC_jpeg_scan:
+         if (d->mcu < d->mcus) {
+            int n = z->scan_n == 1 ? (z->img_comp[z->order[0]].x+7) >> 3 : z->img_mcu_x;
+            if (n > d->mcus - d->mcu) n = d->mcus - d->mcu;
+            if (z->progressive) {
+               if (!stbi__jpeg_decode_mcus_prog(z, d->mcu, n)) return 0;
+            } else {
+               if (!stbi__jpeg_decode_mcus(z, d->mcu, n)) return 0;
+            }
+            d->mcu += n;
+         }
+         // done, or ended early by a marker other than a restart
+         if (d->mcu >= d->mcus || z->todo <= 0) {
+            // the first scan of a band of coefficients is there for previews
+            if (z->progressive && z->succ_high == 0 && d->mcus > 0 && d->mcu >= d->mcus)
+               for (k=0; k < z->scan_n; ++k)
+                  z->img_comp[z->order[k]].bands |= (~(stbi__uint64) 0 >> (63 - z->spec_end)) & (~(stbi__uint64) 0 << z->spec_start);
+            if (!stbi__jpeg_skip_unneeded(z, d->mcu)) return 0;
+            stbi__jpeg_end_scan(z);
+            d->state = STBI__INC_jpeg_markers;
+         }
+         return 1;
+      case STBI__INC_jpeg_idct:
+         if (d->comp_n < z->s->img_n) {
+            if (d->row < (z->img_comp[d->comp_n].y+7) >> 3) {
+               return stbi__jpeg_finish_rows(z, d->comp_n, d->row++, 1);
+            }
+            d->row = 0;
+            ++d->comp_n;
+            return 1;
+         }
+         d->state = STBI__INC_jpeg_output;
+         return 1;
+      case STBI__INC_jpeg_output:
+         if (!stbi__jpeg_setup_output(z, d->req_comp, d->res_comp, &d->n, &d->decode_n, &d->is_rgb)) return 0;
+         d->x = z->s->img_x;
+         d->y = z->s->img_y;
+         d->comp = z->s->img_n >= 3 ? 3 : 1;
+         if (!stbi__incremental_alloc(d)) return 0;
+         for (k=0; k < d->decode_n; ++k)
+            d->linebuf[k] = z->img_comp[k].linebuf;
+         d->row = 0;
+         d->state = STBI__INC_jpeg_convert;
+         return 1;
+      case STBI__INC_jpeg_convert:
+         stbi__jpeg_convert_rows(z, d->res_comp, d->linebuf, stbi__incremental_row(d, d->row), 0, d->n, d->decode_n, d->is_rgb,
+                                 1, d->x);
+         if (++d->row == d->y) {
+            stbi__incremental_cleanup(d);
+            d->state = STBI__INC_done;
+         }
+         return 1;
+   }
+   return stbi__err("bad state", "Internal error");
+}
+#endif
+
+#ifndef STBI_NO_JPEG
+// the zigzag positions of the size x size lowest frequencies
+static stbi__uint64 stbi__jpeg_bands_for(int size)
+{
+   stbi__uint64 bands = 0;
+   int k;
+   for (k=0; k < 64; ++k)
+      if (stbi__jpeg_dezigzag[k] % 8 < size && stbi__jpeg_dezigzag[k] / 8 < size)
+         bands |= (stbi__uint64) 1 << k;
+   return bands;
+}
+
+// the block sizes of a preview scaled down by 1 << shift, if the scans so
+// far have every coefficient they read: chroma is transformed to the luma's
+// resolution as stbi__process_frame_header would, or else upsampled
+static int stbi__jpeg_preview_sizes(stbi__jpeg *z, int shift, int *size)
+{
+   int k;
+   for (k=0; k < z->s->img_n; ++k) {
+      int hs = z->img_h_max / z->img_comp[k].h, vs = z->img_v_max / z->img_comp[k].v;
+      size[k] = 8 >> shift;
+      if (hs == vs && (hs == 2 || hs == 4) && hs <= (1 << shift) && z->img_comp[k].coeff_n == 64 &&
+          (z->img_comp[k].bands & stbi__jpeg_bands_for(size[k] * hs)) == stbi__jpeg_bands_for(size[k] * hs))
+         size[k] *= hs;
+      if (size[k] > 1 && z->img_comp[k].coeff_n == 1) return 0;
+      if ((z->img_comp[k].bands & stbi__jpeg_bands_for(size[k])) != stbi__jpeg_bands_for(size[k])) return 0;
+   }
+   return 1;
+}
+
+// transforms and converts the coefficients decoded so far through a copy of
+// the decoder scaled down further, leaving them as they are
+static stbi_uc *stbi__incremental_preview(stbi_incremental *d, int *x, int *y, int *scale)
+{
+   stbi__jpeg *z = d->jpeg, *p;
+   stbi__context s;
+   stbi__resample res_comp[4];
+   stbi_uc *linebuf[4], *out;
+   int size[4], shift, i, j, k, n, decode_n, is_rgb;
+
+   if (!z || !z->progressive || (d->state != STBI__INC_jpeg_markers && d->state != STBI__INC_jpeg_scan))
+      return stbi__errpuc("no preview", "Not a progressive JPEG before its last scan");
+   for (shift = z->scale_shift; shift <= 3; ++shift)
+      if (stbi__jpeg_preview_sizes(z, shift, size)) break;
+   if (shift > 3) return stbi__errpuc("no preview", "DC coefficients not decoded yet");
+
+   p = (stbi__jpeg *) stbi__malloc(sizeof(stbi__jpeg));
+   if (!p) return stbi__errpuc("outofmem", "Out of memory");
+   memcpy(p, z, sizeof(stbi__jpeg));
+   s = *z->s;
+   p->s = &s;
+   p->scale_shift = shift;
+   for (k=0; k < s.img_n; ++k) {
+      p->img_comp[k].raw_coeff = p->img_comp[k].raw_data = NULL;
+      p->img_comp[k].linebuf = NULL;
+   }
+   for (k=0; k < s.img_n; ++k) {
+      STBI_SIMD_ALIGN(short, data[2][64]);
+      stbi__idct_queue queue = { NULL, 0, NULL };
+      int coeff_n = z->img_comp[k].coeff_n;
+      p->img_comp[k].idct_size = size[k];
+      p->img_comp[k].w2 = p->img_mcu_x * p->img_comp[k].h * size[k];
+      p->img_comp[k].h2 = p->img_mcu_y * p->img_comp[k].v * size[k];
+      p->img_comp[k].raw_data = stbi__malloc_mad2(p->img_comp[k].w2, p->img_comp[k].h2, 15);
+      if (p->img_comp[k].raw_data == NULL) {
+         stbi__free_jpeg_components(p, s.img_n, 0);
+         stbi__free(p);
+         return stbi__errpuc("outofmem", "Out of memory");
       }
-      // end of PNG chunk, read and skip CRC
-      stbi__get32be(s);
+      p->img_comp[k].data = (stbi_uc*) (((size_t) p->img_comp[k].raw_data + 15) & ~15);
+      for (j=0; j < (z->img_comp[k].y+7) >> 3; ++j) {
+         for (i=0; i < (z->img_comp[k].x+7) >> 3; ++i) {
+            short *block = queue.data == data[0] ? data[1] : data[0];
+            memcpy(block, z->img_comp[k].coeff + coeff_n * (i + j * z->img_comp[k].coeff_w), coeff_n * sizeof(short));
+            stbi__jpeg_dequantize(block, z->dequant[z->img_comp[k].tq], size[k]);
+            stbi__idct_push(p, &queue, p->img_comp[k].data + p->img_comp[k].w2*j*size[k] + i*size[k], p->img_comp[k].w2, block, size[k]);
+         }
+      }
+      stbi__idct_flush(p, &queue);
+   }
+
+   out = NULL;
+   if (stbi__jpeg_setup_output(p, d->req_comp, res_comp, &n, &decode_n, &is_rgb)) {
+      out = (stbi_uc *) stbi__malloc_mad3(n, s.img_x, s.img_y, 1);
+      if (!out) out = stbi__errpuc("outofmem", "Out of memory");
+   }
+   if (out) {
+      for (k=0; k < decode_n; ++k)
+         linebuf[k] = p->img_comp[k].linebuf;
+      for (j=0; j < (int) s.img_y; ++j)
+         stbi__jpeg_convert_rows(p, res_comp, linebuf, out + (size_t) (d->flip ? (int) s.img_y - 1 - j : j) * s.img_x * n, 0, n, decode_n,
+                                 is_rgb, 1, s.img_x);
+      *x = s.img_x;
+      *y = s.img_y;
+      *scale = 1 << shift;
+   }
+   stbi__free_jpeg_components(p, s.img_n, 0);
+   stbi__free(p);
+   return out;
+}
+#endif
+
+static int stbi__incremental_unit(stbi_incremental *d)
+{
+   switch (d->state) {
+      case STBI__INC_whole: {
+         int j, ok = 1;
+         stbi_uc *out = stbi__load_8bit(&d->s, &d->x, &d->y, &d->comp, d->req_comp);
+         if (!out) return 0;
+         d->n = d->req_comp ? d->req_comp : d->comp;
+         if (d->into) {
+            ok = stbi__incremental_alloc(d);
+            for (j=0; ok && j < d->y; ++j)
+               memcpy(stbi__incremental_row(d, j), out + (size_t) j * d->x * d->n, (size_t) d->x * d->n);
+            stbi__free(out);
+            if (!ok) return 0;
+         } else {
+            d->out = out;
+            d->pitch = d->x * d->n;
+            if (d->flip) stbi__vertical_flip(d->out, d->x, d->y, d->n);
+         }
+         stbi__incremental_cleanup(d);
+         d->state = STBI__INC_done;
+         return 1;
+      }
+      #ifndef STBI_NO_PNG
+      case STBI__INC_png_rows:
+         // allocated by the first row, so that stbi_incremental_into can come first
+         if (d->row == 0 && !stbi__incremental_alloc(d)) return 0;
+         if (!stbi__png_rows_next(d->png, stbi__incremental_row(d, d->row), 1)) return 0;
+         if (++d->row == d->y) {
+            stbi__incremental_cleanup(d);
+            d->state = STBI__INC_done;
+         }
+         return 1;
+      #endif
    }
+   #ifndef STBI_NO_JPEG
+   return stbi__incremental_jpeg(d);
+   #else
+   return stbi__err("bad state", "Internal error");
+   #endif
 }
 
-static void *stbi__do_png(stbi__png *p, int *x, int *y, int *n, int req_comp, stbi__result_info *ri)
+// once d->s is set up: what the image is and how it will be decoded
+static stbi_incremental *stbi__incremental_begin(stbi_incremental *d, int req_comp)
 {
-   void *result=NULL;
-   if (req_comp < 0 || req_comp > 4) return stbi__errpuc("bad req_comp", "Internal error");
-   if (stbi__parse_png_file(p, STBI__SCAN_load, req_comp)) {
-      if (p->depth <= 8)
-         ri->bits_per_channel = 8;
-      else if (p->depth == 16)
-         ri->bits_per_channel = 16;
-      else
-         return stbi__errpuc("bad bits_per_channel", "PNG not supported: unsupported color depth");
-      result = p->out;
-      p->out = NULL;
-      if (req_comp && req_comp != p->s->img_out_n) {
-         if (ri->bits_per_channel == 8)
-            result = stbi__convert_format((unsigned char *) result, p->s->img_out_n, req_comp, p->s->img_x, p->s->img_y);
-         else
-            result = stbi__convert_format16((stbi__uint16 *) result, p->s->img_out_n, req_comp, p->s->img_x, p->s->img_y);
-         p->s->img_out_n = req_comp;
-         if (result == NULL) return result;
+   int ok = 1;
+   d->req_comp = req_comp;
+   d->flip = stbi__vertically_flip_on_load;
+   d->state = STBI__INC_whole;
+   if (req_comp < 0 || req_comp > 4) ok = stbi__err("bad req_comp", "Internal error");
+   #ifndef STBI_NO_PNG
+   // interlaced PNGs are decoded whole; the interlace method is the last
+   // byte of IHDR, the first chunk
+   else if (stbi__png_test(&d->s) && d->s.img_buffer_end - d->s.img_buffer > 28 && d->s.img_buffer[28] == 0) {
+      d->png = stbi__png_rows_alloc();
+      if (!d->png) {
+         ok = 0;
+      } else {
+         d->png->s = &d->s;
+         ok = stbi__png_rows_init(d->png, req_comp);
+         d->x = d->s.img_x;
+         d->y = d->s.img_y;
+         d->comp = d->s.img_n;
+         d->n = req_comp ? req_comp : d->comp;
+         d->state = STBI__INC_png_rows;
       }
-      *x = p->s->img_x;
-      *y = p->s->img_y;
-      if (n) *n = p->s->img_n;
    }
-   STBI_FREE(p->out);      p->out      = NULL;
-   STBI_FREE(p->expanded); p->expanded = NULL;
-   STBI_FREE(p->idata);    p->idata    = NULL;
+   #endif
+   #ifndef STBI_NO_JPEG
+   else if (stbi__jpeg_test(&d->s)) {
+      stbi__jpeg *z = d->jpeg = (stbi__jpeg *) stbi__malloc(sizeof(stbi__jpeg));
+      if (!z) {
+         ok = stbi__err("outofmem", "Out of memory");
+      } else {
+         z->s = &d->s;
+         z->scale_shift = stbi__jpeg_scale_shift;
+         stbi__setup_jpeg(z);
+         z->s->img_n = 0; // make stbi__cleanup_jpeg safe
+         ok = stbi__jpeg_begin(z);
+         d->state = STBI__INC_jpeg_markers;
+      }
+   }
+   #endif
+   if (!ok) {
+      stbi_incremental_abort(d);
+      return NULL;
+   }
+   return d;
+}
 
-   return result;
+static stbi_incremental *stbi__incremental_alloc_state(void)
+{
+   stbi_incremental *d = (stbi_incremental *) stbi__malloc(sizeof(*d));
+   if (d == NULL) {
+      (void) stbi__err("outofmem", "Out of memory");
+      return NULL;
+   }
+   memset(d, 0, sizeof(*d));
+   return d;
 }
 
-static void *stbi__png_load(stbi__context *s, int *x, int *y, int *comp, int req_comp, stbi__result_info *ri)
+STBIDEF stbi_incremental *stbi_incremental_begin_from_memory(stbi_uc const *buffer, int len, int req_comp)
 {
-   stbi__png p;
-   p.s = s;
-   return stbi__do_png(&p, x,y,comp,req_comp, ri);
+   stbi_incremental *d = stbi__incremental_alloc_state();
+   if (d == NULL) return NULL;
+   stbi__start_mem(&d->s, buffer, len);
+   return stbi__incremental_begin(d, req_comp);
 }
 
-static int stbi__png_test(stbi__context *s)
+STBIDEF stbi_incremental *stbi_incremental_begin_from_callbacks(stbi_io_callbacks const *clbk, void *user, int req_comp)
 {
-   int r;
-   r = stbi__check_png_header(s);
-   stbi__rewind(s);
-   return r;
+   stbi_incremental *d = stbi__incremental_alloc_state();
+   if (d == NULL) return NULL;
+   stbi__start_callbacks(&d->s, (stbi_io_callbacks *) clbk, user);
+   return stbi__incremental_begin(d, req_comp);
 }
 
-static int stbi__png_info_raw(stbi__png *p, int *x, int *y, int *comp)
+#ifndef STBI_NO_STDIO
+STBIDEF stbi_incremental *stbi_incremental_begin(char const *filename, int req_comp)
 {
-   if (!stbi__parse_png_file(p, STBI__SCAN_header, 0)) {
-      stbi__rewind( p->s );
-      return 0;
+   stbi_incremental *d;
+   FILE *f = stbi__fopen(filename, "rb");
+   if (!f) {
+      (void) stbi__err("can't fopen", "Unable to open file");
+      return NULL;
    }
-   if (x) *x = p->s->img_x;
-   if (y) *y = p->s->img_y;
-   if (comp) *comp = p->s->img_n;
-   return 1;
+   d = stbi__incremental_alloc_state();
+   if (d == NULL) {
+      fclose(f);
+      return NULL;
+   }
+   d->f = f;
+   stbi__start_file(&d->s, f);
+   return stbi__incremental_begin(d, req_comp);
 }
+#endif
 
-static int stbi__png_info(stbi__context *s, int *x, int *y, int *comp)
+STBIDEF stbi_incremental *stbi_incremental_begin_from_memory_ctx(stbi_decoder *dec, stbi_uc const *buffer, int len, int req_comp)
 {
-   stbi__png p;
-   p.s = s;
-   return stbi__png_info_raw(&p, x, y, comp);
+   stbi_decoder *prev = stbi__enter_decoder(dec);
+   stbi_incremental *d = stbi_incremental_begin_from_memory(buffer, len, req_comp);
+   if (d) d->decoder = dec;
+   stbi__decoder = prev;
+   return d;
 }
 
-static int stbi__png_is16(stbi__context *s)
+STBIDEF stbi_incremental *stbi_incremental_begin_from_callbacks_ctx(stbi_decoder *dec, stbi_io_callbacks const *clbk, void *user, int req_comp)
 {
-   stbi__png p;
-   p.s = s;
-   if (!stbi__png_info_raw(&p, NULL, NULL, NULL))
-	   return 0;
-   if (p.depth != 16) {
-      stbi__rewind(p.s);
-      return 0;
-   }
-   return 1;
+   stbi_decoder *prev = stbi__enter_decoder(dec);
+   stbi_incremental *d = stbi_incremental_begin_from_callbacks(clbk, user, req_comp);
+   if (d) d->decoder = dec;
+   stbi__decoder = prev;
+   return d;
+}
+
+#ifndef STBI_NO_STDIO
+STBIDEF stbi_incremental *stbi_incremental_begin_ctx(stbi_decoder *dec, char const *filename, int req_comp)
+{
+   stbi_decoder *prev = stbi__enter_decoder(dec);
+   stbi_incremental *d = stbi_incremental_begin(filename, req_comp);
+   if (d) d->decoder = dec;
+   stbi__decoder = prev;
+   return d;
 }
 #endif
 
+STBIDEF int stbi_incremental_into(stbi_incremental *d, stbi_uc *pixels, int pitch, int width, int height, int flip)
+{
+   stbi_decoder *prev = stbi__enter_decoder(d->decoder);
+   int ok = 1;
+   if (d->req_comp < 1) ok = stbi__err("bad req_comp", "Internal error");
+   else if (width <= 0 || height <= 0 || pitch < width*d->req_comp) ok = stbi__err("bad pitch", "Rows given overlap");
+   else if (d->out || d->state == STBI__INC_done || d->state == STBI__INC_failed) ok = stbi__err("too late", "Image already allocated");
+   if (ok) {
+      d->out = pixels;
+      d->pitch = pitch;
+      d->flip = flip;
+      d->into = 1;
+      d->into_width = width;
+      d->into_height = height;
+   }
+   stbi__decoder = prev;
+   return ok;
+}
+
+STBIDEF int stbi_incremental_step(stbi_incremental *d, int budget_us, int budget_rows)
+{
+   stbi_decoder *prev = stbi__enter_decoder(d->decoder);
+   double start = budget_us > 0 ? stbi__clock_us() : 0;
+   int rows = 0;
+   while (d->state != STBI__INC_done && d->state != STBI__INC_failed) {
+      if (!stbi__incremental_unit(d)) {
+         stbi__incremental_cleanup(d);
+         d->state = STBI__INC_failed;
+         break;
+      }
+      if (budget_rows > 0 && ++rows >= budget_rows) break;
+      if (budget_us > 0 && stbi__clock_us() - start >= budget_us) break;
+   }
+   stbi__decoder = prev;
+   return d->state == STBI__INC_done ? 1 : d->state == STBI__INC_failed ? -1 : 0;
+}
+
+STBIDEF stbi_uc *stbi_incremental_finish(stbi_incremental *d, int *x, int *y, int *comp)
+{
+   stbi_uc *result = NULL;
+   if (stbi_incremental_step(d, 0, 0) == 1) {
+      result = d->out;
+      d->out = NULL;
+      *x = d->x;
+      *y = d->y;
+      if (comp) *comp = d->comp;
+   }
+   stbi_incremental_abort(d);
+   return result;
+}
+
+STBIDEF stbi_uc *stbi_incremental_preview(stbi_incremental *d, int *x, int *y, int *scale)
+{
+   #ifndef STBI_NO_JPEG
+   stbi_decoder *prev = stbi__enter_decoder(d->decoder);
+   stbi_uc *result = stbi__incremental_preview(d, x, y, scale);
+   stbi__decoder = prev;
+   return result;
+   #else
+   STBI_NOTUSED(d);
+   STBI_NOTUSED(x);
+   STBI_NOTUSED(y);
+   STBI_NOTUSED(scale);
+   return stbi__errpuc("no preview", "Not a progressive JPEG before its last scan");
+   #endif
+}
+
+STBIDEF void stbi_incremental_abort(stbi_incremental *d)
+{
+   stbi_decoder *prev;
+   if (d == NULL) return;
+   prev = stbi__enter_decoder(d->decoder);
+   stbi__incremental_cleanup(d);
+   if (!d->into) stbi__free(d->out);
+   stbi__free(d);
+   stbi__decoder = prev;
+}
+
 // Microsoft/Windows BMP image
 
 #ifndef STBI_NO_BMP
@@ -5520,7 +9472,7 @@ static void *stbi__bmp_load(stbi__context *s, int *x, int *y, int *comp, int req
    if (!out) return stbi__errpuc("outofmem", "Out of memory");
    if (info.bpp < 16) {
       int z=0;
-      if (psize == 0 || psize > 256) { STBI_FREE(out); return stbi__errpuc("invalid", "Corrupt BMP"); }
+      if (psize == 0 || psize > 256) { stbi__free(out); return stbi__errpuc("invalid", "Corrupt BMP"); }
       for (i=0; i < psize; ++i) {
          pal[i][2] = stbi__get8(s);
          pal[i][1] = stbi__get8(s);
@@ -5532,7 +9484,7 @@ static void *stbi__bmp_load(stbi__context *s, int *x, int *y, int *comp, int req
       if (info.bpp == 1) width = (s->img_x + 7) >> 3;
       else if (info.bpp == 4) width = (s->img_x + 1) >> 1;
       else if (info.bpp == 8) width = s->img_x;
-      else { STBI_FREE(out); return stbi__errpuc("bad bpp", "Corrupt BMP"); }
+      else { stbi__free(out); return stbi__errpuc("bad bpp", "Corrupt BMP"); }
       pad = (-width)&3;
       if (info.bpp == 1) {
          for (j=0; j < (int) s->img_y; ++j) {
@@ -5589,13 +9541,13 @@ static void *stbi__bmp_load(stbi__context *s, int *x, int *y, int *comp, int req
             easy = 2;
       }
       if (!easy) {
-         if (!mr || !mg || !mb) { STBI_FREE(out); return stbi__errpuc("bad masks", "Corrupt BMP"); }
+         if (!mr || !mg || !mb) { stbi__free(out); return stbi__errpuc("bad masks", "Corrupt BMP"); }
          // right shift amt to put high bit in position #7
          rshift = stbi__high_bit(mr)-7; rcount = stbi__bitcount(mr);
          gshift = stbi__high_bit(mg)-7; gcount = stbi__bitcount(mg);
          bshift = stbi__high_bit(mb)-7; bcount = stbi__bitcount(mb);
          ashift = stbi__high_bit(ma)-7; acount = stbi__bitcount(ma);
-         if (rcount > 8 || gcount > 8 || bcount > 8 || acount > 8) { STBI_FREE(out); return stbi__errpuc("bad masks", "Corrupt BMP"); }
+         if (rcount > 8 || gcount > 8 || bcount > 8 || acount > 8) { stbi__free(out); return stbi__errpuc("bad masks", "Corrupt BMP"); }
       }
       for (j=0; j < (int) s->img_y; ++j) {
          if (easy) {
@@ -5863,7 +9815,7 @@ static void *stbi__tga_load(stbi__context *s, int *x, int *y, int *comp, int req
       if ( tga_indexed)
       {
          if (tga_palette_len == 0) {  /* you have to have at least one entry! */
-            STBI_FREE(tga_data);
+            stbi__free(tga_data);
             return stbi__errpuc("bad palette", "Corrupt TGA");
          }
 
@@ -5872,7 +9824,7 @@ static void *stbi__tga_load(stbi__context *s, int *x, int *y, int *comp, int req
          //   load the palette
          tga_palette = (unsigned char*)stbi__malloc_mad2(tga_palette_len, tga_comp, 0);
          if (!tga_palette) {
-            STBI_FREE(tga_data);
+            stbi__free(tga_data);
             return stbi__errpuc("outofmem", "Out of memory");
          }
          if (tga_rgb16) {
@@ -5883,8 +9835,8 @@ static void *stbi__tga_load(stbi__context *s, int *x, int *y, int *comp, int req
                pal_entry += tga_comp;
             }
          } else if (!stbi__getn(s, tga_palette, tga_palette_len * tga_comp)) {
-               STBI_FREE(tga_data);
-               STBI_FREE(tga_palette);
+               stbi__free(tga_data);
+               stbi__free(tga_palette);
                return stbi__errpuc("bad palette", "Corrupt TGA");
          }
       }
@@ -5965,7 +9917,7 @@ static void *stbi__tga_load(stbi__context *s, int *x, int *y, int *comp, int req
       //   clear my palette, if I had one
       if ( tga_palette != NULL )
       {
-         STBI_FREE( tga_palette );
+         stbi__free( tga_palette );
       }
    }
 
@@ -6157,7 +10109,7 @@ static void *stbi__psd_load(stbi__context *s, int *x, int *y, int *comp, int req
          } else {
             // Read the RLE data.
             if (!stbi__psd_decode_rle(s, p, pixelCount)) {
-               STBI_FREE(out);
+               stbi__free(out);
                return stbi__errpuc("corrupt", "bad RLE data");
             }
          }
@@ -6449,7 +10401,7 @@ static void *stbi__pic_load(stbi__context *s,int *px,int *py,int *comp,int req_c
    memset(result, 0xff, x*y*4);
 
    if (!stbi__pic_load_core(s,x,y,comp, result)) {
-      STBI_FREE(result);
+      stbi__free(result);
       result=0;
    }
    *px = x;
@@ -6537,7 +10489,7 @@ static int stbi__gif_header(stbi__context *s, stbi__gif *g, int *comp, int is_in
    if (version != '7' && version != '9')    return stbi__err("not GIF", "Corrupt GIF");
    if (stbi__get8(s) != 'a')                return stbi__err("not GIF", "Corrupt GIF");
 
-   stbi__g_failure_reason = "";
+   stbi__set_failure_reason("");
    g->w = stbi__get16le(s);
    g->h = stbi__get16le(s);
    g->flags = stbi__get8(s);
@@ -6563,13 +10515,13 @@ static int stbi__gif_info_raw(stbi__context *s, int *x, int *y, int *comp)
    stbi__gif* g = (stbi__gif*) stbi__malloc(sizeof(stbi__gif));
    if (!g) return stbi__err("outofmem", "Out of memory");
    if (!stbi__gif_header(s, g, comp, 1)) {
-      STBI_FREE(g);
+      stbi__free(g);
       stbi__rewind( s );
       return 0;
    }
    if (x) *x = g->w;
    if (y) *y = g->h;
-   STBI_FREE(g);
+   stbi__free(g);
    return 1;
 }
 
@@ -6873,12 +10825,12 @@ static stbi_uc *stbi__gif_load_next(stbi__context *s, stbi__gif *g, int *comp, i
 
 static void *stbi__load_gif_main_outofmem(stbi__gif *g, stbi_uc *out, int **delays)
 {
-   STBI_FREE(g->out);
-   STBI_FREE(g->history);
-   STBI_FREE(g->background);
+   stbi__free(g->out);
+   stbi__free(g->history);
+   stbi__free(g->background);
 
-   if (out) STBI_FREE(out);
-   if (delays && *delays) STBI_FREE(*delays);
+   if (out) stbi__free(out);
+   if (delays && *delays) stbi__free(*delays);
    return stbi__errpuc("outofmem", "Out of memory");
 }
 
@@ -6913,7 +10865,7 @@ static void *stbi__load_gif_main(stbi__context *s, int **delays, int *x, int *y,
             stride = g.w * g.h * 4;
 
             if (out) {
-               void *tmp = (stbi_uc*) STBI_REALLOC_SIZED( out, out_size, layers * stride );
+               void *tmp = (stbi_uc*) stbi__realloc(out, layers * stride);
                if (!tmp)
                   return stbi__load_gif_main_outofmem(&g, out, delays);
                else {
@@ -6922,7 +10874,7 @@ static void *stbi__load_gif_main(stbi__context *s, int **delays, int *x, int *y,
                }
 
                if (delays) {
-                  int *new_delays = (int*) STBI_REALLOC_SIZED( *delays, delays_size, sizeof(int) * layers );
+                  int *new_delays = (int*) stbi__realloc(*delays, sizeof(int) * layers);
                   if (!new_delays)
                      return stbi__load_gif_main_outofmem(&g, out, delays);
                   *delays = new_delays;
@@ -6942,7 +10894,7 @@ static void *stbi__load_gif_main(stbi__context *s, int **delays, int *x, int *y,
             }
             memcpy( out + ((layers - 1) * stride), u, stride );
             if (layers >= 2) {
-               two_back = out - 2 * stride;
+               two_back = out + (layers - 2) * stride;
             }
 
             if (delays) {
@@ -6952,9 +10904,9 @@ static void *stbi__load_gif_main(stbi__context *s, int **delays, int *x, int *y,
       } while (u != 0);
 
       // free temp buffer;
-      STBI_FREE(g.out);
-      STBI_FREE(g.history);
-      STBI_FREE(g.background);
+      stbi__free(g.out);
+      stbi__free(g.history);
+      stbi__free(g.background);
 
       // do the final conversion after loading everything;
       if (req_comp && req_comp != 4)
@@ -6986,12 +10938,12 @@ static void *stbi__gif_load(stbi__context *s, int *x, int *y, int *comp, int req
          u = stbi__convert_format(u, 4, req_comp, g.w, g.h);
    } else if (g.out) {
       // if there was an error and we allocated an image buffer, free it!
-      STBI_FREE(g.out);
+      stbi__free(g.out);
    }
 
    // free buffers needed for multiple frame loading;
-   STBI_FREE(g.history);
-   STBI_FREE(g.background);
+   stbi__free(g.history);
+   stbi__free(g.background);
 
    return u;
 }
@@ -7000,6 +10952,132 @@ static int stbi__gif_info(stbi__context *s, int *x, int *y, int *comp)
 {
    return stbi__gif_info_raw(s,x,y,comp);
 }
+
+// streaming GIF frames: stbi__load_gif_main one frame at a time, keeping
+// the two frames before for the "restore to previous" disposal
+
+struct stbi_gif_frames
+{
+   stbi__context s;
+   #ifndef STBI_NO_STDIO
+   FILE *f;
+   #endif
+   stbi__gif g;
+   stbi_uc *back[2]; // frame n-1 goes in back[n & 1], the other one is n-2
+   int frame, ended, failed;
+};
+
+static stbi_gif_frames *stbi__gif_frames_alloc(void)
+{
+   stbi_gif_frames *f = (stbi_gif_frames *) stbi__malloc(sizeof(*f));
+   if (f == NULL) {
+      (void) stbi__err("outofmem", "Out of memory");
+      return NULL;
+   }
+   memset(f, 0, sizeof(*f));
+   return f;
+}
+
+static stbi_gif_frames *stbi__gif_frames_begin(stbi_gif_frames *f, int *x, int *y)
+{
+   // only the size for now, the first frame reads the header again
+   if (!stbi__gif_test(&f->s)) {
+      (void) stbi__err("not GIF", "Image was not as a gif type.");
+   } else if (stbi__gif_header(&f->s, &f->g, NULL, 1)) {
+      *x = f->g.w;
+      *y = f->g.h;
+      stbi__rewind(&f->s);
+      return f;
+   }
+   stbi_gif_frames_close(f);
+   return NULL;
+}
+
+STBIDEF stbi_gif_frames *stbi_gif_frames_from_memory(stbi_uc const *buffer, int len, int *x, int *y)
+{
+   stbi_gif_frames *f = stbi__gif_frames_alloc();
+   if (f == NULL) return NULL;
+   stbi__start_mem(&f->s, buffer, len);
+   return stbi__gif_frames_begin(f, x, y);
+}
+
+STBIDEF stbi_gif_frames *stbi_gif_frames_from_callbacks(stbi_io_callbacks const *clbk, void *user, int *x, int *y)
+{
+   stbi_gif_frames *f = stbi__gif_frames_alloc();
+   if (f == NULL) return NULL;
+   stbi__start_callbacks(&f->s, (stbi_io_callbacks *) clbk, user);
+   return stbi__gif_frames_begin(f, x, y);
+}
+
+#ifndef STBI_NO_STDIO
+STBIDEF stbi_gif_frames *stbi_gif_frames_open(char const *filename, int *x, int *y)
+{
+   stbi_gif_frames *f;
+   FILE *file = stbi__fopen(filename, "rb");
+   if (!file) {
+      (void) stbi__err("can't fopen", "Unable to open file");
+      return NULL;
+   }
+   f = stbi__gif_frames_alloc();
+   if (f == NULL) {
+      fclose(file);
+      return NULL;
+   }
+   f->f = file;
+   stbi__start_file(&f->s, file);
+   return stbi__gif_frames_begin(f, x, y);
+}
+#endif
+
+STBIDEF int stbi_gif_frames_next(stbi_gif_frames *f, stbi_uc const **pixels, int *delay_ms)
+{
+   stbi__gif *g = &f->g;
+   stbi_uc *u, *two_back = NULL;
+   if (f->failed) return -1;
+   if (f->ended) return 0;
+   if (f->frame > 0) {
+      size_t stride = (size_t) g->w * g->h * 4;
+      stbi_uc **prev = &f->back[f->frame & 1];
+      if (*prev == NULL) {
+         *prev = (stbi_uc *) stbi__malloc(stride);
+         if (*prev == NULL) {
+            (void) stbi__err("outofmem", "Out of memory");
+            f->failed = 1;
+            return -1;
+         }
+      }
+      memcpy(*prev, g->out, stride);
+      if (f->frame >= 2) two_back = f->back[(f->frame - 1) & 1];
+   }
+
+   u = stbi__gif_load_next(&f->s, g, NULL, 4, two_back);
+   if (u == (stbi_uc *) &f->s) { // end of animated gif marker
+      f->ended = 1;
+      return 0;
+   }
+   if (u == NULL) {
+      f->failed = 1;
+      return -1;
+   }
+   ++f->frame;
+   *pixels = u;
+   if (delay_ms) *delay_ms = g->delay;
+   return 1;
+}
+
+STBIDEF void stbi_gif_frames_close(stbi_gif_frames *f)
+{
+   if (f == NULL) return;
+   #ifndef STBI_NO_STDIO
+   if (f->f) fclose(f->f);
+   #endif
+   stbi__free(f->g.out);
+   stbi__free(f->g.background);
+   stbi__free(f->g.history);
+   stbi__free(f->back[0]);
+   stbi__free(f->back[1]);
+   stbi__free(f);
+}
 #endif
 
 // *************************************************************************************************
@@ -7077,19 +11155,134 @@ static void stbi__hdr_convert(float *output, stbi_uc *input, int req_comp)
    }
 }
 
-static float *stbi__hdr_load(stbi__context *s, int *x, int *y, int *comp, int req_comp, stbi__result_info *ri)
+// The scanlines of RLE files are decoded to planes (all R, then G, B and E)
+// and converted a row at a time
+
+static void stbi__hdr_convert_pixels(float *output, stbi_uc const *planes, int width, int i, int n, int req_comp)
+{
+   stbi_uc rgbe[4];
+   for (; n > 0; --n, ++i) {
+      rgbe[0] = planes[i];
+      rgbe[1] = planes[width + i];
+      rgbe[2] = planes[2*width + i];
+      rgbe[3] = planes[3*width + i];
+      stbi__hdr_convert(output + i*req_comp, rgbe, req_comp);
+   }
+}
+
+typedef void stbi__hdr_convert_func(float *output, stbi_uc const *planes, int width, int req_comp);
+
+static void stbi__hdr_convert_row(float *output, stbi_uc const *planes, int width, int req_comp)
+{
+   stbi__hdr_convert_pixels(output, planes, width, 0, width, req_comp);
+}
+
+#ifdef STBI_SSE2
+static stbi_inline __m128i stbi__hdr_load4_sse2(stbi_uc const *p)
+{
+   int v;
+   __m128i zero = _mm_setzero_si128();
+   memcpy(&v, p, 4);
+   return _mm_unpacklo_epi16(_mm_unpacklo_epi8(_mm_cvtsi32_si128(v), zero), zero);
+}
+
+// 4 pixels at a time: the mantissas times 2^(e-136) built from its bits,
+// which is exactly what ldexp gives, since every product fits in a float
+static void stbi__hdr_convert_row_sse2(float *output, stbi_uc const *planes, int width, int req_comp)
+{
+   __m128i zero = _mm_setzero_si128(), nine = _mm_set1_epi32(9), ten = _mm_set1_epi32(10);
+   __m128 one = _mm_set1_ps(1.0f), three = _mm_set1_ps(3.0f);
+   int i;
+   // the 3 channel stores write a float into the pixel after the 4
+   for (i=0; i+4 < width; i += 4) {
+      __m128i r = stbi__hdr_load4_sse2(planes + i);
+      __m128i g = stbi__hdr_load4_sse2(planes + width + i);
+      __m128i b = stbi__hdr_load4_sse2(planes + 2*width + i);
+      __m128i e = stbi__hdr_load4_sse2(planes + 3*width + i);
+      __m128 scale;
+      float *o = output + i*req_comp;
+
+      // e == 0 is black and comes out of the multiply by a zero scale; below
+      // 10 the scale is a denormal, left to the plain code (it is rare)
+      if (_mm_movemask_epi8(_mm_and_si128(_mm_cmpgt_epi32(e, zero), _mm_cmplt_epi32(e, ten)))) {
+         stbi__hdr_convert_pixels(output, planes, width, i, 4, req_comp);
+         continue;
+      }
+      scale = _mm_castsi128_ps(_mm_and_si128(_mm_slli_epi32(_mm_sub_epi32(e, nine), 23), _mm_cmpgt_epi32(e, nine)));
+
+      if (req_comp >= 3) {
+         __m128 fr = _mm_mul_ps(_mm_cvtepi32_ps(r), scale);
+         __m128 fg = _mm_mul_ps(_mm_cvtepi32_ps(g), scale);
+         __m128 fb = _mm_mul_ps(_mm_cvtepi32_ps(b), scale);
+         __m128 fa = one;
+         _MM_TRANSPOSE4_PS(fr, fg, fb, fa);
+         _mm_storeu_ps(o,               fr);
+         _mm_storeu_ps(o +   req_comp,  fg);
+         _mm_storeu_ps(o + 2*req_comp,  fb);
+         _mm_storeu_ps(o + 3*req_comp,  fa);
+      } else {
+         __m128 sum = _mm_cvtepi32_ps(_mm_add_epi32(_mm_add_epi32(r, g), b));
+         __m128 v = _mm_div_ps(_mm_mul_ps(sum, scale), three);
+         if (req_comp == 1) {
+            _mm_storeu_ps(o, v);
+         } else {
+            _mm_storeu_ps(o,     _mm_unpacklo_ps(v, one));
+            _mm_storeu_ps(o + 4, _mm_unpackhi_ps(v, one));
+         }
+      }
+   }
+   stbi__hdr_convert_pixels(output, planes, width, i, width - i, req_comp);
+}
+#endif
+
+static stbi__hdr_convert_func *stbi__hdr_convert_kernel(void)
+{
+#ifdef STBI_SSE2
+   if (stbi__simd_level >= STBI_SIMD_SSE2 && stbi__sse2_available())
+      return stbi__hdr_convert_row_sse2;
+#endif
+   return stbi__hdr_convert_row;
+}
+
+// what is buffered in one copy, the rest (refilled, or zeros past the end)
+// a byte at a time
+static void stbi__hdr_getn(stbi__context *s, stbi_uc *buffer, int n)
+{
+   int i = (int) (s->img_buffer_end - s->img_buffer);
+   if (i > n) i = n;
+   memcpy(buffer, s->img_buffer, i);
+   s->img_buffer += i;
+   for (; i < n; ++i)
+      buffer[i] = stbi__get8(s);
+}
+
+// floats, or halves through to_half; either way a float per channel first
+static void stbi__hdr_store(void *output, size_t index, stbi__half_func *to_half, stbi_uc *rgbe, int req_comp)
+{
+   if (to_half) {
+      float f[4];
+      stbi__hdr_convert(f, rgbe, req_comp);
+      to_half((stbi_us *) output + index, f, req_comp);
+   } else {
+      stbi__hdr_convert((float *) output + index, rgbe, req_comp);
+   }
+}
+
+static void *stbi__hdr_load_main(stbi__context *s, int *x, int *y, int *comp, int req_comp, stbi__half_func *to_half)
 {
    char buffer[STBI__HDR_BUFLEN];
    char *token;
    int valid = 0;
    int width, height;
    stbi_uc *scanline;
-   float *hdr_data;
+   float *row = NULL;
+   void *hdr_data;
    int len;
    unsigned char count, value;
-   int i, j, k, c1,c2, z;
+   int i, j, k, c1,c2;
    const char *headerToken;
-   STBI_NOTUSED(ri);
+   size_t value_size = to_half ? sizeof(stbi_us) : sizeof(float);
+   stbi__hdr_convert_func *convert = stbi__hdr_convert_kernel();
 
    // Check identifier
    headerToken = stbi__hdr_gettoken(s,buffer);
@@ -7125,11 +11318,11 @@ static float *stbi__hdr_load(stbi__context *s, int *x, int *y, int *comp, int re
    if (comp) *comp = 3;
    if (req_comp == 0) req_comp = 3;
 
-   if (!stbi__mad4sizes_valid(width, height, req_comp, sizeof(float), 0))
+   if (!stbi__mad4sizes_valid(width, height, req_comp, (int) value_size, 0))
       return stbi__errpf("too large", "HDR image is too large");
 
    // Read data
-   hdr_data = (float *) stbi__malloc_mad4(width, height, req_comp, sizeof(float), 0);
+   hdr_data = stbi__malloc_mad4(width, height, req_comp, (int) value_size, 0);
    if (!hdr_data)
       return stbi__errpf("outofmem", "Out of memory");
 
@@ -7141,8 +11334,8 @@ static float *stbi__hdr_load(stbi__context *s, int *x, int *y, int *comp, int re
          for (i=0; i < width; ++i) {
             stbi_uc rgbe[4];
            main_decode_loop:
-            stbi__getn(s, rgbe, 4);
-            stbi__hdr_convert(hdr_data + j * width * req_comp + i * req_comp, rgbe, req_comp);
+            stbi__hdr_getn(s, rgbe, 4);
+            stbi__hdr_store(hdr_data, ((size_t) j * width + i) * req_comp, to_half, rgbe, req_comp);
          }
       }
    } else {
@@ -7161,24 +11354,27 @@ static float *stbi__hdr_load(stbi__context *s, int *x, int *y, int *comp, int re
             rgbe[1] = (stbi_uc) c2;
             rgbe[2] = (stbi_uc) len;
             rgbe[3] = (stbi_uc) stbi__get8(s);
-            stbi__hdr_convert(hdr_data, rgbe, req_comp);
+            stbi__hdr_store(hdr_data, 0, to_half, rgbe, req_comp);
             i = 1;
             j = 0;
-            STBI_FREE(scanline);
+            stbi__free(scanline);
             goto main_decode_loop; // yes, this makes no sense
          }
          len <<= 8;
          len |= stbi__get8(s);
-         if (len != width) { STBI_FREE(hdr_data); STBI_FREE(scanline); return stbi__errpf("invalid decoded scanline length", "corrupt HDR"); }
+         if (len != width) { stbi__free(hdr_data); stbi__free(scanline); return stbi__errpf("invalid decoded scanline length", "corrupt HDR"); }
          if (scanline == NULL) {
-            scanline = (stbi_uc *) stbi__malloc_mad2(width, 4, 0);
+            // halves are converted from a row of floats after the planes
+            scanline = (stbi_uc *) stbi__malloc_mad2(width, to_half ? 4 + req_comp * (int) sizeof(float) : 4, 0);
             if (!scanline) {
-               STBI_FREE(hdr_data);
+               stbi__free(hdr_data);
                return stbi__errpf("outofmem", "Out of memory");
             }
+            row = (float *) (scanline + (size_t) width * 4);
          }
 
          for (k = 0; k < 4; ++k) {
+            stbi_uc *plane = scanline + (size_t) k * width;
             int nleft;
             i = 0;
             while ((nleft = width - i) > 0) {
@@ -7187,27 +11383,43 @@ static float *stbi__hdr_load(stbi__context *s, int *x, int *y, int *comp, int re
                   // Run
                   value = stbi__get8(s);
                   count -= 128;
-                  if (count > nleft) { STBI_FREE(hdr_data); STBI_FREE(scanline); return stbi__errpf("corrupt", "bad RLE data in HDR"); }
-                  for (z = 0; z < count; ++z)
-                     scanline[i++ * 4 + k] = value;
+                  if (count > nleft) { stbi__free(hdr_data); stbi__free(scanline); return stbi__errpf("corrupt", "bad RLE data in HDR"); }
+                  memset(plane + i, value, count);
                } else {
-                  // Dump
-                  if (count > nleft) { STBI_FREE(hdr_data); STBI_FREE(scanline); return stbi__errpf("corrupt", "bad RLE data in HDR"); }
-                  for (z = 0; z < count; ++z)
-                     scanline[i++ * 4 + k] = stbi__get8(s);
+                  // Dump; an empty one would never get to the end of a truncated file
+                  if (count == 0 || count > nleft) { stbi__free(hdr_data); stbi__free(scanline); return stbi__errpf("corrupt", "bad RLE data in HDR"); }
+                  stbi__hdr_getn(s, plane + i, count);
                }
+               i += count;
             }
          }
-         for (i=0; i < width; ++i)
-            stbi__hdr_convert(hdr_data+(j*width + i)*req_comp, scanline + i*4, req_comp);
+         if (to_half) {
+            convert(row, scanline, width, req_comp);
+            to_half((stbi_us *) hdr_data + (size_t) j * width * req_comp, row, (size_t) width * req_comp);
+         } else {
+            convert((float *) hdr_data + (size_t) j * width * req_comp, scanline, width, req_comp);
+         }
       }
       if (scanline)
-         STBI_FREE(scanline);
+         stbi__free(scanline);
    }
 
    return hdr_data;
 }
 
+static float *stbi__hdr_load(stbi__context *s, int *x, int *y, int *comp, int req_comp, stbi__result_info *ri)
+{
+   STBI_NOTUSED(ri);
+   return (float *) stbi__hdr_load_main(s, x, y, comp, req_comp, NULL);
+}
+
+#ifndef STBI_NO_LINEAR
+static stbi_us *stbi__hdr_load_half(stbi__context *s, int *x, int *y, int *comp, int req_comp)
+{
+   return (stbi_us *) stbi__hdr_load_main(s, x, y, comp, req_comp, stbi__half_kernel());
+}
+#endif
+
 static int stbi__hdr_info(stbi__context *s, int *x, int *y, int *comp)
 {
    char buffer[STBI__HDR_BUFLEN];
@@ -0,0 +1,197 @@
+#include "texture_image.h"
+
+#include <algorithm>
+#include <climits>
+#include <cstring>
+#include <memory>
+#include <stdexcept>
+#include <string>
+
+#include "stb_image.h"
+#include "thread_pool.h"
+
+
+namespace {
+
+void parallel_for_on_pool(void *user, int count, void (*task)(void *task_data, int i), void *task_data) {
+    static_cast<ThreadPool *>(user)->parallel_for(count, [task, task_data](size_t i) { task(task_data, int(i)); });
+}
+
+// Every thread decodes with its own stb_image context: its settings and
+// errors are not shared with the other decoding threads, and the scratch
+// memory (JPEG planes, PNG zlib output) comes from its pool, so decoding
+// texture after texture on the same worker reuses memory that is already
+// paged in, without going through malloc's locks
+const size_t DECODE_POOL_CACHED_BYTES = 128 * 1024 * 1024;
+
+stbi_decoder *thread_decoder() {
+    thread_local std::unique_ptr<stbi_decoder, decltype(&stbi_decoder_destroy)> decoder(
+        stbi_decoder_create(DECODE_POOL_CACHED_BYTES), stbi_decoder_destroy);
+    if (!decoder)
+        throw std::runtime_error("Failed to create the image decoder");
+    return decoder.get();
+}
+
+// The face an incremental decode writes into is cleared this many rows at a
+// time before it starts, so that a large one does not take a whole frame
+const int CLEAR_ROWS_PER_CHUNK = 64;
+
+}
+
+
+void set_decode_thread_pool(ThreadPool *pool) {
+    stbi_set_parallel_for(pool ? parallel_for_on_pool : nullptr, pool);
+}
+
+TextureImage load_texture_image(const std::filesystem::path &path, int level) {
+    stbi_decoder *decoder = thread_decoder();
+
+    int width, height, channels;
+    stbi_decoder_set_jpeg_scale_on_load(decoder, 1);
+    if (!stbi_info_ctx(decoder, path.c_str(), &width, &height, &channels)) {
+        throw std::runtime_error((std::string) "Failed to load texture: " + (std::string) path + ": " + stbi_decoder_failure_reason(decoder));
+    }
+    int level_width = std::max(1, width >> level), level_height = std::max(1, height >> level);
+
+    // The scaled JPEG sizes round up, so only scales that divide the size
+    // land exactly on a level. Other formats come out at full size anyway.
+    int scale_shift = std::min(level, 3);
+    while (scale_shift > 0 && ((width | height) & ((1 << scale_shift) - 1)))
+        --scale_shift;
+    if (scale_shift > 0) {
+        stbi_decoder_set_jpeg_scale_on_load(decoder, 1 << scale_shift);
+        stbi_info_ctx(decoder, path.c_str(), &width, &height, &channels);
+    }
+
+    TextureImage image;
+    image.width = width;
+    image.height = height;
+    auto &pixels = image.faces.emplace_back(size_t(width) * height * 4);
+    if (!stbi_load_into_ctx(decoder, path.c_str(), pixels.data(), width * 4, width, height, 4, 0)) { // RGBA
+        throw std::runtime_error((std::string) "Failed to load texture: " + (std::string) path + ": " + stbi_decoder_failure_reason(decoder));
+    }
+    while (image.width > level_width || image.height > level_height)
+        image = downsample(image);
+    return image;
+}
+
+std::vector<TextureImage> load_texture_planes(const std::filesystem::path &path, int level) {
+    stbi_decoder *decoder = thread_decoder();
+
+    int width, height;
+    stbi_jpeg_planes planes;
+    stbi_decoder_set_jpeg_scale_on_load(decoder, 1);
+    int status = stbi_load_jpeg_planes_ctx(decoder, path.c_str(), &width, &height, &planes);
+    if (status < 0) // not a JPEG, or RGB or CMYK
+        return {};
+    if (status == 0) {
+        throw std::runtime_error((std::string) "Failed to load texture: " + (std::string) path + ": " + stbi_decoder_failure_reason(decoder));
+    }
+
+    // Decoded at full size and box filtered, since scaled JPEG planes do
+    // not all shrink by the same factor
+    std::vector<TextureImage> result(planes.planes);
+    for (int plane = 0; plane < planes.planes; ++plane) {
+        TextureImage &image = result[plane];
+        image.width = planes.width[plane];
+        image.height = planes.height[plane];
+        image.channels = 1;
+        auto &pixels = image.faces.emplace_back(size_t(image.width) * image.height);
+        for (int y = 0; y < image.height; ++y)
+            std::memcpy(pixels.data() + size_t(y) * image.width, planes.data[plane] + size_t(y) * planes.stride[plane], image.width);
+    }
+    stbi_jpeg_planes_free(&planes);
+
+    for (auto &image : result) {
+        int level_width = std::max(1, image.width >> level), level_height = std::max(1, image.height >> level);
+        while (image.width > level_width || image.height > level_height)
+            image = downsample(image);
+    }
+    return result;
+}
+
+IncrementalTextureImage::IncrementalTextureImage(const std::filesystem::path &path)
+    : path(path), context(thread_decoder()) {
+    int channels;
+    stbi_decoder_set_jpeg_scale_on_load(context, 1);
+    if (!stbi_info_ctx(context, path.c_str(), &image.width, &image.height, &channels)) {
+        throw std::runtime_error((std::string) "Failed to load texture: " + (std::string) path + ": " + stbi_decoder_failure_reason(context));
+    }
+    // Reserved rather than sized, which would clear it all at once
+    image.faces.emplace_back().reserve(size_t(image.width) * image.height * 4);
+    decoder = stbi_incremental_begin_ctx(context, path.c_str(), 4); // RGBA
+    if (!decoder)
+        throw std::runtime_error((std::string) "Failed to load texture: " + (std::string) path + ": " + stbi_decoder_failure_reason(context));
+}
+
+IncrementalTextureImage::~IncrementalTextureImage() {
+    stbi_incremental_abort(decoder);
+}
+
+bool IncrementalTextureImage::step(std::chrono::microseconds budget) {
+    if (!decoder)
+        return true;
+    auto deadline = std::chrono::steady_clock::now() + budget;
+    auto &face = image.faces.front();
+    size_t size = size_t(image.width) * image.height * 4;
+    if (face.size() < size) {
+        size_t chunk = size_t(image.width) * 4 * CLEAR_ROWS_PER_CHUNK;
+        while (face.size() < size && std::chrono::steady_clock::now() < deadline)
+            face.resize(std::min(size, face.size() + chunk));
+        if (face.size() < size)
+            return false;
+        // Within the capacity reserved, so face.data() stays put
+        if (!stbi_incremental_into(decoder, face.data(), image.width * 4, image.width, image.height, 0)) {
+            throw std::runtime_error((std::string) "Failed to load texture: " + (std::string) path + ": " + stbi_decoder_failure_reason(context));
+        }
+    }
+
+    auto left = std::chrono::duration_cast<std::chrono::microseconds>(deadline - std::chrono::steady_clock::now());
+    int result = stbi_incremental_step(decoder, int(std::clamp<long long>(left.count(), 1, INT_MAX)), 0);
+    if (result == 0)
+        return false;
+    int width, height, channels;
+    unsigned char *pixels = stbi_incremental_finish(decoder, &width, &height, &channels); // the face's, nullptr after an error
+    decoder = nullptr;
+    if (!pixels)
+        throw std::runtime_error((std::string) "Failed to load texture: " + (std::string) path + ": " + stbi_decoder_failure_reason(context));
+    return true;
+}
+
+TextureImage IncrementalTextureImage::finish() {
+    return std::move(image);
+}
+
+void downsample_rows(const unsigned char *pixels, int width, int height, int first_row, int rows_num, unsigned char *out,
+                     int channels) {
+    int next_width = std::max(1, width / 2);
+    for (int y = first_row; y < first_row + rows_num; ++y) {
+        const unsigned char *row0 = pixels + size_t(std::min(2 * y, height - 1)) * width * channels;
+        const unsigned char *row1 = pixels + size_t(std::min(2 * y + 1, height - 1)) * width * channels;
+        unsigned char *row_out = out + size_t(y) * next_width * channels;
+        for (int x = 0; x < next_width; ++x) {
+            int x0 = std::min(2 * x, width - 1) * channels;
+            int x1 = std::min(2 * x + 1, width - 1) * channels;
+            for (int c = 0; c < channels; ++c)
+                row_out[x * channels + c] = (row0[x0 + c] + row0[x1 + c] + row1[x0 + c] + row1[x1 + c] + 2) / 4;
+        }
+    }
+}
+
+std::vector<unsigned char> downsample(const unsigned char *pixels, int width, int height, int channels) {
+    int next_width = std::max(1, width / 2);
+    int next_height = std::max(1, height / 2);
+    std::vector<unsigned char> result(size_t(next_width) * next_height * channels);
+    downsample_rows(pixels, width, height, 0, next_height, result.data(), channels);
+    return result;
+}
+
+TextureImage downsample(const TextureImage &image) {
+    TextureImage result;
+    result.width = std::max(1, image.width / 2);
+    result.height = std::max(1, image.height / 2);
+    result.channels = image.channels;
+    for (auto &face : image.faces)
+        result.faces.push_back(downsample(face.data(), image.width, image.height, image.channels));
+    return result;
+}
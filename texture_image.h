@@ -0,0 +1,60 @@
+#pragma once
+
+#include <chrono>
+#include <filesystem>
+#include <vector>
+
+class ThreadPool;
+struct stbi_decoder;
+struct stbi_incremental;
+
+// Level 0 of a texture as RGBA8 (or a single channel, for the planes of a
+// JPEG), one image for 2D textures and six for cubemaps
+struct TextureImage {
+    int width = 0, height = 0;
+    std::vector<std::vector<unsigned char>> faces;
+    int channels = 4;
+};
+
+// Decodes an image file into a single face, at mip `level` (max(1, size >> level)
+// like GL's levels). JPEGs are scaled down by up to 8 while they are decoded,
+// the rest of the way is box filtered
+TextureImage load_texture_image(const std::filesystem::path &path, int level = 0);
+
+// The Y, Cb and Cr planes of a JPEG (just Y if it is grayscale) as single
+// channel images at mip `level` of their own resolution, e.g. half the size
+// of Y for 4:2:0 chroma. None for other images and RGB or CMYK JPEGs.
+std::vector<TextureImage> load_texture_planes(const std::filesystem::path &path, int level = 0);
+
+// Decodes an image file into a single RGBA face on the calling thread, a
+// little at a time, so that it can be done between frames
+class IncrementalTextureImage {
+public:
+    explicit IncrementalTextureImage(const std::filesystem::path &path);
+    ~IncrementalTextureImage();
+    IncrementalTextureImage(const IncrementalTextureImage &) = delete;
+    IncrementalTextureImage &operator=(const IncrementalTextureImage &) = delete;
+
+    // Decodes for about `budget`, returns whether the image is complete
+    bool step(std::chrono::microseconds budget);
+    // Hands the image over once `step` returned true
+    TextureImage finish();
+
+private:
+    std::filesystem::path path;
+    stbi_decoder *context; // of the thread, see thread_decoder
+    stbi_incremental *decoder = nullptr; // decoding into image.faces[0]
+    TextureImage image;
+};
+
+// 2x2 box filter, same level sizes as GL uses: max(1, size / 2)
+std::vector<unsigned char> downsample(const unsigned char *pixels, int width, int height, int channels = 4);
+TextureImage downsample(const TextureImage &image);
+// Only rows [first_row, first_row + rows_num) of the next level, into `out`
+// which holds all of it
+void downsample_rows(const unsigned char *pixels, int width, int height, int first_row, int rows_num, unsigned char *out,
+                     int channels = 4);
+
+// Lets stb_image split large decodes (JPEG restart intervals and color
+// conversion) over the pool; nullptr goes back to decoding on the calling thread
+void set_decode_thread_pool(ThreadPool *pool);
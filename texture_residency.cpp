@@ -0,0 +1,294 @@
+#include "texture_residency.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <exception>
+#include <iomanip>
+#include <iostream>
+#include <string>
+
+#include "thread_pool.h"
+
+
+namespace {
+
+// Everything is uploaded as RGBA8, except the planes of JPEGs, which are R8
+GLenum internal_format(bool srgb, int channels) {
+    return channels == 1 ? GL_R8 : srgb ? GL_SRGB8_ALPHA8 : GL_RGBA;
+}
+
+GLenum pixel_format(int channels) {
+    return channels == 1 ? GL_RED : GL_RGBA;
+}
+
+GLenum face_target(GLenum target, int face) {
+    return target == GL_TEXTURE_CUBE_MAP ? GL_TEXTURE_CUBE_MAP_POSITIVE_X + face : target;
+}
+
+}
+
+
+TextureResidency::TextureResidency(ThreadPool &pool, size_t budget_bytes) : pool(pool), budget(budget_bytes) {}
+
+void TextureResidency::track(GLuint texture, const std::filesystem::path &path, bool srgb) {
+    track(texture, GL_TEXTURE_2D, path.filename().string(), srgb, [path](int level) { return load_texture_image(path, level); });
+}
+
+void TextureResidency::track(GLuint texture, GLenum target, const std::string &name, bool srgb, Reload reload) {
+    GLenum level_target = target == GL_TEXTURE_CUBE_MAP ? GL_TEXTURE_CUBE_MAP_POSITIVE_X : target;
+    GLint width, height, format;
+    glBindTexture(target, texture);
+    glGetTexLevelParameteriv(level_target, 0, GL_TEXTURE_WIDTH, &width);
+    glGetTexLevelParameteriv(level_target, 0, GL_TEXTURE_HEIGHT, &height);
+    glGetTexLevelParameteriv(level_target, 0, GL_TEXTURE_INTERNAL_FORMAT, &format);
+    int channels = format == GL_R8 ? 1 : 4;
+    int faces_num = target == GL_TEXTURE_CUBE_MAP ? 6 : 1;
+
+    textures.push_back({texture, target, name, srgb, std::move(reload), width, height, channels, faces_num,
+                        levels_num_of(width, height), 0, texels_per_radian_at_0(target, width)});
+}
+
+void TextureResidency::track_planes(const std::vector<GLuint> &planes, const std::vector<std::string> &names, ReloadPlanes reload) {
+    auto shared_reload = std::make_shared<ReloadPlanes>(std::move(reload));
+    for (size_t plane = 0; plane < planes.size(); ++plane) {
+        track(planes[plane], GL_TEXTURE_2D, names[plane], false, {});
+        textures.back().reload_planes = shared_reload;
+        textures.back().plane = plane;
+    }
+}
+
+void TextureResidency::reserve(GLuint texture, GLenum target, const std::string &name, int width, int height) {
+    // A texture that is reloaded, or turned out to have another size, starts over
+    int old_width, old_height, old_base_level;
+    untrack(texture, old_width, old_height, old_base_level);
+    int faces_num = target == GL_TEXTURE_CUBE_MAP ? 6 : 1;
+    int levels_num = levels_num_of(width, height);
+
+    // Nothing finer than the coarsest level until update has picked a target
+    Texture &reserved = textures.emplace_back(Texture{texture, target, name, false, {}, width, height, 4, faces_num, levels_num,
+                                                      budget == 0 ? 0 : levels_num - 1, texels_per_radian_at_0(target, width)});
+    reserved.reserved = true;
+}
+
+int TextureResidency::target_base_level(GLuint texture) const {
+    auto it = std::find_if(textures.begin(), textures.end(), [texture](const Texture &t) { return t.id == texture; });
+    return it == textures.end() || !it->reserved ? 0 : it->base_level;
+}
+
+void TextureResidency::track_reserved(GLuint texture, bool srgb, Reload reload, int base_level) {
+    auto it = std::find_if(textures.begin(), textures.end(), [texture](const Texture &t) { return t.id == texture; });
+    if (it == textures.end())
+        return;
+    it->srgb = srgb;
+    it->reload = std::move(reload);
+    it->base_level = base_level;
+    it->reserved = false;
+}
+
+bool TextureResidency::untrack(GLuint texture, int &width, int &height, int &base_level, Reload *reload) {
+    auto it = std::find_if(textures.begin(), textures.end(), [texture](const Texture &t) { return t.id == texture; });
+    if (it == textures.end())
+        return false;
+
+    width = it->width;
+    height = it->height;
+    base_level = it->base_level;
+    if (reload)
+        *reload = std::move(it->reload);
+    textures.erase(it);
+    return true;
+}
+
+int TextureResidency::levels_num_of(int width, int height) {
+    int result = 1;
+    while ((std::max(width, height) >> result) > 0)
+        ++result;
+    return result;
+}
+
+// Equirectangular textures wrap the whole equator, while the center of a cube
+// face spans one unit of the face per radian
+float TextureResidency::texels_per_radian_at_0(GLenum target, int width) {
+    return target == GL_TEXTURE_CUBE_MAP ? width / 2.f : width / (2.f * float(M_PI));
+}
+
+size_t TextureResidency::level_bytes(const Texture &texture, int level) {
+    return size_t(std::max(1, texture.width >> level)) * std::max(1, texture.height >> level) * texture.channels * texture.faces_num;
+}
+
+size_t TextureResidency::bytes_from(const Texture &texture, int base_level) {
+    size_t result = 0;
+    for (int level = base_level; level < texture.levels_num; ++level)
+        result += level_bytes(texture, level);
+    return result;
+}
+
+size_t TextureResidency::allocated_bytes() const {
+    size_t result = 0;
+    for (auto &texture : textures)
+        result += bytes_from(texture, texture.base_level);
+    return result;
+}
+
+void TextureResidency::update(float texels_per_radian) {
+    if (budget == 0)
+        return;
+
+    // The coarsest level that still covers the screen, and one finer level as
+    // the target so that small camera moves do not re-upload anything
+    std::vector<int> needed(textures.size()), target(textures.size());
+    size_t target_bytes = 0;
+    for (size_t i = 0; i < textures.size(); ++i) {
+        auto &texture = textures[i];
+        int level = 0;
+        while (level + 1 < texture.levels_num && std::ldexp(texture.texels_per_radian, -(level + 1)) >= texels_per_radian)
+            ++level;
+
+        needed[i] = level;
+        target[i] = std::max(level - 1, 0);
+        target_bytes += bytes_from(texture, target[i]);
+    }
+
+    // Over budget: keep coarsening the texture with the largest top level
+    while (target_bytes > budget) {
+        size_t largest = textures.size();
+        for (size_t i = 0; i < textures.size(); ++i) {
+            if (target[i] + 1 >= textures[i].levels_num)
+                continue;
+            if (largest == textures.size() || level_bytes(textures[i], target[i]) > level_bytes(textures[largest], target[largest]))
+                largest = i;
+        }
+        if (largest == textures.size())
+            break;
+
+        target_bytes -= level_bytes(textures[largest], target[largest]);
+        ++target[largest];
+    }
+
+    // Textures being streamed in just stop at their target; levels they got
+    // past it before it went up are evicted once they are handed over
+    for (size_t i = 0; i < textures.size(); ++i)
+        if (textures[i].reserved)
+            textures[i].base_level = target[i];
+
+    // Evict first so that restoring never goes over the budget
+    for (size_t i = 0; i < textures.size(); ++i)
+        if (target[i] > textures[i].base_level && !textures[i].reserved)
+            evict(textures[i], target[i]);
+
+    // A restore that is no longer needed, or no longer fits, is dropped when it
+    // is done; one that falls short of the target is followed by another
+    for (size_t i = 0; i < textures.size(); ++i) {
+        auto &texture = textures[i];
+        if (!texture.restored.valid() || texture.restored.wait_for(std::chrono::seconds(0)) != std::future_status::ready)
+            continue;
+        int level = texture.restoring_level;
+        try {
+            const TextureImage &image = texture.restored.get().at(texture.plane);
+            if (level < texture.base_level && level >= target[i])
+                upload(texture, level, image);
+        } catch (std::exception const &e) {
+            std::cerr << "Keeping the coarser levels of " << texture.name << ": " << e.what() << std::endl;
+            texture.restore_failed = true;
+        }
+        texture.restored = {};
+    }
+
+    std::vector<bool> restoring(textures.size());
+    for (size_t i = 0; i < textures.size(); ++i) {
+        auto &texture = textures[i];
+        restoring[i] = texture.base_level > needed[i] && target[i] < texture.base_level && !texture.restored.valid() &&
+                       !texture.restore_failed && !texture.reserved;
+    }
+    for (size_t i = 0; i < textures.size(); ++i) {
+        if (!restoring[i])
+            continue;
+        if (textures[i].reload_planes)
+            restore_planes(i, target, restoring);
+        else
+            restore(textures[i], target[i]);
+    }
+}
+
+void TextureResidency::evict(Texture &texture, int base_level) {
+    glBindTexture(texture.target, texture.id);
+    glTexParameteri(texture.target, GL_TEXTURE_BASE_LEVEL, base_level);
+
+    // Redefining a level as empty releases its storage
+    for (int face = 0; face < texture.faces_num; ++face)
+        for (int level = texture.base_level; level < base_level; ++level)
+            glTexImage2D(face_target(texture.target, face), level, internal_format(texture.srgb, texture.channels), 0, 0, 0,
+                         pixel_format(texture.channels), GL_UNSIGNED_BYTE, nullptr);
+
+    texture.base_level = base_level;
+}
+
+void TextureResidency::restore(Texture &texture, int base_level) {
+    texture.restoring_level = base_level;
+    texture.restored = pool.submit([reload = texture.reload, base_level]() {
+        std::vector<TextureImage> result;
+        result.push_back(reload(base_level));
+        return result;
+    }).share();
+}
+
+void TextureResidency::restore_planes(size_t texture, const std::vector<int> &target, std::vector<bool> &restoring) {
+    auto reload = textures[texture].reload_planes;
+    auto shares_decode = [&](size_t i) { return restoring[i] && textures[i].reload_planes == reload; };
+
+    // Each plane is box filtered down to its own target when it is uploaded
+    int base_level = target[texture];
+    for (size_t i = texture; i < textures.size(); ++i)
+        if (shares_decode(i))
+            base_level = std::min(base_level, target[i]);
+
+    auto restored = pool.submit([reload, base_level]() { return (*reload)(base_level); }).share();
+    for (size_t i = texture; i < textures.size(); ++i) {
+        if (!shares_decode(i))
+            continue;
+        textures[i].restoring_level = target[i];
+        textures[i].restored = restored;
+        restoring[i] = false;
+    }
+}
+
+void TextureResidency::upload(Texture &texture, int base_level, const TextureImage &image) {
+    const TextureImage *level_image = &image;
+    TextureImage downsampled;
+    while (level_image->width > std::max(1, texture.width >> base_level) || level_image->height > std::max(1, texture.height >> base_level)) {
+        downsampled = downsample(*level_image);
+        level_image = &downsampled;
+    }
+
+    glBindTexture(texture.target, texture.id);
+    glPixelStorei(GL_UNPACK_ALIGNMENT, 1); // R8 rows are not padded to 4 bytes
+    for (int face = 0; face < texture.faces_num; ++face) {
+        glTexImage2D(face_target(texture.target, face), base_level, internal_format(texture.srgb, texture.channels),
+                     level_image->width, level_image->height, 0, pixel_format(texture.channels), GL_UNSIGNED_BYTE,
+                     level_image->faces[face].data());
+    }
+    glPixelStorei(GL_UNPACK_ALIGNMENT, 4);
+
+    // Let GL rebuild the coarser levels from the new base level
+    glTexParameteri(texture.target, GL_TEXTURE_BASE_LEVEL, base_level);
+    glGenerateMipmap(texture.target);
+
+    texture.base_level = base_level;
+}
+
+void TextureResidency::print_report(std::ostream &out) const {
+    auto mib = [](size_t bytes) { return bytes / (1024.0 * 1024.0); };
+
+    out << std::fixed << std::setprecision(1);
+    out << "Textures: " << mib(allocated_bytes()) << " MiB";
+    if (budget != 0)
+        out << " of " << mib(budget) << " MiB budget";
+    out << std::endl;
+
+    for (auto &texture : textures) {
+        out << "  " << texture.name
+            << ": " << std::max(1, texture.width >> texture.base_level) << "x" << std::max(1, texture.height >> texture.base_level)
+            << " (" << (texture.reserved ? "streaming to " : "") << "base level " << texture.base_level << "), " << mib(bytes_from(texture, texture.base_level)) << " MiB" << std::endl;
+    }
+}
@@ -0,0 +1,107 @@
+#pragma once
+
+#include <cstddef>
+#include <filesystem>
+#include <functional>
+#include <future>
+#include <iosfwd>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "GL/glew.h"
+
+#include "texture_image.h"
+
+class ThreadPool;
+
+// Accounts for the video memory of every texture created through load_texture
+// and keeps the total under a budget by dropping the finest mip levels of the
+// textures (GL_TEXTURE_BASE_LEVEL) and re-uploading them from the source file
+// once they are needed again. The levels are decoded again on the thread pool,
+// the texture keeps its coarser levels until they are ready. The planes of one
+// image share that decode.
+class TextureResidency {
+public:
+    // Returns mip `level` of the texture, or a finer level that gets box filtered
+    using Reload = std::function<TextureImage(int level)>;
+    // Returns every plane of an image, e.g. the Y, Cb and Cr of a JPEG, at mip
+    // `level` of its own resolution, or finer
+    using ReloadPlanes = std::function<std::vector<TextureImage>(int level)>;
+
+    // budget_bytes == 0 means no budget: textures are only accounted for
+    explicit TextureResidency(ThreadPool &pool, size_t budget_bytes = 0);
+
+    // A 2D equirectangular texture that is reloaded from the image file
+    void track(GLuint texture, const std::filesystem::path &path, bool srgb);
+    // A 2D equirectangular texture or a cubemap, reloaded with `reload`
+    void track(GLuint texture, GLenum target, const std::string &name, bool srgb, Reload reload);
+    // 2D textures with one plane each, restored together by a single `reload`
+    void track_planes(const std::vector<GLuint> &planes, const std::vector<std::string> &names, ReloadPlanes reload);
+
+    // An RGBA texture that TextureStreamer fills in from the coarsest level
+    // down. It counts against the budget from the start, at the base level
+    // that target_base_level returns and the streamer stops at, but is
+    // neither evicted nor restored until track_reserved hands it over with
+    // the base level it got to.
+    void reserve(GLuint texture, GLenum target, const std::string &name, int width, int height);
+    int target_base_level(GLuint texture) const;
+    void track_reserved(GLuint texture, bool srgb, Reload reload, int base_level);
+
+    // Stops managing the texture, e.g. while its content is being replaced.
+    // Returns false if it was not tracked, otherwise the size of level 0, the
+    // current base level and, if asked for, how it was reloaded.
+    bool untrack(GLuint texture, int &width, int &height, int &base_level, Reload *reload = nullptr);
+
+    // Pick the base level of every texture from the texel density needed on
+    // screen (texels per radian of the sphere) and the budget, then evict
+    // levels, upload the ones restored since the last call and start
+    // restoring the rest. Call once per frame.
+    void update(float texels_per_radian);
+
+    size_t allocated_bytes() const;
+    size_t budget_bytes() const { return budget; }
+
+    void print_report(std::ostream &out) const;
+
+private:
+    struct Texture {
+        GLuint id;
+        GLenum target;
+        std::string name;
+        bool srgb;
+        Reload reload;
+        int width, height;
+        int channels; // 4 (RGBA8) or 1 (R8)
+        int faces_num;
+        int levels_num;
+        int base_level;
+        float texels_per_radian; // at level 0, where it is the lowest
+
+        std::shared_ptr<ReloadPlanes> reload_planes; // instead of reload, for the planes of one image
+        size_t plane = 0;
+
+        std::shared_future<std::vector<TextureImage>> restored; // being decoded on the pool, one image per plane
+        int restoring_level = -1;
+        bool restore_failed = false; // the coarser levels stay then
+        bool reserved = false; // still streamed in, base_level is its target
+    };
+
+    static size_t level_bytes(const Texture &texture, int level);
+    static size_t bytes_from(const Texture &texture, int base_level);
+    static float texels_per_radian_at_0(GLenum target, int width);
+    static int levels_num_of(int width, int height);
+
+    void evict(Texture &texture, int base_level);
+    // Starts decoding `base_level` on the pool
+    void restore(Texture &texture, int base_level);
+    // Starts one decode for the planes of `texture`'s image that are being
+    // restored, at the finest of their target levels, and clears them from
+    // `restoring`
+    void restore_planes(size_t texture, const std::vector<int> &target, std::vector<bool> &restoring);
+    void upload(Texture &texture, int base_level, const TextureImage &image);
+
+    ThreadPool &pool;
+    size_t budget;
+    std::vector<Texture> textures;
+};
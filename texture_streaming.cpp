@@ -0,0 +1,382 @@
+#include "texture_streaming.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <fstream>
+#include <iostream>
+#include <stdexcept>
+
+#include "texture_residency.h"
+#include "thread_pool.h"
+
+
+namespace {
+
+const int PREVIEW_SIZE = 256; // the preview is the first level not larger than this
+
+const int FILTER_ROWS_PER_STEP = 16; // of the level being box filtered, between checks of the deadline
+
+const uint32_t PREVIEW_MAGIC = 0x56505145; // "EQPV"
+const uint32_t PREVIEW_VERSION = 1;
+
+struct PreviewHeader {
+    uint32_t magic;
+    uint32_t version;
+    int32_t width, height; // of level 0
+    int32_t level;
+    int32_t faces_num;
+    uint64_t source_size;
+    int64_t source_mtime;
+};
+
+int levels_num(int width, int height) {
+    int result = 1;
+    while ((std::max(width, height) >> result) > 0)
+        ++result;
+    return result;
+}
+
+int preview_level(int width, int height) {
+    int level = 0;
+    while ((std::max(width, height) >> level) > PREVIEW_SIZE)
+        ++level;
+    return level;
+}
+
+GLenum internal_format(bool srgb) {
+    return srgb ? GL_SRGB8_ALPHA8 : GL_RGBA;
+}
+
+GLenum face_target(GLenum target, int face) {
+    return target == GL_TEXTURE_CUBE_MAP ? GL_TEXTURE_CUBE_MAP_POSITIVE_X + face : target;
+}
+
+std::filesystem::path preview_path(const std::filesystem::path &cache_dir, const std::filesystem::path &path, GLenum target) {
+    return cache_dir / (path.filename().string() + (target == GL_TEXTURE_CUBE_MAP ? ".cube" : "") + ".preview");
+}
+
+PreviewHeader preview_header_for(const std::filesystem::path &source_path) {
+    PreviewHeader header{};
+    header.magic = PREVIEW_MAGIC;
+    header.version = PREVIEW_VERSION;
+    header.source_size = std::filesystem::file_size(source_path);
+    header.source_mtime = std::filesystem::last_write_time(source_path).time_since_epoch().count();
+    return header;
+}
+
+bool read_preview(const std::filesystem::path &preview_path, const std::filesystem::path &source_path,
+                  PreviewHeader &header, TextureImage &preview) {
+    std::ifstream file(preview_path, std::ios::binary);
+    if (!file || !file.read(reinterpret_cast<char *>(&header), sizeof(header)))
+        return false;
+
+    PreviewHeader expected = preview_header_for(source_path);
+    if (header.magic != expected.magic || header.version != expected.version ||
+        header.source_size != expected.source_size || header.source_mtime != expected.source_mtime)
+        return false;
+
+    preview.width = std::max(1, header.width >> header.level);
+    preview.height = std::max(1, header.height >> header.level);
+    preview.faces.resize(header.faces_num);
+    for (auto &face : preview.faces) {
+        face.resize(size_t(preview.width) * preview.height * 4);
+        if (!file.read(reinterpret_cast<char *>(face.data()), face.size()))
+            return false;
+    }
+    return true;
+}
+
+void write_preview(const std::filesystem::path &preview_path, const std::filesystem::path &source_path,
+                   int width, int height, int level, const TextureImage &preview) {
+    std::filesystem::create_directories(preview_path.parent_path());
+
+    auto temp_path = preview_path;
+    temp_path += ".tmp";
+    {
+        std::ofstream file(temp_path, std::ios::binary);
+        if (!file)
+            return; // only a cache, the next start will just be slower
+
+        PreviewHeader header = preview_header_for(source_path);
+        header.width = width;
+        header.height = height;
+        header.level = level;
+        header.faces_num = int32_t(preview.faces.size());
+        file.write(reinterpret_cast<const char *>(&header), sizeof(header));
+        for (auto &face : preview.faces)
+            file.write(reinterpret_cast<const char *>(face.data()), face.size());
+    }
+    std::filesystem::rename(temp_path, preview_path);
+}
+
+}
+
+
+TextureStreamer::TextureStreamer(ThreadPool &pool, TextureResidency &residency, std::filesystem::path cache_dir,
+                                 size_t upload_bytes_per_frame, std::chrono::microseconds decode_budget_per_frame)
+    : pool(pool), residency(residency), cache_dir(std::move(cache_dir)), upload_bytes_per_frame(upload_bytes_per_frame),
+      decode_budget_per_frame(decode_budget_per_frame) {}
+
+void TextureStreamer::set_sampling(Texture &texture) {
+    glBindTexture(texture.target, texture.id);
+    glTexParameteri(texture.target, GL_TEXTURE_MIN_FILTER, GL_LINEAR_MIPMAP_LINEAR);
+    glTexParameteri(texture.target, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+    glTexParameterf(texture.target, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+    glTexParameterf(texture.target, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+    glTexParameterf(texture.target, GL_TEXTURE_WRAP_R, GL_CLAMP_TO_EDGE);
+}
+
+void TextureStreamer::upload_coarse_levels(Texture &texture, int level, TextureImage image) {
+    glBindTexture(texture.target, texture.id);
+    for (int coarse_level = level; coarse_level < levels_num(texture.width, texture.height); ++coarse_level) {
+        for (int face = 0; face < texture.faces_num; ++face) {
+            glTexImage2D(face_target(texture.target, face), coarse_level, internal_format(texture.srgb), image.width, image.height, 0,
+                         GL_RGBA, GL_UNSIGNED_BYTE, image.faces[face].data());
+        }
+        image = downsample(image);
+    }
+    texture.base_level = std::min(texture.base_level, level);
+    glTexParameteri(texture.target, GL_TEXTURE_BASE_LEVEL, texture.base_level);
+}
+
+GLuint TextureStreamer::load(GLenum target, const std::filesystem::path &path, bool srgb, int width, int height, Decode decode) {
+    Texture &texture = textures.emplace_back();
+    glGenTextures(1, &texture.id);
+    texture.target = target;
+    texture.path = path;
+    texture.srgb = srgb;
+    texture.decode = decode;
+    texture.previous_decode = decode;
+    texture.faces_num = target == GL_TEXTURE_CUBE_MAP ? 6 : 1;
+
+    // Without a preview the texture starts as a single grey texel
+    PreviewHeader header;
+    TextureImage preview;
+    auto sidecar_path = preview_path(cache_dir, path, target);
+    if (read_preview(sidecar_path, path, header, preview) && header.faces_num == texture.faces_num) {
+        texture.width = header.width;
+        texture.height = header.height;
+        texture.base_level = header.level;
+    } else {
+        texture.width = width;
+        texture.height = height;
+        texture.base_level = levels_num(width, height) - 1;
+        preview.width = preview.height = 1;
+        preview.faces.assign(texture.faces_num, {128, 128, 128, 255});
+
+        // Submitted before the full decode, so it is picked up first
+        texture.preview_future = pool.submit([decode, level = preview_level(width, height)]() { return decode(level); });
+    }
+
+    residency.reserve(texture.id, target, path.filename().string(), texture.width, texture.height);
+    set_sampling(texture);
+    upload_coarse_levels(texture, texture.base_level, std::move(preview));
+
+    decode_levels(texture);
+    return texture.id;
+}
+
+void TextureStreamer::reload(GLuint texture_id, GLenum target, const std::filesystem::path &path, bool srgb, Decode decode) {
+    auto it = std::find_if(textures.begin(), textures.end(), [texture_id](const Texture &t) { return t.id == texture_id; });
+    if (it == textures.end()) {
+        Texture &texture = textures.emplace_back();
+        texture.id = texture_id;
+        texture.target = target;
+        texture.path = path;
+        texture.srgb = srgb;
+        texture.faces_num = target == GL_TEXTURE_CUBE_MAP ? 6 : 1;
+        if (!residency.untrack(texture_id, texture.width, texture.height, texture.base_level, &texture.previous_decode))
+            throw std::runtime_error("Reloading a texture that was not loaded: " + path.string());
+        residency.reserve(texture_id, target, path.filename().string(), texture.width, texture.height);
+        it = std::prev(textures.end());
+    }
+
+    // A texture that is still streaming starts over with the new file
+    it->decode = decode;
+    it->preview_future = {};
+    it->levels.clear();
+    it->next_level = -1;
+    it->next_row = 0;
+    try {
+        decode_levels(*it);
+    } catch (std::exception const &e) {
+        keep_old(it, e);
+    }
+}
+
+// The decoded image goes down to the preview level, which is stored for the
+// next start
+void TextureStreamer::decode_levels(Texture &texture) {
+    if (decode_budget_per_frame.count() > 0 && texture.target == GL_TEXTURE_2D) {
+        texture.levels_future = {};
+        texture.incremental = std::make_unique<IncrementalTextureImage>(texture.path);
+        return;
+    }
+    texture.incremental.reset();
+    auto sidecar_path = preview_path(cache_dir, texture.path, texture.target);
+    texture.levels_future = pool.submit([decode = texture.decode, sidecar_path, path = texture.path]() {
+        TextureImage image = decode(0);
+        int full_width = image.width, full_height = image.height;
+        int last_level = preview_level(full_width, full_height);
+
+        std::vector<Level> levels;
+        for (int level = 0; level < last_level; ++level) {
+            TextureImage next = downsample(image);
+            levels.push_back({image.width, image.height, std::move(image.faces)});
+            image = std::move(next);
+        }
+        write_preview(sidecar_path, path, full_width, full_height, last_level, image);
+        levels.push_back({image.width, image.height, std::move(image.faces)});
+        return levels;
+    });
+}
+
+// Does what decode_levels does on the pool, in steps
+bool TextureStreamer::decode_levels_step(Texture &texture, Clock::time_point deadline) {
+    if (texture.incremental) {
+        if (Clock::now() >= deadline ||
+            !texture.incremental->step(std::chrono::duration_cast<std::chrono::microseconds>(deadline - Clock::now())))
+            return false;
+        TextureImage image = texture.incremental->finish();
+        texture.incremental.reset();
+        texture.levels.push_back({image.width, image.height, std::move(image.faces)});
+        texture.filtered_rows = texture.levels.back().height;
+    }
+
+    auto &full = texture.levels.front();
+    int full_width = full.width, full_height = full.height;
+    int last_level = preview_level(full_width, full_height);
+    while (true) {
+        int level = int(texture.levels.size()) - 1;
+        Level &filtered = texture.levels[level];
+        if (texture.filtered_rows == filtered.height) {
+            if (level == last_level)
+                break;
+            Level next = {std::max(1, filtered.width / 2), std::max(1, filtered.height / 2), {}};
+            next.faces.assign(filtered.faces.size(), std::vector<unsigned char>(size_t(next.width) * next.height * 4));
+            texture.levels.push_back(std::move(next));
+            texture.filtered_rows = 0;
+            continue;
+        }
+        if (Clock::now() >= deadline)
+            return false;
+        Level &source = texture.levels[level - 1];
+        int rows = std::min(FILTER_ROWS_PER_STEP, filtered.height - texture.filtered_rows);
+        for (size_t face = 0; face < filtered.faces.size(); ++face)
+            downsample_rows(source.faces[face].data(), source.width, source.height, texture.filtered_rows, rows, filtered.faces[face].data());
+        texture.filtered_rows += rows;
+    }
+
+    auto &preview = texture.levels.back();
+    write_preview(preview_path(cache_dir, texture.path, texture.target), texture.path, full_width, full_height, last_level,
+                  {preview.width, preview.height, preview.faces});
+    return true;
+}
+
+bool TextureStreamer::upload_rows(Texture &texture, size_t &budget, Clock::time_point decode_deadline) {
+    if (texture.next_level < 0) {
+        if (texture.preview_future.valid() && texture.preview_future.wait_for(std::chrono::seconds(0)) == std::future_status::ready) {
+            TextureImage preview = texture.preview_future.get();
+            int level = preview_level(texture.width, texture.height);
+            while (preview.width > std::max(1, texture.width >> level) || preview.height > std::max(1, texture.height >> level))
+                preview = downsample(preview);
+            if (preview.width == std::max(1, texture.width >> level) && preview.height == std::max(1, texture.height >> level))
+                upload_coarse_levels(texture, level, std::move(preview));
+        }
+        if (texture.levels_future.valid()) {
+            if (texture.levels_future.wait_for(std::chrono::seconds(0)) != std::future_status::ready)
+                return false;
+            texture.levels = texture.levels_future.get();
+        } else if (!decode_levels_step(texture, decode_deadline)) {
+            return false;
+        }
+        texture.preview_future = {};
+
+        // The file might have changed since the preview was written
+        auto &full = texture.levels.front();
+        if (full.width != texture.width || full.height != texture.height) {
+            texture.width = full.width;
+            texture.height = full.height;
+            texture.base_level = levels_num(texture.width, texture.height);
+            residency.reserve(texture.id, texture.target, texture.path.filename().string(), texture.width, texture.height);
+        }
+
+        // The coarsest decoded level and everything below it are small
+        int last_level = int(texture.levels.size()) - 1;
+        auto &level = texture.levels.back();
+        upload_coarse_levels(texture, last_level, {level.width, level.height, std::move(level.faces)});
+        texture.levels.pop_back();
+        texture.next_level = last_level - 1;
+    }
+
+    // Levels finer than the budget allows are left to the residency manager
+    int finest_level = residency.target_base_level(texture.id);
+    glBindTexture(texture.target, texture.id);
+    while (texture.next_level >= finest_level && budget > 0) {
+        Level &level = texture.levels[texture.next_level];
+        size_t row_bytes = size_t(level.width) * 4;
+        size_t rows_num = size_t(level.height) * texture.faces_num;
+        if (texture.next_row == 0) {
+            for (int face = 0; face < texture.faces_num; ++face) {
+                glTexImage2D(face_target(texture.target, face), texture.next_level, internal_format(texture.srgb), level.width, level.height,
+                             0, GL_RGBA, GL_UNSIGNED_BYTE, nullptr);
+            }
+        }
+
+        int face = int(texture.next_row / level.height);
+        int row = int(texture.next_row % level.height);
+        int rows = int(std::min<size_t>(std::max<size_t>(1, budget / row_bytes), level.height - row));
+        glTexSubImage2D(face_target(texture.target, face), texture.next_level, 0, row, level.width, rows,
+                        GL_RGBA, GL_UNSIGNED_BYTE, level.faces[face].data() + row * row_bytes);
+        budget -= std::min(budget, rows * row_bytes);
+        texture.next_row += rows;
+
+        if (texture.next_row == rows_num) {
+            if (texture.next_level < texture.base_level) {
+                texture.base_level = texture.next_level;
+                glTexParameteri(texture.target, GL_TEXTURE_BASE_LEVEL, texture.base_level);
+            }
+            level.faces.clear();
+            level.faces.shrink_to_fit();
+            texture.next_level--;
+            texture.next_row = 0;
+        }
+    }
+    if (texture.next_level >= finest_level)
+        return false;
+
+    // A level cut short by the target going up is released again
+    if (texture.next_row > 0) {
+        for (int face = 0; face < texture.faces_num; ++face)
+            glTexImage2D(face_target(texture.target, face), texture.next_level, internal_format(texture.srgb), 0, 0, 0,
+                         GL_RGBA, GL_UNSIGNED_BYTE, nullptr);
+    }
+    return true;
+}
+
+std::list<TextureStreamer::Texture>::iterator TextureStreamer::keep_old(std::list<Texture>::iterator it, const std::exception &e) {
+    std::cerr << "Keeping the old " << it->path.filename().string() << ": " << e.what() << std::endl;
+    residency.track_reserved(it->id, it->srgb, it->previous_decode, it->base_level);
+    return textures.erase(it);
+}
+
+void TextureStreamer::update() {
+    size_t budget = upload_bytes_per_frame;
+    auto decode_deadline = Clock::now() + decode_budget_per_frame;
+    for (auto it = textures.begin(); it != textures.end() && budget > 0;) {
+        bool done;
+        try {
+            done = upload_rows(*it, budget, decode_deadline);
+        } catch (std::exception const &e) {
+            it = keep_old(it, e);
+            continue;
+        }
+        if (done) {
+            residency.track_reserved(it->id, it->srgb, it->decode, it->base_level);
+            it = textures.erase(it);
+        } else {
+            ++it;
+        }
+    }
+}
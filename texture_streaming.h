@@ -0,0 +1,105 @@
+#pragma once
+
+#include <chrono>
+#include <cstddef>
+#include <exception>
+#include <filesystem>
+#include <functional>
+#include <future>
+#include <list>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "GL/glew.h"
+
+#include "texture_image.h"
+
+class ThreadPool;
+class TextureResidency;
+
+
+// Loads textures without blocking the frame loop. The texture starts with only
+// the coarse levels, filled from a small preview, and GL_TEXTURE_BASE_LEVEL
+// pointing at them. The full image is decoded on the thread pool, and its
+// levels are allocated and uploaded a few rows per frame from the coarsest to
+// the finest, lowering the base level as each one is complete. The texture is
+// reserved in the residency manager meanwhile, and streaming stops at the base
+// level it leaves the texture within its budget; finer levels are restored by
+// it later, once they are needed and fit. The preview is a sidecar file written into the cache directory
+// after the previous full decode; without one, the preview level is decoded
+// on its own first, which for JPEGs is a fraction of the full decode.
+//
+// With a decode budget, 2D textures are decoded on the GL thread instead, in
+// `update`, for at most that long per frame (along with box filtering the
+// levels), which leaves the pool to everything else.
+class TextureStreamer {
+public:
+    // Returns mip `level` of the texture, or a finer level that gets box filtered
+    using Decode = std::function<TextureImage(int level)>;
+
+    TextureStreamer(ThreadPool &pool, TextureResidency &residency, std::filesystem::path cache_dir, size_t upload_bytes_per_frame,
+                    std::chrono::microseconds decode_budget_per_frame = {});
+
+    // `width` and `height` are the expected size of level 0, used when there
+    // is no preview yet. Once the texture is complete it is handed over to the
+    // residency manager, which reloads it with `decode` as well.
+    GLuint load(GLenum target, const std::filesystem::path &path, bool srgb, int width, int height, Decode decode);
+
+    // Replaces the content of a loaded texture (streamed or not) after its
+    // file has changed. The old content stays visible until the new levels
+    // overwrite it, coarsest first, and for good if the new file fails to
+    // decode.
+    void reload(GLuint texture, GLenum target, const std::filesystem::path &path, bool srgb, Decode decode);
+
+    // Decodes and uploads the next rows within the per frame budgets; call
+    // once per frame on the GL thread
+    void update();
+
+    bool finished() const { return textures.empty(); }
+
+private:
+    struct Level {
+        int width, height;
+        std::vector<std::vector<unsigned char>> faces;
+    };
+
+    struct Texture {
+        GLuint id;
+        GLenum target;
+        std::filesystem::path path;
+        bool srgb;
+        Decode decode;
+        Decode previous_decode; // of the content kept if `decode` fails
+        int width, height, faces_num;
+        int base_level; // it and the coarser levels are complete
+
+        std::future<TextureImage> preview_future; // while there is no preview yet
+        std::future<std::vector<Level>> levels_future;
+        std::unique_ptr<IncrementalTextureImage> incremental; // instead, with a decode budget
+        std::vector<Level> levels; // down to the preview level, once decoded
+        int filtered_rows = 0; // of the last of `levels`, while they are box filtered in steps
+        int next_level = -1; // the one being uploaded, -1 until decoded
+        size_t next_row = 0; // across faces
+    };
+
+    using Clock = std::chrono::steady_clock;
+
+    void decode_levels(Texture &texture);
+    // Decodes and box filters until `deadline`, returns whether the levels are done
+    bool decode_levels_step(Texture &texture, Clock::time_point deadline);
+
+    void set_sampling(Texture &texture);
+    // Defines `level` and every coarser one from `image`, lowering the base to it
+    void upload_coarse_levels(Texture &texture, int level, TextureImage image);
+    bool upload_rows(Texture &texture, size_t &budget, Clock::time_point decode_deadline);
+    // Hands the texture back to the residency manager as it is, returns the next one
+    std::list<Texture>::iterator keep_old(std::list<Texture>::iterator it, const std::exception &e);
+
+    ThreadPool &pool;
+    TextureResidency &residency;
+    std::filesystem::path cache_dir;
+    size_t upload_bytes_per_frame;
+    std::chrono::microseconds decode_budget_per_frame;
+    std::list<Texture> textures;
+};
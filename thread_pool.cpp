@@ -0,0 +1,88 @@
+#include "thread_pool.h"
+
+#include <atomic>
+#include <exception>
+
+
+ThreadPool::ThreadPool(size_t threads_num) {
+    for (size_t i = 0; i < threads_num; ++i)
+        workers.emplace_back([this]() { worker_loop(); });
+}
+
+ThreadPool::~ThreadPool() {
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        stopping = true;
+    }
+    task_available.notify_all();
+    for (auto &worker : workers)
+        worker.join();
+}
+
+void ThreadPool::enqueue(std::function<void()> task) {
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        tasks.push(std::move(task));
+    }
+    task_available.notify_one();
+}
+
+void ThreadPool::worker_loop() {
+    while (true) {
+        std::function<void()> task;
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            task_available.wait(lock, [this]() { return stopping || !tasks.empty(); });
+            if (tasks.empty())
+                return;
+            task = std::move(tasks.front());
+            tasks.pop();
+        }
+        task();
+    }
+}
+
+void ThreadPool::parallel_for(size_t count, const std::function<void(size_t)> &body) {
+    if (count == 0)
+        return;
+
+    // Helpers may start after everything is done, so the state they touch is
+    // shared rather than living on this stack frame
+    struct State {
+        std::function<void(size_t)> body;
+        size_t count;
+        std::atomic<size_t> next{0};
+        std::atomic<size_t> done{0};
+        std::mutex mutex;
+        std::condition_variable finished;
+        std::exception_ptr error;
+    };
+    auto state = std::make_shared<State>();
+    state->body = body;
+    state->count = count;
+
+    auto run = [state]() {
+        for (size_t i; (i = state->next.fetch_add(1)) < state->count;) {
+            try {
+                state->body(i);
+            } catch (...) {
+                std::lock_guard<std::mutex> lock(state->mutex);
+                if (!state->error)
+                    state->error = std::current_exception();
+            }
+            if (state->done.fetch_add(1) + 1 == state->count) {
+                std::lock_guard<std::mutex> lock(state->mutex);
+                state->finished.notify_all();
+            }
+        }
+    };
+
+    for (size_t i = 1; i < std::min(count, workers.size() + 1); ++i)
+        enqueue(run);
+    run();
+
+    std::unique_lock<std::mutex> lock(state->mutex);
+    state->finished.wait(lock, [&]() { return state->done == state->count; });
+    if (state->error)
+        std::rethrow_exception(state->error);
+}
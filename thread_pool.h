@@ -0,0 +1,47 @@
+#pragma once
+
+#include <algorithm>
+#include <condition_variable>
+#include <cstddef>
+#include <functional>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <queue>
+#include <thread>
+#include <vector>
+
+
+class ThreadPool {
+public:
+    explicit ThreadPool(size_t threads_num = std::max(1u, std::thread::hardware_concurrency()));
+    ~ThreadPool();
+
+    ThreadPool(const ThreadPool &) = delete;
+    ThreadPool &operator=(const ThreadPool &) = delete;
+
+    size_t size() const { return workers.size(); }
+
+    template <typename F>
+    auto submit(F &&f) -> std::future<decltype(f())> {
+        auto task = std::make_shared<std::packaged_task<decltype(f())()>>(std::forward<F>(f));
+        auto result = task->get_future();
+        enqueue([task]() { (*task)(); });
+        return result;
+    }
+
+    // Calls body(i) for every i in [0, count) and waits for all of them.
+    // The calling thread takes part too, so it is fine to call this from a
+    // task that is itself running on the pool.
+    void parallel_for(size_t count, const std::function<void(size_t)> &body);
+
+private:
+    void enqueue(std::function<void()> task);
+    void worker_loop();
+
+    std::vector<std::thread> workers;
+    std::queue<std::function<void()>> tasks;
+    std::mutex mutex;
+    std::condition_variable task_available;
+    bool stopping = false;
+};
@@ -0,0 +1,235 @@
+#include "tile_pyramid.h"
+
+#include <algorithm>
+#include <cstring>
+#include <fstream>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include "stb_image.h"
+#include "texture_image.h"
+#include "thread_pool.h"
+
+
+namespace {
+
+const int DOWNSAMPLE_ROWS_PER_TASK = 16; // of the next level
+
+struct Strip {
+    int width, height; // of the level
+    int first_row = 0; // of the strip within the level
+    int rows_num = 0;
+    std::vector<unsigned char> rows;
+    std::vector<TilePyramidTile> tiles;
+};
+
+struct Builder {
+    int tile_size;
+    ThreadPool &pool;
+    std::ofstream &tiles_file;
+    std::vector<Strip> levels;
+    TilePyramidStats stats;
+
+    void flush(size_t level);
+};
+
+// Cuts the strip into tiles, appends them to the tile file and passes the
+// strip on to the next level
+void Builder::flush(size_t level) {
+    Strip &strip = levels[level];
+    int rows_num = strip.rows_num;
+    if (rows_num == 0)
+        return;
+
+    size_t row_bytes = size_t(strip.width) * 4;
+    int tiles_x = (strip.width + tile_size - 1) / tile_size;
+    std::vector<std::vector<unsigned char>> tiles(tiles_x);
+    pool.parallel_for(tiles_x, [&](size_t x) {
+        int tile_width = std::min(tile_size, strip.width - int(x) * tile_size);
+        size_t tile_row_bytes = size_t(tile_width) * 4;
+        tiles[x].resize(tile_row_bytes * rows_num);
+        for (int y = 0; y < rows_num; ++y)
+            std::memcpy(tiles[x].data() + y * tile_row_bytes, strip.rows.data() + y * row_bytes + x * tile_size * 4, tile_row_bytes);
+    });
+
+    for (int x = 0; x < tiles_x; ++x) {
+        strip.tiles.push_back({stats.tile_bytes, uint32_t(tiles[x].size() / 4 / rows_num), uint32_t(rows_num)});
+        tiles_file.write(reinterpret_cast<const char *>(tiles[x].data()), tiles[x].size());
+        stats.tile_bytes += tiles[x].size();
+        ++stats.tiles_num;
+    }
+
+    if (level + 1 < levels.size()) {
+        // Strips start on even rows, so the row pairs of the box filter never
+        // straddle two of them
+        Strip &next = levels[level + 1];
+        size_t next_row_bytes = size_t(next.width) * 4;
+        int next_rows = std::min(std::max(1, rows_num / 2), next.height - (next.first_row + next.rows_num));
+        int tasks_num = (next_rows + DOWNSAMPLE_ROWS_PER_TASK - 1) / DOWNSAMPLE_ROWS_PER_TASK;
+        pool.parallel_for(tasks_num, [&](size_t task) {
+            int first = int(task) * DOWNSAMPLE_ROWS_PER_TASK;
+            int count = std::min(DOWNSAMPLE_ROWS_PER_TASK, next_rows - first);
+            int source_rows = std::min(2 * count, rows_num - 2 * first);
+            auto downsampled = downsample(strip.rows.data() + 2 * first * row_bytes, strip.width, source_rows);
+            std::memcpy(next.rows.data() + (next.rows_num + first) * next_row_bytes, downsampled.data(), count * next_row_bytes);
+        });
+        next.rows_num += next_rows;
+
+        if (next_rows > 0 && (next.rows_num == tile_size || next.first_row + next.rows_num == next.height))
+            flush(level + 1);
+    }
+
+    strip.first_row += rows_num;
+    strip.rows_num = 0;
+}
+
+// Expands 1 or 3 channels into RGBA in place, from the end
+void expand_to_rgba(unsigned char *pixels, size_t count, int channels) {
+    for (size_t i = count; i-- > 0;) {
+        unsigned char *out = pixels + i * 4;
+        const unsigned char *in = pixels + i * channels;
+        unsigned char r = in[0], g = in[channels == 1 ? 0 : 1], b = in[channels == 1 ? 0 : 2];
+        out[0] = r;
+        out[1] = g;
+        out[2] = b;
+        out[3] = 255;
+    }
+}
+
+}
+
+
+RowSource open_raw_rows(const std::filesystem::path &path, int width, int height, int channels) {
+    if (channels != 1 && channels != 3 && channels != 4)
+        throw std::runtime_error("Raw images need 1, 3 or 4 channels, got " + std::to_string(channels));
+
+    auto file = std::make_shared<std::ifstream>(path, std::ios::binary);
+    if (!*file)
+        throw std::runtime_error((std::string) "Failed to open " + (std::string) path);
+    if (std::filesystem::file_size(path) != size_t(width) * height * channels)
+        throw std::runtime_error((std::string) "Size of " + (std::string) path + " does not match "
+                                 + std::to_string(width) + "x" + std::to_string(height) + "x" + std::to_string(channels));
+
+    RowSource source;
+    source.width = width;
+    source.height = height;
+    source.read_rows = [file, path, width, channels](unsigned char *rows, int count) {
+        size_t pixels_num = size_t(width) * count;
+        if (!file->read(reinterpret_cast<char *>(rows), pixels_num * channels))
+            throw std::runtime_error((std::string) "Failed to read " + (std::string) path);
+        if (channels != 4)
+            expand_to_rgba(rows, pixels_num, channels);
+    };
+    return source;
+}
+
+RowSource open_image_rows(const std::filesystem::path &path) {
+    int width, height, channels;
+    if (stbi_png_rows *png = stbi_png_rows_open(path.c_str(), &width, &height, &channels, 4)) {
+        auto rows_stream = std::shared_ptr<stbi_png_rows>(png, stbi_png_rows_close);
+        RowSource source;
+        source.width = width;
+        source.height = height;
+        source.read_rows = [rows_stream, path, width](unsigned char *rows, int count) {
+            if (stbi_png_rows_read(rows_stream.get(), rows, width * 4, count) != count)
+                throw std::runtime_error((std::string) "Failed to decode " + (std::string) path + ": " + stbi_failure_reason());
+        };
+        return source;
+    }
+
+    // Not a PNG, or an interlaced one
+    stbi_uc *data = stbi_load(path.c_str(), &width, &height, &channels, 4); // RGBA
+    if (!data)
+        throw std::runtime_error((std::string) "Failed to load " + (std::string) path + ": " + stbi_failure_reason());
+
+    auto pixels = std::shared_ptr<stbi_uc>(data, stbi_image_free);
+    auto next_row = std::make_shared<int>(0);
+
+    RowSource source;
+    source.width = width;
+    source.height = height;
+    source.read_rows = [pixels, next_row, width](unsigned char *rows, int count) {
+        size_t row_bytes = size_t(width) * 4;
+        std::memcpy(rows, pixels.get() + *next_row * row_bytes, count * row_bytes);
+        *next_row += count;
+    };
+    return source;
+}
+
+std::filesystem::path tile_pyramid_index_path(const std::filesystem::path &output) {
+    auto result = output;
+    result += ".index";
+    return result;
+}
+
+std::filesystem::path tile_pyramid_tiles_path(const std::filesystem::path &output) {
+    auto result = output;
+    result += ".tiles";
+    return result;
+}
+
+TilePyramidStats build_tile_pyramid(RowSource &source, int tile_size, const std::filesystem::path &output, ThreadPool &pool) {
+    if (tile_size < 2 || tile_size % 2 != 0)
+        throw std::runtime_error("Tile size has to be even, got " + std::to_string(tile_size));
+
+    auto tiles_path = tile_pyramid_tiles_path(output);
+    std::ofstream tiles_file(tiles_path, std::ios::binary);
+    if (!tiles_file)
+        throw std::runtime_error((std::string) "Failed to write " + (std::string) tiles_path);
+
+    Builder builder{tile_size, pool, tiles_file, {}, {}};
+    for (int width = source.width, height = source.height;; width = std::max(1, width / 2), height = std::max(1, height / 2)) {
+        Strip &strip = builder.levels.emplace_back();
+        strip.width = width;
+        strip.height = height;
+        strip.rows.resize(size_t(width) * tile_size * 4);
+        builder.stats.strip_bytes += strip.rows.size();
+        if (width <= tile_size && height <= tile_size)
+            break;
+    }
+    builder.stats.levels_num = int(builder.levels.size());
+
+    Strip &top = builder.levels.front();
+    while (top.first_row < top.height) {
+        int count = std::min(tile_size - top.rows_num, top.height - top.first_row - top.rows_num);
+        source.read_rows(top.rows.data() + size_t(top.rows_num) * top.width * 4, count);
+        top.rows_num += count;
+        if (top.rows_num == tile_size || top.first_row + top.rows_num == top.height)
+            builder.flush(0);
+    }
+
+    tiles_file.close();
+    if (!tiles_file)
+        throw std::runtime_error((std::string) "Failed to write " + (std::string) tiles_path);
+
+    // The index goes last and is renamed into place, so it never describes
+    // tiles that are not there
+    auto index_path = tile_pyramid_index_path(output);
+    auto temp_path = index_path;
+    temp_path += ".tmp";
+    {
+        std::ofstream file(temp_path, std::ios::binary);
+        TilePyramidHeader header{TILE_PYRAMID_MAGIC, TILE_PYRAMID_VERSION, uint32_t(tile_size), uint32_t(builder.levels.size()),
+                                 uint32_t(source.width), uint32_t(source.height), builder.stats.tiles_num};
+        file.write(reinterpret_cast<const char *>(&header), sizeof(header));
+
+        uint64_t first_tile = 0;
+        for (auto &strip : builder.levels) {
+            uint32_t tiles_x = (strip.width + tile_size - 1) / tile_size;
+            uint32_t tiles_y = (strip.height + tile_size - 1) / tile_size;
+            TilePyramidLevel level{uint32_t(strip.width), uint32_t(strip.height), tiles_x, tiles_y, first_tile};
+            file.write(reinterpret_cast<const char *>(&level), sizeof(level));
+            first_tile += strip.tiles.size();
+        }
+        for (auto &strip : builder.levels)
+            file.write(reinterpret_cast<const char *>(strip.tiles.data()), strip.tiles.size() * sizeof(TilePyramidTile));
+
+        if (!file)
+            throw std::runtime_error((std::string) "Failed to write " + (std::string) temp_path);
+    }
+    std::filesystem::rename(temp_path, index_path);
+
+    return builder.stats;
+}
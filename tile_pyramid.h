@@ -0,0 +1,68 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <filesystem>
+#include <functional>
+
+class ThreadPool;
+
+
+// A tile pyramid keeps an image too large for a single texture as square RGBA8
+// tiles at every mip level, down to the level that fits into one tile. The
+// tiles are stored one after another in `<name>.tiles`, and `<name>.index`
+// describes them with plain structs that can be memory-mapped as is:
+// a TilePyramidHeader, a TilePyramidLevel per level starting from the finest,
+// then a TilePyramidTile per tile, row-major within every level.
+
+const uint32_t TILE_PYRAMID_MAGIC = 0x59505145; // "EQPY"
+const uint32_t TILE_PYRAMID_VERSION = 1;
+
+struct TilePyramidHeader {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t tile_size;
+    uint32_t levels_num;
+    uint32_t width, height; // of level 0
+    uint64_t tiles_num;
+};
+
+struct TilePyramidLevel {
+    uint32_t width, height;
+    uint32_t tiles_x, tiles_y;
+    uint64_t first_tile;
+};
+
+// Tiles on the right and bottom edges are smaller than tile_size
+struct TilePyramidTile {
+    uint64_t offset; // in the tile file
+    uint32_t width, height;
+};
+
+// Rows of the source image from the top, as RGBA8
+struct RowSource {
+    int width = 0, height = 0;
+    std::function<void(unsigned char *rows, int count)> read_rows;
+};
+
+// Headerless 8 bit raw file with 1, 3 or 4 channels, read in strips
+RowSource open_raw_rows(const std::filesystem::path &path, int width, int height, int channels);
+// Anything stb_image reads; PNGs that are not interlaced are decoded strip by
+// strip as well, everything else as a whole before the first row
+RowSource open_image_rows(const std::filesystem::path &path);
+
+struct TilePyramidStats {
+    int levels_num = 0;
+    size_t tiles_num = 0;
+    size_t tile_bytes = 0;
+    size_t strip_bytes = 0; // memory taken by the strips of all levels
+};
+
+// Works through the source in strips of tile_size rows: every full strip is
+// cut into tiles, which are written out, and downsampled into the strip of the
+// next level. Memory is bounded by a strip per level, about
+// 2 * width * tile_size * 4 bytes. Downsampling and tiling run on the pool.
+TilePyramidStats build_tile_pyramid(RowSource &source, int tile_size, const std::filesystem::path &output, ThreadPool &pool);
+
+std::filesystem::path tile_pyramid_index_path(const std::filesystem::path &output);
+std::filesystem::path tile_pyramid_tiles_path(const std::filesystem::path &output);
@@ -0,0 +1,251 @@
+#include "tiled_raster.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <stdexcept>
+#include <string>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#include "tile_pyramid.h"
+
+
+namespace {
+
+const int TILES_PER_BLOCK = TiledRaster::BLOCK_SIZE / TiledRaster::TILE_SIZE;
+const size_t TILE_TEXELS = TiledRaster::TILE_SIZE * TiledRaster::TILE_SIZE;
+const size_t BLOCK_TEXELS = size_t(TiledRaster::BLOCK_SIZE) * TiledRaster::BLOCK_SIZE;
+
+// Spreads the bits of v to the even bits, for Morton order
+size_t spread_bits(int v) {
+    size_t spread = 0;
+    for (int bit = 0; (1 << bit) < TILES_PER_BLOCK; ++bit)
+        spread |= size_t((v >> bit) & 1) << (2 * bit);
+    return spread;
+}
+
+// Texel of a coordinate, in [0, size] when wrapping (size is texel 0 again)
+// and in [0, size - 1] otherwise, plus the fraction to the next texel
+int split(float v, int size, bool wrap, float &fraction) {
+    float limit = float(size);
+    if (wrap)
+        v = std::clamp(v - std::floor(v * (1.f / limit)) * limit, 0.f, limit);
+    else
+        v = std::clamp(v, 0.f, limit - 1.f);
+    float texel = std::floor(v);
+    fraction = v - texel;
+    return int(texel);
+}
+
+int tap(int t, int size, bool wrap) {
+    if (!wrap)
+        return std::clamp(t, 0, size - 1);
+    t %= size;
+    return t < 0 ? t + size : t;
+}
+
+void catmull_rom(float t, float w[4]) {
+    w[0] = t * (-0.5f + t * (1.f - 0.5f * t));
+    w[1] = 1.f + t * t * (-2.5f + 1.5f * t);
+    w[2] = t * (0.5f + t * (2.f - 1.5f * t));
+    w[3] = t * t * (-0.5f + 0.5f * t);
+}
+
+#ifdef __SSE2__
+// Exact for |v| < 2^31, which split4 keeps to
+__m128 floor_ps(__m128 v) {
+    __m128 t = _mm_cvtepi32_ps(_mm_cvttps_epi32(v));
+    return _mm_sub_ps(t, _mm_and_ps(_mm_cmpgt_ps(t, v), _mm_set1_ps(1.f)));
+}
+
+__m128i split4(__m128 v, int size, bool wrap, __m128 &fraction) {
+    __m128 limit = _mm_set1_ps(float(size));
+    if (wrap)
+        v = _mm_min_ps(_mm_max_ps(_mm_sub_ps(v, _mm_mul_ps(floor_ps(_mm_mul_ps(v, _mm_set1_ps(1.f / float(size)))), limit)), _mm_setzero_ps()), limit);
+    else
+        v = _mm_min_ps(_mm_max_ps(v, _mm_setzero_ps()), _mm_sub_ps(limit, _mm_set1_ps(1.f)));
+    __m128 texel = floor_ps(v);
+    fraction = _mm_sub_ps(v, texel);
+    return _mm_cvttps_epi32(texel);
+}
+
+// t + offset for t from split4, wrapping needs size >= 3
+__m128i tap4(__m128i t, int offset, int size, bool wrap) {
+    t = _mm_add_epi32(t, _mm_set1_epi32(offset));
+    __m128i below = _mm_cmplt_epi32(t, _mm_setzero_si128());
+    __m128i above = _mm_cmpgt_epi32(t, _mm_set1_epi32(size - 1));
+    __m128i limit = _mm_set1_epi32(size);
+    if (wrap)
+        return _mm_sub_epi32(_mm_add_epi32(t, _mm_and_si128(below, limit)), _mm_and_si128(above, limit));
+    t = _mm_or_si128(_mm_and_si128(above, _mm_set1_epi32(size - 1)), _mm_andnot_si128(above, t));
+    return _mm_andnot_si128(below, t);
+}
+
+void catmull_rom4(__m128 t, __m128 w[4]) {
+    auto c = [](float v) { return _mm_set1_ps(v); };
+    __m128 t2 = _mm_mul_ps(t, t);
+    w[0] = _mm_mul_ps(t, _mm_add_ps(c(-0.5f), _mm_mul_ps(t, _mm_sub_ps(c(1.f), _mm_mul_ps(c(0.5f), t)))));
+    w[1] = _mm_add_ps(c(1.f), _mm_mul_ps(t2, _mm_add_ps(c(-2.5f), _mm_mul_ps(c(1.5f), t))));
+    w[2] = _mm_mul_ps(t, _mm_add_ps(c(0.5f), _mm_mul_ps(t, _mm_sub_ps(c(2.f), _mm_mul_ps(c(1.5f), t)))));
+    w[3] = _mm_mul_ps(t2, _mm_add_ps(c(-0.5f), _mm_mul_ps(c(0.5f), t)));
+}
+#endif
+
+}
+
+
+TiledRaster::TiledRaster(int width, int height, bool wrap_x, Layout layout) : texel_layout(layout), wrap_x(wrap_x) {
+    if (width <= 0 || height <= 0)
+        throw std::runtime_error("Bad raster size " + std::to_string(width) + "x" + std::to_string(height));
+
+    column_offsets.resize(width);
+    row_offsets.resize(height);
+    if (layout == Layout::row_major) {
+        for (int x = 0; x < width; ++x)
+            column_offsets[x] = size_t(x);
+        for (int y = 0; y < height; ++y)
+            row_offsets[y] = size_t(y) * width;
+        texels_num = size_t(width) * height;
+    } else {
+        size_t blocks_x = (width + BLOCK_SIZE - 1) / BLOCK_SIZE;
+        size_t blocks_y = (height + BLOCK_SIZE - 1) / BLOCK_SIZE;
+        for (int x = 0; x < width; ++x)
+            column_offsets[x] = x / BLOCK_SIZE * BLOCK_TEXELS + spread_bits(x / TILE_SIZE % TILES_PER_BLOCK) * TILE_TEXELS + x % TILE_SIZE;
+        for (int y = 0; y < height; ++y)
+            row_offsets[y] = y / BLOCK_SIZE * blocks_x * BLOCK_TEXELS + (spread_bits(y / TILE_SIZE % TILES_PER_BLOCK) << 1) * TILE_TEXELS
+                + y % TILE_SIZE * TILE_SIZE;
+        texels_num = blocks_x * blocks_y * BLOCK_TEXELS;
+    }
+
+    // A tile row is then never split between two cache lines
+    storage.resize(texels_num + 15);
+    data = storage.data() + (64 - reinterpret_cast<uintptr_t>(storage.data()) % 64) % 64 / sizeof(float);
+}
+
+void TiledRaster::set_rows(const unsigned char *pixels, int channels, int channel, int first_row, int count) {
+    int w = width();
+    for (int y = 0; y < count; ++y) {
+        const unsigned char *source = pixels + size_t(y) * w * channels + channel;
+        float *row = data + row_offsets[first_row + y];
+        for (int x = 0; x < w; ++x)
+            row[column_offsets[x]] = source[size_t(x) * channels] * (1.f / 255.f);
+    }
+}
+
+float TiledRaster::bilinear(float x, float y) const {
+    float fx, fy;
+    int x0 = split(x, width(), wrap_x, fx), y0 = split(y, height(), false, fy);
+    const float *row0 = data + row_offsets[y0], *row1 = data + row_offsets[tap(y0 + 1, height(), false)];
+    size_t column0 = column_offsets[tap(x0, width(), wrap_x)], column1 = column_offsets[tap(x0 + 1, width(), wrap_x)];
+    float top = row0[column0] + (row0[column1] - row0[column0]) * fx;
+    float bottom = row1[column0] + (row1[column1] - row1[column0]) * fx;
+    return top + (bottom - top) * fy;
+}
+
+float TiledRaster::bicubic(float x, float y) const {
+    float fx, fy, wx[4], wy[4];
+    int x0 = split(x, width(), wrap_x, fx), y0 = split(y, height(), false, fy);
+    catmull_rom(fx, wx);
+    catmull_rom(fy, wy);
+    size_t columns[4];
+    for (int i = 0; i < 4; ++i)
+        columns[i] = column_offsets[tap(x0 - 1 + i, width(), wrap_x)];
+
+    float sum = 0.f;
+    for (int j = 0; j < 4; ++j) {
+        const float *row = data + row_offsets[tap(y0 - 1 + j, height(), false)];
+        float row_sum = 0.f;
+        for (int i = 0; i < 4; ++i)
+            row_sum += wx[i] * row[columns[i]];
+        sum += wy[j] * row_sum;
+    }
+    return sum;
+}
+
+void TiledRaster::bilinear(const float *x, const float *y, float *out, size_t count) const {
+    size_t i = 0;
+#ifdef __SSE2__
+    for (; width() >= 3 && i + 4 <= count; i += 4) {
+        __m128 fx, fy;
+        __m128i x0 = split4(_mm_loadu_ps(x + i), width(), wrap_x, fx), y0 = split4(_mm_loadu_ps(y + i), height(), false, fy);
+        alignas(16) int columns[2][4], rows[2][4];
+        for (int k = 0; k < 2; ++k) {
+            _mm_store_si128(reinterpret_cast<__m128i *>(columns[k]), tap4(x0, k, width(), wrap_x));
+            _mm_store_si128(reinterpret_cast<__m128i *>(rows[k]), tap4(y0, k, height(), false));
+        }
+        alignas(16) float texels[4][4]; // top left, top right, bottom left, bottom right
+        for (int lane = 0; lane < 4; ++lane) {
+            const float *row0 = data + row_offsets[rows[0][lane]], *row1 = data + row_offsets[rows[1][lane]];
+            size_t column0 = column_offsets[columns[0][lane]], column1 = column_offsets[columns[1][lane]];
+            texels[0][lane] = row0[column0];
+            texels[1][lane] = row0[column1];
+            texels[2][lane] = row1[column0];
+            texels[3][lane] = row1[column1];
+        }
+        __m128 a = _mm_load_ps(texels[0]), b = _mm_load_ps(texels[1]), c = _mm_load_ps(texels[2]), d = _mm_load_ps(texels[3]);
+        __m128 top = _mm_add_ps(a, _mm_mul_ps(_mm_sub_ps(b, a), fx));
+        __m128 bottom = _mm_add_ps(c, _mm_mul_ps(_mm_sub_ps(d, c), fx));
+        _mm_storeu_ps(out + i, _mm_add_ps(top, _mm_mul_ps(_mm_sub_ps(bottom, top), fy)));
+    }
+#endif
+    for (; i < count; ++i)
+        out[i] = bilinear(x[i], y[i]);
+}
+
+void TiledRaster::bicubic(const float *x, const float *y, float *out, size_t count) const {
+    size_t i = 0;
+#ifdef __SSE2__
+    for (; width() >= 3 && i + 4 <= count; i += 4) {
+        __m128 fx, fy, wx[4], wy[4];
+        __m128i x0 = split4(_mm_loadu_ps(x + i), width(), wrap_x, fx), y0 = split4(_mm_loadu_ps(y + i), height(), false, fy);
+        catmull_rom4(fx, wx);
+        catmull_rom4(fy, wy);
+        alignas(16) int columns[4][4], rows[4][4];
+        for (int k = 0; k < 4; ++k) {
+            _mm_store_si128(reinterpret_cast<__m128i *>(columns[k]), tap4(x0, k - 1, width(), wrap_x));
+            _mm_store_si128(reinterpret_cast<__m128i *>(rows[k]), tap4(y0, k - 1, height(), false));
+        }
+        size_t column_offset[4][4];
+        for (int k = 0; k < 4; ++k)
+            for (int lane = 0; lane < 4; ++lane)
+                column_offset[k][lane] = column_offsets[columns[k][lane]];
+
+        __m128 sum = _mm_setzero_ps();
+        for (int j = 0; j < 4; ++j) {
+            const float *row[4];
+            for (int lane = 0; lane < 4; ++lane)
+                row[lane] = data + row_offsets[rows[j][lane]];
+            __m128 row_sum = _mm_setzero_ps();
+            for (int k = 0; k < 4; ++k) {
+                __m128 texels = _mm_setr_ps(row[0][column_offset[k][0]], row[1][column_offset[k][1]],
+                                            row[2][column_offset[k][2]], row[3][column_offset[k][3]]);
+                row_sum = _mm_add_ps(row_sum, _mm_mul_ps(wx[k], texels));
+            }
+            sum = _mm_add_ps(sum, _mm_mul_ps(wy[j], row_sum));
+        }
+        _mm_storeu_ps(out + i, sum);
+    }
+#endif
+    for (; i < count; ++i)
+        out[i] = bicubic(x[i], y[i]);
+}
+
+
+TiledRaster load_tiled_raster(const std::filesystem::path &path, int channel, bool wrap_x, TiledRaster::Layout layout) {
+    if (channel < 0 || channel > 3)
+        throw std::runtime_error((std::string) "Bad channel " + std::to_string(channel) + " for " + (std::string) path);
+
+    RowSource source = open_image_rows(path);
+    TiledRaster raster(source.width, source.height, wrap_x, layout);
+    // A strip is a row of blocks, so the tiled layout fills whole blocks at a time
+    std::vector<unsigned char> strip(size_t(source.width) * 4 * TiledRaster::BLOCK_SIZE);
+    for (int y = 0; y < source.height; y += TiledRaster::BLOCK_SIZE) {
+        int count = std::min(TiledRaster::BLOCK_SIZE, source.height - y);
+        source.read_rows(strip.data(), count);
+        raster.set_rows(strip.data(), 4, channel, y, count);
+    }
+    return raster;
+}
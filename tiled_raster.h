@@ -0,0 +1,77 @@
+#pragma once
+
+#include <cstddef>
+#include <filesystem>
+#include <vector>
+
+
+// Single channel float raster for the CPU-side users of the textures that
+// sample them at random points: picking, baking normals and horizons, culling
+// bounds, contours.
+//
+// In the tiled layout texels are kept in 8x8 tiles (64 floats, four cache
+// lines), the tiles of every 64x64 block are in Morton order and the blocks
+// are row-major. A bilinear or bicubic footprint then touches one or two tiles
+// that are usually next to each other in memory, where row-major rows of a big
+// heightmap are tens of KiB apart. The address of a texel is the sum of a
+// column and a row offset from two small tables, so both layouts share all of
+// the sampling code and the row-major one is there to compare against.
+//
+// Coordinates are in texels with texel centers on integers: (0, 0) is the
+// center of the top-left texel, an equirectangular u in [0, 1) maps to
+// u * width - 0.5. Rows are clamped, columns wrap around for wrap_x (longitude)
+// and are clamped otherwise.
+class TiledRaster {
+public:
+    enum class Layout { tiled, row_major };
+
+    static constexpr int TILE_SIZE = 8;
+    static constexpr int BLOCK_SIZE = 64; // tiles of a block are in Morton order
+
+    TiledRaster() = default;
+    TiledRaster(int width, int height, bool wrap_x = false, Layout layout = Layout::tiled);
+
+    TiledRaster(const TiledRaster &) = delete;
+    TiledRaster &operator=(const TiledRaster &) = delete;
+    TiledRaster(TiledRaster &&) = default;
+    TiledRaster &operator=(TiledRaster &&) = default;
+
+    int width() const { return int(column_offsets.size()); }
+    int height() const { return int(row_offsets.size()); }
+    Layout layout() const { return texel_layout; }
+    bool wraps_x() const { return wrap_x; }
+    // Including the padding of the tiled layout to whole blocks
+    size_t size_bytes() const { return texels_num * sizeof(float); }
+
+    // Fills rows [first_row, first_row + count) from `count` rows of
+    // interleaved 8 bit pixels, as stb_image returns them, taking `channel`
+    // and scaling it to [0, 1]
+    void set_rows(const unsigned char *pixels, int channels, int channel, int first_row, int count);
+
+    float &texel(int x, int y) { return data[column_offsets[x] + row_offsets[y]]; }
+    float texel(int x, int y) const { return data[column_offsets[x] + row_offsets[y]]; }
+
+    float bilinear(float x, float y) const;
+    // Catmull-Rom, may overshoot the range of the texels a little
+    float bicubic(float x, float y) const;
+
+    // The same for `count` points at a time, four at once with SSE2 (the
+    // arithmetic is vectorized, the texels are still loaded one by one).
+    // Results are exactly those of the calls above.
+    void bilinear(const float *x, const float *y, float *out, size_t count) const;
+    void bicubic(const float *x, const float *y, float *out, size_t count) const;
+
+private:
+    std::vector<size_t> column_offsets, row_offsets;
+    std::vector<float> storage;
+    float *data = nullptr; // into storage, aligned to a cache line
+    size_t texels_num = 0;
+    Layout texel_layout = Layout::tiled;
+    bool wrap_x = false;
+};
+
+// Decodes `channel` of an image into a raster strip by strip (see
+// open_image_rows), without keeping the whole row-major image around for PNGs
+// that are not interlaced
+TiledRaster load_tiled_raster(const std::filesystem::path &path, int channel = 0, bool wrap_x = false,
+                              TiledRaster::Layout layout = TiledRaster::Layout::tiled);
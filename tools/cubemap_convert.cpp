@@ -0,0 +1,69 @@
+// Converts equirectangular images into cubemaps and stores them into the cache
+// that `hw4 --cubemap` loads them from, so the first start is not slowed down
+// by the conversion.
+//
+// Usage: cubemap_convert [--cache-dir DIR] [--face-size N] image...
+
+#include <chrono>
+#include <filesystem>
+#include <iostream>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "cubemap.h"
+#include "stb_image.h"
+#include "texture_image.h"
+#include "thread_pool.h"
+
+
+int main(int argc, char **argv) try {
+    std::filesystem::path cache_dir = std::filesystem::path(PROJECT_ROOT) / ".cache";
+    int face_size = 0; // 0 - matching the equator of the source
+    std::vector<std::filesystem::path> inputs;
+
+    for (int i = 1; i < argc; ++i) {
+        std::string_view arg = argv[i];
+        if (arg == "--cache-dir" && i + 1 < argc)
+            cache_dir = argv[++i];
+        else if (arg == "--face-size" && i + 1 < argc)
+            face_size = std::stoi(argv[++i]);
+        else
+            inputs.emplace_back(arg);
+    }
+    if (inputs.empty())
+        throw std::runtime_error("Usage: cubemap_convert [--cache-dir DIR] [--face-size N] image...");
+
+    ThreadPool pool;
+    set_decode_thread_pool(&pool);
+
+    for (auto &input : inputs) {
+        auto start = std::chrono::steady_clock::now();
+
+        int width, height, channels;
+        stbi_uc *data = stbi_load(input.c_str(), &width, &height, &channels, 4); // RGBA
+        if (!data)
+            throw std::runtime_error((std::string) "Failed to load " + (std::string) input + ": " + stbi_failure_reason());
+        auto decoded = std::chrono::steady_clock::now();
+
+        TextureImage cubemap = equirect_to_cubemap(data, width, height, face_size ? face_size : cubemap_face_size(width), pool);
+        stbi_image_free(data);
+        auto converted = std::chrono::steady_clock::now();
+
+        auto cache_path = cubemap_cache_path(cache_dir, input);
+        write_cubemap_cache(cache_path, input, cubemap);
+
+        auto ms = [](auto duration) { return std::chrono::duration<double, std::milli>(duration).count(); };
+        size_t equirect_bytes = size_t(width) * height * 4;
+        size_t cubemap_bytes = 6 * size_t(cubemap.width) * cubemap.width * 4;
+        std::cout << input.filename().string() << ": " << width << "x" << height << " -> 6x" << cubemap.width << "^2"
+                  << " (" << equirect_bytes / (1024.0 * 1024.0) << " -> " << cubemap_bytes / (1024.0 * 1024.0) << " MiB)"
+                  << ", decode " << ms(decoded - start) << " ms, convert " << ms(converted - decoded) << " ms"
+                  << " on " << pool.size() << " threads -> " << cache_path.string() << std::endl;
+    }
+}
+catch (std::exception const &e) {
+    std::cerr << e.what() << std::endl;
+    return EXIT_FAILURE;
+}
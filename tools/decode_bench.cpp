@@ -0,0 +1,457 @@
+// Measures how fast stb_image decodes a corpus of images, per format and,
+// where they can be told apart, per decoding stage.
+//
+// Usage: decode_bench [--reps N] [--cpu N] [--simd none|sse2|avx2] [--json FILE] [dir|image...]
+//
+// Without arguments it decodes the images in the project root (earth.png,
+// earth_specular.jpg, ...); directories are searched for .jpg, .jpeg, .png,
+// .hdr and .gif files. The files are read into memory before decoding, every
+// time is the best of N after a warm-up run (the JSON also has the median).
+// Throughput is in megapixels/s and in MB/s of decoded image at the depth and
+// channels of the file, as in png_unfilter_bench.
+//
+// stb_image does not time its own stages, so they are measured by decoding
+// less of the image and taking differences:
+//   JPEG  entropy   the Y, Cb and Cr planes scaled down to 1/8, which still
+//                   decodes every coefficient but transforms only the DC ones
+//         idct      the planes at their full size, minus the above
+//         color     the RGBA image, minus the planes (upsampling and color
+//                   conversion); not for CMYK and RGB JPEGs, which have no planes
+//   PNG   inflate   the concatenated IDAT data through stbi_zlib_decode
+//         unfilter  the image at its own depth and channels, minus the above
+//   HDR   decode to floats, and to half floats
+//   GIF   every frame, streamed through stbi_gif_frames
+
+#include <algorithm>
+#include <cctype>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <filesystem>
+#include <fstream>
+#include <functional>
+#include <iomanip>
+#include <iostream>
+#include <iterator>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#ifdef __linux__
+#include <sched.h>
+#endif
+
+#include "stb_image.h"
+
+
+namespace {
+
+struct Stage {
+    std::string name;
+    double best, median; // seconds
+    bool derived;        // a difference of two measurements
+};
+
+struct Result {
+    std::filesystem::path path;
+    std::string format, details;
+    int width = 0, height = 0, channels = 0, bytes_per_channel = 1, frames = 1;
+    size_t file_bytes = 0;
+    std::vector<Stage> stages;
+
+    double pixels() const { return double(width) * height * frames; }
+    double bytes() const { return pixels() * channels * bytes_per_channel; }
+};
+
+const char *FILTER_NAMES[] = {"none", "sub", "up", "avg", "paeth"};
+
+const char *SIMD_NAMES[] = {"none", "sse2", "avx2"};
+
+int reps = 5;
+
+std::string lowercase(std::string s) {
+    std::transform(s.begin(), s.end(), s.begin(), [](unsigned char c) { return char(std::tolower(c)); });
+    return s;
+}
+
+bool is_image(const std::filesystem::path &path) {
+    auto extension = lowercase(path.extension().string());
+    return extension == ".jpg" || extension == ".jpeg" || extension == ".png" || extension == ".hdr" || extension == ".gif";
+}
+
+std::vector<unsigned char> read_file(const std::filesystem::path &path) {
+    std::ifstream file(path, std::ios::binary);
+    if (!file)
+        throw std::runtime_error((std::string) "Failed to open " + (std::string) path);
+    return {std::istreambuf_iterator<char>(file), std::istreambuf_iterator<char>()};
+}
+
+uint32_t get32be(const unsigned char *p) {
+    return uint32_t(p[0]) << 24 | uint32_t(p[1]) << 16 | uint32_t(p[2]) << 8 | p[3];
+}
+
+// Runs decode once to warm up and check that it works, then reps times
+Stage measure(const std::string &name, const std::function<void()> &decode) {
+    decode();
+    std::vector<double> times;
+    for (int rep = 0; rep < reps; ++rep) {
+        auto start = std::chrono::steady_clock::now();
+        decode();
+        times.push_back(std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count());
+    }
+    std::sort(times.begin(), times.end());
+    return {name, times.front(), times[times.size() / 2], false};
+}
+
+// whole - part, clamped at 0 where the difference is lost in the noise
+Stage difference(const std::string &name, const Stage &whole, const Stage &part) {
+    return {name, std::max(0.0, whole.best - part.best), std::max(0.0, whole.median - part.median), true};
+}
+
+void check(const void *pixels, const std::string &what) {
+    if (!pixels)
+        throw std::runtime_error("Failed to decode " + what + ": " + stbi_failure_reason());
+}
+
+void bench_jpeg(const std::vector<unsigned char> &file, Result &result) {
+    // progressive or not, and the sampling factors, from the frame header
+    bool progressive = false;
+    std::string sampling;
+    for (size_t pos = 2; pos + 4 <= file.size() && file[pos] == 0xFF;) {
+        int marker = file[pos + 1];
+        size_t length = size_t(file[pos + 2]) << 8 | file[pos + 3];
+        if (marker >= 0xC0 && marker <= 0xCF && marker != 0xC4 && marker != 0xC8 && marker != 0xCC) {
+            progressive = marker == 0xC2;
+            if (pos + 10 <= file.size() && file[pos + 9] == 1)
+                sampling = "gray";
+            if (pos + 10 <= file.size() && file[pos + 9] == 3 && pos + 19 <= file.size()) {
+                int h0 = file[pos + 11] >> 4, v0 = file[pos + 11] & 15;
+                int h1 = std::max(1, file[pos + 14] >> 4), v1 = std::max(1, file[pos + 14] & 15);
+                int h = h0 / h1, v = v0 / v1;
+                sampling = h == 1 && v == 1 ? "4:4:4" : h == 2 && v == 1 ? "4:2:2" : h == 2 && v == 2 ? "4:2:0"
+                         : std::to_string(h) + "x" + std::to_string(v);
+            }
+            break;
+        }
+        pos += 2 + length;
+    }
+    result.format = progressive ? "jpeg progressive" : "jpeg baseline";
+    result.details = sampling;
+
+    int width, height, channels;
+    if (!stbi_info_from_memory(file.data(), int(file.size()), &width, &height, &channels))
+        throw std::runtime_error((std::string) "Failed to read the header: " + stbi_failure_reason());
+    result.width = width, result.height = height, result.channels = channels;
+
+    Stage decode = measure("decode", [&] {
+        stbi_uc *pixels = stbi_load_from_memory(file.data(), int(file.size()), &width, &height, &channels, 4);
+        check(pixels, "the image");
+        stbi_image_free(pixels);
+    });
+    result.stages.push_back(decode);
+
+    auto load_planes = [&](int denominator) {
+        stbi_set_jpeg_scale_on_load(denominator);
+        stbi_jpeg_planes planes;
+        int ok = stbi_load_jpeg_planes_from_memory(file.data(), int(file.size()), &width, &height, &planes);
+        stbi_set_jpeg_scale_on_load(1);
+        if (ok > 0)
+            stbi_jpeg_planes_free(&planes);
+        return ok > 0;
+    };
+    if (!load_planes(1)) {
+        result.details += result.details.empty() ? "no planes" : ", no planes";
+        return;
+    }
+    Stage entropy = measure("entropy", [&] { load_planes(8); });
+    Stage planes = measure("planes", [&] { load_planes(1); });
+    result.stages.push_back(entropy);
+    result.stages.push_back(difference("idct", planes, entropy));
+    result.stages.push_back(difference("color", decode, planes));
+}
+
+void bench_png(const std::vector<unsigned char> &file, Result &result) {
+    int depth = 8, color_type = 0, interlaced = 0;
+    std::vector<char> idat;
+    for (size_t pos = 8; pos + 12 <= file.size();) {
+        size_t length = get32be(&file[pos]);
+        std::string_view type((const char *) &file[pos + 4], 4);
+        const unsigned char *data = &file[pos + 8];
+        if (pos + 12 + length > file.size())
+            break;
+        if (type == "IHDR" && length >= 13) {
+            depth = data[8], color_type = data[9], interlaced = data[12];
+        } else if (type == "IDAT") {
+            idat.insert(idat.end(), data, data + length);
+        } else if (type == "IEND") {
+            break;
+        }
+        pos += 12 + length;
+    }
+
+    int width, height, channels;
+    if (!stbi_info_from_memory(file.data(), int(file.size()), &width, &height, &channels))
+        throw std::runtime_error((std::string) "Failed to read the header: " + stbi_failure_reason());
+    static const int channels_of[] = {1, 0, 3, 1, 2, 0, 4};
+    int file_channels = color_type <= 6 && channels_of[color_type] ? channels_of[color_type] : channels;
+    result.format = "png " + std::to_string(depth) + "-bit";
+    result.width = width, result.height = height, result.channels = channels;
+    result.bytes_per_channel = depth == 16 ? 2 : 1;
+
+    Stage decode = measure("decode", [&] {
+        void *pixels = depth == 16
+            ? (void *) stbi_load_16_from_memory(file.data(), int(file.size()), &width, &height, &channels, 0)
+            : (void *) stbi_load_from_memory(file.data(), int(file.size()), &width, &height, &channels, 0);
+        check(pixels, "the image");
+        stbi_image_free(pixels);
+    });
+
+    // the scanlines, a filter byte and the packed pixels each
+    size_t row_bytes = 1 + (size_t(width) * file_channels * depth + 7) / 8;
+    int raw_size = int(std::min<size_t>(row_bytes * height, 1u << 30));
+    std::vector<unsigned char> raw;
+    Stage inflate = measure("inflate", [&] {
+        int size;
+        char *data = stbi_zlib_decode_malloc_guesssize(idat.data(), int(idat.size()), raw_size, &size);
+        check(data, "the IDAT data");
+        if (raw.empty())
+            raw.assign(data, data + size);
+        stbi_image_free(data);
+    });
+    result.stages.push_back(decode);
+    result.stages.push_back(inflate);
+    result.stages.push_back(difference("unfilter", decode, inflate));
+
+    if (interlaced) {
+        result.details = "interlaced";
+        return;
+    }
+    size_t filters[5] = {};
+    for (size_t pos = 0; pos + row_bytes <= raw.size(); pos += row_bytes)
+        if (raw[pos] < 5)
+            ++filters[raw[pos]];
+    std::ostringstream details;
+    for (int filter = 0; filter < 5; ++filter) {
+        if (!filters[filter])
+            continue;
+        details << (details.tellp() > 0 ? " " : "") << FILTER_NAMES[filter] << " " << std::fixed
+                << std::setprecision(0) << 100.0 * filters[filter] / height << "%";
+    }
+    result.details = details.str();
+}
+
+void bench_hdr(const std::vector<unsigned char> &file, Result &result) {
+    int width, height, channels;
+    if (!stbi_info_from_memory(file.data(), int(file.size()), &width, &height, &channels))
+        throw std::runtime_error((std::string) "Failed to read the header: " + stbi_failure_reason());
+    result.format = "hdr";
+    result.width = width, result.height = height, result.channels = channels;
+    result.bytes_per_channel = 4;
+
+    result.stages.push_back(measure("float", [&] {
+        float *pixels = stbi_loadf_from_memory(file.data(), int(file.size()), &width, &height, &channels, 0);
+        check(pixels, "the image");
+        stbi_image_free(pixels);
+    }));
+    result.stages.push_back(measure("half", [&] {
+        stbi_us *pixels = stbi_loadf_half_from_memory(file.data(), int(file.size()), &width, &height, &channels, 0);
+        check(pixels, "the image");
+        stbi_image_free(pixels);
+    }));
+}
+
+void bench_gif(const std::vector<unsigned char> &file, Result &result) {
+    result.format = "gif";
+    result.channels = 4;
+    result.stages.push_back(measure("frames", [&] {
+        stbi_gif_frames *frames = stbi_gif_frames_from_memory(file.data(), int(file.size()), &result.width, &result.height);
+        check(frames, "the image");
+        const stbi_uc *pixels;
+        int delay, status, count = 0;
+        while ((status = stbi_gif_frames_next(frames, &pixels, &delay)) > 0)
+            ++count;
+        stbi_gif_frames_close(frames);
+        if (status < 0)
+            throw std::runtime_error((std::string) "Failed to decode frame " + std::to_string(count) + ": " + stbi_failure_reason());
+        result.frames = count;
+    }));
+    result.details = std::to_string(result.frames) + (result.frames == 1 ? " frame" : " frames");
+}
+
+Result bench(const std::filesystem::path &path) {
+    auto file = read_file(path);
+    Result result;
+    result.path = path;
+    result.file_bytes = file.size();
+
+    const stbi_uc *data = file.data();
+    int size = int(file.size());
+    if (size >= 3 && data[0] == 0xFF && data[1] == 0xD8 && data[2] == 0xFF)
+        bench_jpeg(file, result);
+    else if (size >= 8 && std::string_view((const char *) data + 1, 3) == "PNG")
+        bench_png(file, result);
+    else if (size >= 6 && std::string_view((const char *) data, 4) == "GIF8")
+        bench_gif(file, result);
+    else if (stbi_is_hdr_from_memory(data, size))
+        bench_hdr(file, result);
+    else
+        throw std::runtime_error("Not a JPEG, PNG, HDR or GIF image");
+    return result;
+}
+
+std::string json_string(const std::string &s) {
+    std::ostringstream out;
+    out << '"';
+    for (unsigned char c : s) {
+        if (c == '"' || c == '\\')
+            out << '\\' << c;
+        else if (c < 0x20)
+            out << "\\u" << std::hex << std::setw(4) << std::setfill('0') << int(c) << std::dec << std::setfill(' ');
+        else
+            out << c;
+    }
+    out << '"';
+    return out.str();
+}
+
+void write_json(const std::filesystem::path &path, const std::vector<Result> &results, int simd, int cpu) {
+    std::ofstream out(path);
+    if (!out)
+        throw std::runtime_error((std::string) "Failed to create " + (std::string) path);
+    out << std::setprecision(6);
+    out << "{\n  \"reps\": " << reps << ",\n  \"simd\": \"" << SIMD_NAMES[simd] << "\",\n  \"cpu\": " << cpu
+        << ",\n  \"images\": [";
+    for (size_t i = 0; i < results.size(); ++i) {
+        auto &r = results[i];
+        out << (i ? "," : "") << "\n    {\"file\": " << json_string(r.path.string()) << ", \"format\": "
+            << json_string(r.format) << ", \"details\": " << json_string(r.details) << ", \"width\": " << r.width
+            << ", \"height\": " << r.height << ", \"channels\": " << r.channels << ", \"bytes_per_channel\": "
+            << r.bytes_per_channel << ", \"frames\": " << r.frames << ", \"file_bytes\": " << r.file_bytes
+            << ", \"stages\": [";
+        for (size_t j = 0; j < r.stages.size(); ++j) {
+            auto &s = r.stages[j];
+            out << (j ? "," : "") << "\n      {\"name\": " << json_string(s.name) << ", \"best_ms\": " << s.best * 1e3
+                << ", \"median_ms\": " << s.median * 1e3 << ", \"mp_per_s\": "
+                << (s.best > 0 ? r.pixels() / 1e6 / s.best : 0) << ", \"mb_per_s\": "
+                << (s.best > 0 ? r.bytes() / 1e6 / s.best : 0) << ", \"derived\": " << (s.derived ? "true" : "false")
+                << "}";
+        }
+        out << "]}";
+    }
+    out << "\n  ]\n}\n";
+    if (!out)
+        throw std::runtime_error((std::string) "Failed to write " + (std::string) path);
+}
+
+}
+
+
+int main(int argc, char **argv) try {
+    const char *usage = "Usage: decode_bench [--reps N] [--cpu N] [--simd none|sse2|avx2] [--json FILE] [dir|image...]";
+
+    int cpu = -1, simd = STBI_SIMD_AVX2;
+    std::filesystem::path json;
+    std::vector<std::filesystem::path> args;
+    for (int i = 1; i < argc; ++i) {
+        std::string_view arg = argv[i];
+        if (arg == "--reps" && i + 1 < argc) {
+            reps = std::max(1, std::stoi(argv[++i]));
+        } else if (arg == "--cpu" && i + 1 < argc) {
+            cpu = std::stoi(argv[++i]);
+        } else if (arg == "--simd" && i + 1 < argc) {
+            auto name = std::find(std::begin(SIMD_NAMES), std::end(SIMD_NAMES), std::string_view(argv[++i]));
+            if (name == std::end(SIMD_NAMES))
+                throw std::runtime_error(usage);
+            simd = int(name - std::begin(SIMD_NAMES));
+        } else if (arg == "--json" && i + 1 < argc) {
+            json = argv[++i];
+        } else if (arg.starts_with("--")) {
+            throw std::runtime_error(usage);
+        } else {
+            args.emplace_back(arg);
+        }
+    }
+
+    std::vector<std::filesystem::path> paths;
+    auto add_directory = [&](const std::filesystem::path &dir, bool recursive) {
+        std::vector<std::filesystem::path> found;
+        auto add = [&](const std::filesystem::directory_entry &entry) {
+            if (entry.is_regular_file() && is_image(entry.path()))
+                found.push_back(entry.path());
+        };
+        if (recursive) {
+            for (auto &entry : std::filesystem::recursive_directory_iterator(dir))
+                add(entry);
+        } else {
+            for (auto &entry : std::filesystem::directory_iterator(dir))
+                add(entry);
+        }
+        std::sort(found.begin(), found.end());
+        paths.insert(paths.end(), found.begin(), found.end());
+    };
+    for (auto &arg : args) {
+        if (std::filesystem::is_directory(arg))
+            add_directory(arg, true);
+        else
+            paths.push_back(arg);
+    }
+    if (args.empty())
+        add_directory(PROJECT_ROOT, false);
+    if (paths.empty())
+        throw std::runtime_error(usage);
+
+    if (cpu >= 0) {
+#ifdef __linux__
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        CPU_SET(cpu, &set);
+        if (sched_setaffinity(0, sizeof(set), &set) != 0)
+            throw std::runtime_error("Failed to pin the benchmark to CPU " + std::to_string(cpu));
+#else
+        throw std::runtime_error("--cpu is only supported on Linux");
+#endif
+    }
+    stbi_set_simd_level(simd);
+
+    std::cout << "best of " << reps << ", SIMD " << SIMD_NAMES[simd];
+    if (cpu >= 0)
+        std::cout << ", CPU " << cpu;
+    std::cout << "; * derived from the difference of two measurements" << std::endl;
+    std::cout << std::left << std::setw(28) << "" << std::setw(18) << "format" << std::setw(12) << "size"
+              << std::setw(10) << "stage" << std::right << std::setw(10) << "ms" << std::setw(10) << "MP/s"
+              << std::setw(10) << "MB/s" << "  " << "details" << std::endl;
+
+    std::vector<Result> results;
+    for (auto &path : paths) {
+        Result result;
+        try {
+            result = bench(path);
+        } catch (std::exception const &e) {
+            std::cerr << path.string() << ": " << e.what() << std::endl;
+            continue;
+        }
+        for (size_t i = 0; i < result.stages.size(); ++i) {
+            auto &stage = result.stages[i];
+            std::string size = std::to_string(result.width) + "x" + std::to_string(result.height);
+            std::cout << std::left << std::setw(28) << (i ? "" : path.filename().string()) << std::setw(18)
+                      << (i ? "" : result.format) << std::setw(12) << (i ? "" : size) << std::setw(10)
+                      << stage.name + (stage.derived ? "*" : "") << std::right << std::fixed << std::setprecision(2)
+                      << std::setw(10) << stage.best * 1e3 << std::setprecision(1) << std::setw(10)
+                      << (stage.best > 0 ? result.pixels() / 1e6 / stage.best : 0) << std::setw(10)
+                      << (stage.best > 0 ? result.bytes() / 1e6 / stage.best : 0) << "  "
+                      << (i ? "" : result.details) << std::endl;
+        }
+        results.push_back(std::move(result));
+    }
+
+    if (!json.empty())
+        write_json(json, results, simd, cpu);
+    stbi_set_simd_level(STBI_SIMD_AVX2);
+    return results.size() == paths.size() ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+catch (std::exception const &e) {
+    std::cerr << e.what() << std::endl;
+    return EXIT_FAILURE;
+}
@@ -0,0 +1,149 @@
+// Compares how long stb_image takes to load files read through FILE, through
+// a memory mapping (stbi_set_mmap), and through a memory mapping read ahead by
+// a thread (stbi_set_mmap_prefetch), both with the files in the page cache
+// (warm) and dropped from it before every load (cold).
+//
+// Usage: file_load_bench [--reps N] [image...]
+//
+// Without images it loads the textures of hw4. Times are in ms, best of N.
+// Dropping a file from the page cache (posix_fadvise) needs no privileges,
+// but does nothing on some file systems (tmpfs, some overlays), in which case
+// the cold times are marked with a '*'.
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <filesystem>
+#include <functional>
+#include <iomanip>
+#include <iostream>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include "stb_image.h"
+
+
+namespace {
+
+struct Mode {
+    const char *name;
+    std::function<stbi_uc *(const std::filesystem::path &path, int *width, int *height)> load;
+};
+
+stbi_uc *load_stdio(const std::filesystem::path &path, int *width, int *height) {
+    FILE *file = std::fopen(path.c_str(), "rb");
+    if (!file)
+        return nullptr;
+    int channels;
+    stbi_uc *pixels = stbi_load_from_file(file, width, height, &channels, 4);
+    std::fclose(file);
+    return pixels;
+}
+
+stbi_uc *load_mmap(const std::filesystem::path &path, int *width, int *height, bool prefetch) {
+    stbi_set_mmap(1);
+    stbi_set_mmap_prefetch(prefetch);
+    int channels;
+    stbi_uc *pixels = stbi_load(path.c_str(), width, height, &channels, 4);
+    stbi_set_mmap_prefetch(0);
+    stbi_set_mmap(0);
+    return pixels;
+}
+
+// Drops the file from the page cache, returns whether it is gone
+bool drop_from_page_cache(const std::filesystem::path &path) {
+    int fd = open(path.c_str(), O_RDONLY);
+    if (fd < 0)
+        throw std::runtime_error((std::string) "Failed to open " + (std::string) path);
+    off_t size = lseek(fd, 0, SEEK_END);
+    posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+
+    size_t page = size_t(sysconf(_SC_PAGESIZE));
+    size_t resident = 0, pages = (size_t(size) + page - 1) / page;
+    void *data = mmap(nullptr, size_t(size), PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (data != MAP_FAILED) {
+        std::vector<unsigned char> in_core(pages);
+        if (mincore(data, size_t(size), in_core.data()) == 0)
+            resident = std::count_if(in_core.begin(), in_core.end(), [](unsigned char c) { return c & 1; });
+        munmap(data, size_t(size));
+    }
+    return resident * 10 < pages; // a few pages may come back through readahead of other files
+}
+
+}
+
+
+int main(int argc, char **argv) try {
+    const char *usage = "Usage: file_load_bench [--reps N] [image...]";
+
+    int reps = 3;
+    std::vector<std::filesystem::path> paths;
+    for (int i = 1; i < argc; ++i) {
+        std::string_view arg = argv[i];
+        if (arg == "--reps" && i + 1 < argc)
+            reps = std::max(1, std::stoi(argv[++i]));
+        else if (arg.starts_with("--"))
+            throw std::runtime_error(usage);
+        else
+            paths.emplace_back(arg);
+    }
+    if (paths.empty()) {
+        for (const char *name : {"earth_diffuse_day.jpg", "earth_diffuse_night.jpg", "earth_specular.jpg", "earth_heightmap.png"}) {
+            auto path = std::filesystem::path(PROJECT_ROOT) / name;
+            if (std::filesystem::exists(path))
+                paths.push_back(path);
+        }
+        if (paths.empty())
+            throw std::runtime_error(usage);
+    }
+
+    const Mode modes[] = {
+        {"stdio", load_stdio},
+        {"mmap", [](auto &path, int *width, int *height) { return load_mmap(path, width, height, false); }},
+        {"prefetch", [](auto &path, int *width, int *height) { return load_mmap(path, width, height, true); }},
+    };
+
+    std::cout << "ms, best of " << reps << std::endl;
+    std::cout << std::setw(28) << "" << std::setw(10) << "MiB";
+    for (bool cold : {true, false})
+        for (auto &mode : modes)
+            std::cout << std::setw(16) << (std::string) mode.name + (cold ? " cold" : " warm");
+    std::cout << std::endl;
+
+    for (auto &path : paths) {
+        std::cout << std::setw(28) << path.filename().string() << std::setw(10) << std::fixed << std::setprecision(1)
+                  << std::filesystem::file_size(path) / (1024.0 * 1024.0);
+        for (bool cold : {true, false}) {
+            for (auto &mode : modes) {
+                double best = 1e30;
+                bool dropped = true;
+                for (int rep = 0; rep < reps + !cold; ++rep) {
+                    if (cold)
+                        dropped = drop_from_page_cache(path) && dropped;
+                    int width, height;
+                    auto start = std::chrono::steady_clock::now();
+                    stbi_uc *pixels = mode.load(path, &width, &height);
+                    double ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+                    if (!pixels)
+                        throw std::runtime_error((std::string) "Failed to load " + (std::string) path + ": " + stbi_failure_reason());
+                    stbi_image_free(pixels);
+                    if (cold || rep > 0) // the first warm load only fills the page cache
+                        best = std::min(best, ms);
+                }
+                std::cout << std::setw(15) << best << (dropped ? " " : "*");
+            }
+        }
+        std::cout << std::endl;
+    }
+}
+catch (std::exception const &e) {
+    std::cerr << e.what() << std::endl;
+    return EXIT_FAILURE;
+}
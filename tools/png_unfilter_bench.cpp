@@ -0,0 +1,198 @@
+// Measures how fast stb_image unfilters PNG scanlines, per filter type and
+// bytes per pixel, at every SIMD level.
+//
+// Usage: png_unfilter_bench [--size WIDTHxHEIGHT] [--reps N]
+//
+// The images are generated in memory with the same filter on every row and
+// stored (uncompressed) deflate blocks, so decoding them is mostly
+// unfiltering. Throughput is in MB/s of decoded image, best of N.
+
+#include <algorithm>
+#include <array>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <iomanip>
+#include <iostream>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "stb_image.h"
+
+
+namespace {
+
+struct Format {
+    const char *name;
+    int channels, depth;
+};
+
+const Format FORMATS[] = {
+    {"gray8", 1, 8}, {"ga8", 2, 8}, {"rgb8", 3, 8}, {"rgba8", 4, 8},
+    {"gray16", 1, 16}, {"ga16", 2, 16}, {"rgb16", 3, 16}, {"rgba16", 4, 16},
+};
+
+const char *FILTER_NAMES[] = {"none", "sub", "up", "avg", "paeth"};
+
+const char *SIMD_NAMES[] = {"C", "SSE2", "AVX2"};
+
+uint32_t crc32(const unsigned char *data, size_t size) {
+    static const auto table = [] {
+        std::array<uint32_t, 256> table;
+        for (uint32_t i = 0; i < 256; ++i) {
+            uint32_t c = i;
+            for (int k = 0; k < 8; ++k)
+                c = (c >> 1) ^ (0xEDB88320u & (0u - (c & 1)));
+            table[i] = c;
+        }
+        return table;
+    }();
+    uint32_t crc = ~0u;
+    for (size_t i = 0; i < size; ++i)
+        crc = table[(crc ^ data[i]) & 0xFF] ^ (crc >> 8);
+    return ~crc;
+}
+
+void put32be(std::vector<unsigned char> &out, uint32_t v) {
+    for (int shift = 24; shift >= 0; shift -= 8)
+        out.push_back((unsigned char) (v >> shift));
+}
+
+void put_chunk(std::vector<unsigned char> &png, const char *type, const std::vector<unsigned char> &data) {
+    put32be(png, uint32_t(data.size()));
+    size_t start = png.size();
+    png.insert(png.end(), type, type + 4);
+    png.insert(png.end(), data.begin(), data.end());
+    put32be(png, crc32(png.data() + start, png.size() - start));
+}
+
+// zlib stream of stored blocks
+std::vector<unsigned char> store(const std::vector<unsigned char> &data) {
+    std::vector<unsigned char> out = {0x78, 0x01};
+    size_t pos = 0;
+    do {
+        size_t size = std::min<size_t>(data.size() - pos, 65535);
+        out.push_back(pos + size == data.size() ? 1 : 0);
+        out.push_back((unsigned char) size);
+        out.push_back((unsigned char) (size >> 8));
+        out.push_back((unsigned char) ~size);
+        out.push_back((unsigned char) (~size >> 8));
+        out.insert(out.end(), data.begin() + pos, data.begin() + pos + size);
+        pos += size;
+    } while (pos < data.size());
+
+    uint32_t a = 1, b = 0;
+    for (unsigned char c : data) {
+        a = (a + c) % 65521;
+        b = (b + a) % 65521;
+    }
+    put32be(out, (b << 16) | a);
+    return out;
+}
+
+int paeth(int a, int b, int c) {
+    int p = a + b - c;
+    int pa = std::abs(p - a), pb = std::abs(p - b), pc = std::abs(p - c);
+    if (pa <= pb && pa <= pc)
+        return a;
+    return pb <= pc ? b : c;
+}
+
+// A smooth, slightly noisy image, like a heightmap, with every row filtered by `filter`
+std::vector<unsigned char> make_png(const Format &format, int filter, int width, int height) {
+    int bpp = format.channels * format.depth / 8;
+    size_t row_bytes = size_t(width) * bpp;
+    std::vector<unsigned char> prior(row_bytes), row(row_bytes), filtered;
+    filtered.reserve((row_bytes + 1) * height);
+
+    uint32_t seed = 1;
+    for (int y = 0; y < height; ++y) {
+        for (size_t i = 0; i < row_bytes; ++i) {
+            seed = seed * 1664525 + 1013904223;
+            row[i] = (unsigned char) ((i / bpp) / 3 + y / 2 + (i % bpp) * 40 + (seed >> 29));
+        }
+        filtered.push_back((unsigned char) filter);
+        for (size_t i = 0; i < row_bytes; ++i) {
+            int a = i >= size_t(bpp) ? row[i - bpp] : 0;
+            int b = prior[i];
+            int c = i >= size_t(bpp) ? prior[i - bpp] : 0;
+            int predicted = filter == 1 ? a : filter == 2 ? b : filter == 3 ? (a + b) / 2 : filter == 4 ? paeth(a, b, c) : 0;
+            filtered.push_back((unsigned char) (row[i] - predicted));
+        }
+        std::swap(prior, row);
+    }
+
+    static const int color_types[] = {0, 0, 4, 2, 6};
+    std::vector<unsigned char> header;
+    put32be(header, width);
+    put32be(header, height);
+    header.insert(header.end(), {(unsigned char) format.depth, (unsigned char) color_types[format.channels], 0, 0, 0});
+
+    std::vector<unsigned char> png = {0x89, 'P', 'N', 'G', '\r', '\n', 0x1A, '\n'};
+    put_chunk(png, "IHDR", header);
+    put_chunk(png, "IDAT", store(filtered));
+    put_chunk(png, "IEND", {});
+    return png;
+}
+
+}
+
+
+int main(int argc, char **argv) try {
+    const char *usage = "Usage: png_unfilter_bench [--size WIDTHxHEIGHT] [--reps N]";
+
+    int width = 4096, height = 1024, reps = 5;
+    for (int i = 1; i < argc; ++i) {
+        std::string_view arg = argv[i];
+        if (arg == "--size" && i + 1 < argc) {
+            if (std::sscanf(argv[++i], "%dx%d", &width, &height) != 2 || width <= 0 || height <= 0)
+                throw std::runtime_error(usage);
+        } else if (arg == "--reps" && i + 1 < argc) {
+            reps = std::max(1, std::stoi(argv[++i]));
+        } else {
+            throw std::runtime_error(usage);
+        }
+    }
+
+    std::cout << width << "x" << height << ", MB/s of decoded image, best of " << reps << std::endl;
+    std::cout << std::setw(12) << "";
+    for (auto name : FILTER_NAMES)
+        std::cout << std::setw(9) << name;
+    std::cout << std::endl;
+
+    for (auto &format : FORMATS) {
+        std::vector<std::vector<unsigned char>> pngs;
+        for (int filter = 0; filter < 5; ++filter)
+            pngs.push_back(make_png(format, filter, width, height));
+
+        for (int level = STBI_SIMD_NONE; level <= STBI_SIMD_AVX2; ++level) {
+            stbi_set_simd_level(level);
+            std::cout << std::setw(7) << (level == STBI_SIMD_NONE ? format.name : "") << std::setw(5) << SIMD_NAMES[level];
+            for (auto &png : pngs) {
+                double best = 1e30;
+                for (int rep = 0; rep < reps; ++rep) {
+                    int w, h, channels;
+                    auto start = std::chrono::steady_clock::now();
+                    void *pixels = format.depth == 16
+                        ? (void *) stbi_load_16_from_memory(png.data(), int(png.size()), &w, &h, &channels, format.channels)
+                        : (void *) stbi_load_from_memory(png.data(), int(png.size()), &w, &h, &channels, format.channels);
+                    best = std::min(best, std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count());
+                    if (!pixels)
+                        throw std::runtime_error((std::string) "Failed to decode " + format.name + ": " + stbi_failure_reason());
+                    stbi_image_free(pixels);
+                }
+                double megabytes = double(width) * height * format.channels * format.depth / 8 / 1e6;
+                std::cout << std::setw(9) << std::fixed << std::setprecision(0) << megabytes / best;
+            }
+            std::cout << std::endl;
+        }
+    }
+    stbi_set_simd_level(STBI_SIMD_AVX2);
+}
+catch (std::exception const &e) {
+    std::cerr << e.what() << std::endl;
+    return EXIT_FAILURE;
+}
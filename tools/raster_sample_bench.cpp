@@ -0,0 +1,194 @@
+// Measures how many samples per second TiledRaster takes at random points, in
+// the tiled and in the row-major layout, one point per call and in batches.
+//
+// Usage: raster_sample_bench [--size WIDTHxHEIGHT] [--samples N] [--reps N] [--wrap] [image]
+//
+// Without an image the raster is a generated heightmap of the given size
+// (8192x4096 by default, well past the caches). "uniform" points are spread
+// over the whole raster, like picking and culling queries; "walk" points each
+// take a step of up to 4 texels from the previous one, like baking and contour
+// tracing. Throughput is in millions of samples per second, best of N.
+// Both layouts must give the same samples, otherwise it fails.
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <filesystem>
+#include <functional>
+#include <iomanip>
+#include <iostream>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "tiled_raster.h"
+
+
+namespace {
+
+const size_t BATCH_SIZE = 256;
+
+struct Points {
+    const char *name;
+    std::vector<float> x, y;
+};
+
+struct Kernel {
+    const char *name;
+    std::function<void(const TiledRaster &raster, const Points &points, std::vector<float> &out)> run;
+};
+
+Points uniform_points(int width, int height, size_t count) {
+    Points points{"uniform", {}, {}};
+    uint32_t seed = 1;
+    auto random = [&seed] {
+        seed = seed * 1664525 + 1013904223;
+        return (seed >> 8) * (1.f / 16777216.f);
+    };
+    for (size_t i = 0; i < count; ++i) {
+        points.x.push_back(random() * width - 0.5f);
+        points.y.push_back(random() * height - 0.5f);
+    }
+    return points;
+}
+
+Points walk_points(int width, int height, size_t count) {
+    Points points{"walk", {}, {}};
+    uint32_t seed = 2;
+    auto random = [&seed] {
+        seed = seed * 1664525 + 1013904223;
+        return (seed >> 8) * (1.f / 16777216.f);
+    };
+    float x = width * 0.5f, y = height * 0.5f;
+    for (size_t i = 0; i < count; ++i) {
+        x = std::clamp(x + (random() - 0.5f) * 8.f, 0.f, width - 1.f);
+        y = std::clamp(y + (random() - 0.5f) * 8.f, 0.f, height - 1.f);
+        points.x.push_back(x);
+        points.y.push_back(y);
+    }
+    return points;
+}
+
+// Smooth hills with some noise, as 8 bit gray
+std::vector<unsigned char> make_heightmap(int width, int height) {
+    std::vector<unsigned char> pixels(size_t(width) * height);
+    uint32_t seed = 3;
+    for (int y = 0; y < height; ++y) {
+        for (int x = 0; x < width; ++x) {
+            seed = seed * 1664525 + 1013904223;
+            float hills = std::sin(x * 0.013f) * std::cos(y * 0.021f) + std::sin((x + y) * 0.0037f);
+            pixels[size_t(y) * width + x] = (unsigned char) std::clamp(128.f + hills * 50.f + (seed >> 29), 0.f, 255.f);
+        }
+    }
+    return pixels;
+}
+
+}
+
+
+int main(int argc, char **argv) try {
+    const char *usage = "Usage: raster_sample_bench [--size WIDTHxHEIGHT] [--samples N] [--reps N] [--wrap] [image]";
+
+    int width = 8192, height = 4096, reps = 5;
+    size_t samples = 4 << 20;
+    bool wrap = false;
+    std::filesystem::path path;
+    for (int i = 1; i < argc; ++i) {
+        std::string_view arg = argv[i];
+        if (arg == "--size" && i + 1 < argc) {
+            if (std::sscanf(argv[++i], "%dx%d", &width, &height) != 2 || width <= 0 || height <= 0)
+                throw std::runtime_error(usage);
+        } else if (arg == "--samples" && i + 1 < argc) {
+            samples = std::max(1, std::stoi(argv[++i]));
+        } else if (arg == "--reps" && i + 1 < argc) {
+            reps = std::max(1, std::stoi(argv[++i]));
+        } else if (arg == "--wrap") {
+            wrap = true;
+        } else if (arg.starts_with("--") || !path.empty()) {
+            throw std::runtime_error(usage);
+        } else {
+            path = arg;
+        }
+    }
+
+    std::vector<unsigned char> heightmap;
+    if (path.empty())
+        heightmap = make_heightmap(width, height);
+
+    const TiledRaster::Layout layouts[] = {TiledRaster::Layout::row_major, TiledRaster::Layout::tiled};
+    const char *layout_names[] = {"row-major", "tiled"};
+    std::vector<TiledRaster> rasters;
+    std::vector<double> convert_ms;
+    for (auto layout : layouts) {
+        auto start = std::chrono::steady_clock::now();
+        if (path.empty()) {
+            rasters.emplace_back(width, height, wrap, layout);
+            rasters.back().set_rows(heightmap.data(), 1, 0, 0, height);
+        } else {
+            rasters.push_back(load_tiled_raster(path, 0, wrap, layout));
+        }
+        convert_ms.push_back(std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count());
+    }
+    width = rasters[0].width();
+    height = rasters[0].height();
+
+    const Kernel kernels[] = {
+        {"bilinear", [](auto &raster, auto &points, auto &out) {
+            for (size_t i = 0; i < out.size(); ++i)
+                out[i] = raster.bilinear(points.x[i], points.y[i]);
+        }},
+        {"bilinear x4", [](auto &raster, auto &points, auto &out) {
+            for (size_t i = 0; i < out.size(); i += BATCH_SIZE)
+                raster.bilinear(&points.x[i], &points.y[i], &out[i], std::min(BATCH_SIZE, out.size() - i));
+        }},
+        {"bicubic", [](auto &raster, auto &points, auto &out) {
+            for (size_t i = 0; i < out.size(); ++i)
+                out[i] = raster.bicubic(points.x[i], points.y[i]);
+        }},
+        {"bicubic x4", [](auto &raster, auto &points, auto &out) {
+            for (size_t i = 0; i < out.size(); i += BATCH_SIZE)
+                raster.bicubic(&points.x[i], &points.y[i], &out[i], std::min(BATCH_SIZE, out.size() - i));
+        }},
+    };
+
+    std::cout << (path.empty() ? "generated" : path.filename().string()) << " " << width << "x" << height << (wrap ? ", wrapped" : "")
+              << ", " << samples << " samples, millions of samples/s, best of " << reps << std::endl;
+    std::cout << std::setw(22) << "" << std::setw(12) << "MiB" << std::setw(12) << "load ms";
+    for (auto &kernel : kernels)
+        std::cout << std::setw(13) << kernel.name;
+    std::cout << std::endl;
+
+    for (auto &points : {uniform_points(width, height, samples), walk_points(width, height, samples)}) {
+        std::vector<std::vector<float>> reference(std::size(kernels));
+        for (size_t layout = 0; layout < rasters.size(); ++layout) {
+            std::cout << std::setw(10) << points.name << std::setw(12) << layout_names[layout] << std::fixed << std::setprecision(1)
+                      << std::setw(12) << rasters[layout].size_bytes() / (1024.0 * 1024.0) << std::setw(12) << convert_ms[layout];
+            for (size_t k = 0; k < std::size(kernels); ++k) {
+                std::vector<float> out(samples);
+                double best = 1e30;
+                for (int rep = 0; rep < reps; ++rep) {
+                    auto start = std::chrono::steady_clock::now();
+                    kernels[k].run(rasters[layout], points, out);
+                    best = std::min(best, std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count());
+                }
+                std::cout << std::setw(13) << samples / best / 1e6 << std::flush;
+
+                // The batches must match the single calls, and every layout the first one
+                std::vector<float> &expected = reference[k & ~size_t(1)];
+                if (expected.empty())
+                    expected = out;
+                else if (std::memcmp(expected.data(), out.data(), samples * sizeof(float)) != 0)
+                    throw std::runtime_error((std::string) "\n" + kernels[k].name + " on the " + layout_names[layout] + " layout gives different samples");
+            }
+            std::cout << std::endl;
+        }
+    }
+}
+catch (std::exception const &e) {
+    std::cerr << e.what() << std::endl;
+    return EXIT_FAILURE;
+}
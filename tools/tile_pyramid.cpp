@@ -0,0 +1,64 @@
+// Cuts a huge equirectangular image into a tile pyramid (see tile_pyramid.h),
+// working through it in strips so that memory does not grow with the height.
+//
+// Usage: tile_pyramid [--tile-size 256|512] [--raw WIDTHxHEIGHTxCHANNELS] image output
+//
+// `output` is the path prefix of `output.tiles` and `output.index`. With --raw
+// the image is a headerless 8 bit file. Raw files and PNGs that are not
+// interlaced are read strip by strip; everything else is decoded by stb_image
+// up front.
+
+#include <chrono>
+#include <cstdio>
+#include <filesystem>
+#include <iostream>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "texture_image.h"
+#include "thread_pool.h"
+#include "tile_pyramid.h"
+
+
+int main(int argc, char **argv) try {
+    const char *usage = "Usage: tile_pyramid [--tile-size 256|512] [--raw WIDTHxHEIGHTxCHANNELS] image output";
+
+    int tile_size = 256;
+    int raw_width = 0, raw_height = 0, raw_channels = 0;
+    std::vector<std::filesystem::path> paths;
+
+    for (int i = 1; i < argc; ++i) {
+        std::string_view arg = argv[i];
+        if (arg == "--tile-size" && i + 1 < argc) {
+            tile_size = std::stoi(argv[++i]);
+            if (tile_size != 256 && tile_size != 512)
+                throw std::runtime_error(usage);
+        } else if (arg == "--raw" && i + 1 < argc) {
+            if (std::sscanf(argv[++i], "%dx%dx%d", &raw_width, &raw_height, &raw_channels) != 3)
+                throw std::runtime_error(usage);
+        } else {
+            paths.emplace_back(arg);
+        }
+    }
+    if (paths.size() != 2)
+        throw std::runtime_error(usage);
+
+    auto start = std::chrono::steady_clock::now();
+
+    ThreadPool pool;
+    set_decode_thread_pool(&pool);
+    RowSource source = raw_width ? open_raw_rows(paths[0], raw_width, raw_height, raw_channels) : open_image_rows(paths[0]);
+    TilePyramidStats stats = build_tile_pyramid(source, tile_size, paths[1], pool);
+
+    auto ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+    std::cout << paths[0].filename().string() << ": " << source.width << "x" << source.height
+              << " -> " << stats.levels_num << " levels, " << stats.tiles_num << " tiles of " << tile_size << "^2"
+              << " (" << stats.tile_bytes / (1024.0 * 1024.0) << " MiB), strips " << stats.strip_bytes / (1024.0 * 1024.0) << " MiB"
+              << ", " << ms << " ms on " << pool.size() << " threads -> " << tile_pyramid_index_path(paths[1]).string() << std::endl;
+}
+catch (std::exception const &e) {
+    std::cerr << e.what() << std::endl;
+    return EXIT_FAILURE;
+}